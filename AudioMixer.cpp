@@ -0,0 +1,44 @@
+#include "AudioMixer.h"
+
+AudioMixer::AudioMixer()
+{
+	for (int i = 0; i < AUDIO_SOURCE_COUNT; i++)
+		sourceGain[i] = 1.0f;
+}
+
+void AudioMixer::setSourceGain(uint8_t sourceNum, float newGain)
+{
+	if (sourceNum < AUDIO_SOURCE_COUNT)
+		sourceGain[sourceNum] = newGain;
+}
+
+void AudioMixer::mixBlock(float sourceSamples[AUDIO_SOURCE_COUNT][BLIP_MAX_BLOCK_SAMPLES], unsigned int sampleCount, audioFrameStruct* outputFrames)
+{
+	// Everything here is written as plain loops over flat float arrays with no branches inside, so the compiler is free to
+	// turn each of them into SIMD code
+	for (unsigned int i = 0; i < sampleCount; i++)
+	{
+		mixLeft[i] = 0.0f;
+		mixRight[i] = 0.0f;
+	}
+
+	for (int source = 0; source < AUDIO_SOURCE_COUNT; source++)
+	{
+		float gainLeft = sourceGain[source] * sourcePanLeft[source] * audioMixerOutputScale;
+		float gainRight = sourceGain[source] * sourcePanRight[source] * audioMixerOutputScale;
+		const float* samplePtr = sourceSamples[source];
+		for (unsigned int i = 0; i < sampleCount; i++)
+		{
+			mixLeft[i] += samplePtr[i] * gainLeft;
+			mixRight[i] += samplePtr[i] * gainRight;
+		}
+	}
+
+	for (unsigned int i = 0; i < sampleCount; i++)
+	{
+		float leftLevel = (mixLeft[i] > 32767.0f) ? 32767.0f : ((mixLeft[i] < -32768.0f) ? -32768.0f : mixLeft[i]);
+		float rightLevel = (mixRight[i] > 32767.0f) ? 32767.0f : ((mixRight[i] < -32768.0f) ? -32768.0f : mixRight[i]);
+		outputFrames[i].leftChannel = (int16_t)leftLevel;
+		outputFrames[i].rightChannel = (int16_t)rightLevel;
+	}
+}
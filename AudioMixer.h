@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "BlipSynth.h"
+#include "AudioRingBuffer.h"
+
+// Audio sources that get mixed together into the host's stereo output. Each one has its own BlipSynth on the GimeBus.
+constexpr uint8_t AUDIO_SOURCE_DAC			= 0;	// 6-bit DAC on PIA1 Side A ($FF20)
+constexpr uint8_t AUDIO_SOURCE_SINGLE_BIT	= 1;	// Single bit sound on PIA1 Side B ($FF22 bit 1)
+constexpr uint8_t AUDIO_SOURCE_ORCH90_LEFT	= 2;	// Orchestra-90 left channel DAC
+constexpr uint8_t AUDIO_SOURCE_ORCH90_RIGHT	= 3;	// Orchestra-90 right channel DAC
+constexpr uint8_t AUDIO_SOURCE_CASSETTE		= 4;	// Tape playback, through the analog multiplexer (AUDIO ON)
+constexpr uint8_t AUDIO_SOURCE_COUNT		= 5;
+
+constexpr float audioMixerOutputScale		= 16384.0f;		// Converts mixed audio levels (full scale DAC = 1.0) to 16-bit samples
+
+class AudioMixer
+{
+public:
+	AudioMixer();
+
+	void setSourceGain(uint8_t, float);
+	float getSourceGain(uint8_t sourceNum) const { return sourceGain[sourceNum]; }
+	void mixBlock(float[AUDIO_SOURCE_COUNT][BLIP_MAX_BLOCK_SAMPLES], unsigned int, audioFrameStruct*);
+
+	std::string sourceName[AUDIO_SOURCE_COUNT] = { "DAC", "SINGLEBIT", "ORCH90LEFT", "ORCH90RIGHT", "CASSETTE" };
+
+private:
+	float sourceGain[AUDIO_SOURCE_COUNT];
+	float sourcePanLeft[AUDIO_SOURCE_COUNT] = { 1.0f, 1.0f, 1.0f, 0.0f, 1.0f };		// CoCo's own sound is centered, Orch-90 channels go hard left/right
+	float sourcePanRight[AUDIO_SOURCE_COUNT] = { 1.0f, 1.0f, 0.0f, 1.0f, 1.0f };
+	float mixLeft[BLIP_MAX_BLOCK_SAMPLES], mixRight[BLIP_MAX_BLOCK_SAMPLES];
+};
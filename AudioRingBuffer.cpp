@@ -0,0 +1,80 @@
+#include "AudioRingBuffer.h"
+
+AudioRingBuffer::AudioRingBuffer(uint32_t requestedFrames)
+{
+	// Round the capacity up to a power of 2 so indexes can be wrapped with a simple mask
+	ringCapacity = 1;
+	while (ringCapacity < requestedFrames)
+		ringCapacity <<= 1;
+	ringIndexMask = ringCapacity - 1;
+	ringData.resize(ringCapacity);
+	clearBuffer();
+}
+
+bool AudioRingBuffer::pushFrame(const audioFrameStruct& newFrame)
+{
+	uint32_t curWriteIndex = writeIndex.load(std::memory_order_relaxed);
+	uint32_t fillLevel = curWriteIndex - readIndex.load(std::memory_order_acquire);
+
+	if (fillLevel >= ringCapacity)
+	{
+		// Audio thread has fallen behind (or stopped) so the newest sample gets dropped
+		overrunCount.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	ringData[curWriteIndex & ringIndexMask] = newFrame;
+	writeIndex.store(curWriteIndex + 1, std::memory_order_release);
+
+	if ((fillLevel + 1) > highestFillLevel.load(std::memory_order_relaxed))
+		highestFillLevel.store(fillLevel + 1, std::memory_order_relaxed);
+	return true;
+}
+
+bool AudioRingBuffer::popFrame(audioFrameStruct& destFrame)
+{
+	uint32_t curReadIndex = readIndex.load(std::memory_order_relaxed);
+	uint32_t fillLevel = writeIndex.load(std::memory_order_acquire) - curReadIndex;
+
+	if (fillLevel == 0)
+	{
+		underrunCount.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	destFrame = ringData[curReadIndex & ringIndexMask];
+	readIndex.store(curReadIndex + 1, std::memory_order_release);
+
+	if ((fillLevel - 1) < lowestFillLevel.load(std::memory_order_relaxed))
+		lowestFillLevel.store(fillLevel - 1, std::memory_order_relaxed);
+	return true;
+}
+
+uint32_t AudioRingBuffer::getFillLevel() const
+{
+	return writeIndex.load(std::memory_order_acquire) - readIndex.load(std::memory_order_acquire);
+}
+
+audioRingTelemetryStruct AudioRingBuffer::readTelemetry()
+{
+	audioRingTelemetryStruct telemetry;
+
+	telemetry.capacityFrames = ringCapacity;
+	telemetry.fillLevel = getFillLevel();
+	telemetry.lowestFillLevel = lowestFillLevel.exchange(telemetry.fillLevel, std::memory_order_relaxed);
+	telemetry.highestFillLevel = highestFillLevel.exchange(telemetry.fillLevel, std::memory_order_relaxed);
+	telemetry.underrunCount = underrunCount.load(std::memory_order_relaxed);
+	telemetry.overrunCount = overrunCount.load(std::memory_order_relaxed);
+	return telemetry;
+}
+
+void AudioRingBuffer::clearBuffer()
+{
+	// Only safe to call while neither the producer or consumer thread is using the buffer
+	writeIndex = 0;
+	readIndex = 0;
+	underrunCount = 0;
+	overrunCount = 0;
+	lowestFillLevel = 0;
+	highestFillLevel = 0;
+}
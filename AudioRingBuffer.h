@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Most x86 and ARM hosts use 64 byte cache lines. Keeping the producer and consumer indexes on separate lines stops the
+// emulation thread and the audio thread from constantly stealing the same line from each other.
+constexpr size_t AUDIO_RING_CACHE_LINE_SIZE = 64;
+
+struct audioFrameStruct
+{
+	int16_t leftChannel;
+	int16_t rightChannel;
+};
+
+struct audioRingTelemetryStruct
+{
+	uint32_t capacityFrames;
+	uint32_t fillLevel;
+	uint32_t lowestFillLevel;		// Since the last time telemetry was read
+	uint32_t highestFillLevel;		// Since the last time telemetry was read
+	uint32_t underrunCount;
+	uint32_t overrunCount;
+};
+
+// Fixed-size, lock-free ring buffer of stereo frames. Exactly ONE thread may push (the emulation thread) and exactly ONE thread may pop (the host audio thread).
+class AudioRingBuffer
+{
+public:
+	AudioRingBuffer(uint32_t);
+
+	bool pushFrame(const audioFrameStruct&);
+	bool popFrame(audioFrameStruct&);
+	uint32_t getFillLevel() const;
+	uint32_t getCapacity() const { return ringCapacity; }
+	audioRingTelemetryStruct readTelemetry();
+	void clearBuffer();
+
+private:
+	std::vector<audioFrameStruct> ringData;
+	uint32_t ringCapacity, ringIndexMask;
+
+	// Indexes are free-running and only masked when used, so (write - read) is always the fill level even after they wrap
+	alignas(AUDIO_RING_CACHE_LINE_SIZE) std::atomic<uint32_t> writeIndex;
+	std::atomic<uint32_t> overrunCount;
+	std::atomic<uint32_t> highestFillLevel;
+	alignas(AUDIO_RING_CACHE_LINE_SIZE) std::atomic<uint32_t> readIndex;
+	std::atomic<uint32_t> underrunCount;
+	std::atomic<uint32_t> lowestFillLevel;
+	alignas(AUDIO_RING_CACHE_LINE_SIZE) uint8_t cacheLinePadding;
+};
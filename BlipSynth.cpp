@@ -0,0 +1,106 @@
+#include "BlipSynth.h"
+#include <cmath>
+#include <cstring>
+
+BlipSynth::BlipSynth()
+{
+	const double PI = 3.14159265358979323846;
+	const double cutoffRatio = 0.45;		// Keep everything below 45% of the output sample rate (just under Nyquist)
+
+	// Build the kernel as a Blackman windowed sinc impulse for each sub-sample phase. Since the output is integrated
+	// afterwards, adding an impulse here is what produces the band-limited step.
+	for (int phase = 0; phase < BLIP_KERNEL_PHASES; phase++)
+	{
+		double kernelSum = 0;
+		for (int tap = 0; tap < BLIP_KERNEL_TAPS; tap++)
+		{
+			double x = (tap - (BLIP_KERNEL_TAPS / 2)) + (1.0 - ((double)phase / BLIP_KERNEL_PHASES));
+			double sincValue = (x == 0) ? 1.0 : sin(PI * 2 * cutoffRatio * x) / (PI * 2 * cutoffRatio * x);
+			double windowPos = (x + (BLIP_KERNEL_TAPS / 2)) / BLIP_KERNEL_TAPS;
+			double windowValue = 0.42 - (0.5 * cos(2 * PI * windowPos)) + (0.08 * cos(4 * PI * windowPos));
+			stepKernel[phase][tap] = (float)(sincValue * windowValue);
+			kernelSum += stepKernel[phase][tap];
+		}
+		// Normalize so every phase adds exactly the full delta once it's integrated
+		for (int tap = 0; tap < BLIP_KERNEL_TAPS; tap++)
+			stepKernel[phase][tap] = (float)(stepKernel[phase][tap] / kernelSum);
+	}
+
+	deltaBuffer.resize(BLIP_MAX_BLOCK_SAMPLES + BLIP_KERNEL_TAPS + 1);
+	setClocksPerSample(1.0f);
+	clearSynth();
+}
+
+void BlipSynth::setClocksPerSample(float newClocksPerSample)
+{
+	clocksPerSample = newClocksPerSample;
+	samplesPerClock = 1.0f / newClocksPerSample;
+}
+
+void BlipSynth::setLevel(uint32_t clockTime, float newLevel)
+{
+	if (newLevel != curLevel)
+	{
+		addDelta(clockTime, newLevel - curLevel);
+		curLevel = newLevel;
+	}
+}
+
+void BlipSynth::addDelta(uint32_t clockTime, float deltaLevel)
+{
+	// Convert the GIME clock time (relative to start of block) to an output sample position relative to the first unread sample,
+	// then split that into a whole sample index and which sub-sample phase of the kernel to use
+	float samplePosition = blockStartOffset + (clockTime * samplesPerClock);
+	unsigned int sampleIndex = (unsigned int)samplePosition;
+	unsigned int kernelPhase = (unsigned int)((samplePosition - sampleIndex) * BLIP_KERNEL_PHASES);
+
+	if ((sampleIndex + BLIP_KERNEL_TAPS) > deltaBuffer.size())
+		return;		// Should never happen unless a block was left running way too long
+
+	float* deltaPtr = &deltaBuffer[sampleIndex];
+	for (int tap = 0; tap < BLIP_KERNEL_TAPS; tap++)
+		deltaPtr[tap] += deltaLevel * stepKernel[kernelPhase][tap];
+}
+
+unsigned int BlipSynth::endBlock(uint32_t blockClocks)
+{
+	// Advance to the end of this block. Every whole output sample before that point is now complete and can be read, and any 
+	// leftover fraction simply carries over as the starting position of the next block.
+	blockStartOffset += blockClocks * samplesPerClock;
+	if (blockStartOffset > BLIP_MAX_BLOCK_SAMPLES)
+		blockStartOffset = BLIP_MAX_BLOCK_SAMPLES;		// Nobody has been reading samples, so don't run off the end of the buffer
+	samplesReady = (unsigned int)blockStartOffset;
+	return samplesReady;
+}
+
+unsigned int BlipSynth::readSamples(float* outputBuffer, unsigned int maxSamples)
+{
+	unsigned int sampleCount = (samplesReady < maxSamples) ? samplesReady : maxSamples;
+
+	for (unsigned int i = 0; i < sampleCount; i++)
+	{
+		// Integrate the band-limited impulses back into steps, then remove any DC offset with a simple one-pole high-pass
+		// so a DAC parked at some level doesn't sit there pushing the host speaker to one side
+		integratorLevel += deltaBuffer[i];
+		outputBuffer[i] = integratorLevel - dcOffsetLevel;
+		dcOffsetLevel += (integratorLevel - dcOffsetLevel) * 0.0005f;
+	}
+
+	// Slide the unread part of the buffer (including the tails of any kernels that reach past the end of this block) down to the start
+	unsigned int remainingEntries = (unsigned int)deltaBuffer.size() - sampleCount;
+	memmove(deltaBuffer.data(), deltaBuffer.data() + sampleCount, remainingEntries * sizeof(float));
+	memset(deltaBuffer.data() + remainingEntries, 0, sampleCount * sizeof(float));
+	samplesReady -= sampleCount;
+	blockStartOffset -= sampleCount;
+	return sampleCount;
+}
+
+void BlipSynth::clearSynth()
+{
+	std::fill(deltaBuffer.begin(), deltaBuffer.end(), 0.0f);
+	blockStartOffset = 0;
+	curLevel = 0;
+	integratorLevel = 0;
+	dcOffsetLevel = 0;
+	samplesReady = 0;
+}
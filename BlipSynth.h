@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+// Band-limited step synthesis. Rather than sampling an output level every so many GIME clocks (which aliases terribly with 
+// square waves from the single bit sound or fast DAC writes), each change in level is recorded at the exact GIME clock it happened
+// and drawn into the output as a band-limited step. Samples are then produced in blocks, once per scanline.
+constexpr int BLIP_KERNEL_PHASES	= 32;		// Number of sub-sample positions the step kernel is calculated for
+constexpr int BLIP_KERNEL_TAPS		= 16;		// Width of the step kernel in output samples
+constexpr int BLIP_MAX_BLOCK_SAMPLES	= 64;		// Largest number of output samples a single block can produce
+
+class BlipSynth
+{
+public:
+	BlipSynth();
+
+	void setClocksPerSample(float);
+	void setLevel(uint32_t, float);
+	void addDelta(uint32_t, float);
+	unsigned int endBlock(uint32_t);
+	unsigned int readSamples(float*, unsigned int);
+	void clearSynth();
+
+	float getLevel() const { return curLevel; }
+
+private:
+	float stepKernel[BLIP_KERNEL_PHASES][BLIP_KERNEL_TAPS];
+	std::vector<float> deltaBuffer;
+	float clocksPerSample, samplesPerClock;
+	float blockStartOffset;			// Output sample position where the current block started, relative to the first unread sample
+	float curLevel;
+	float integratorLevel, dcOffsetLevel;
+	unsigned int samplesReady;
+};
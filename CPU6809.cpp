@@ -111,6 +111,14 @@ void Cpu6809::cpuClockTick()
 		if (cpuSoftHalt != CPU_SOFTWARE_HALT_NONE)
 			return;
 
+		// Let the bus fast-forward through any ROM routines it has trapped (ie. cassette loading) before fetching the next opcode
+		if (execTrapsArmed && gimeBus->checkExecTrap(cpuReg.PC))
+		{
+			nextOpWaitCounter = EXEC_TRAP_CYCLES - 1;
+			cpuCyclesTotal += EXEC_TRAP_CYCLES;
+			return;
+		}
+
 		// CPU is not halted so here we go! First grab opcode
 		debuggerRegPC = cpuReg.PC;				// For our Debugger, Preserve the start address of instruction before the PC gets incremented by the handlers
 
@@ -45,6 +45,8 @@ constexpr uint8_t CPU_SOFTWARE_HALT_CWAI	= 1;
 constexpr uint8_t CPU_SOFTWARE_HALT_SYNC	= 2;
 constexpr uint8_t CPU_SOFTWARE_HALT_OTHER	= 3;
 
+constexpr int EXEC_TRAP_CYCLES = 5;		// Cycles charged when a trapped ROM routine is handled by the emulator instead. Same as the RTS it ends with.
+
 // Constants that define bit positions for registers within the Postbyte when pushing/pulling from a stack
 constexpr uint8_t MASK_PC = 0x80;
 constexpr uint8_t MASK_SU = 0x40;
@@ -110,6 +112,7 @@ public:
 	registersStruct cpuReg;
 	bool cpuHaltAsserted, cpuHardwareHalt;
 	bool debuggerStepEnabled = false;
+	bool execTrapsArmed = false;
 
 	void ConnectToBus(GimeBus* busPtr) { gimeBus = busPtr; }
 	void cpuClockTick();
@@ -0,0 +1,453 @@
+#include <cstring>
+#include "GimeBus.h"
+#include "Cassette.h"
+
+Cassette::Cassette()
+{
+	isTapeInserted = false;
+	isMotorOn = false;
+	fastLoadEnabled = true;
+	tapeFormat = CASSETTE_FORMAT_NONE;
+	trapAddrCSRDON = 0;
+	trapAddrBLKIN = 0;
+	blocksFastLoaded = 0;
+	wavSampleRate = 0;
+	tapePosition = 0;
+	audioTapePosition = 0;
+	lastUpdateClock = 0;
+	playbackBitIndex = 0;
+}
+
+uint8_t Cassette::insertTape(std::string tapeFilePath)
+{
+	// If a tape is already in the deck, take it out first
+	if (isTapeInserted)
+		ejectTape();
+
+	FILE* tapeFile = fopen(tapeFilePath.c_str(), "rb");
+	if (tapeFile == NULL)
+		return CASSETTE_ERROR_OPENING_FILE;
+
+	// Tell the two formats apart by the RIFF header rather than trusting the file extension
+	char headerID[4] = { 0 };
+	size_t headerLength = fread(headerID, 1, 4, tapeFile);
+	fseek(tapeFile, 0, SEEK_SET);
+
+	uint8_t loadResult;
+	if ((headerLength == 4) && (memcmp(headerID, "RIFF", 4) == 0))
+		loadResult = loadWavFile(tapeFile);
+	else
+		loadResult = loadCasFile(tapeFile);
+	fclose(tapeFile);
+
+	if (loadResult != CASSETTE_OPERATION_COMPLETE)
+	{
+		tapeBits.clear();
+		wavSamples.clear();
+		tapeFormat = CASSETTE_FORMAT_NONE;
+		return loadResult;
+	}
+
+	tapeFilePathname = tapeFilePath;
+	isTapeInserted = true;
+	rewindTape();
+	resolveTrapAddresses();
+	return CASSETTE_OPERATION_COMPLETE;
+}
+
+uint8_t Cassette::ejectTape()
+{
+	if (!isTapeInserted)
+		return CASSETTE_ERROR_NO_TAPE_INSERTED;
+
+	tapeBits.clear();
+	tapeBits.shrink_to_fit();
+	wavSamples.clear();
+	wavSamples.shrink_to_fit();
+	tapeFormat = CASSETTE_FORMAT_NONE;
+	tapeFilePathname.clear();
+	isTapeInserted = false;
+	gimeBus->updateExecTraps();
+	return CASSETTE_OPERATION_COMPLETE;
+}
+
+uint8_t Cassette::rewindTape()
+{
+	if (!isTapeInserted)
+		return CASSETTE_ERROR_NO_TAPE_INSERTED;
+
+	tapePosition = 0;
+	audioTapePosition = 0;
+	lastUpdateClock = gimeBus->masterBusCycleCounter;
+	playbackBitIndex = 0;
+	return CASSETTE_OPERATION_COMPLETE;
+}
+
+void Cassette::resolveTrapAddresses()
+{
+	// Color BASIC always calls CSRDON and BLKIN through its jump table, so read the real entry points from there instead of hardcoding them for one ROM version
+	if (gimeBus->romCoCo3 != nullptr)
+	{
+		trapAddrCSRDON = (gimeBus->romCoCo3->readByte(CASSETTE_VECTOR_CSRDON) * 256) + gimeBus->romCoCo3->readByte(CASSETTE_VECTOR_CSRDON + 1);
+		trapAddrBLKIN = (gimeBus->romCoCo3->readByte(CASSETTE_VECTOR_BLKIN) * 256) + gimeBus->romCoCo3->readByte(CASSETTE_VECTOR_BLKIN + 1);
+	}
+	gimeBus->updateExecTraps();
+}
+
+uint8_t Cassette::loadCasFile(FILE* tapeFile)
+{
+	fseek(tapeFile, 0, SEEK_END);
+	long tapeFileSize = ftell(tapeFile);
+	fseek(tapeFile, 0, SEEK_SET);
+	if (tapeFileSize <= 0)
+		return CASSETTE_ERROR_UNSUPPORTED_FORMAT;
+
+	std::vector<uint8_t> casData(tapeFileSize);
+	if (fread(casData.data(), 1, tapeFileSize, tapeFile) != (size_t)tapeFileSize)
+		return CASSETTE_ERROR_OPENING_FILE;
+
+	// A CAS file is just the bytes that were recorded, with the leader, sync bytes and all. Lay them out on the tape least significant bit first,
+	// the same order the ROM writes them in.
+	tapeBits.clear();
+	tapeBits.reserve(casData.size() * 8);
+	uint64_t bitStartTime = 0;
+	for (size_t i = 0; i < casData.size(); i++)
+		for (uint8_t bitNum = 0; bitNum < 8; bitNum++)
+		{
+			cassetteBitStruct tapeBit;
+			tapeBit.startTime = bitStartTime;
+			tapeBit.bitValue = (casData[i] >> bitNum) & 0x01;
+			tapeBit.cycleLength = tapeBit.bitValue ? CASSETTE_CYCLE_CLOCKS_BIT1 : CASSETTE_CYCLE_CLOCKS_BIT0;
+			tapeBits.push_back(tapeBit);
+			bitStartTime += tapeBit.cycleLength;
+		}
+
+	tapeFormat = CASSETTE_FORMAT_CAS;
+	return CASSETTE_OPERATION_COMPLETE;
+}
+
+uint8_t Cassette::loadWavFile(FILE* tapeFile)
+{
+	uint8_t riffHeader[12];
+	if ((fread(riffHeader, 1, 12, tapeFile) != 12) || (memcmp(riffHeader + 8, "WAVE", 4) != 0))
+		return CASSETTE_ERROR_UNSUPPORTED_FORMAT;
+
+	uint16_t formatTag = 0, channelCount = 0, bitsPerSample = 0;
+	bool formatChunkFound = false;
+	uint8_t chunkHeader[8];
+
+	// Walk through the chunks until we hit the sample data, picking up the format chunk along the way
+	while (fread(chunkHeader, 1, 8, tapeFile) == 8)
+	{
+		uint32_t chunkSize = chunkHeader[4] | (chunkHeader[5] << 8) | (chunkHeader[6] << 16) | ((uint32_t)chunkHeader[7] << 24);
+		if (memcmp(chunkHeader, "fmt ", 4) == 0)
+		{
+			uint8_t formatData[16];
+			if ((chunkSize < 16) || (fread(formatData, 1, 16, tapeFile) != 16))
+				return CASSETTE_ERROR_UNSUPPORTED_FORMAT;
+			formatTag = formatData[0] | (formatData[1] << 8);
+			channelCount = formatData[2] | (formatData[3] << 8);
+			wavSampleRate = formatData[4] | (formatData[5] << 8) | (formatData[6] << 16) | ((uint32_t)formatData[7] << 24);
+			bitsPerSample = formatData[14] | (formatData[15] << 8);
+			fseek(tapeFile, (chunkSize - 16) + (chunkSize & 1), SEEK_CUR);
+			formatChunkFound = true;
+		}
+		else if (memcmp(chunkHeader, "data", 4) == 0)
+		{
+			// Only plain PCM is supported, which is what every tape digitizing tool spits out anyway
+			if (!formatChunkFound || (formatTag != 1) || (channelCount == 0) || (wavSampleRate == 0) || ((bitsPerSample != 8) && (bitsPerSample != 16)))
+				return CASSETTE_ERROR_UNSUPPORTED_FORMAT;
+
+			std::vector<uint8_t> sampleData(chunkSize);
+			size_t bytesRead = fread(sampleData.data(), 1, chunkSize, tapeFile);
+			uint32_t bytesPerFrame = channelCount * (bitsPerSample / 8);
+			size_t frameCount = bytesRead / bytesPerFrame;
+
+			// Keep only the first channel and convert everything to signed 16-bit so playback doesn't care what the file was
+			wavSamples.resize(frameCount);
+			for (size_t i = 0; i < frameCount; i++)
+			{
+				uint8_t* framePtr = &sampleData[i * bytesPerFrame];
+				if (bitsPerSample == 8)
+					wavSamples[i] = (int16_t)((framePtr[0] - 128) * 256);
+				else
+					wavSamples[i] = (int16_t)(framePtr[0] | (framePtr[1] << 8));
+			}
+
+			tapeFormat = CASSETTE_FORMAT_WAV;
+			decodeWavBits();
+			return CASSETTE_OPERATION_COMPLETE;
+		}
+		else
+			fseek(tapeFile, chunkSize + (chunkSize & 1), SEEK_CUR);	// Chunks are padded to an even number of bytes
+	}
+
+	return CASSETTE_ERROR_UNSUPPORTED_FORMAT;
+}
+
+void Cassette::decodeWavBits()
+{
+	// The fast loader works on bits, so demodulate the recording once up front. Run the samples through a comparator with a little hysteresis
+	// and measure the time between rising edges. Each full cycle is one bit, and its length tells us whether it was 1200 Hz or 2400 Hz.
+	uint32_t minCycleSamples = wavSampleRate / CASSETTE_WAV_MAX_CYCLE_HZ;
+	uint32_t maxCycleSamples = wavSampleRate / CASSETTE_WAV_MIN_CYCLE_HZ;
+	uint32_t bitThresholdSamples = wavSampleRate / CASSETTE_WAV_BIT_THRESHOLD_HZ;
+	bool levelHigh = false, risingEdgeFound = false;
+	size_t lastRisingEdge = 0;
+
+	tapeBits.clear();
+	for (size_t i = 0; i < wavSamples.size(); i++)
+	{
+		if (!levelHigh && (wavSamples[i] > CASSETTE_WAV_HYSTERESIS))
+		{
+			levelHigh = true;
+			if (risingEdgeFound)
+			{
+				size_t cycleSamples = i - lastRisingEdge;
+				if ((cycleSamples >= minCycleSamples) && (cycleSamples <= maxCycleSamples))
+				{
+					cassetteBitStruct tapeBit;
+					tapeBit.startTime = ((uint64_t)lastRisingEdge * (uint64_t)gimeMasterClock_NTSC) / wavSampleRate;
+					tapeBit.cycleLength = (uint32_t)((((uint64_t)i * (uint64_t)gimeMasterClock_NTSC) / wavSampleRate) - tapeBit.startTime);
+					tapeBit.bitValue = (cycleSamples < bitThresholdSamples) ? 1 : 0;
+					tapeBits.push_back(tapeBit);
+				}
+			}
+			lastRisingEdge = i;
+			risingEdgeFound = true;
+		}
+		else if (levelHigh && (wavSamples[i] < -CASSETTE_WAV_HYSTERESIS))
+			levelHigh = false;
+	}
+}
+
+void Cassette::updateTapePosition()
+{
+	// The tape only moves while the motor relay is closed
+	uint32_t curClock = gimeBus->masterBusCycleCounter;
+	if (isMotorOn)
+		tapePosition += (uint32_t)(curClock - lastUpdateClock);
+	lastUpdateClock = curClock;
+}
+
+void Cassette::setMotor(bool motorOn)
+{
+	if (motorOn == isMotorOn)
+		return;
+
+	updateTapePosition();
+	isMotorOn = motorOn;
+	if (isTapeInserted)
+		gimeBus->statusBarText = isMotorOn ? "Cassette: Motor ON" : "Cassette: Motor OFF";
+}
+
+size_t Cassette::findBitAtPosition(uint64_t position)
+{
+	// Bits are stored in tape order, so binary search for the first one that hasn't finished yet at this position
+	size_t lowIndex = 0, highIndex = tapeBits.size();
+	while (lowIndex < highIndex)
+	{
+		size_t midIndex = lowIndex + ((highIndex - lowIndex) / 2);
+		if ((tapeBits[midIndex].startTime + tapeBits[midIndex].cycleLength) <= position)
+			lowIndex = midIndex + 1;
+		else
+			highIndex = midIndex;
+	}
+	return lowIndex;
+}
+
+uint8_t Cassette::readInputBit()
+{
+	// Returns the level on the cassette input comparator, which shows up in bit 0 of PIA1 Side A ($FF20)
+	if (!isTapeInserted)
+		return 0;
+
+	updateTapePosition();
+	if (tapeFormat == CASSETTE_FORMAT_WAV)
+	{
+		uint64_t sampleIndex = (tapePosition * wavSampleRate) / (uint64_t)gimeMasterClock_NTSC;
+		if (sampleIndex >= wavSamples.size())
+			return 0;
+		return (wavSamples[sampleIndex] > 0) ? 1 : 0;
+	}
+
+	// The ROM polls this constantly while the tape moves forward, so pick up from the last bit we played and only search if the tape jumped backwards or ran out
+	if ((playbackBitIndex >= tapeBits.size()) || (tapeBits[playbackBitIndex].startTime > tapePosition))
+		playbackBitIndex = findBitAtPosition(tapePosition);
+	while ((playbackBitIndex < tapeBits.size()) && ((tapeBits[playbackBitIndex].startTime + tapeBits[playbackBitIndex].cycleLength) <= tapePosition))
+		playbackBitIndex++;
+	if (playbackBitIndex >= tapeBits.size())
+		return 0;
+
+	// Each bit is one cycle of a square wave, high for the first half and low for the second
+	cassetteBitStruct& curBit = tapeBits[playbackBitIndex];
+	if (tapePosition < curBit.startTime)
+		return 0;
+	return ((tapePosition - curBit.startTime) < (curBit.cycleLength / 2)) ? 1 : 0;
+}
+
+void Cassette::renderAudioBlock(uint32_t blockClocks)
+{
+	// Called at the end of every audio block. Whatever went past the tape head during the block goes into the cassette's mixer source at
+	// the clock it happened, so the tape can be heard (and have its gain set or be muted) like any other source.
+	BlipSynth& cassetteSynth = gimeBus->audioSynth[AUDIO_SOURCE_CASSETTE];
+	uint64_t blockStartPosition = audioTapePosition;
+	if (isTapeInserted)
+		updateTapePosition();
+	audioTapePosition = tapePosition;
+
+	// Nothing to play if the tape didn't move, jumped backwards (rewound), or jumped way ahead because the fast loader skipped over a block
+	if (!isTapeInserted || !gimeBus->isCassetteAudioSelected() || (tapePosition <= blockStartPosition) || ((tapePosition - blockStartPosition) > ((uint64_t)blockClocks * 2)))
+	{
+		cassetteSynth.setLevel(0, 0.0f);
+		return;
+	}
+
+	// If the motor only ran for part of the block, the tape's movement gets lined up with the end of it
+	uint64_t tapeMoved = tapePosition - blockStartPosition;
+	uint32_t clockOffset = (tapeMoved < blockClocks) ? (uint32_t)(blockClocks - tapeMoved) : 0;
+	auto tapeToBlockClock = [&](uint64_t position) -> uint32_t
+	{
+		uint64_t blockClock = clockOffset + (position - blockStartPosition);
+		return (blockClock < blockClocks) ? (uint32_t)blockClock : blockClocks;
+	};
+
+	if (tapeFormat == CASSETTE_FORMAT_WAV)
+	{
+		uint64_t sampleIndex = ((blockStartPosition * wavSampleRate) / (uint64_t)gimeMasterClock_NTSC) + 1;
+		uint64_t lastSampleIndex = (tapePosition * wavSampleRate) / (uint64_t)gimeMasterClock_NTSC;
+		for (; sampleIndex <= lastSampleIndex; sampleIndex++)
+		{
+			uint64_t samplePosition = (sampleIndex * (uint64_t)gimeMasterClock_NTSC) / wavSampleRate;
+			float sampleLevel = (sampleIndex < wavSamples.size()) ? (wavSamples[sampleIndex] * AUDIO_CASSETTE_WAV_STEP) : 0.0f;
+			cassetteSynth.setLevel(tapeToBlockClock(samplePosition), sampleLevel);
+		}
+		return;
+	}
+
+	// CAS bits are square waves, high for the first half of the cycle and low for the second
+	for (size_t bitIndex = findBitAtPosition(blockStartPosition); (bitIndex < tapeBits.size()) && (tapeBits[bitIndex].startTime < tapePosition); bitIndex++)
+	{
+		cassetteBitStruct& curBit = tapeBits[bitIndex];
+		uint64_t midPosition = curBit.startTime + (curBit.cycleLength / 2);
+		if (curBit.startTime >= blockStartPosition)
+			cassetteSynth.setLevel(tapeToBlockClock(curBit.startTime), AUDIO_CASSETTE_LEVEL);
+		if ((midPosition >= blockStartPosition) && (midPosition < tapePosition))
+			cassetteSynth.setLevel(tapeToBlockClock(midPosition), 0.0f);
+	}
+}
+
+bool Cassette::checkFastLoadTrap(uint16_t address)
+{
+	// Called by the CPU before every instruction while the trap is armed, so get out quickly if it isn't one of ours
+	if ((address != trapAddrCSRDON) && (address != trapAddrBLKIN))
+		return false;
+
+	// Make sure it really is BASIC sitting at this address and not something else mapped over it (OS-9, a cartridge, etc)
+	for (uint16_t i = 0; i < 4; i++)
+		if (gimeBus->readMemoryByte(address + i) != gimeBus->romCoCo3->readByte(address + i))
+			return false;
+
+	if (address == trapAddrCSRDON)
+	{
+		fastLoadCSRDON();
+		return true;
+	}
+	return fastLoadBLKIN();
+}
+
+void Cassette::fastLoadCSRDON()
+{
+	// Start the motor the same way the ROM does so the PIA ends up in the same state, but skip waiting for the leader. BLKIN hunts for the sync byte itself.
+	gimeBus->writeMemoryByte(0xFF21, gimeBus->readMemoryByte(0xFF21) | 0x08);
+	gimeBus->cpu.cpuReg.CC.I = true;
+	gimeBus->cpu.cpuReg.CC.F = true;
+	returnFromTrap();
+}
+
+bool Cassette::readTapeByte(size_t& bitIndex, uint8_t& byteValue)
+{
+	if ((bitIndex + 8) > tapeBits.size())
+		return false;
+
+	byteValue = 0;
+	for (uint8_t bitNum = 0; bitNum < 8; bitNum++)
+		byteValue |= tapeBits[bitIndex++].bitValue << bitNum;
+	return true;
+}
+
+bool Cassette::fastLoadBLKIN()
+{
+	updateTapePosition();
+	size_t bitIndex = findBitAtPosition(tapePosition);
+
+	// Hunt for the sync byte one bit at a time like the ROM does, since blocks in a WAV recording don't have to line up with anything
+	uint8_t shiftRegister = 0;
+	do
+	{
+		// If we run off the end of the tape, just let the real ROM routine sit and wait for data like it would on the real thing
+		if (bitIndex >= tapeBits.size())
+			return false;
+		shiftRegister = (shiftRegister >> 1) | (tapeBits[bitIndex++].bitValue << 7);
+	} while (shiftRegister != CASSETTE_SYNC_BYTE);
+
+	uint8_t blockType, blockLength, dataByte, errorCode = 0;
+	if (!readTapeByte(bitIndex, blockType) || !readTapeByte(bitIndex, blockLength))
+		return false;
+
+	// Copy the block straight into the buffer BASIC asked for, verifying each byte the same way the ROM does so loading into ROM still reports an error
+	uint16_t bufferAddr = gimeBus->readMemoryWord(CASSETTE_BASIC_CBUFAD);
+	uint8_t checksum = blockType + blockLength;
+	for (uint16_t i = 0; i < blockLength; i++)
+	{
+		if (!readTapeByte(bitIndex, dataByte))
+			return false;
+		gimeBus->writeMemoryByte(bufferAddr, dataByte);
+		if (gimeBus->readMemoryByte(bufferAddr) != dataByte)
+		{
+			errorCode = CASSETTE_BLKIN_MEMORY_ERROR;
+			break;
+		}
+		bufferAddr++;
+		checksum += dataByte;
+	}
+	if (errorCode == 0)
+	{
+		if (!readTapeByte(bitIndex, dataByte))
+			return false;
+		if (dataByte != checksum)
+			errorCode = CASSETTE_BLKIN_CHECKSUM_ERROR;
+	}
+
+	// Leave everything the way BLKIN would have: block info in BASIC's variables, X pointing past the data, error code in A with the flags set from it, and interrupts back on
+	gimeBus->writeMemoryByte(CASSETTE_BASIC_BLKTYP, blockType);
+	gimeBus->writeMemoryByte(CASSETTE_BASIC_BLKLEN, blockLength);
+	gimeBus->writeMemoryByte(CASSETTE_BASIC_CCKSUM, checksum);
+	gimeBus->writeMemoryByte(CASSETTE_BASIC_CSRERR, errorCode);
+	gimeBus->cpu.cpuReg.X = bufferAddr;
+	gimeBus->cpu.cpuReg.Acc.A = errorCode;
+	gimeBus->cpu.cpuReg.CC.N = errorCode & 0x80;
+	gimeBus->cpu.cpuReg.CC.Z = (errorCode == 0);
+	gimeBus->cpu.cpuReg.CC.V = false;
+	gimeBus->cpu.cpuReg.CC.I = false;
+	gimeBus->cpu.cpuReg.CC.F = false;
+
+	// Move the tape to the end of the block
+	tapePosition = tapeBits[bitIndex - 1].startTime + tapeBits[bitIndex - 1].cycleLength;
+	playbackBitIndex = bitIndex;
+	blocksFastLoaded++;
+
+	char textBuffer[64];
+	snprintf(textBuffer, sizeof(textBuffer), "Cassette: Fast loaded block type %02X, %u bytes", blockType, blockLength);
+	gimeBus->statusBarText = textBuffer;
+
+	returnFromTrap();
+	return true;
+}
+
+void Cassette::returnFromTrap()
+{
+	// Both routines are entered with a JSR through the jump table, so finish with the equivalent of an RTS
+	gimeBus->cpu.cpuReg.PC = gimeBus->readMemoryWord(gimeBus->cpu.cpuReg.S);
+	gimeBus->cpu.cpuReg.S += 2;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class GimeBus;
+
+constexpr uint8_t CASSETTE_OPERATION_COMPLETE		= 0x00;
+constexpr uint8_t CASSETTE_ERROR_NO_TAPE_INSERTED	= 0x01;
+constexpr uint8_t CASSETTE_ERROR_OPENING_FILE		= 0x02;
+constexpr uint8_t CASSETTE_ERROR_UNSUPPORTED_FORMAT	= 0x03;
+
+constexpr uint8_t CASSETTE_FORMAT_NONE	= 0;
+constexpr uint8_t CASSETTE_FORMAT_CAS	= 1;	// Raw bit-stream of the bytes that were recorded, each bit gets played back as one cycle of a square wave
+constexpr uint8_t CASSETTE_FORMAT_WAV	= 2;	// Sampled audio of an actual tape
+
+// The CoCo records a 0 bit as one cycle of 1200 Hz and a 1 bit as one cycle of 2400 Hz. These are in GIME master clock ticks.
+constexpr uint32_t CASSETTE_CYCLE_CLOCKS_BIT0	= 23863;
+constexpr uint32_t CASSETTE_CYCLE_CLOCKS_BIT1	= 11932;
+constexpr uint32_t CASSETTE_WAV_BIT_THRESHOLD_HZ = 1800;	// Cycles decoded from a WAV file faster than this are 1 bits, slower ones are 0 bits
+constexpr uint32_t CASSETTE_WAV_MIN_CYCLE_HZ	= 600;		// Anything outside of these is treated as noise or a gap between blocks
+constexpr uint32_t CASSETTE_WAV_MAX_CYCLE_HZ	= 4800;
+constexpr int16_t CASSETTE_WAV_HYSTERESIS		= 512;
+
+// Color BASIC's cassette routines are called through the indirect jump table at $A000. We look the real addresses up from the ROM.
+constexpr uint16_t CASSETTE_VECTOR_CSRDON	= 0xA004;	// Start tape and look for the leader
+constexpr uint16_t CASSETTE_VECTOR_BLKIN	= 0xA006;	// Read one block from tape into the buffer pointed to by CBUFAD
+
+// Color BASIC direct page variables used by BLKIN
+constexpr uint16_t CASSETTE_BASIC_BLKTYP	= 0x007C;
+constexpr uint16_t CASSETTE_BASIC_BLKLEN	= 0x007D;
+constexpr uint16_t CASSETTE_BASIC_CBUFAD	= 0x007E;
+constexpr uint16_t CASSETTE_BASIC_CCKSUM	= 0x0080;
+constexpr uint16_t CASSETTE_BASIC_CSRERR	= 0x0081;
+
+constexpr uint8_t CASSETTE_SYNC_BYTE		= 0x3C;
+constexpr uint8_t CASSETTE_BLKIN_CHECKSUM_ERROR = 0x01;
+constexpr uint8_t CASSETTE_BLKIN_MEMORY_ERROR	= 0x02;
+
+// One bit of a tape, located by where its cycle starts on the tape in GIME master clock ticks
+struct cassetteBitStruct
+{
+	uint64_t startTime;
+	uint32_t cycleLength;
+	uint8_t bitValue;
+};
+
+class Cassette
+{
+public:
+	Cassette();
+
+	void ConnectToBus(GimeBus* busPtr) { gimeBus = busPtr; }
+	uint8_t insertTape(std::string);
+	uint8_t ejectTape();
+	uint8_t rewindTape();
+	void setMotor(bool);
+	uint8_t readInputBit();
+	void renderAudioBlock(uint32_t);
+	bool checkFastLoadTrap(uint16_t);
+	void resolveTrapAddresses();
+
+	bool isTapeInserted, isMotorOn, fastLoadEnabled;
+	uint8_t tapeFormat;
+	uint16_t trapAddrCSRDON, trapAddrBLKIN;
+	uint32_t blocksFastLoaded;
+	std::string tapeFilePathname;
+
+private:
+	GimeBus* gimeBus = nullptr;
+	std::vector<cassetteBitStruct> tapeBits;	// Filled for both formats. CAS files play these back directly, the fast loader reads them for WAV files too
+	std::vector<int16_t> wavSamples;			// Only used for WAV files, which are played back sample by sample
+	uint32_t wavSampleRate;
+	uint64_t tapePosition;						// Current position on the tape in GIME master clock ticks
+	uint64_t audioTapePosition;					// Tape position at the start of the current audio block
+	uint32_t lastUpdateClock;					// Value of the bus cycle counter when tapePosition was last brought up to date
+	size_t playbackBitIndex;
+
+	uint8_t loadCasFile(FILE*);
+	uint8_t loadWavFile(FILE*);
+	void decodeWavBits();
+	void updateTapePosition();
+	size_t findBitAtPosition(uint64_t);
+	bool readTapeByte(size_t&, uint8_t&);
+	void fastLoadCSRDON();
+	bool fastLoadBLKIN();
+	void returnFromTrap();
+};
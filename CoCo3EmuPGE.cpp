@@ -4,12 +4,13 @@
 #include "olcPixelGameEngine.h"
 #include "CoCo3EmuPGE.h"
 #include "FontData.h"
+#include "DiskFileIO.h"
 
 #define OLC_PGEX_SOUND
 #include "olcPGEX_Sound.h"
 
 // These defines are just so I can use shorthand labels for these long object references
-#define palRegs gimeBus.gimePaletteRegs
+#define palRegs (renderVideoRegs + VIDEO_REG_PALETTE)
 #define palDefs gimeBus.gimePaletteDefs
 
 CoCoEmuPGE::CoCoEmuPGE()
@@ -17,16 +18,24 @@ CoCoEmuPGE::CoCoEmuPGE()
 	// Name your application
 	sAppName = "CoCo3Emu";
 	gimeBus.ConnectBusGime(this);
+	for (int source = 0; source < AUDIO_SOURCE_COUNT; source++)
+		gimeBus.audioSynth[source].setClocksPerSample(gimeAudioCountInterval);
+	for (int i = 0; i < FRAME_QUEUE_BUFFERS; i++)
+		frameQueueBuffers[i].resize(EMU_FRAME_WIDTH * STATUSBAR_START_Y);
+	emuFrameIndexed.resize(EMU_FRAME_WIDTH * STATUSBAR_START_Y);
 
 	gimeBus.joystickDevice[JOYSTICK_PORT_RIGHT].isAttached = true;
 	gimeBus.joystickDevice[JOYSTICK_PORT_RIGHT].deviceType = JOYSTICK_DEVICE_MOUSE;
+
+	gimeGlyphCache.resize(GLYPH_CACHE_GIME_ENTRIES);
+	vdgGlyphCache.resize(GLYPH_CACHE_VDG_ENTRIES);
 }
 
 bool CoCoEmuPGE::OnUserCreate()
 {
 	// Init the sound extension/hardware
 	std::function<float(int, float, float)> soundHandlerFunc = std::bind(&CoCoEmuPGE::SoundHandler, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
-	olc::SOUND::InitialiseAudio(48000, 1, 8, 512);
+	olc::SOUND::InitialiseAudio(48000, 2, 8, 512);		// Stereo so the Orchestra-90 channels can be heard separately
 	olc::SOUND::SetUserSynthFunction(soundHandlerFunc);
 
 	uiLoadmHasExecAddr = false;
@@ -59,6 +68,12 @@ bool CoCoEmuPGE::OnUserCreate()
 	//gimeBus.emuDiskDriver.isEnabled = true;
 	//gimeBus.emuDiskDriver.vhdMountDisk(0, "Z:\\Documents\\Coco_Code\\EOU\\V101_STD\\68SDC.vhd");
 
+	if (!startupOverlayTag.empty())
+	{
+		gimeBus.diskOverlayTag = startupOverlayTag;
+		printf("Disk images will be mounted as overlays with tag \"%s\"\n", startupOverlayTag.c_str());
+	}
+
 	// Attempt to load config file
 	uint8_t configLoadStatus = loadConfigFile();
 	if (configLoadStatus == CONFIG_ERROR_OPENING_FILE)
@@ -71,7 +86,8 @@ bool CoCoEmuPGE::OnUserCreate()
 		printf("Successfully loaded config file.\n");
 
 	gimeBus.cpu.assertedInterrupts[INT_RESET] = INT_ASSERT_MASK_RESET;		// This "resets" the CPU to it's initial state and enables it's "clock"
-	cmpOrRgb = 1;	// Set display palette set to RGB by default
+	cmpOrRgb = 1;	// Set display palette set to RGB by default. Frames are only converted to RGB when they're shown, so nothing cached needs to be thrown out
+	loadRenderVideoParams();		// Start the renderer off with video parameters that match the power-up register state
 
 	// Setup initial status bar state
 	gimeBus.statusBarText = "Idle";
@@ -79,65 +95,54 @@ bool CoCoEmuPGE::OnUserCreate()
 	DrawString(STATUSBAR_TEXT_OFFSET_X, STATUSBAR_TEXT_OFFSET_Y, gimeBus.statusBarText, olc::BLACK);
 	statusBarTimeout = true;
 
+	// If a WAV file was given on the command line, start recording right from power-up
+	if (!startupWavPathname.empty())
+	{
+		if (wavWriter.startRecording(startupWavPathname, (uint32_t)audioSampleRateInHz))
+			printf("Recording audio to %s\n", startupWavPathname.c_str());
+		else
+			printf("Error: Could not create WAV file %s\n", startupWavPathname.c_str());
+	}
+
+	// Everything's set up, so the emulated machine can start running on its own thread
+	emulationThreadRunning = true;
+	emulationThread = std::thread(&CoCoEmuPGE::emulationThreadLoop, this);
+
 	return true;
 }
 
 bool CoCoEmuPGE::OnUserDestroy()
 {
+	emulationThreadRunning = false;
+	if (emulationThread.joinable())
+		emulationThread.join();
+	gimeBus.diskController.fdcFlushAllDisks();
+	gimeBus.emuDiskDriver.vhdFlushAllCaches();
+	gimeBus.diskWriteQueue.shutdownQueue();		// Waits for every queued disk write to make it into its image
+	wavWriter.stopRecording();
 	olc::SOUND::DestroyAudio();
 	return true;
 }
 
 bool CoCoEmuPGE::OnUserUpdate(float fElapsedTime)
 {	
-	// Called once per frame, draws random coloured pixels
-	uint16_t scanlineIndex;
-	
 	statusElapsedTime += fElapsedTime;
-	//gimeCycleCounter = residualGimeCycleCount;
-	elapsedGimeClockCycles = (gimeMasterClock_NTSC * fElapsedTime) + residualCycles;
+	emulationPaused = IsConsoleShowing();		// Hold the emulated machine still while the command console is open, same as it always has
 
-	/*
-	averageElapsedGimeCycles += elapsedGimeClockCycles;
-	averageElapsedGimeCyclesCounter++;
-	if (averageElapsedGimeCyclesCounter >= 2000)
-	{
-		printf("Average elapsed GIME cycles = %f\n", (averageElapsedGimeCycles / 2000));
-		averageElapsedGimeCyclesCounter = 0;
-		averageElapsedGimeCycles = 0;
-	}
-	*/
+	presentEmulatedFrame();
 
-	while (elapsedGimeClockCycles > 1.0f)
+	// Everything below touches state the emulation thread also uses, so grab the lock for the duration
+	std::unique_lock<std::mutex> emulationLock(emulationMutex);
+
+	// Every so often, hand any floppy and hard drive sectors that have changed to the disk write queue, whose I/O thread puts them in the
+	// host's disk image files. This is done under the emulation lock, but queuing the writes is just a copy.
+	diskFlushElapsedTime += fElapsedTime;
+	if (diskFlushElapsedTime >= diskFlushIntervalSeconds)
 	{
-		gimeBus.gimeBusClockTick();
-		gimeAudioCounter--;
-		if (gimeAudioCounter <= 0.0f)
-		{
-			//fifoAudioBuffer.push(gimeBus.devPIA1.SideA.dataReg >> 2);	// add a new coco audio sample to our Host audio buffer
-			leftAudioBuffer.push(gimeBus.devPIA1.SideA.dataReg >> 2);
-			//rightAudioBuffer.push(gimeBus.orch90dac.rightChannel);
-			//fifoAudioBuffer.push(newStereoSample);
-			if (!audioBufferReady && leftAudioBuffer.size() >= numSamplesToBuffer)
-				audioBufferReady = true;
-			gimeAudioCounter += gimeAudioCountInterval;
-		}
-		
-		if (gimeBus.dotCounter == 168)
-		{
-			// If current scanline is in the "visible" range (including borders because you CAN see those), then call relevant renderer function
-			if ((gimeBus.scanlineCounter >= 13) && (gimeBus.scanlineCounter < 255))
-			{
-				if (gimeBus.gimeRegInit0.cocoCompatMode)
-					renderScanlineVDG(gimeBus.scanlineCounter);
-				else
-					renderScanlineGIME(gimeBus.scanlineCounter);
-			}
-		}
-		elapsedGimeClockCycles--;
-	} 
-	// correct any overshoot of our counter next time through the loop
-	residualCycles = elapsedGimeClockCycles;
+		gimeBus.diskController.fdcFlushAllDisks();
+		gimeBus.emuDiskDriver.vhdFlushAllCaches();
+		diskFlushElapsedTime = 0;
+	}
 
 	for (int i = 0; i < 56; i++) 
 		gimeBus.hostKeyMatrix[i].keyDownState = GetKey(gimeBus.hostKeyMatrix[i].keyID).bHeld;
@@ -198,13 +203,223 @@ bool CoCoEmuPGE::OnUserUpdate(float fElapsedTime)
 		FillRect(0, STATUSBAR_START_Y, 640, STATUSBAR_HEIGHT, olc::GREY);
 		DrawString(STATUSBAR_TEXT_OFFSET_X, STATUSBAR_TEXT_OFFSET_Y, gimeBus.statusBarText, olc::BLACK);
 	}
+	emulationLock.unlock();
+
+	updatePerfOverlay(fElapsedTime);
 
 	return true;
 }
 
+void CoCoEmuPGE::emulationThreadLoop()
+{
+	// Runs the emulated machine in real time (or as fast as the host allows in turbo mode) on its own thread, handing each
+	// completed frame over to the UI thread through the frame queue
+	std::chrono::steady_clock::time_point lastTime = std::chrono::steady_clock::now();
+
+	while (emulationThreadRunning)
+	{
+		std::chrono::steady_clock::time_point curTime = std::chrono::steady_clock::now();
+		float elapsedTime = std::chrono::duration<float>(curTime - lastTime).count();
+		lastTime = curTime;
+
+		if (emulationPaused)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			continue;
+		}
+
+		if (turboModeEnabled)
+		{
+			elapsedGimeClockCycles = EMULATION_SLICE_CYCLES;
+			residualCycles = 0;
+		}
+		else
+		{
+			// If the host stalled for some reason, don't try to make up for more than a tenth of a second or we'll never catch up
+			if (elapsedTime > 0.1f)
+				elapsedTime = 0.1f;
+			elapsedGimeClockCycles = (gimeMasterClock_NTSC * elapsedTime) + residualCycles;
+		}
+
+		while (elapsedGimeClockCycles > 1.0f)
+		{
+			// Work in small slices so the UI thread and console commands never have to wait long for the lock
+			std::lock_guard<std::mutex> emulationLock(emulationMutex);
+			unsigned int sliceCycles = EMULATION_SLICE_CYCLES;
+			while ((elapsedGimeClockCycles > 1.0f) && (sliceCycles > 0))
+			{
+				runGimeClockTick();
+				elapsedGimeClockCycles--;
+				sliceCycles--;
+			}
+		}
+		// correct any overshoot of our counter next time through the loop
+		residualCycles = elapsedGimeClockCycles;
+
+		if (!turboModeEnabled)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void CoCoEmuPGE::runGimeClockTick()
+{
+	gimeBus.gimeBusClockTick();
+
+	if (gimeBus.audioBlockComplete)
+	{
+		gimeBus.audioBlockComplete = false;
+		mixAudioBlock();
+	}
+
+	if (gimeBus.videoFrameComplete)
+	{
+		// All the visible scanlines have gone by, so draw the whole frame in one go from the logged video register writes
+		gimeBus.videoFrameComplete = false;
+		renderVideoFrame();
+		queueEmulatedFrame();
+	}
+}
+
+void CoCoEmuPGE::mixAudioBlock()
+{
+	// Called once per scanline to turn all the audio level changes logged since the last call into output samples
+	uint32_t blockClocks = gimeBus.masterBusCycleCounter - gimeBus.audioBlockStartClock;
+	gimeBus.cassetteDeck.renderAudioBlock(blockClocks);		// The tape's level changes are worked out here rather than on every tick
+	gimeBus.audioBlockStartClock = gimeBus.masterBusCycleCounter;
+	// Every source's synth sees the same block length and clock ratio so they always have the same number of samples ready
+	unsigned int sampleCount = BLIP_MAX_BLOCK_SAMPLES;
+	for (int source = 0; source < AUDIO_SOURCE_COUNT; source++)
+	{
+		gimeBus.audioSynth[source].endBlock(blockClocks);
+		unsigned int sourceSampleCount = gimeBus.audioSynth[source].readSamples(audioBlockSamples[source], BLIP_MAX_BLOCK_SAMPLES);
+		if (sourceSampleCount < sampleCount)
+			sampleCount = sourceSampleCount;
+	}
+
+	// Samples are thrown away in turbo mode since the host can't play them back any faster anyway, unless they're being recorded
+	bool wavRecording = wavWriter.isRecording();
+	if (turboModeEnabled && !wavRecording)
+		return;
+
+	audioMixer.mixBlock(audioBlockSamples, sampleCount, audioBlockFrames);
+	if (wavRecording)
+		wavWriter.queueFrames(audioBlockFrames, sampleCount);
+	if (turboModeEnabled)
+		return;
+
+	for (unsigned int i = 0; i < sampleCount; i++)
+	{
+		audioRingBuffer.pushFrame(audioBlockFrames[i]);	// add a new coco audio sample to our Host audio buffer
+		if (!audioBufferReady && (audioRingBuffer.getFillLevel() >= audioTargetFillLevel))
+			audioBufferReady = true;
+		if (++audioRateControlCounter >= audioRateControlInterval)
+			updateAudioRateControl();
+	}
+}
+
+void CoCoEmuPGE::updateAudioRateControl()
+{
+	// The emulated clock and the host's audio clock never run at exactly the same rate, so the number of GIME clocks between
+	// samples gets nudged a tiny bit based on how far the ring buffer's fill level is from our latency target. Buffer filling
+	// up means we're producing too fast, so stretch the interval. Draining means the opposite.
+	audioRateControlCounter = 0;
+	if (!audioBufferReady)
+		return;
+
+	float fillError = ((float)audioRingBuffer.getFillLevel() - (float)audioTargetFillLevel) / (float)audioTargetFillLevel;
+	if (fillError > 1.0f)
+		fillError = 1.0f;
+	else if (fillError < -1.0f)
+		fillError = -1.0f;
+	gimeAudioCountCurrent = gimeAudioCountInterval * (1.0f + (fillError * audioMaxRateAdjust));
+	for (int source = 0; source < AUDIO_SOURCE_COUNT; source++)
+		gimeBus.audioSynth[source].setClocksPerSample(gimeAudioCountCurrent);
+}
+
+int CoCoEmuPGE::findAudioSource(std::string sourceName)
+{
+	for (int i = 0; i < AUDIO_SOURCE_COUNT; i++)
+		if (audioMixer.sourceName[i] == sourceName)
+			return i;
+	return -1;
+}
+
+void CoCoEmuPGE::setAudioLatency(unsigned int latencyMS)
+{
+	if (latencyMS < audioMinLatencyMS)
+		latencyMS = audioMinLatencyMS;
+	else if (latencyMS > audioMaxLatencyMS)
+		latencyMS = audioMaxLatencyMS;
+	audioLatencyMS = latencyMS;
+	audioTargetFillLevel = (unsigned int)((audioSampleRateInHz * latencyMS) / 1000);
+}
+
+void CoCoEmuPGE::queueEmulatedFrame()
+{
+	// Copy the finished frame into our back buffer, then swap it with the "ready" slot. The UI thread only ever takes from the 
+	// ready slot, so neither side ever has to wait on the other.
+	memcpy(frameQueueBuffers[frameQueueWriteIndex].data(), emuFrameIndexed.data(), emuFrameIndexed.size());
+	uint8_t prevReadyIndex = frameQueueReady.exchange(frameQueueWriteIndex | FRAME_QUEUE_FRESH_FLAG);
+	frameQueueWriteIndex = prevReadyIndex & FRAME_QUEUE_INDEX_MASK;
+}
+
+void CoCoEmuPGE::presentEmulatedFrame()
+{
+	// Nothing new from the emulation thread since last time, so what's already on screen is still current
+	if (!(frameQueueReady.load() & FRAME_QUEUE_FRESH_FLAG))
+		return;
+
+	uint8_t prevReadyIndex = frameQueueReady.exchange(frameQueueDisplayIndex);
+	frameQueueDisplayIndex = prevReadyIndex & FRAME_QUEUE_INDEX_MASK;
+
+	// Frames come across as GIME color numbers, so this is the one place they get turned into real RGB values for the display
+	const uint8_t* framePtr = frameQueueBuffers[frameQueueDisplayIndex].data();
+	const olc::Pixel* colorLookup = gimeBus.gimePaletteDefs[cmpOrRgb];
+	for (int y = 0; y < STATUSBAR_START_Y; y++)
+	{
+		olc::Pixel* destPtr = GetDrawTarget()->GetData() + (y * GetDrawTargetWidth());
+		for (int x = 0; x < EMU_FRAME_WIDTH; x++)
+			destPtr[x] = colorLookup[framePtr[x] & 0x3F];
+		framePtr += EMU_FRAME_WIDTH;
+	}
+}
+
+uint32_t CoCoEmuPGE::calcFrameHash()
+{
+	// 32-bit FNV-1a hash of the GIME color numbers in the most recently drawn frame. Since no RGB conversion is involved,
+	// the same picture always gives the same hash no matter which display palette set is selected.
+	uint32_t frameHash = 2166136261u;
+	for (uint8_t colorNum : emuFrameIndexed)
+	{
+		frameHash ^= colorNum;
+		frameHash *= 16777619u;
+	}
+	return frameHash;
+}
+
+void CoCoEmuPGE::drawFrameSpan(int x1, int x2, int y, uint8_t colorNum)
+{
+	// Renderers run on the emulation thread, so they draw GIME color numbers straight into the emulator's own frame instead of PGE's draw target
+	if (x1 < 0)
+		x1 = 0;
+	if (x2 >= EMU_FRAME_WIDTH)
+		x2 = EMU_FRAME_WIDTH - 1;
+	if (x2 < x1)
+		return;
+	uint8_t* spanPtr = emuFrameIndexed.data() + (y * EMU_FRAME_WIDTH);
+	memset(spanPtr + x1, colorNum, (x2 - x1) + 1);
+}
+
+void CoCoEmuPGE::setFramePixel(int x, int y, uint8_t colorNum)
+{
+	if ((x >= 0) && (x < EMU_FRAME_WIDTH))
+		emuFrameIndexed[(y * EMU_FRAME_WIDTH) + x] = colorNum;
+}
+
 bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 {
 	std::string commandWord, filename;
+	std::lock_guard<std::mutex> emulationLock(emulationMutex);	// Commands can reach into any part of the emulated machine, so keep the emulation thread out while one runs
 
 	// Extract next word
 	commandWord = stringToUpper(nextStringWord(sText));
@@ -315,7 +530,12 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 			std::string diskImageFilename = nextStringWord(sText);
 			uint8_t mountResult = gimeBus.diskController.fdcInsertDisk(targetDriveNum, diskImageFilename);
 			if (mountResult == FD502_OPERATION_COMPLETE)
+			{
 				std::cout << "Successfully mounted " << diskImageFilename << " to Drive " << std::to_string(targetDriveNum) << std::endl;
+				if (gimeBus.diskController.fdcDrive[targetDriveNum].hostDirectory != nullptr)
+					std::cout << "Host directory disk built with " << gimeBus.diskController.fdcDrive[targetDriveNum].hostDirectory->filesOnDisk << " files ("
+						<< gimeBus.diskController.fdcDrive[targetDriveNum].hostDirectory->filesSkipped << " skipped)" << std::endl;
+			}
 			else
 				std::cout << "Error: Disk image mount failed." << std::endl;
 		}
@@ -338,6 +558,20 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 			break;
 		}
 	}
+	else if (commandWord == "RESCAN")
+	{
+		// Rebuilds a host directory disk right away instead of waiting for the periodic check to notice the host files changed. Once the
+		// CoCo has written to the disk, this is the only way host-side changes get picked up.
+		uint8_t targetDriveNum = std::stoi(nextStringWord(sText));
+		uint8_t rescanStatus = gimeBus.diskController.fdcRescanHostDirectory(targetDriveNum);
+		if (rescanStatus == FD502_OPERATION_COMPLETE)
+			std::cout << "Rebuilt Drive " << std::to_string(targetDriveNum) << " from its host directory with " << gimeBus.diskController.fdcDrive[targetDriveNum].hostDirectory->filesOnDisk << " files ("
+				<< gimeBus.diskController.fdcDrive[targetDriveNum].hostDirectory->filesSkipped << " skipped)" << std::endl;
+		else if (rescanStatus == FD502_ERROR_NOT_HOST_DIRECTORY)
+			std::cout << "Error: Drive " << std::to_string(targetDriveNum) << " does not have a host directory inserted." << std::endl;
+		else
+			std::cout << "Error: No disk is inserted in Drive " << std::to_string(targetDriveNum) << std::endl;
+	}
 	else if (commandWord == "RESET")
 		gimeBus.cpu.assertedInterrupts[INT_RESET] = INT_ASSERT_MASK_RESET;
 	else if (commandWord == "SAVE")
@@ -358,7 +592,7 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 			configFile << "Device = EmuDisk" << std::endl;
 
 		if (gimeBus.diskController.isConnected)
-			for (int i = 0; i < 3; i++)
+			for (int i = 0; i < FD502_MAX_DRIVES; i++)
 			{
 				if (gimeBus.diskController.fdcDrive[i].isDriveAttached)
 				{
@@ -371,12 +605,14 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 				}
 			}
 
-		if (gimeBus.emuDiskDriver.isEnabled && (gimeBus.emuDiskDriver.emuDiskDrive[0].imageMounted || gimeBus.emuDiskDriver.emuDiskDrive[1].imageMounted))
+		if (gimeBus.emuDiskDriver.isEnabled)
 		{
-			for (int i = 0; i < 2; i++)
+			for (int i = 0; i < EMUDISK_MAX_DRIVES; i++)
 				if (gimeBus.emuDiskDriver.emuDiskDrive[i].imageMounted)
 				{
 					configFile << std::endl << "[HDD " << std::to_string(i) << "]" << std::endl;
+					configFile << "CacheChunks = " << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdCache.capacityChunks << std::endl;
+					configFile << "CacheWriteBack = " << (gimeBus.emuDiskDriver.emuDiskDrive[i].vhdCache.writeBackEnabled ? "Yes" : "No") << std::endl;
 					configFile << "ImageFilePath = " << gimeBus.emuDiskDriver.emuDiskDrive[i].imgFilePathname << std::endl;
 				}
 		}
@@ -416,25 +652,330 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 				std::cout << "Successfully mounted " << diskImageFilename << " to HDD " << std::to_string(targetDriveNum) << std::endl;
 			else if (mountResult == EMUDISK_ERROR_NOT_ENABLED)
 				std::cout << "Error: EmuDisk driver is not enabled." << std::endl;
+			else if (mountResult == EMUDISK_ERROR_INVALID_DRIVE_NUM)
+				std::cout << "Error: HDD number must be 0 to " << (EMUDISK_MAX_DRIVES - 1) << "." << std::endl;
+			else if (mountResult == EMUDISK_ERROR_UNSUPPORTED_DISK_IMAGE)
+				std::cout << "Error: Compressed disk image is damaged or can't be mounted in overlay mode." << std::endl;
 			else
 				std::cout << "Error: Disk image mount failed." << std::endl;
 		}
+		else if ((subCommandWord == "COMPRESS") || (subCommandWord == "DECOMPRESS"))
+		{
+			// HDD COMPRESS <raw image> <compressed image> / HDD DECOMPRESS <compressed image> <raw image>. Compressing an image that's already
+			// compressed repacks it without the space left behind by rewritten blocks.
+			std::string sourceFilename = nextStringWord(sText);
+			std::string destFilename = nextStringWord(sText);
+			if (sourceFilename.empty() || destFilename.empty())
+				std::cout << "Usage: HDD " << subCommandWord << " <source image> <destination image>" << std::endl;
+			else if ((gimeBus.emuDiskDriver.findDriveUsingFile(destFilename) >= 0) || (gimeBus.diskController.fdcFindDriveUsingFile(destFilename) >= 0))
+				std::cout << "Error: " << destFilename << " is mounted. Eject it before converting over it." << std::endl;
+			else
+			{
+				// The destination gets written from scratch, so it can never be a mounted image. A mounted source is fine once everything
+				// written to it has made it through the cache and write queue into the file.
+				int sourceDrive = gimeBus.emuDiskDriver.findDriveUsingFile(sourceFilename);
+				if (sourceDrive >= 0)
+				{
+					gimeBus.emuDiskDriver.vhdFlushDisk(sourceDrive);
+					if (gimeBus.emuDiskDriver.emuDiskDrive[sourceDrive].vhdOverlay != nullptr)
+						std::cout << "Note: HDD " << sourceDrive << " is in overlay mode. Its delta isn't part of the conversion unless it's committed first." << std::endl;
+				}
+				sourceDrive = gimeBus.diskController.fdcFindDriveUsingFile(sourceFilename);
+				if (sourceDrive >= 0)
+				{
+					gimeBus.diskController.fdcFlushDisk(sourceDrive);
+					gimeBus.diskWriteQueue.flushBarrier();
+				}
+				uint8_t convertResult = (subCommandWord == "COMPRESS") ? CompressedDisk::compressImage(sourceFilename, destFilename) : CompressedDisk::decompressImage(sourceFilename, destFilename);
+				if (convertResult == COMPRESSED_DISK_OPERATION_COMPLETE)
+					std::cout << "Successfully converted " << sourceFilename << " to " << destFilename << std::endl;
+				else if (convertResult == COMPRESSED_DISK_ERROR_NOT_COMPRESSED)
+					std::cout << "Error: " << sourceFilename << " is not a compressed disk image." << std::endl;
+				else if (convertResult == COMPRESSED_DISK_ERROR_INVALID_HEADER)
+					std::cout << "Error: " << sourceFilename << " is a damaged compressed disk image." << std::endl;
+				else if (convertResult == COMPRESSED_DISK_ERROR_CREATING_DEST)
+					std::cout << "Error: Could not create " << destFilename << std::endl;
+				else if (convertResult == COMPRESSED_DISK_ERROR_IMAGE_TOO_LARGE)
+					std::cout << "Error: " << sourceFilename << " is larger than the 4 GB a hard drive image can be." << std::endl;
+				else
+					std::cout << "Error: Could not open " << sourceFilename << std::endl;
+			}
+		}
+		else if (subCommandWord == "STRESS")
+		{
+			// HDD STRESS <scratch file> [writes] runs a burst of random writes through a disk write queue of its own and reports how long the
+			// calls kept this thread waiting, which is what the emulation thread sees when the CoCo writes heavily to a drive
+			std::string scratchFilename = nextStringWord(sText);
+			std::string writeCountWord = nextStringWord(sText);
+			uint32_t writeCount = (!writeCountWord.empty() && std::isdigit(writeCountWord.at(0))) ? std::stoi(writeCountWord) : 5000;
+			diskStressResultStruct stressResults;
+			if (scratchFilename.empty())
+				std::cout << "Usage: HDD STRESS <scratch file> [writes]" << std::endl;
+			else if (!DiskWriteQueue::runStressTest(scratchFilename, writeCount, stressResults))
+				std::cout << "Error: Could not create " << scratchFilename << std::endl;
+			else
+			{
+				printf("%u writes queued in %u ms. Longest queueWrite %u us (average %u us), longest readThrough %u us, longest image write %u us\n",
+					stressResults.writesQueued, stressResults.totalMilliseconds, stressResults.longestQueueWriteMicroseconds, stressResults.averageQueueWriteMicroseconds,
+					stressResults.longestReadThroughMicroseconds, stressResults.longestImageWriteMicroseconds);
+				printf("%u of %u reads through the queue matched, final image %s\n", stressResults.readsChecked - stressResults.mismatchedReads, stressResults.readsChecked,
+					stressResults.imageVerified ? "matched" : "DID NOT MATCH");
+			}
+		}
+		else if (subCommandWord == "SELFTEST")
+		{
+			// HDD SELFTEST <scratch file> checks reads and writes past 4 GB using a sparse scratch file, first straight through the file I/O
+			// calls and then with sector commands on a drive the test mounts it to. The file is deleted afterwards.
+			std::string scratchFilename = nextStringWord(sText);
+			std::string failureReason;
+			if (scratchFilename.empty())
+				std::cout << "Usage: HDD SELFTEST <scratch file>" << std::endl;
+			else if (!selfTestFileIO64(scratchFilename, failureReason))
+				std::cout << "Error: 64-bit disk image I/O self test failed, " << failureReason << "." << std::endl;
+			else if (!gimeBus.emuDiskDriver.selfTestLargeImage(scratchFilename, failureReason))
+				std::cout << "Error: EmuDisk LSN $FFFFFF self test failed, " << failureReason << "." << std::endl;
+			else
+				std::cout << "64-bit disk image I/O and EmuDisk LSN $FFFFFF self tests passed." << std::endl;
+		}
+		else if (subCommandWord == "CACHE")
+		{
+			// HDD CACHE <drive> <chunks> [WRITEBACK] sets how many 64K chunks of the image are kept in memory. 0 turns the cache off. Writes go
+			// straight through to the write queue unless WRITEBACK is given, in which case they stay in the cache until it's flushed.
+			std::string driveNumWord = nextStringWord(sText);
+			std::string chunkCountWord = nextStringWord(sText);
+			std::string writeModeWord = stringToUpper(nextStringWord(sText));
+			if (driveNumWord.empty() || chunkCountWord.empty() || !std::isdigit(driveNumWord.at(0)) || !std::isdigit(chunkCountWord.at(0)) || (std::stoi(driveNumWord) >= EMUDISK_MAX_DRIVES)
+				|| (!writeModeWord.empty() && (writeModeWord != "WRITEBACK")))
+				std::cout << "Usage: HDD CACHE <drive> <64K chunks> [WRITEBACK]" << std::endl;
+			else
+			{
+				uint8_t targetDriveNum = std::stoi(driveNumWord);
+				gimeBus.emuDiskDriver.emuDiskDrive[targetDriveNum].vhdCache.setCapacity(std::stoi(chunkCountWord));
+				gimeBus.emuDiskDriver.emuDiskDrive[targetDriveNum].vhdCache.setWriteBack(writeModeWord == "WRITEBACK");
+				std::cout << "HDD " << std::to_string(targetDriveNum) << " cache set to " << gimeBus.emuDiskDriver.emuDiskDrive[targetDriveNum].vhdCache.capacityChunks << " chunks ("
+					<< (gimeBus.emuDiskDriver.emuDiskDrive[targetDriveNum].vhdCache.capacityChunks * (DISK_CACHE_CHUNK_SIZE / 1024)) << "K), "
+					<< (gimeBus.emuDiskDriver.emuDiskDrive[targetDriveNum].vhdCache.writeBackEnabled ? "write-back" : "write-through") << std::endl;
+			}
+		}
 		else if (subCommandWord == "EJECT")
 		{
 			uint8_t targetDriveNum = std::stoi(nextStringWord(sText));
 			uint8_t ejectStatus = gimeBus.emuDiskDriver.vhdEjectDisk(targetDriveNum);
 			if (ejectStatus == EMUDISK_ERROR_NOT_ENABLED)
 				std::cout << "Error: EmuDisk driver is not enabled." << std::endl;
+			else if (ejectStatus == EMUDISK_ERROR_INVALID_DRIVE_NUM)
+				std::cout << "Error: HDD number must be 0 to " << (EMUDISK_MAX_DRIVES - 1) << "." << std::endl;
 			else if (ejectStatus == EMUDISK_ERROR_NO_DISK_MOUNTED)
-				std::cout << "Error: No HDD image file is currently mounted to HDD " << targetDriveNum << std::endl;
+				std::cout << "Error: No HDD image file is currently mounted to HDD " << std::to_string(targetDriveNum) << std::endl;
+			else
+				std::cout << "Successfully ejected HDD image file from HDD " << std::to_string(targetDriveNum) << std::endl;
+		}
+	}
+	else if (commandWord == "TAPE")
+	{
+		std::string subCommandWord = stringToUpper(nextStringWord(sText));
+		if (subCommandWord == "INSERT")
+		{
+			filename = nextStringWord(sText);
+			if (filename.empty())
+				std::cout << "Error: No filename was specified." << std::endl;
+			else
+			{
+				uint8_t insertResult = gimeBus.cassetteDeck.insertTape(filename);
+				if (insertResult == CASSETTE_OPERATION_COMPLETE)
+					std::cout << "Successfully inserted tape " << filename << std::endl;
+				else if (insertResult == CASSETTE_ERROR_UNSUPPORTED_FORMAT)
+					std::cout << "Error: Unsupported tape image format." << std::endl;
+				else
+					std::cout << "Error: Could not open tape image " << filename << std::endl;
+			}
+		}
+		else if (subCommandWord == "EJECT")
+		{
+			if (gimeBus.cassetteDeck.ejectTape() == CASSETTE_ERROR_NO_TAPE_INSERTED)
+				std::cout << "Error: No tape is inserted." << std::endl;
+			else
+				std::cout << "Successfully ejected tape." << std::endl;
+		}
+		else if (subCommandWord == "REWIND")
+		{
+			if (gimeBus.cassetteDeck.rewindTape() == CASSETTE_ERROR_NO_TAPE_INSERTED)
+				std::cout << "Error: No tape is inserted." << std::endl;
+			else
+				std::cout << "Tape rewound." << std::endl;
+		}
+		else if (subCommandWord == "FAST")
+		{
+			// Toggles whether CLOAD/CLOADM get their blocks injected straight into memory or have to listen to the whole tape
+			gimeBus.cassetteDeck.fastLoadEnabled = !gimeBus.cassetteDeck.fastLoadEnabled;
+			gimeBus.updateExecTraps();
+			std::cout << "Cassette fast loading " << (gimeBus.cassetteDeck.fastLoadEnabled ? "enabled." : "disabled.") << std::endl;
+		}
+		else
+			std::cout << "Error: Invalid parameter." << std::endl;
+	}
+	else if (commandWord == "PERF")
+	{
+		perfOverlayEnabled = !perfOverlayEnabled;
+		if (!perfOverlayEnabled)
+			FillRect(PERF_OVERLAY_START_X, STATUSBAR_START_Y, 640 - PERF_OVERLAY_START_X, STATUSBAR_HEIGHT, olc::GREY);
+		std::cout << "Performance overlay " << (perfOverlayEnabled ? "enabled." : "disabled.") << std::endl;
+	}
+	else if (commandWord == "AUDIO")
+	{
+		std::string subCommandWord = stringToUpper(nextStringWord(sText));
+		if (subCommandWord == "LATENCY")
+		{
+			std::string latencyParam = nextStringWord(sText);
+			if (latencyParam.empty() || !std::isdigit(latencyParam.at(0)))
+				std::cout << "Error: Invalid parameter." << std::endl;
+			else
+			{
+				setAudioLatency(std::stoi(latencyParam));
+				std::cout << "Audio latency target set to " << audioLatencyMS << " ms." << std::endl;
+			}
+		}
+		else if (subCommandWord == "GAIN")
+		{
+			// AUDIO GAIN <source> <percent>
+			std::string sourceParam = stringToUpper(nextStringWord(sText));
+			std::string gainParam = nextStringWord(sText);
+			int sourceNum = findAudioSource(sourceParam);
+			if ((sourceNum < 0) || gainParam.empty() || !std::isdigit(gainParam.at(0)))
+				std::cout << "Error: Invalid parameter." << std::endl;
+			else
+			{
+				audioMixer.setSourceGain(sourceNum, std::stoi(gainParam) / 100.0f);
+				std::cout << "Audio gain for " << audioMixer.sourceName[sourceNum] << " set to " << std::stoi(gainParam) << "%." << std::endl;
+			}
+		}
+		else
+			std::cout << "Error: Invalid parameter." << std::endl;
+	}
+	else if (commandWord == "RECORD")
+	{
+		filename = nextStringWord(sText);
+		if (filename.empty())
+			std::cout << "Error: No filename was specified." << std::endl;
+		else if (stringToUpper(filename) == "STOP")
+		{
+			if (!wavWriter.isRecording())
+				std::cout << "Error: Audio is not being recorded." << std::endl;
+			else
+			{
+				wavWriter.stopRecording();
+				std::cout << "Saved " << wavWriter.framesWritten << " samples to " << wavWriter.wavFilePathname << std::endl;
+			}
+		}
+		else if (wavWriter.startRecording(filename, (uint32_t)audioSampleRateInHz))
+			std::cout << "Recording audio to " << filename << std::endl;
+		else
+			std::cout << "Error: Could not create WAV file " << filename << std::endl;
+	}
+	else if (commandWord == "FRAMEHASH")
+		printf("Frame hash: %08X\n", calcFrameHash());
+	else if (commandWord == "TURBO")
+	{
+		turboModeEnabled = !turboModeEnabled;
+		std::cout << "Turbo mode " << (turboModeEnabled ? "enabled." : "disabled.") << std::endl;
+	}
+	else if (commandWord == "FASTDISK")
+	{
+		gimeBus.diskController.fastDiskMode = !gimeBus.diskController.fastDiskMode;
+		std::cout << "Fast disk mode " << (gimeBus.diskController.fastDiskMode ? "enabled." : "disabled.") << std::endl;
+	}
+	else if (commandWord == "DSKCON")
+	{
+		if (gimeBus.romExternal == nullptr)
+			std::cout << "Error: No disk ROM is loaded." << std::endl;
+		else
+		{
+			gimeBus.diskController.fdcSetDskconHLE(!gimeBus.diskController.dskconHLEEnabled);
+			if (gimeBus.diskController.dskconHLEEnabled)
+				printf("DSKCON HLE enabled. Trapping DSKCON at $%04X\n", gimeBus.diskController.trapAddrDSKCON);
+			else
+				std::cout << "DSKCON HLE disabled." << std::endl;
+		}
+	}
+	else if (commandWord == "OVERLAY")
+	{
+		std::string subCommandWord = stringToUpper(nextStringWord(sText));
+		if (subCommandWord == "ON")
+		{
+			std::string overlayTag = nextStringWord(sText);
+			if (overlayTag.empty())
+				std::cout << "Usage: OVERLAY ON <tag>" << std::endl;
+			else
+			{
+				gimeBus.diskOverlayTag = overlayTag;
+				std::cout << "Disk images mounted from now on will be overlays. Writes go to <image>." << overlayTag << ".delta" << std::endl;
+			}
+		}
+		else if (subCommandWord == "OFF")
+		{
+			gimeBus.diskOverlayTag.clear();
+			std::cout << "Disk images mounted from now on will be written to directly." << std::endl;
+		}
+		else if ((subCommandWord == "COMMIT") || (subCommandWord == "DISCARD"))
+		{
+			std::string deviceWord = stringToUpper(nextStringWord(sText));
+			std::string driveNumWord = nextStringWord(sText);
+			bool commitChanges = (subCommandWord == "COMMIT");
+			if (driveNumWord.empty() || !std::isdigit(driveNumWord.at(0)))
+				std::cout << "Usage: OVERLAY COMMIT|DISCARD DRIVE|HDD <number>" << std::endl;
+			else if ((deviceWord == "DRIVE") && (std::stoi(driveNumWord) < FD502_MAX_DRIVES))
+			{
+				uint8_t targetDriveNum = std::stoi(driveNumWord);
+				uint8_t overlayStatus = commitChanges ? gimeBus.diskController.fdcCommitOverlay(targetDriveNum) : gimeBus.diskController.fdcDiscardOverlay(targetDriveNum);
+				if (overlayStatus == FD502_OPERATION_COMPLETE)
+					std::cout << "Successfully " << (commitChanges ? "committed" : "discarded") << " the overlay on Drive " << std::to_string(targetDriveNum) << std::endl;
+				else if (overlayStatus == FD502_ERROR_NOT_OVERLAY)
+					std::cout << "Error: The disk in Drive " << std::to_string(targetDriveNum) << " is not mounted as an overlay." << std::endl;
+				else if (overlayStatus == FD502_ERROR_NO_DISK_INSERTED)
+					std::cout << "Error: No disk is inserted in Drive " << std::to_string(targetDriveNum) << std::endl;
+				else if (overlayStatus == FD502_ERROR_WRITING_DISK_IMAGE)
+					std::cout << "Error: Could not write the overlay on Drive " << std::to_string(targetDriveNum) << " into its base image. The overlay has been kept." << std::endl;
+				else
+					std::cout << "Error: Could not " << (commitChanges ? "commit" : "discard") << " the overlay on Drive " << std::to_string(targetDriveNum) << std::endl;
+			}
+			else if ((deviceWord == "HDD") && (std::stoi(driveNumWord) < EMUDISK_MAX_DRIVES))
+			{
+				uint8_t targetDriveNum = std::stoi(driveNumWord);
+				uint8_t overlayStatus = commitChanges ? gimeBus.emuDiskDriver.vhdCommitOverlay(targetDriveNum) : gimeBus.emuDiskDriver.vhdDiscardOverlay(targetDriveNum);
+				if (overlayStatus == EMUDISK_OPERATION_COMPLETE)
+					std::cout << "Successfully " << (commitChanges ? "committed" : "discarded") << " the overlay on HDD " << std::to_string(targetDriveNum) << std::endl;
+				else if (overlayStatus == EMUDISK_ERROR_NOT_OVERLAY)
+					std::cout << "Error: HDD " << std::to_string(targetDriveNum) << " is not mounted as an overlay." << std::endl;
+				else if (overlayStatus == EMUDISK_ERROR_NO_DISK_MOUNTED)
+					std::cout << "Error: No HDD image file is currently mounted to HDD " << std::to_string(targetDriveNum) << std::endl;
+				else if (overlayStatus == EMUDISK_ERROR_NOT_ENABLED)
+					std::cout << "Error: EmuDisk driver is not enabled." << std::endl;
+				else if (overlayStatus == EMUDISK_ERROR_WRITING_DISK_IMAGE)
+					std::cout << "Error: Could not write the overlay on HDD " << std::to_string(targetDriveNum) << " into its base image. The overlay has been kept." << std::endl;
+				else
+					std::cout << "Error: Could not " << (commitChanges ? "commit" : "discard") << " the overlay on HDD " << std::to_string(targetDriveNum) << std::endl;
+			}
 			else
-				std::cout << "Successfully ejected HDD image file from HDD " << targetDriveNum << std::endl;
+				std::cout << "Usage: OVERLAY COMMIT|DISCARD DRIVE|HDD <number>" << std::endl;
 		}
+		else if (gimeBus.diskOverlayTag.empty())
+			std::cout << "Overlay mode is off." << std::endl;
+		else
+			std::cout << "Overlay mode is on with tag \"" << gimeBus.diskOverlayTag << "\"" << std::endl;
 	}
 	else if (commandWord == "STATUS")
 	{
 		std::cout << std::endl << "Emulator Status" << std::endl << "---------------" << std::endl;
 
+		audioRingTelemetryStruct audioTelemetry = audioRingBuffer.readTelemetry();
+		printf("Audio Buffer: %u of %u samples (low %u, high %u), %u underruns, %u overruns\n", audioTelemetry.fillLevel, audioTelemetry.capacityFrames,
+			audioTelemetry.lowestFillLevel, audioTelemetry.highestFillLevel, audioTelemetry.underrunCount, audioTelemetry.overrunCount);
+		printf("Audio Latency Target: %u ms (%u samples), rate adjust %+.3f%%\n", audioLatencyMS, audioTargetFillLevel, ((gimeAudioCountInterval / gimeAudioCountCurrent) - 1.0f) * 100.0f);
+		printf("Audio Gain:");
+		for (int i = 0; i < AUDIO_SOURCE_COUNT; i++)
+			printf(" %s %u%%", audioMixer.sourceName[i].c_str(), (unsigned int)((audioMixer.getSourceGain(i) * 100.0f) + 0.5f));
+		printf("\n");
+
 		for (int i = 0; i < 2; i++)
 		{
 			std::cout << "Joystick " << gimeBus.joystickDevice[i].portName << " Port";
@@ -449,14 +990,28 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 			std::cout << std::endl;
 		}
 
+		std::cout << "Cassette = ";
+		if (gimeBus.cassetteDeck.isTapeInserted)
+			std::cout << gimeBus.cassetteDeck.tapeFilePathname << " (" << (gimeBus.cassetteDeck.tapeFormat == CASSETTE_FORMAT_WAV ? "WAV" : "CAS") << "), motor "
+				<< (gimeBus.cassetteDeck.isMotorOn ? "on" : "off") << ", fast loading " << (gimeBus.cassetteDeck.fastLoadEnabled ? "on" : "off")
+				<< ", " << gimeBus.cassetteDeck.blocksFastLoaded << " blocks fast loaded";
+		else
+			std::cout << "No tape inserted";
+		std::cout << std::endl;
+
 		std::string strStatusFDC = gimeBus.diskController.isConnected ? "Enabled" : "Disabled";
-		std::cout << std::endl << "FD502 Floppy Disk Controller = " << strStatusFDC << std::endl;
+		std::cout << std::endl << "FD502 Floppy Disk Controller = " << strStatusFDC << (gimeBus.diskController.fastDiskMode ? " (Fast disk mode)" : "") << std::endl;
+		if (gimeBus.diskController.dskconHLEEnabled)
+			std::cout << "DSKCON HLE                   = Enabled, " << gimeBus.diskController.dskconCallsHandled << " calls handled" << std::endl;
 		std::string strStatusEmuDisk = gimeBus.emuDiskDriver.isEnabled ? "Enabled" : "Disabled";
 		std::cout << "EmuDisk Virtual HDD Driver   = " << strStatusEmuDisk << std::endl;
+		printf("Disk Write Queue: %llu writes queued, %llu completed, %llu failed (highest depth %u, longest write %u us, longest caller wait %u us), %llu journal records replayed\n",
+			(unsigned long long)gimeBus.diskWriteQueue.writesQueued, (unsigned long long)gimeBus.diskWriteQueue.writesCompleted, (unsigned long long)gimeBus.diskWriteQueue.writesFailed, gimeBus.diskWriteQueue.highestQueueDepth,
+			gimeBus.diskWriteQueue.longestWriteMicroseconds.load(), gimeBus.diskWriteQueue.longestCallerWaitMicroseconds.load(), (unsigned long long)gimeBus.diskWriteQueue.recordsReplayed);
 		
 		if (gimeBus.diskController.isConnected)
 		{
-			for (int i = 0; i < 3; i++)
+			for (int i = 0; i < FD502_MAX_DRIVES; i++)
 			{
 				if (gimeBus.diskController.fdcDrive[i].isDriveAttached)
 				{
@@ -468,10 +1023,18 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 
 					if (gimeBus.diskController.fdcDrive[i].isDiskInserted)
 					{
-						std::cout << gimeBus.diskController.fdcDrive[i].imgFilePathname << std::endl;
+						if (gimeBus.diskController.fdcDrive[i].hostDirectory != nullptr)
+							std::cout << gimeBus.diskController.fdcDrive[i].imgFilePathname << " (Host Directory)" << std::endl;
+						else
+							std::cout << gimeBus.diskController.fdcDrive[i].imgFilePathname << ((gimeBus.diskController.fdcDrive[i].diskImageFormat == DISK_IMAGE_FORMAT_DMK) ? " (DMK)" : " (JVC)") << std::endl;
 						std::cout << "                    - Tracks/Side     = " << std::to_string(gimeBus.diskController.fdcDrive[i].diskImageGeometry->tracksPerSide) << std::endl;
 						std::cout << "                    - Sectors/Track   = " << std::to_string(gimeBus.diskController.fdcDrive[i].diskImageGeometry->sectorsPerTrack) << std::endl;
 						std::cout << "                    - Number of Sides = " << std::to_string(gimeBus.diskController.fdcDrive[i].diskImageGeometry->totalSides) << std::endl;
+						if (gimeBus.diskController.fdcDrive[i].hostDirectory != nullptr)
+							std::cout << "                    - Host Files      = " << gimeBus.diskController.fdcDrive[i].hostDirectory->filesOnDisk << " on disk, " << gimeBus.diskController.fdcDrive[i].hostDirectory->filesSkipped
+								<< " skipped, " << gimeBus.diskController.fdcDrive[i].hostDirectory->filesWrittenBack << " written back" << std::endl;
+						if (gimeBus.diskController.fdcDrive[i].diskOverlay != nullptr)
+							std::cout << "                    - Overlay Delta   = " << gimeBus.diskController.fdcDrive[i].diskOverlay->deltaPathname << " (" << gimeBus.diskController.fdcDrive[i].diskOverlay->sectorsInDelta << " sectors)" << std::endl;
 					}
 					else
 						std::cout << "NONE" << std::endl;  
@@ -481,13 +1044,31 @@ bool CoCoEmuPGE::OnConsoleCommand(const std::string& sText)
 
 		if (gimeBus.emuDiskDriver.isEnabled)
 		{
-			for (int i = 0; i < 2; i++)
+			for (int i = 0; i < EMUDISK_MAX_DRIVES; i++)
 			{
 				if (gimeBus.emuDiskDriver.emuDiskDrive[i].imageMounted)
 				{
 					std::cout << std::endl << "[HDD " << std::to_string(i) << " Mounted]" << std::endl;
 					std::cout << "Mounted Image File:  " << gimeBus.emuDiskDriver.emuDiskDrive[i].imgFilePathname << std::endl;
 					std::cout << "HDD Size (in bytes): " << std::to_string(gimeBus.emuDiskDriver.emuDiskDrive[i].diskImageFilesize) << std::endl;
+					DiskBlockCache& hddCache = gimeBus.emuDiskDriver.emuDiskDrive[i].vhdCache;
+					if (hddCache.isEnabled())
+					{
+						uint64_t totalLookups = hddCache.cacheHits + hddCache.cacheMisses;
+						printf("Block Cache:         %u of %u chunks (%s), %llu hits, %llu misses (%.1f%% hit rate), %llu chunks read ahead, %llu written back, %llu writes through\n", (unsigned int)hddCache.cachedChunks(),
+							hddCache.capacityChunks, hddCache.writeBackEnabled ? "write-back" : "write-through", (unsigned long long)hddCache.cacheHits, (unsigned long long)hddCache.cacheMisses,
+							(totalLookups > 0) ? ((hddCache.cacheHits * 100.0) / totalLookups) : 0.0, (unsigned long long)hddCache.chunksReadAhead, (unsigned long long)hddCache.chunksWrittenBack,
+							(unsigned long long)hddCache.writesThrough);
+					}
+					else
+						std::cout << "Block Cache:         Off" << std::endl;
+					if (gimeBus.emuDiskDriver.emuDiskDrive[i].vhdOverlay != nullptr)
+						std::cout << "Overlay Delta File:  " << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdOverlay->deltaPathname << " (" << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdOverlay->sectorsInDelta << " sectors)" << std::endl;
+					if (gimeBus.emuDiskDriver.emuDiskDrive[i].vhdContainer != nullptr)
+						std::cout << "Compressed Image:    " << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdContainer->blocksAllocated << " of " << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdContainer->totalBlocks
+							<< " blocks allocated, " << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdContainer->containerFilesize << " bytes on disk (" << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdContainer->freeBytes
+							<< " free), " << gimeBus.emuDiskDriver.emuDiskDrive[i].vhdContainer->blocksDecompressed
+							<< " blocks decompressed" << std::endl;
 				}
 			}
 		}
@@ -697,7 +1278,7 @@ uint8_t CoCoEmuPGE::loadConfigFile()
 		else if (inputLine.substr(0, 5) == "[HDD ")
 		{
 			int driveNum = -1;
-			if (!std::isdigit(inputLine.at(5)) || (inputLine.at(5) > '1') || (inputLine.at(6) != ']'))
+			if (!std::isdigit(inputLine.at(5)) || ((inputLine.at(5) - '0') >= EMUDISK_MAX_DRIVES) || (inputLine.at(6) != ']'))
 				return CONFIG_ERROR_INVALID_SYNTAX;		// Invalid config file
 			else
 				driveNum = inputLine.at(5) - '0';	// convert ascii number to its integer equivalent
@@ -705,7 +1286,15 @@ uint8_t CoCoEmuPGE::loadConfigFile()
 			while (std::getline(configFile, inputLine) && !inputLine.empty())
 			{
 				curConfigLine = parseConfigLine(inputLine);
-				if (curConfigLine.validResult && (curConfigLine.paramKeyword == "IMAGEFILEPATH") && !curConfigLine.paramValue.empty())
+				if (curConfigLine.validResult && (curConfigLine.paramKeyword == "CACHECHUNKS"))
+				{
+					// Has to come before ImageFilePath in the section so it's in place before the image is mounted
+					try { gimeBus.emuDiskDriver.emuDiskDrive[driveNum].vhdCache.setCapacity(std::stoi(curConfigLine.paramValue)); }
+					catch (std::exception& ex) { return CONFIG_ERROR_INVALID_SYNTAX; }
+				}
+				else if (curConfigLine.validResult && (curConfigLine.paramKeyword == "CACHEWRITEBACK"))
+					gimeBus.emuDiskDriver.emuDiskDrive[driveNum].vhdCache.setWriteBack(curConfigLine.paramValue == "YES");
+				else if (curConfigLine.validResult && (curConfigLine.paramKeyword == "IMAGEFILEPATH") && !curConfigLine.paramValue.empty())
 				{
 					if (gimeBus.emuDiskDriver.vhdMountDisk(driveNum, curConfigLine.paramValue) != EMUDISK_OPERATION_COMPLETE)
 						//std::cout << "Successfully mounted HDD image " << curConfigLine.paramValue << std::endl;
@@ -756,6 +1345,25 @@ uint8_t CoCoEmuPGE::loadConfigFile()
 			gimeBus.joystickDevice[portNum].isAttached = true;
 			//std::cout << "Joystick port " << gimeBus.joystickDevice[portNum].portName << " connected to device " << gimeBus.joystickTypeName[deviceType] << std::endl;
 		}
+		else if (inputLine.substr(0, 7) == "[Audio]")
+		{
+			while (std::getline(configFile, inputLine) && !inputLine.empty())
+			{
+				curConfigLine = parseConfigLine(inputLine);
+				if (!curConfigLine.validResult || curConfigLine.paramValue.empty() || !std::isdigit(curConfigLine.paramValue.at(0)))
+					return CONFIG_ERROR_INVALID_SYNTAX;
+				if (curConfigLine.paramKeyword == "LATENCY")
+					setAudioLatency(std::stoi(curConfigLine.paramValue));
+				else if ((curConfigLine.paramKeyword.size() > 4) && (curConfigLine.paramKeyword.substr(curConfigLine.paramKeyword.size() - 4) == "GAIN")
+					&& (findAudioSource(curConfigLine.paramKeyword.substr(0, curConfigLine.paramKeyword.size() - 4)) >= 0))
+				{
+					// Gain keywords are just the source name with GAIN on the end, ie. DACGAIN = 100 or ORCH90LEFTGAIN = 80
+					audioMixer.setSourceGain(findAudioSource(curConfigLine.paramKeyword.substr(0, curConfigLine.paramKeyword.size() - 4)), std::stoi(curConfigLine.paramValue) / 100.0f);
+				}
+				else
+					return CONFIG_ERROR_INVALID_SYNTAX;
+			}
+		}
 	}
 
 	configFile.close();
@@ -788,100 +1396,131 @@ configResultStruct CoCoEmuPGE::parseConfigLine(std::string inputLine)
 	return paramLineResult;
 }
 
+void CoCoEmuPGE::renderVideoFrame()
+{
+	// Walk through every visible scanline, applying any logged register writes that happened before the point where that line 
+	// would have been drawn. This way mid-frame palette and mode changes still land on the same scanline they would on real hardware.
+	std::vector<videoRegWriteStruct>& regWriteLog = gimeBus.videoRegWriteLog;
+	size_t logIndex = 0;
+
+	for (unsigned int scanline = VIDEO_FIRST_SCANLINE; scanline < VIDEO_FRAME_END_SCANLINE; scanline++)
+	{
+		uint32_t linePosition = (((scanline + 262 - VIDEO_FRAME_END_SCANLINE) % 262) * 1820) + VIDEO_RENDER_DOT;
+		if ((logIndex < regWriteLog.size()) && (regWriteLog[logIndex].framePosition <= linePosition))
+		{
+			while ((logIndex < regWriteLog.size()) && (regWriteLog[logIndex].framePosition <= linePosition))
+				applyVideoRegWrite(regWriteLog[logIndex++]);
+			loadRenderVideoParams();
+		}
+
+		if (renderParams.cocoCompatMode)
+			renderScanlineVDG(scanline);
+		else
+			renderScanlineGIME(scanline);
+	}
+
+	// Anything written after the last visible scanline carries over into the start of the next frame
+	if (logIndex < regWriteLog.size())
+	{
+		while (logIndex < regWriteLog.size())
+			applyVideoRegWrite(regWriteLog[logIndex++]);
+		loadRenderVideoParams();
+	}
+	regWriteLog.clear();
+}
+
+void CoCoEmuPGE::applyVideoRegWrite(const videoRegWriteStruct& regWrite)
+{
+	renderVideoRegs[regWrite.regIndex] = regWrite.value;
+	if (regWrite.regIndex < (VIDEO_REG_PALETTE + 16))
+		renderPaletteGeneration++;
+	renderRegsGeneration++;
+}
+
+void CoCoEmuPGE::loadRenderVideoParams()
+{
+	gimeBus.calcVideoParams(renderVideoRegs, renderParams);
+	curLinesPerRow = renderParams.linesPerRow;
+	underlineRowOffset = renderParams.underlineRowOffset;
+	curBytesPerChar = renderParams.bytesPerChar;
+	curCharsPerRow = renderParams.charsPerRow;
+	curBytesPerCharRow = renderParams.bytesPerCharRow;
+	bytesPerPixelRow = renderParams.bytesPerPixelRow;
+	pixelsPerDraw = renderParams.pixelsPerDraw;
+	colorSetOffset = renderParams.colorSetOffset;
+}
+
 void CoCoEmuPGE::renderScanlineVDG(unsigned int curScanline)
 {
-	if (!gimeBus.vdgVideoConfig.gfxModeEnabled)
-		borderPixel = olc::BLACK;
+	if (!renderParams.vdg.gfxModeEnabled)
+		borderPixel = GIME_COLOR_BLACK;
+	else
+		borderPixel = gimeBus.vdgBorderColors[renderParams.vdg.colorSetSelect];
 	curScanline -= 13;	// Convert physical scanline number to zero-based visible scanline offset to make this easier to read
 	topBorderEnd = 25;
 	bottomBorderStart = 217;
 
 	// This IF statement should handle both the top and bottom border scanlines
 	if ((curScanline < topBorderEnd) || ((curScanline >= bottomBorderStart) && (curScanline < 242)))
-		DrawLine(0, curScanline, 639, curScanline, borderPixel);	// Draw top or bottom border scanline
+	{
+		if (!scanlineUnchanged(curScanline, 0, 0))
+			drawFrameSpan(0, 639, curScanline, borderPixel);	// Draw top or bottom border scanline
+	}
 	else 
 	{
 		rowPixelCounter = 64;
-		DrawLine(0, curScanline, rowPixelCounter - 1, curScanline, borderPixel);
+		drawFrameSpan(0, rowPixelCounter - 1, curScanline, borderPixel);
 
-		if (!gimeBus.vdgVideoConfig.gfxModeEnabled)
+		if (!renderParams.vdg.gfxModeEnabled)
 		{
-			screenRamPtr = (((curScanline - topBorderEnd) / 12) * vdgColumnsPerRow) + gimeBus.videoStartAddr;
+			screenRamPtr = (((curScanline - topBorderEnd) / 12) * vdgColumnsPerRow) + renderParams.videoStartAddr;
+			if (scanlineUnchanged(curScanline, screenRamPtr, vdgColumnsPerRow))
+				return;
 			fontLineOffset = (curScanline - topBorderEnd) % 12;
+			uint8_t* scanlinePixelPtr = emuFrameIndexed.data() + (curScanline * EMU_FRAME_WIDTH) + rowPixelCounter;
+			unsigned int fontCacheOffset = renderParams.vdg.fontIsExternal ? (256 * 12) : 0;
 			for (int y = 0; y < vdgColumnsPerRow; y++)
 			{
+				// Every VDG character is 8 font pixels doubled to 16 screen pixels, so each cell is a single copy from the glyph row cache
 				curScreenChar = gimeBus.physicalRAM[screenRamPtr];
-				if (curScreenChar & 0x80)
-				{
-					// If here, we are rendering a semi-graphics mode 4 character
-					vdgFontDataIndex = ((curScreenChar & 0x0F) * 12) + fontLineOffset;
-					fontDataByte = sg4_fontdata8x12[vdgFontDataIndex];
-					uint8_t semiGfxColor = gimeBus.gimePaletteRegs[(curScreenChar & 0x7F) >> 4];		// Mask off semi-graphics flag bit 7, and shift color bits 6-4 over to get our color value
-					for (int x = 0; x < 8; x++)
-					{
-						fontPixel = (fontDataByte & 0x80) ? gimeBus.gimePaletteDefs[cmpOrRgb][semiGfxColor] : olc::BLACK;
-						Draw(rowPixelCounter, curScanline, fontPixel);
-						Draw(rowPixelCounter + 1, curScanline, fontPixel);
-						fontDataByte <<= 1;
-						rowPixelCounter += 2;
-					}
-				}
-				else
-				{
-					// If here, we are rendering an ASCII character
-					vdgFontDataIndex = ((curScreenChar & 0x3F) * 12) + fontLineOffset;		// Mask off bits 6 and 7 to get character index. 12 bytes per character bitmap entry
-					if (gimeBus.vdgVideoConfig.fontIsExternal)
-					{
-						if (curScreenChar & 0b01000000)
-							fontDataByte = lowres_font[vdgFontDataIndex];
-						else
-							fontDataByte = lowres_font[vdgFontDataIndex + vdgLowercaseOffset];
-					}
-					else
-					{
-						fontDataByte = lowres_font[vdgFontDataIndex];
-						if (!(curScreenChar & 0b01000000))		// Check the "inverted" color bit
-							fontDataByte = ~fontDataByte;	// Invert the character's bitmap
-					}
-					for (int x = 0; x < 8; x++)
-					{
-						fontPixel = (fontDataByte & 0x80) ? olc::BLACK : olc::GREEN;
-						Draw(rowPixelCounter, curScanline, fontPixel);
-						Draw(rowPixelCounter + 1, curScanline, fontPixel);
-						fontDataByte <<= 1;
-						rowPixelCounter += 2;
-					}
-				}
+				glyphRowCacheEntry& glyphRow = vdgGlyphCache[fontCacheOffset + (curScreenChar * 12) + fontLineOffset];
+				if (glyphRow.paletteGeneration != renderPaletteGeneration)
+					buildVdgGlyphRow(glyphRow, curScreenChar, fontLineOffset);
+				std::memcpy(scanlinePixelPtr, glyphRow.pixelRow, 16 * sizeof(uint8_t));
+				scanlinePixelPtr += 16;
+				rowPixelCounter += 16;
 				screenRamPtr++;
 			}
 		}
 		else
 		{
 			// If here, the coco is configured for a graphics mode
-			screenRamPtr = (((curScanline - 25) / curLinesPerRow) * bytesPerPixelRow) + gimeBus.videoStartAddr;
-			switch (gimeBus.vdgVideoConfig.colorDepth)
+			screenRamPtr = (((curScanline - 25) / curLinesPerRow) * bytesPerPixelRow) + renderParams.videoStartAddr;
+			if (scanlineUnchanged(curScanline, screenRamPtr, bytesPerPixelRow))
+				return;
+			switch (renderParams.vdg.colorDepth)
 			{
 			case 4:
 				for (int y = 0; y < bytesPerPixelRow; y++)
 				{
 					curScreenByte = gimeBus.physicalRAM[screenRamPtr + y];
-					pixelArray[0] = palDefs[cmpOrRgb][palRegs[(curScreenByte >> 6) + colorSetOffset]];
-					pixelArray[1] = palDefs[cmpOrRgb][palRegs[((curScreenByte & 0b00110000) >> 4) + colorSetOffset]];
-					pixelArray[2] = palDefs[cmpOrRgb][palRegs[((curScreenByte & 0b00001100) >> 2) + colorSetOffset]];
-					pixelArray[3] = palDefs[cmpOrRgb][palRegs[(curScreenByte & 0b00000011) + colorSetOffset]];
+					pixelArray[0] = palRegs[(curScreenByte >> 6) + colorSetOffset];
+					pixelArray[1] = palRegs[((curScreenByte & 0b00110000) >> 4) + colorSetOffset];
+					pixelArray[2] = palRegs[((curScreenByte & 0b00001100) >> 2) + colorSetOffset];
+					pixelArray[3] = palRegs[(curScreenByte & 0b00000011) + colorSetOffset];
 					if (pixelsPerDraw == 2)
 					{
 						for (int x = 0; x < 4; x++)
 						{
-							Draw(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
-							Draw(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
 						}
 						rowPixelCounter += 8;
 					}
 					else
 					{
 						for (int x = 0; x < 4; x++)
-							DrawLine(rowPixelCounter + (x * pixelsPerDraw), curScanline, rowPixelCounter + (x * pixelsPerDraw) + 3, curScanline, pixelArray[x]);
+							drawFrameSpan(rowPixelCounter + (x * pixelsPerDraw), rowPixelCounter + (x * pixelsPerDraw) + 3, curScanline, pixelArray[x]);
 						rowPixelCounter += (4 * pixelsPerDraw);
 					}
 				}
@@ -893,21 +1532,21 @@ void CoCoEmuPGE::renderScanlineVDG(unsigned int curScanline)
 					for (int x = 7; x >= 0; x--)
 					{
 						// In 2-color mode on a CoCo 3, the relevant palette register is offset from $FFB8, so add 8 to the index
-						pixelArray[x] = palDefs[cmpOrRgb][palRegs[(curScreenByte & 0x01) + 8 + colorSetOffset]];
+						pixelArray[x] = palRegs[(curScreenByte & 0x01) + 8 + colorSetOffset];
 						curScreenByte >>= 1;
 					}
 					if (pixelsPerDraw == 1)
 					{
 						for (int x = 0; x < 8; x++)
-							Draw(rowPixelCounter + x, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + x, curScanline, pixelArray[x]);
 						rowPixelCounter += 8;
 					}
 					else
 					{
 						for (int x = 0; x < 8; x++)
 						{
-							Draw(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
-							Draw(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
 						}
 						rowPixelCounter += 16;
 					}
@@ -917,49 +1556,62 @@ void CoCoEmuPGE::renderScanlineVDG(unsigned int curScanline)
 		}
 
 		// Finally draw right-hand border
-		DrawLine(rowPixelCounter, curScanline, 639, curScanline, borderPixel);
+		drawFrameSpan(rowPixelCounter, 639, curScanline, borderPixel);
 	}
 }
 
 void CoCoEmuPGE::renderScanlineGIME(unsigned int curScanline)
 {
-	borderPixel = gimeBus.gimePaletteDefs[cmpOrRgb][gimeBus.gimeRegBorder];
+	borderPixel = renderVideoRegs[VIDEO_REG_BORDER];
 	curScanline -= 13;	// Convert physical scanline number to zero-based visible scanline offset to make this easier to read
-	topBorderEnd = gimeBus.gimeTopBorderEnd[gimeBus.gimeRegVRES.LPF];
-	bottomBorderStart = gimeBus.gimeBottomBorderStart[gimeBus.gimeRegVRES.LPF];
+	topBorderEnd = gimeBus.gimeTopBorderEnd[renderParams.vres.LPF];
+	bottomBorderStart = gimeBus.gimeBottomBorderStart[renderParams.vres.LPF];
 
 	// This IF statement should handle both the top and bottom border scanlines
 	if ((curScanline < topBorderEnd) || ((curScanline >= bottomBorderStart) && (curScanline < 255)))
-		DrawLine(0, curScanline, 639, curScanline, borderPixel);	// Draw top or bottom border scanline
+	{
+		if (!scanlineUnchanged(curScanline, 0, 0))
+			drawFrameSpan(0, 639, curScanline, borderPixel);	// Draw top or bottom border scanline
+	}
 	else
 	{
 		// Does the current video mode have any side borders? If so, draw left and right borders for this scanline
-		if (!(gimeBus.gimeRegVRES.HRES & 0x01))
+		if (!(renderParams.vres.HRES & 0x01))
 		{
-			DrawLine(0, curScanline, 63, curScanline, borderPixel);
-			DrawLine(640 - 64, curScanline, 639, curScanline, borderPixel);
+			drawFrameSpan(0, 63, curScanline, borderPixel);
+			drawFrameSpan(640 - 64, 639, curScanline, borderPixel);
 			rowPixelCounter = 64;
 		}
 		else
 			rowPixelCounter = 0;	// No side borders so first active pixel will be at 0 X-coordinate
 		// Next we need to know if we are currently in a Text or Graphics video mode
-		if (!gimeBus.gimeRegVMode.gfxOrTextMode)
+		if (!renderParams.vmode.gfxOrTextMode)
 		{
 			// Text display mode
-			screenRamPtr = (((curScanline - topBorderEnd) / curLinesPerRow) * curBytesPerCharRow) + gimeBus.videoStartAddr;
+			screenRamPtr = (((curScanline - topBorderEnd) / curLinesPerRow) * curBytesPerCharRow) + renderParams.videoStartAddr;
+			if (scanlineUnchanged(curScanline, screenRamPtr, curBytesPerCharRow))
+				return;
 			fontLineOffset = (curScanline - topBorderEnd) % curLinesPerRow;
 
+			// Is this a high or low resolution display mode? if it's low-res, each pixel is doubled to conform to main window aspect ratio
+			uint8_t glyphRowWidth = (renderParams.vres.HRES & 0x04) ? 8 : 16;
+			unsigned int glyphWidthOffset = (glyphRowWidth == 16) ? (128 * 256) : 0;
+			// Underline only depends on the font line being drawn, and blinking only on the GIME timer state, so resolve both once for the whole scanline
+			bool underlineThisLine = (curLinesPerRow > 2) && ((fontLineOffset + 1) == underlineRowOffset);
+			bool blinkHiddenNow = !renderVideoRegs[VIDEO_REG_BLINK];
+			uint8_t* scanlinePixelPtr = emuFrameIndexed.data() + (curScanline * EMU_FRAME_WIDTH) + rowPixelCounter;
+			uint8_t glyphColorKey;
+
 			for (int y = 0; y < curCharsPerRow; y++)
 			{
 				curScreenChar = gimeBus.physicalRAM[screenRamPtr] & 0x7F;
 				if (curBytesPerChar > 1)
 				{
 					curScreenAttr = gimeBus.physicalRAM[screenRamPtr + 1];
-					foregroundPixel = palDefs[cmpOrRgb][palRegs[((curScreenAttr & 0x3F) >> 3) + 8]];	// Bits 5-3 of attribute byte contain Foreground color number
-					backgroundPixel = palDefs[cmpOrRgb][palRegs[(curScreenAttr & 0x07)]];				// Bits 2-0 of attribute byte contain Background color number
-					if ((curScreenAttr & GIME_TEXT_UNDERLINE) && (curLinesPerRow > 2) && ((fontLineOffset + 1) == underlineRowOffset))
+					glyphColorKey = curScreenAttr & 0x3F;		// Bits 5-3 are the Foreground color and bits 2-0 are the Background color
+					if ((curScreenAttr & GIME_TEXT_UNDERLINE) && underlineThisLine)
 						fontDataByte = 0xFF;
-					else if ((curScreenAttr & GIME_TEXT_BLINKING) && !gimeBus.gimeBlinkStateOn)
+					else if ((curScreenAttr & GIME_TEXT_BLINKING) && blinkHiddenNow)
 						fontDataByte = 0x00;	// If the "blink" attribute is set and the current on/off state governed by GIME timer is "off", display blank scanlines for current character
 					else if (fontLineOffset > 7)
 						fontDataByte = 0x00;	// If Lines Per Row video mode setting permits font heights beyond the GIME internal font's built-in 8x8 size, then display blank lines for the rest
@@ -969,65 +1621,49 @@ void CoCoEmuPGE::renderScanlineGIME(unsigned int curScanline)
 				else
 				{
 					// Color attributes are DISABLED. Background and Foreground colors always default to 0 and 1 respectively
-					foregroundPixel = palDefs[cmpOrRgb][palRegs[1]];
-					backgroundPixel = palDefs[cmpOrRgb][palRegs[0]];
+					glyphColorKey = GLYPH_CACHE_NO_ATTR_KEY;
 					if (fontLineOffset > 7)
 						fontDataByte = 0x00;	// If Lines Per Row video mode setting permits font heights beyond the GIME internal font's built-in 8, then display blank lines for the rest
 					else
 						fontDataByte = hires_font[curScreenChar][fontLineOffset];
 				}
-				// Is this a high or low resolution display mode? if it's low-res, double each pixel to conform to main window aspect ratio
-				if (gimeBus.gimeRegVRES.HRES & 0x04)
-				{
-					// Render 8 pixels for each character in this scanline
-					for (int x = 0; x < 8; x++)
-					{
-						fontPixel = (fontDataByte & 0x80) ? foregroundPixel : backgroundPixel;
-						Draw(rowPixelCounter, curScanline, fontPixel);
-						rowPixelCounter++;
-						fontDataByte <<= 1;
-					}
-				}
-				else
-				{
-					// Render 8 pixels for each character in this scanline
-					for (int x = 0; x < 8; x++)
-					{
-						fontPixel = (fontDataByte & 0x80) ? foregroundPixel : backgroundPixel;
-						Draw(rowPixelCounter, curScanline, fontPixel);
-						Draw(rowPixelCounter + 1, curScanline, fontPixel);
-						rowPixelCounter += 2;
-						fontDataByte <<= 1;
-					}
-				}
+				// The resolved font row bitmap plus its color pair fully describes the pixels, so the whole character cell is one copy from the glyph row cache
+				glyphRowCacheEntry& glyphRow = gimeGlyphCache[glyphWidthOffset + (glyphColorKey * 256) + fontDataByte];
+				if (glyphRow.paletteGeneration != renderPaletteGeneration)
+					buildGimeGlyphRow(glyphRow, fontDataByte, glyphColorKey, glyphRowWidth);
+				std::memcpy(scanlinePixelPtr, glyphRow.pixelRow, glyphRowWidth * sizeof(uint8_t));
+				scanlinePixelPtr += glyphRowWidth;
+				rowPixelCounter += glyphRowWidth;
 				screenRamPtr += curBytesPerChar; 
 			}
 		}
 		else
 		{
 			// GIME Graphics Mode
-			screenRamPtr = (((curScanline - topBorderEnd) / curLinesPerRow) * bytesPerPixelRow) + gimeBus.videoStartAddr;
-			switch (gimeBus.gimeRegVRES.CRES)
+			screenRamPtr = (((curScanline - topBorderEnd) / curLinesPerRow) * bytesPerPixelRow) + renderParams.videoStartAddr;
+			if (scanlineUnchanged(curScanline, screenRamPtr, bytesPerPixelRow))
+				return;
+			switch (renderParams.vres.CRES)
 			{
 			case GIME_GFX_COLORS_16:
 				for (int x = 0; x < bytesPerPixelRow; x++)
 				{
 					curScreenByte = gimeBus.physicalRAM[screenRamPtr + x];
-					pixelArray[0] = palDefs[cmpOrRgb][palRegs[curScreenByte >> 4]];
-					pixelArray[1] = palDefs[cmpOrRgb][palRegs[curScreenByte & 0x0F]];
+					pixelArray[0] = palRegs[curScreenByte >> 4];
+					pixelArray[1] = palRegs[curScreenByte & 0x0F];
 
 					if (pixelsPerDraw == 2)
 					{
-						Draw(rowPixelCounter, curScanline, pixelArray[0]);
-						Draw(rowPixelCounter + 1, curScanline, pixelArray[0]);
-						Draw(rowPixelCounter + 2, curScanline, pixelArray[1]);
-						Draw(rowPixelCounter + 3, curScanline, pixelArray[1]);
+						setFramePixel(rowPixelCounter, curScanline, pixelArray[0]);
+						setFramePixel(rowPixelCounter + 1, curScanline, pixelArray[0]);
+						setFramePixel(rowPixelCounter + 2, curScanline, pixelArray[1]);
+						setFramePixel(rowPixelCounter + 3, curScanline, pixelArray[1]);
 						rowPixelCounter += 4;
 					}
 					else
 					{
-						DrawLine(rowPixelCounter, curScanline, rowPixelCounter + 3, curScanline, pixelArray[0]);
-						DrawLine(rowPixelCounter + 4, curScanline, rowPixelCounter + 7, curScanline, pixelArray[1]);
+						drawFrameSpan(rowPixelCounter, rowPixelCounter + 3, curScanline, pixelArray[0]);
+						drawFrameSpan(rowPixelCounter + 4, rowPixelCounter + 7, curScanline, pixelArray[1]);
 						rowPixelCounter += 8;
 					}
 				}
@@ -1036,29 +1672,29 @@ void CoCoEmuPGE::renderScanlineGIME(unsigned int curScanline)
 				for (int y = 0; y < bytesPerPixelRow; y++)
 				{
 					curScreenByte = gimeBus.physicalRAM[screenRamPtr + y];
-					pixelArray[0] = palDefs[cmpOrRgb][palRegs[curScreenByte >> 6]];
-					pixelArray[1] = palDefs[cmpOrRgb][palRegs[(curScreenByte & 0b00110000) >> 4]];
-					pixelArray[2] = palDefs[cmpOrRgb][palRegs[(curScreenByte & 0b00001100) >> 2]];
-					pixelArray[3] = palDefs[cmpOrRgb][palRegs[(curScreenByte & 0b00000011)]];
+					pixelArray[0] = palRegs[curScreenByte >> 6];
+					pixelArray[1] = palRegs[(curScreenByte & 0b00110000) >> 4];
+					pixelArray[2] = palRegs[(curScreenByte & 0b00001100) >> 2];
+					pixelArray[3] = palRegs[(curScreenByte & 0b00000011)];
 					if (pixelsPerDraw == 1)
 					{
 						for (int x = 0; x < 4; x++)
-							Draw(rowPixelCounter + x, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + x, curScanline, pixelArray[x]);
 						rowPixelCounter += 4;
 					}
 					else if (pixelsPerDraw == 2)
 					{
 						for (int x = 0; x < 4; x++)
 						{
-							Draw(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
-							Draw(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
 						}
 						rowPixelCounter += 8;
 					}
 					else
 					{
 						for (int x = 0; x < 4; x++)
-							DrawLine(rowPixelCounter + (x * pixelsPerDraw), curScanline, rowPixelCounter + (x * pixelsPerDraw) + 3, curScanline, pixelArray[x]);
+							drawFrameSpan(rowPixelCounter + (x * pixelsPerDraw), rowPixelCounter + (x * pixelsPerDraw) + 3, curScanline, pixelArray[x]);
 						rowPixelCounter += 16;
 					}
 				}
@@ -1069,29 +1705,29 @@ void CoCoEmuPGE::renderScanlineGIME(unsigned int curScanline)
 					curScreenByte = gimeBus.physicalRAM[screenRamPtr + y];
 					for (int x = 7; x >= 0; x--)
 					{
-						pixelArray[x] = palDefs[cmpOrRgb][palRegs[curScreenByte & 0x01]];
+						pixelArray[x] = palRegs[curScreenByte & 0x01];
 						curScreenByte >>= 1;
 					}
 
 					if (pixelsPerDraw == 1)
 					{
 						for (int x = 0; x < 8; x++)
-							Draw(rowPixelCounter + x, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + x, curScanline, pixelArray[x]);
 						rowPixelCounter += 8;
 					}
 					else if (pixelsPerDraw == 2)
 					{
 						for (int x = 0; x < 8; x++)
 						{
-							Draw(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
-							Draw(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2), curScanline, pixelArray[x]);
+							setFramePixel(rowPixelCounter + (x * 2) + 1, curScanline, pixelArray[x]);
 						}
 						rowPixelCounter += 16;
 					}
 					else
 					{
 						for (int x = 0; x < 8; x++)
-							DrawLine(rowPixelCounter + (x * pixelsPerDraw), curScanline, rowPixelCounter + (x * pixelsPerDraw) + 3, curScanline, pixelArray[x]);
+							drawFrameSpan(rowPixelCounter + (x * pixelsPerDraw), rowPixelCounter + (x * pixelsPerDraw) + 3, curScanline, pixelArray[x]);
 						rowPixelCounter += 32;
 					}
 				}
@@ -1101,69 +1737,153 @@ void CoCoEmuPGE::renderScanlineGIME(unsigned int curScanline)
 	}
 }
 
-bool CoCoEmuPGE::updateStatusBar()
+void CoCoEmuPGE::buildGimeGlyphRow(glyphRowCacheEntry& glyphRow, uint8_t fontDataByte, uint8_t glyphColorKey, uint8_t glyphRowWidth)
 {
-	if ((gimeBus.statusBarText != "Idle") && (gimeBus.statusBarText != prevStatusBarMsg))
+	if (glyphColorKey == GLYPH_CACHE_NO_ATTR_KEY)
 	{
-		FillRect(0, STATUSBAR_START_Y, 640, STATUSBAR_HEIGHT, olc::GREY);
-		DrawString(STATUSBAR_TEXT_OFFSET_X, STATUSBAR_TEXT_OFFSET_Y, gimeBus.statusBarText, olc::BLACK);
-		prevStatusBarMsg = gimeBus.statusBarText;
-		return true;
+		foregroundPixel = palRegs[1];
+		backgroundPixel = palRegs[0];
 	}
-		return false;
+	else
+	{
+		foregroundPixel = palRegs[(glyphColorKey >> 3) + 8];
+		backgroundPixel = palRegs[(glyphColorKey & 0x07)];
+	}
+
+	uint8_t pixelsPerBit = glyphRowWidth / 8;
+	for (int x = 0; x < glyphRowWidth; x += pixelsPerBit)
+	{
+		fontPixel = (fontDataByte & 0x80) ? foregroundPixel : backgroundPixel;
+		glyphRow.pixelRow[x] = fontPixel;
+		glyphRow.pixelRow[x + pixelsPerBit - 1] = fontPixel;
+		fontDataByte <<= 1;
+	}
+	glyphRow.paletteGeneration = renderPaletteGeneration;
 }
 
-float CoCoEmuPGE::SoundHandler(int nChannel, float fGlobalTime, float fTimeStep)
+void CoCoEmuPGE::buildVdgGlyphRow(glyphRowCacheEntry& glyphRow, uint8_t vdgChar, uint8_t fontLine)
 {
-	//return 0;
-
-	if (nChannel != 0)
-		return 0;
+	uint8_t setPixel, clearPixel;
 
-	if (leftAudioBuffer.empty())
+	if (vdgChar & 0x80)
 	{
-		printf("Audio buffer is empty!\n");
-		return 0;
+		// Semi-graphics mode 4 character. Mask off semi-graphics flag bit 7, and shift color bits 6-4 over to get our color value
+		fontDataByte = sg4_fontdata8x12[((vdgChar & 0x0F) * 12) + fontLine];
+		setPixel = palRegs[(vdgChar & 0x7F) >> 4];
+		clearPixel = GIME_COLOR_BLACK;
 	}
-
-	cocoAudioSample = leftAudioBuffer.front();
-	leftAudioBuffer.pop();
-	return cocoAudioSample;
-	
-	if ((nChannel != 0) && (nChannel != 1))
-		printf("Weird channel!!\n");
-
-	if (audioBufferReady)
+	else
 	{
-		if (leftAudioBuffer.empty() || rightAudioBuffer.empty())
+		// ASCII character. Mask off bits 6 and 7 to get character index. 12 bytes per character bitmap entry
+		vdgFontDataIndex = ((vdgChar & 0x3F) * 12) + fontLine;
+		if (renderParams.vdg.fontIsExternal)
 		{
-			printf("Error: Audio buffer %d is empty!\n", nChannel);
-			return 0;
-		}
-
-		if (nChannel == 0)
-		{
-			cocoAudioSample = leftAudioBuffer.front();
-			unsigned int size = leftAudioBuffer.size();
- 			leftAudioBuffer.pop();
+			if (vdgChar & 0b01000000)
+				fontDataByte = lowres_font[vdgFontDataIndex];
+			else
+				fontDataByte = lowres_font[vdgFontDataIndex + vdgLowercaseOffset];
 		}
-		else if (nChannel == 1)
+		else
 		{
-			cocoAudioSample = rightAudioBuffer.front();
-			rightAudioBuffer.pop();
+			fontDataByte = lowres_font[vdgFontDataIndex];
+			if (!(vdgChar & 0b01000000))		// Check the "inverted" color bit
+				fontDataByte = ~fontDataByte;	// Invert the character's bitmap
 		}
-		return cocoAudioSample;
+		setPixel = GIME_COLOR_BLACK;
+		clearPixel = GIME_COLOR_GREEN;
 	}
-	else
+
+	for (int x = 0; x < 16; x += 2)
+	{
+		fontPixel = (fontDataByte & 0x80) ? setPixel : clearPixel;
+		glyphRow.pixelRow[x] = fontPixel;
+		glyphRow.pixelRow[x + 1] = fontPixel;
+		fontDataByte <<= 1;
+	}
+	glyphRow.paletteGeneration = renderPaletteGeneration;
+}
+
+bool CoCoEmuPGE::scanlineUnchanged(unsigned int visibleScanline, uint32_t ramStartAddr, unsigned int ramLength)
+{
+	// A scanline only needs redrawing if a video register changed, it now shows a different part of RAM, or any RAM page it shows was written since it was last drawn
+	scanlineRecordStruct& lineRecord = scanlineRecords[visibleScanline];
+	bool lineUnchanged = (lineRecord.videoRegsGeneration == renderRegsGeneration) && (lineRecord.ramStartAddr == ramStartAddr) && (lineRecord.ramLength == ramLength);
+
+	if (lineUnchanged && (ramLength > 0))
+	{
+		uint32_t pageIndexMask = (gimeBus.ramSizeMask >> VIDEO_DIRTY_PAGE_SHIFT);
+		uint32_t firstPage = ramStartAddr >> VIDEO_DIRTY_PAGE_SHIFT;
+		uint32_t lastPage = (ramStartAddr + ramLength - 1) >> VIDEO_DIRTY_PAGE_SHIFT;
+		for (uint32_t page = firstPage; page <= lastPage; page++)
+			if (gimeBus.videoPageWriteStamp[page & pageIndexMask] >= lineRecord.renderedStamp)
+			{
+				lineUnchanged = false;
+				break;
+			}
+	}
+
+	perfTotalScanlines++;
+	if (lineUnchanged)
+	{
+		perfSkippedScanlines++;
+		return true;
+	}
+
+	lineRecord.videoRegsGeneration = renderRegsGeneration;
+	lineRecord.ramStartAddr = ramStartAddr;
+	lineRecord.ramLength = ramLength;
+	lineRecord.renderedStamp = gimeBus.videoLineStamp;
+	return false;
+}
+
+void CoCoEmuPGE::updatePerfOverlay(float fElapsedTime)
+{
+	perfElapsedTime += fElapsedTime;
+	perfFrameCounter++;
+	if (perfElapsedTime < 1.0f)
+		return;
+
+	if (perfOverlayEnabled)
 	{
-		printf("Audio buffer not ready yet.\n");
-		return 0;
+		// Report the average number of visible scanlines per emulated frame that didn't need redrawing, along with the host frame rate
+		unsigned int emulatedFrames = perfTotalScanlines / 242;
+		unsigned int skippedPerFrame = (emulatedFrames > 0) ? (perfSkippedScanlines / emulatedFrames) : 0;
+		snprintf(perfTextBuffer, sizeof(perfTextBuffer), "FPS %3u  Skipped %3u/242", (unsigned int)(perfFrameCounter / perfElapsedTime), skippedPerFrame);
+		FillRect(PERF_OVERLAY_START_X, STATUSBAR_START_Y, 640 - PERF_OVERLAY_START_X, STATUSBAR_HEIGHT, olc::GREY);
+		DrawString(PERF_OVERLAY_START_X, STATUSBAR_TEXT_OFFSET_Y, perfTextBuffer, olc::BLACK);
 	}
+	perfElapsedTime = 0;
+	perfFrameCounter = 0;
+	perfTotalScanlines = 0;
+	perfSkippedScanlines = 0;
+}
 
-	
+bool CoCoEmuPGE::updateStatusBar()
+{
+	if ((gimeBus.statusBarText != "Idle") && (gimeBus.statusBarText != prevStatusBarMsg))
+	{
+		FillRect(0, STATUSBAR_START_Y, 640, STATUSBAR_HEIGHT, olc::GREY);
+		DrawString(STATUSBAR_TEXT_OFFSET_X, STATUSBAR_TEXT_OFFSET_Y, gimeBus.statusBarText, olc::BLACK);
+		prevStatusBarMsg = gimeBus.statusBarText;
+		return true;
+	}
+		return false;
+}
+
+float CoCoEmuPGE::SoundHandler(int nChannel, float fGlobalTime, float fTimeStep)
+{
+	// The sound extension asks for each channel of a frame in turn, so a new stereo frame gets pulled from the ring on channel 0
+	// and the right half is held onto for when channel 1 is requested
+	if (nChannel != 0)
+		return hostAudioFrame.rightChannel / 32768.0f;
+
+	// Don't start playing until the emulation thread has built up some samples, otherwise we'd just underrun right away
+	if (!audioBufferReady || !audioRingBuffer.popFrame(hostAudioFrame))
+	{
+		hostAudioFrame.leftChannel = 0;
+		hostAudioFrame.rightChannel = 0;
+	}
+	return hostAudioFrame.leftChannel / 32768.0f;
 
-	//if ((gimeBus.devPIA1.SideA.dataReg >> 2) != 0)
-	//	printf("Sound = %u\n", (gimeBus.devPIA1.SideA.dataReg >> 2));
 	//return sin(fGlobalTime * 440.0f * 2.0f * 3.14159f);
-	//return 0;
 }
\ No newline at end of file
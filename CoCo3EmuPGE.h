@@ -2,17 +2,43 @@
 #include "olcPixelGameEngine.h"
 #include <cstdint>
 #include <queue>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include "GimeBus.h"
+#include "AudioRingBuffer.h"
+#include "WavWriter.h"
 #include "DeviceROM.h"
 
 constexpr int STATUSBAR_HEIGHT = 12;
 constexpr int STATUSBAR_START_Y = 242;
 constexpr int STATUSBAR_TEXT_OFFSET_X = 8;
 constexpr int STATUSBAR_TEXT_OFFSET_Y = STATUSBAR_START_Y + 2;
+constexpr int PERF_OVERLAY_START_X = 440;
+constexpr int EMU_FRAME_WIDTH = 640;
+
+// The emulation thread holds the machine lock for at most this many GIME master clocks at a time (about 1 ms)
+constexpr unsigned int EMULATION_SLICE_CYCLES = 28636;
+
+// Frame queue slot encoding. Low bits are the buffer index, the flag means the emulation thread has put a frame there the UI hasn't shown yet
+constexpr uint8_t FRAME_QUEUE_INDEX_MASK	= 0x03;
+constexpr uint8_t FRAME_QUEUE_FRESH_FLAG	= 0x04;
+constexpr uint8_t FRAME_QUEUE_BUFFERS		= 3;		// One being drawn into, one waiting to be shown and one on screen
 
 constexpr float audioSampleRateInHz				= 48000.0f;
 constexpr float gimeAudioCountInterval			= (gimeMasterClock_NTSC / audioSampleRateInHz);
-constexpr unsigned int numSamplesToBuffer		= 400;
+constexpr unsigned int audioDefaultLatencyMS	= 40;		// How much audio we try to keep queued up for the host, adjustable from 20-60 ms
+constexpr unsigned int audioMinLatencyMS		= 20;
+constexpr unsigned int audioMaxLatencyMS		= 60;
+constexpr unsigned int audioRateControlInterval	= 480;		// Number of samples between each rate control adjustment (10 ms)
+constexpr float audioMaxRateAdjust				= 0.005f;	// Never change the sample rate by more than 0.5% which is too small to hear as pitch change
+constexpr uint32_t audioRingBufferFrames		= 4096;		// About 85 ms at 48 kHz
+constexpr float diskFlushIntervalSeconds		= 2.0f;		// How often written floppy sectors get flushed from memory back to the host's disk image files
+
+// Glyph row cache sizes. GIME entries are indexed by [Double-width flag][Color attribute key][Font row bitmap] and VDG entries by [External font flag][Character][Font line]
+constexpr unsigned int GLYPH_CACHE_GIME_ENTRIES		= 2 * 128 * 256;
+constexpr unsigned int GLYPH_CACHE_VDG_ENTRIES		= 2 * 256 * 12;
+constexpr uint8_t GLYPH_CACHE_NO_ATTR_KEY			= 0x40;		// Color key used when text color attributes are disabled (Attribute bits 6 and 7 are never part of the key)
 
 constexpr uint8_t CONFIG_SUCCESSFULLY_LOADED	= 0x00;
 constexpr uint8_t CONFIG_ERROR_OPENING_FILE		= 0x01;
@@ -32,6 +58,20 @@ struct stereoSamnpleStruct
 	uint8_t leftChannel;
 };
 
+struct scanlineRecordStruct
+{
+	uint32_t videoRegsGeneration = 0;	// Zero never matches the renderer's generation so every scanline gets drawn at least once
+	uint32_t ramStartAddr = 0;
+	unsigned int ramLength = 0;
+	uint32_t renderedStamp = 0;
+};
+
+struct glyphRowCacheEntry
+{
+	uint32_t paletteGeneration = 0;		// Entry is only valid while this matches the renderer's palette generation it was built with
+	uint8_t pixelRow[16];		// GIME color numbers, not RGB values
+};
+
 // Override base class with your custom functionality
 class CoCoEmuPGE : public olc::PixelGameEngine
 {
@@ -41,7 +81,11 @@ public:
 public:
 	GimeBus gimeBus;
 	float statusElapsedTime = 0, frameTimePeriod = (1.0f / 60.0f);
-	float gimeAudioCounter = gimeAudioCountInterval, audioNextCoCoSample = 0;
+	float diskFlushElapsedTime = 0;
+	float audioNextCoCoSample = 0;
+	float gimeAudioCountCurrent = gimeAudioCountInterval;		// Rate-controlled version of gimeAudioCountInterval that's actually used
+	unsigned int audioLatencyMS = audioDefaultLatencyMS, audioTargetFillLevel = (unsigned int)((audioSampleRateInHz * audioDefaultLatencyMS) / 1000);
+	unsigned int audioRateControlCounter = 0;
 	long double averageElapsedGimeCycles = 0;
 	unsigned int averageElapsedGimeCyclesCounter = 0;
 	long double fpsFrameCounter = 0, elapsedGimeClockCycles, residualCycles = 0, residualGimeCycleCount = 0;
@@ -51,11 +95,19 @@ public:
 	bool keyBackspacePressed;
 	unsigned int cmpOrRgb;		// 0 = Composite definitions, 1 = RGB definitions
 	uint8_t curLinesPerRow, curCharsPerRow, curBytesPerCharRow, curBytesPerChar, underlineRowOffset, bytesPerPixelRow, pixelsPerDraw, colorSetOffset;
-	olc::Pixel borderPixel;
+	uint8_t borderPixel;
+	uint8_t renderVideoRegs[VIDEO_REG_COUNT] = {};		// Renderer's copy of the video register file, brought up to date from the write log as each frame is drawn
+	GimeBus::videoParamsStruct renderParams = {};
+	uint32_t renderPaletteGeneration = 1;	// Incremented whenever a palette register changes so renderer caches built from the old palette can be discarded
+	uint32_t renderRegsGeneration = 1;		// Incremented whenever ANY register that affects what a scanline looks like changes
 	uint16_t dataBlockSize, blockLoadAddress, execAddress;
 	std::string strStatusBarIdle = "Idle";
 	std::string prevStatusBarMsg;
 	bool statusBarTimeout;
+	bool perfOverlayEnabled = false;
+	std::string startupWavPathname;		// Set from the command line to start recording audio as soon as the emulator starts
+	std::string startupOverlayTag;		// Set from the command line to mount every disk image as an overlay from the start, so the config file's images are covered too
+	std::atomic<bool> turboModeEnabled = false;
 
 	const unsigned int vdgColumnsPerRow = 32;
 
@@ -72,22 +124,57 @@ private:
 	uint32_t vdgVideoStartAddr, screenRamPtr;
 	uint16_t rowPixelCounter, vdgFontDataIndex, scanlineIndex;
 	uint8_t fontLineOffset, bottomLineOffset, curScreenChar, curScreenAttr, fontDataByte, topBorderEnd, bottomBorderStart, curScreenByte;
-	olc::Pixel foregroundPixel, backgroundPixel, fontPixel, pixelArray[8];
+	uint8_t foregroundPixel, backgroundPixel, fontPixel, pixelArray[8];	// All video rendering works in GIME color numbers (0-63) which get converted to RGB only when the frame is displayed
 	bool uiLoadmHasExecAddr;
 	unsigned int commandStringIndex = 0;
-	uint8_t cocoAudioSample;
-	stereoSamnpleStruct newStereoSample;
-	//std::queue<stereoSamnpleStruct> fifoAudioBuffer;
-	std::queue<uint8_t> leftAudioBuffer;
-	std::queue<uint8_t> rightAudioBuffer;
-	bool audioBufferReady = false;
+	AudioRingBuffer audioRingBuffer{ audioRingBufferFrames };
+	AudioMixer audioMixer;
+	WavWriter wavWriter;
+	float audioBlockSamples[AUDIO_SOURCE_COUNT][BLIP_MAX_BLOCK_SAMPLES];
+	audioFrameStruct audioBlockFrames[BLIP_MAX_BLOCK_SAMPLES];		// Only touched by the emulation thread
+	audioFrameStruct hostAudioFrame = {};		// Only touched by the host audio thread
+	std::atomic<bool> audioBufferReady = false;
+	scanlineRecordStruct scanlineRecords[256];
+	std::atomic<unsigned int> perfTotalScanlines = 0, perfSkippedScanlines = 0;
+	unsigned int perfFrameCounter = 0;
+	float perfElapsedTime = 0;
+	char perfTextBuffer[64];
+	std::vector<glyphRowCacheEntry> gimeGlyphCache;
+	std::vector<glyphRowCacheEntry> vdgGlyphCache;
+
+	// Emulation thread and the triple-buffered queue it hands finished frames to the UI thread through
+	std::thread emulationThread;
+	std::mutex emulationMutex;
+	std::atomic<bool> emulationThreadRunning = false, emulationPaused = false;
+	std::vector<uint8_t> emuFrameIndexed;
+	std::vector<uint8_t> frameQueueBuffers[FRAME_QUEUE_BUFFERS];
+	std::atomic<uint8_t> frameQueueReady = 1;
+	uint8_t frameQueueWriteIndex = 0, frameQueueDisplayIndex = 2;
 
 	float averageTime = 0;
 	int numAverageSamples = 0;
 	long float previousTime = 0, currentTime = 0;
 
+	void emulationThreadLoop();
+	void runGimeClockTick();
+	void queueEmulatedFrame();
+	void mixAudioBlock();
+	void updateAudioRateControl();
+	void setAudioLatency(unsigned int);
+	int findAudioSource(std::string);
+	void presentEmulatedFrame();
+	void drawFrameSpan(int, int, int, uint8_t);
+	void setFramePixel(int, int, uint8_t);
+	uint32_t calcFrameHash();
+	void renderVideoFrame();
+	void applyVideoRegWrite(const videoRegWriteStruct&);
+	void loadRenderVideoParams();
 	void renderScanlineVDG(unsigned int);
 	void renderScanlineGIME(unsigned int);
+	bool scanlineUnchanged(unsigned int, uint32_t, unsigned int);
+	void updatePerfOverlay(float);
+	void buildGimeGlyphRow(glyphRowCacheEntry&, uint8_t, uint8_t, uint8_t);
+	void buildVdgGlyphRow(glyphRowCacheEntry&, uint8_t, uint8_t);
 	std::string nextStringWord(std::string);
 	std::string stringToUpper(std::string);
 	void commandLOADM(std::string);
@@ -0,0 +1,503 @@
+#include "CompressedDisk.h"
+#include "DiskFileIO.h"
+#include "LZCodec.h"
+#include <cstring>
+#include <algorithm>
+
+constexpr uint32_t NO_BUFFERED_BLOCK = UINT32_MAX;
+
+// Everything in the container is stored little-endian no matter what the host is
+static void packLittleEndian(uint8_t* destPtr, uint64_t value, int byteCount)
+{
+	for (int i = 0; i < byteCount; i++)
+		destPtr[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static uint64_t unpackLittleEndian(const uint8_t* sourcePtr, int byteCount)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < byteCount; i++)
+		value |= (uint64_t)sourcePtr[i] << (i * 8);
+	return value;
+}
+
+static bool isAllZeros(const uint8_t* dataPtr, uint32_t dataLength)
+{
+	for (uint32_t i = 0; i < dataLength; i++)
+		if (dataPtr[i] != 0)
+			return false;
+	return true;
+}
+
+CompressedDisk::CompressedDisk()
+{
+	isOpen = false;
+	imageFilesize = 0;
+	containerFilesize = 0;
+	totalBlocks = 0;
+	blocksAllocated = 0;
+	blocksDecompressed = 0;
+	freeBytes = 0;
+	imageFile = nullptr;
+	bufferedBlockNum = NO_BUFFERED_BLOCK;
+}
+
+CompressedDisk::~CompressedDisk()
+{
+	closeImage();
+}
+
+bool CompressedDisk::isCompressedImage(std::string imageFilePathname)
+{
+	FILE* testFile = fopen(imageFilePathname.c_str(), "rb");
+	if (testFile == nullptr)
+		return false;
+	uint8_t magicBytes[4];
+	bool magicFound = (readFileAt(testFile, 0, magicBytes, 4) == 4) && (unpackLittleEndian(magicBytes, 4) == COMPRESSED_DISK_MAGIC);
+	fclose(testFile);
+	return magicFound;
+}
+
+uint8_t CompressedDisk::openImage(std::string imageFilePathname)
+{
+	closeImage();
+
+	imageFile = fopen(imageFilePathname.c_str(), "rb+");
+	if (imageFile == nullptr)
+		return COMPRESSED_DISK_ERROR_OPENING_SOURCE;
+	uint64_t indexOffset;
+	if (!readHeader(imageFile, imageFilesize, totalBlocks, indexOffset))
+	{
+		closeImage();
+		return COMPRESSED_DISK_ERROR_INVALID_HEADER;
+	}
+
+	std::vector<uint8_t> indexData((size_t)totalBlocks * COMPRESSED_DISK_INDEX_ENTRY_SIZE);
+	if (readFileAt(imageFile, indexOffset, indexData.data(), indexData.size()) != indexData.size())
+	{
+		closeImage();
+		return COMPRESSED_DISK_ERROR_INVALID_HEADER;
+	}
+	containerFilesize = std::max(getFileSize64(imageFile), getDataStart(totalBlocks));
+	blockIndex.resize(totalBlocks);
+	blocksAllocated = 0;
+	for (uint32_t i = 0; i < totalBlocks; i++)
+	{
+		const uint8_t* entryPtr = indexData.data() + ((size_t)i * COMPRESSED_DISK_INDEX_ENTRY_SIZE);
+		blockIndex[i].fileOffset = unpackLittleEndian(entryPtr, 8);
+		blockIndex[i].storedLength = unpackLittleEndian(entryPtr + 8, 4);
+		blockIndex[i].blockFlags = unpackLittleEndian(entryPtr + 12, 4);
+		// Anything pointing outside the file or claiming to be bigger than a block gets treated as never written rather than trusted
+		if ((blockIndex[i].fileOffset != 0) && ((blockIndex[i].fileOffset < getDataStart(totalBlocks)) || ((blockIndex[i].fileOffset + blockIndex[i].storedLength) > containerFilesize) ||
+			(blockIndex[i].storedLength > COMPRESSED_DISK_BLOCK_SIZE)))
+			blockIndex[i] = compressedBlockStruct();
+		if (blockIndex[i].fileOffset != 0)
+			blocksAllocated++;
+	}
+
+	buildFreeExtents();
+
+	blockBuffer.resize(COMPRESSED_DISK_BLOCK_SIZE);
+	storedBuffer.resize(COMPRESSED_DISK_BLOCK_SIZE);
+	bufferedBlockNum = NO_BUFFERED_BLOCK;
+	blocksDecompressed = 0;
+	isOpen = true;
+	return COMPRESSED_DISK_OPERATION_COMPLETE;
+}
+
+void CompressedDisk::closeImage()
+{
+	if (imageFile != nullptr)
+		fclose(imageFile);
+	imageFile = nullptr;
+	blockIndex.clear();
+	freeExtents.clear();
+	freeBytes = 0;
+	bufferedBlockNum = NO_BUFFERED_BLOCK;
+	isOpen = false;
+}
+
+void CompressedDisk::readData(uint64_t byteOffset, uint8_t* destData, uint32_t dataLength)
+{
+	// Only the blocks the read actually touches get decompressed. Anything past the end of the image reads back as zeros, the same as
+	// it does for a raw .VHD file.
+	while (dataLength > 0)
+	{
+		uint32_t blockPosition = byteOffset % COMPRESSED_DISK_BLOCK_SIZE;
+		uint32_t copyLength = ((COMPRESSED_DISK_BLOCK_SIZE - blockPosition) < dataLength) ? (COMPRESSED_DISK_BLOCK_SIZE - blockPosition) : dataLength;
+		uint64_t blockNum = byteOffset / COMPRESSED_DISK_BLOCK_SIZE;
+		if (!isOpen || (byteOffset >= imageFilesize) || (blockIndex[blockNum].fileOffset == 0))
+			memset(destData, 0, copyLength);
+		else
+		{
+			loadBlock(blockNum);
+			memcpy(destData, blockBuffer.data() + blockPosition, copyLength);
+		}
+		byteOffset += copyLength;
+		destData += copyLength;
+		dataLength -= copyLength;
+	}
+}
+
+bool CompressedDisk::writeData(uint64_t byteOffset, const uint8_t* sourceData, uint32_t dataLength)
+{
+	// Returns false if the host wouldn't take some of the data
+	if (!isOpen)
+		return false;
+	if (byteOffset >= imageFilesize)
+		return true;
+	if ((byteOffset + dataLength) > imageFilesize)
+		dataLength = imageFilesize - byteOffset;
+
+	bool writeSucceeded = true;
+	while (dataLength > 0)
+	{
+		uint32_t blockPosition = byteOffset % COMPRESSED_DISK_BLOCK_SIZE;
+		uint32_t copyLength = ((COMPRESSED_DISK_BLOCK_SIZE - blockPosition) < dataLength) ? (COMPRESSED_DISK_BLOCK_SIZE - blockPosition) : dataLength;
+		uint32_t blockNum = byteOffset / COMPRESSED_DISK_BLOCK_SIZE;
+		loadBlock(blockNum);
+		memcpy(blockBuffer.data() + blockPosition, sourceData, copyLength);
+		if (!storeBlock(blockNum))
+			writeSucceeded = false;
+		byteOffset += copyLength;
+		sourceData += copyLength;
+		dataLength -= copyLength;
+	}
+	return writeSucceeded;
+}
+
+void CompressedDisk::loadBlock(uint32_t blockNum)
+{
+	// Consecutive sector reads usually land in the same block, so the last one decompressed is kept around
+	if (blockNum == bufferedBlockNum)
+		return;
+	bufferedBlockNum = blockNum;
+
+	compressedBlockStruct& curBlock = blockIndex[blockNum];
+	if (curBlock.fileOffset == 0)
+	{
+		memset(blockBuffer.data(), 0, COMPRESSED_DISK_BLOCK_SIZE);
+		return;
+	}
+	bool blockValid;
+	if (curBlock.blockFlags & COMPRESSED_DISK_BLOCK_LZ)
+	{
+		blockValid = (readFileAt(imageFile, curBlock.fileOffset, storedBuffer.data(), curBlock.storedLength) == curBlock.storedLength) &&
+			(lzDecompress(storedBuffer.data(), curBlock.storedLength, blockBuffer.data(), COMPRESSED_DISK_BLOCK_SIZE) == COMPRESSED_DISK_BLOCK_SIZE);
+		blocksDecompressed++;
+	}
+	else
+		blockValid = (readFileAt(imageFile, curBlock.fileOffset, blockBuffer.data(), curBlock.storedLength) == COMPRESSED_DISK_BLOCK_SIZE);
+	if (!blockValid)
+	{
+		printf("Compressed disk image: Block %u is damaged, reading it back as zeros.\n", blockNum);
+		memset(blockBuffer.data(), 0, COMPRESSED_DISK_BLOCK_SIZE);
+	}
+}
+
+bool CompressedDisk::storeBlock(uint32_t blockNum)
+{
+	// Stores the block sitting in blockBuffer. The data always goes in before the index entry that points to it, and space the block
+	// gives up only goes back on the free list once the index no longer points to it.
+	compressedBlockStruct& curBlock = blockIndex[blockNum];
+	if (isAllZeros(blockBuffer.data(), COMPRESSED_DISK_BLOCK_SIZE))
+	{
+		if (curBlock.fileOffset != 0)
+		{
+			compressedBlockStruct oldBlock = curBlock;
+			curBlock = compressedBlockStruct();
+			blocksAllocated--;
+			if (!writeIndexEntry(blockNum))
+				return false;
+			releaseExtent(oldBlock.fileOffset, oldBlock.storedLength);
+		}
+		return true;
+	}
+
+	uint32_t blockFlags;
+	uint32_t storedLength = packBlock(blockBuffer.data(), storedBuffer.data(), blockFlags);
+	// The new copy never goes over the slot the index points at now, so a crash part way through the write leaves the old copy whole
+	compressedBlockStruct oldBlock = curBlock;
+	uint64_t storeOffset = allocateExtent(storedLength);
+	if (writeFileAt(imageFile, storeOffset, storedBuffer.data(), storedLength) != storedLength)
+	{
+		// Whatever we took off the free list goes back on it, since the index still points where it did before
+		releaseExtent(storeOffset, storedLength);
+		return false;
+	}
+	if (oldBlock.fileOffset == 0)
+		blocksAllocated++;
+	curBlock.fileOffset = storeOffset;
+	curBlock.storedLength = storedLength;
+	curBlock.blockFlags = blockFlags;
+	if ((storeOffset + storedLength) > containerFilesize)
+		containerFilesize = storeOffset + storedLength;
+	if (!writeIndexEntry(blockNum))
+		return false;
+	if (oldBlock.fileOffset != 0)
+		releaseExtent(oldBlock.fileOffset, oldBlock.storedLength);
+	return true;
+}
+
+void CompressedDisk::buildFreeExtents()
+{
+	// Everything in the data area that no index entry points to is free. Older copies of rewritten blocks left behind by versions that
+	// always appended get picked up here too.
+	freeExtents.clear();
+	freeBytes = 0;
+	std::vector<compressedBlockStruct> usedExtents;
+	for (const compressedBlockStruct& curBlock : blockIndex)
+		if (curBlock.fileOffset != 0)
+			usedExtents.push_back(curBlock);
+	std::sort(usedExtents.begin(), usedExtents.end(), [](const compressedBlockStruct& a, const compressedBlockStruct& b) { return a.fileOffset < b.fileOffset; });
+	uint64_t scanOffset = getDataStart(totalBlocks);
+	for (const compressedBlockStruct& curExtent : usedExtents)
+	{
+		if (curExtent.fileOffset > scanOffset)
+			releaseExtent(scanOffset, curExtent.fileOffset - scanOffset);
+		scanOffset = std::max(scanOffset, curExtent.fileOffset + curExtent.storedLength);
+	}
+	if (containerFilesize > scanOffset)
+		releaseExtent(scanOffset, containerFilesize - scanOffset);
+}
+
+uint64_t CompressedDisk::allocateExtent(uint32_t extentLength)
+{
+	// First fit from the free list, otherwise the end of the file
+	for (auto freeIter = freeExtents.begin(); freeIter != freeExtents.end(); ++freeIter)
+	{
+		if (freeIter->second < extentLength)
+			continue;
+		uint64_t extentOffset = freeIter->first;
+		uint64_t leftoverLength = freeIter->second - extentLength;
+		freeExtents.erase(freeIter);
+		if (leftoverLength > 0)
+			freeExtents[extentOffset + extentLength] = leftoverLength;
+		freeBytes -= extentLength;
+		return extentOffset;
+	}
+	return containerFilesize;
+}
+
+void CompressedDisk::releaseExtent(uint64_t extentOffset, uint64_t extentLength)
+{
+	if (extentLength == 0)
+		return;
+	// Space at the very end of the file just comes off containerFilesize so the next append lands there. The file itself isn't shrunk.
+	if ((extentOffset + extentLength) >= containerFilesize)
+	{
+		containerFilesize = extentOffset;
+		// That can leave a gap that's now the last thing in the file, so it gets folded in as well
+		auto lastIter = freeExtents.empty() ? freeExtents.end() : std::prev(freeExtents.end());
+		if ((lastIter != freeExtents.end()) && ((lastIter->first + lastIter->second) == containerFilesize))
+		{
+			containerFilesize = lastIter->first;
+			freeBytes -= lastIter->second;
+			freeExtents.erase(lastIter);
+		}
+		return;
+	}
+	freeBytes += extentLength;
+	auto nextIter = freeExtents.lower_bound(extentOffset);
+	if ((nextIter != freeExtents.end()) && (nextIter->first == (extentOffset + extentLength)))
+	{
+		extentLength += nextIter->second;
+		nextIter = freeExtents.erase(nextIter);
+	}
+	if (nextIter != freeExtents.begin())
+	{
+		auto prevIter = std::prev(nextIter);
+		if ((prevIter->first + prevIter->second) == extentOffset)
+		{
+			prevIter->second += extentLength;
+			return;
+		}
+	}
+	freeExtents[extentOffset] = extentLength;
+}
+
+bool CompressedDisk::writeIndexEntry(uint32_t blockNum)
+{
+	uint8_t entryData[COMPRESSED_DISK_INDEX_ENTRY_SIZE];
+	packLittleEndian(entryData, blockIndex[blockNum].fileOffset, 8);
+	packLittleEndian(entryData + 8, blockIndex[blockNum].storedLength, 4);
+	packLittleEndian(entryData + 12, blockIndex[blockNum].blockFlags, 4);
+	return (writeFileAt(imageFile, COMPRESSED_DISK_HEADER_SIZE + ((uint64_t)blockNum * COMPRESSED_DISK_INDEX_ENTRY_SIZE), entryData, COMPRESSED_DISK_INDEX_ENTRY_SIZE) == COMPRESSED_DISK_INDEX_ENTRY_SIZE);
+}
+
+bool CompressedDisk::readHeader(FILE* containerFile, uint64_t& imageSize, uint32_t& blockCount, uint64_t& indexOffset)
+{
+	uint8_t headerData[COMPRESSED_DISK_HEADER_SIZE];
+	if (readFileAt(containerFile, 0, headerData, COMPRESSED_DISK_HEADER_SIZE) != COMPRESSED_DISK_HEADER_SIZE)
+		return false;
+	imageSize = unpackLittleEndian(headerData + 16, 8);
+	blockCount = unpackLittleEndian(headerData + 24, 4);
+	indexOffset = unpackLittleEndian(headerData + 32, 8);
+	// The size is checked against the format's limit before anything gets allocated off the back of it
+	return (unpackLittleEndian(headerData, 4) == COMPRESSED_DISK_MAGIC) && (headerData[4] == COMPRESSED_DISK_VERSION) &&
+		(unpackLittleEndian(headerData + 8, 4) == COMPRESSED_DISK_BLOCK_SIZE) && (imageSize > 0) && (imageSize <= COMPRESSED_DISK_MAX_IMAGE_SIZE) &&
+		(blockCount == ((imageSize + COMPRESSED_DISK_BLOCK_SIZE - 1) / COMPRESSED_DISK_BLOCK_SIZE)) && (indexOffset == COMPRESSED_DISK_HEADER_SIZE);
+}
+
+bool CompressedDisk::writeHeader(FILE* containerFile, uint64_t imageSize, uint32_t blockCount)
+{
+	uint8_t headerData[COMPRESSED_DISK_HEADER_SIZE] = { 0 };
+	packLittleEndian(headerData, COMPRESSED_DISK_MAGIC, 4);
+	headerData[4] = COMPRESSED_DISK_VERSION;
+	packLittleEndian(headerData + 8, COMPRESSED_DISK_BLOCK_SIZE, 4);
+	packLittleEndian(headerData + 16, imageSize, 8);
+	packLittleEndian(headerData + 24, blockCount, 4);
+	packLittleEndian(headerData + 32, COMPRESSED_DISK_HEADER_SIZE, 8);
+	packLittleEndian(headerData + 40, getDataStart(blockCount), 8);
+	return (writeFileAt(containerFile, 0, headerData, COMPRESSED_DISK_HEADER_SIZE) == COMPRESSED_DISK_HEADER_SIZE);
+}
+
+uint64_t CompressedDisk::getDataStart(uint32_t blockCount)
+{
+	uint64_t indexEnd = COMPRESSED_DISK_HEADER_SIZE + ((uint64_t)blockCount * COMPRESSED_DISK_INDEX_ENTRY_SIZE);
+	return ((indexEnd + COMPRESSED_DISK_DATA_ALIGN - 1) / COMPRESSED_DISK_DATA_ALIGN) * COMPRESSED_DISK_DATA_ALIGN;
+}
+
+uint32_t CompressedDisk::packBlock(const uint8_t* blockData, uint8_t* destData, uint32_t& blockFlags)
+{
+	// Blocks that don't get any smaller are stored as they are so reading them back costs nothing
+	uint32_t packedLength = lzCompress(blockData, COMPRESSED_DISK_BLOCK_SIZE, destData, COMPRESSED_DISK_BLOCK_SIZE - 1);
+	if (packedLength > 0)
+	{
+		blockFlags = COMPRESSED_DISK_BLOCK_LZ;
+		return packedLength;
+	}
+	memcpy(destData, blockData, COMPRESSED_DISK_BLOCK_SIZE);
+	blockFlags = 0;
+	return COMPRESSED_DISK_BLOCK_SIZE;
+}
+
+uint8_t CompressedDisk::compressImage(std::string sourceFilePathname, std::string destFilePathname)
+{
+	// Converts a raw .VHD file into a compressed one. Given an image that's already compressed, it repacks it into a new file without
+	// the space taken up by old copies of rewritten blocks.
+	if (isSameHostFile(sourceFilePathname, destFilePathname))
+		return COMPRESSED_DISK_ERROR_CREATING_DEST;
+	CompressedDisk sourceContainer;
+	FILE* sourceFile = nullptr;
+	uint64_t imageSize;
+	if (isCompressedImage(sourceFilePathname))
+	{
+		uint8_t openStatus = sourceContainer.openImage(sourceFilePathname);
+		if (openStatus != COMPRESSED_DISK_OPERATION_COMPLETE)
+			return openStatus;
+		imageSize = sourceContainer.imageFilesize;
+	}
+	else
+	{
+		sourceFile = fopen(sourceFilePathname.c_str(), "rb");
+		if (sourceFile == nullptr)
+			return COMPRESSED_DISK_ERROR_OPENING_SOURCE;
+		imageSize = getFileSize64(sourceFile);
+		if (imageSize == 0)
+		{
+			fclose(sourceFile);
+			return COMPRESSED_DISK_ERROR_OPENING_SOURCE;
+		}
+		if (imageSize > COMPRESSED_DISK_MAX_IMAGE_SIZE)
+		{
+			fclose(sourceFile);
+			return COMPRESSED_DISK_ERROR_IMAGE_TOO_LARGE;
+		}
+	}
+
+	FILE* destFile = fopen(destFilePathname.c_str(), "wb+");
+	if (destFile == nullptr)
+	{
+		if (sourceFile != nullptr)
+			fclose(sourceFile);
+		return COMPRESSED_DISK_ERROR_CREATING_DEST;
+	}
+
+	uint32_t blockCount = (imageSize + COMPRESSED_DISK_BLOCK_SIZE - 1) / COMPRESSED_DISK_BLOCK_SIZE;
+	std::vector<uint8_t> indexData((size_t)blockCount * COMPRESSED_DISK_INDEX_ENTRY_SIZE, 0);
+	std::vector<uint8_t> blockData(COMPRESSED_DISK_BLOCK_SIZE), packedData(COMPRESSED_DISK_BLOCK_SIZE);
+	uint64_t appendOffset = getDataStart(blockCount);
+	bool writeSucceeded = true;
+	for (uint32_t blockNum = 0; writeSucceeded && (blockNum < blockCount); blockNum++)
+	{
+		uint64_t blockOffset = (uint64_t)blockNum * COMPRESSED_DISK_BLOCK_SIZE;
+		if (sourceFile != nullptr)
+		{
+			size_t bytesRead = readFileAt(sourceFile, blockOffset, blockData.data(), COMPRESSED_DISK_BLOCK_SIZE);
+			if (bytesRead < COMPRESSED_DISK_BLOCK_SIZE)
+				memset(blockData.data() + bytesRead, 0, COMPRESSED_DISK_BLOCK_SIZE - bytesRead);
+		}
+		else
+			sourceContainer.readData(blockOffset, blockData.data(), COMPRESSED_DISK_BLOCK_SIZE);
+		if (isAllZeros(blockData.data(), COMPRESSED_DISK_BLOCK_SIZE))
+			continue;
+
+		uint32_t blockFlags;
+		uint32_t storedLength = packBlock(blockData.data(), packedData.data(), blockFlags);
+		if (writeFileAt(destFile, appendOffset, packedData.data(), storedLength) != storedLength)
+			writeSucceeded = false;
+		uint8_t* entryPtr = indexData.data() + ((size_t)blockNum * COMPRESSED_DISK_INDEX_ENTRY_SIZE);
+		packLittleEndian(entryPtr, appendOffset, 8);
+		packLittleEndian(entryPtr + 8, storedLength, 4);
+		packLittleEndian(entryPtr + 12, blockFlags, 4);
+		appendOffset += storedLength;
+	}
+
+	// The header and index go in last, so a conversion that got cut short doesn't look like a usable image. If the host wouldn't take
+	// all of it (a full disk, say), whatever did get written is deleted rather than left lying around looking like it worked.
+	if (writeSucceeded)
+		writeSucceeded = (writeFileAt(destFile, COMPRESSED_DISK_HEADER_SIZE, indexData.data(), indexData.size()) == indexData.size()) &&
+			writeHeader(destFile, imageSize, blockCount);
+	if (fclose(destFile) != 0)
+		writeSucceeded = false;
+	if (sourceFile != nullptr)
+		fclose(sourceFile);
+	if (!writeSucceeded)
+	{
+		remove(destFilePathname.c_str());
+		return COMPRESSED_DISK_ERROR_CREATING_DEST;
+	}
+	return COMPRESSED_DISK_OPERATION_COMPLETE;
+}
+
+uint8_t CompressedDisk::decompressImage(std::string sourceFilePathname, std::string destFilePathname)
+{
+	// Converts a compressed image back into a raw .VHD file. Blocks that were never written are skipped over rather than written out as
+	// zeros, so the raw file ends up sparse on hosts that support it.
+	if (isSameHostFile(sourceFilePathname, destFilePathname))
+		return COMPRESSED_DISK_ERROR_CREATING_DEST;
+	if (!isCompressedImage(sourceFilePathname))
+		return COMPRESSED_DISK_ERROR_NOT_COMPRESSED;
+	CompressedDisk sourceContainer;
+	uint8_t openStatus = sourceContainer.openImage(sourceFilePathname);
+	if (openStatus != COMPRESSED_DISK_OPERATION_COMPLETE)
+		return openStatus;
+	FILE* destFile = fopen(destFilePathname.c_str(), "wb");
+	if (destFile == nullptr)
+		return COMPRESSED_DISK_ERROR_CREATING_DEST;
+
+	std::vector<uint8_t> blockData(COMPRESSED_DISK_BLOCK_SIZE);
+	bool writeSucceeded = true;
+	for (uint32_t blockNum = 0; writeSucceeded && (blockNum < sourceContainer.totalBlocks); blockNum++)
+	{
+		// The last block always gets written so the file comes out the right size
+		bool isLastBlock = (blockNum == (sourceContainer.totalBlocks - 1));
+		if ((sourceContainer.blockIndex[blockNum].fileOffset == 0) && !isLastBlock)
+			continue;
+		uint64_t blockOffset = (uint64_t)blockNum * COMPRESSED_DISK_BLOCK_SIZE;
+		uint32_t blockLength = isLastBlock ? (uint32_t)(sourceContainer.imageFilesize - blockOffset) : COMPRESSED_DISK_BLOCK_SIZE;
+		sourceContainer.readData(blockOffset, blockData.data(), blockLength);
+		if (writeFileAt(destFile, blockOffset, blockData.data(), blockLength) != blockLength)
+			writeSucceeded = false;
+	}
+	if (fclose(destFile) != 0)
+		writeSucceeded = false;
+	if (!writeSucceeded)
+	{
+		// A raw image that came up short would still mount, so it doesn't get left behind
+		remove(destFilePathname.c_str());
+		return COMPRESSED_DISK_ERROR_CREATING_DEST;
+	}
+	return COMPRESSED_DISK_OPERATION_COMPLETE;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdint>
+
+constexpr uint8_t COMPRESSED_DISK_OPERATION_COMPLETE		= 0x00;
+constexpr uint8_t COMPRESSED_DISK_ERROR_OPENING_SOURCE		= 0x01;
+constexpr uint8_t COMPRESSED_DISK_ERROR_CREATING_DEST		= 0x02;
+constexpr uint8_t COMPRESSED_DISK_ERROR_NOT_COMPRESSED		= 0x03;
+constexpr uint8_t COMPRESSED_DISK_ERROR_INVALID_HEADER		= 0x04;
+constexpr uint8_t COMPRESSED_DISK_ERROR_IMAGE_TOO_LARGE		= 0x05;
+
+constexpr uint32_t COMPRESSED_DISK_MAGIC					= 0x44485643;	// "CVHD" in little-endian
+constexpr uint8_t COMPRESSED_DISK_VERSION					= 1;
+constexpr uint32_t COMPRESSED_DISK_BLOCK_SIZE				= 65536;		// Same size as a DiskBlockCache chunk, so a cache miss decompresses exactly one block
+constexpr uint32_t COMPRESSED_DISK_HEADER_SIZE				= 64;			// Magic, version, reserved, block size, reserved, image size, block count, reserved, index offset, data start
+constexpr uint32_t COMPRESSED_DISK_INDEX_ENTRY_SIZE			= 16;			// File offset, stored length, flags
+constexpr uint32_t COMPRESSED_DISK_DATA_ALIGN				= 4096;
+constexpr uint32_t COMPRESSED_DISK_BLOCK_LZ					= 0x01;			// Index entry flag. Without it the block is stored as-is.
+constexpr uint64_t COMPRESSED_DISK_MAX_IMAGE_SIZE			= 0x100000000;	// 24-bit LSNs of 256 bytes each, as far as EmuDisk can address
+
+struct compressedBlockStruct
+{
+	uint64_t fileOffset = 0;		// 0 means the block was never written and reads back as zeros
+	uint32_t storedLength = 0;
+	uint32_t blockFlags = 0;
+};
+
+// Sparse, compressed container for EmuDisk hard drive images. The image is split into 64K blocks, and an index at the front of the file
+// says where each block's data is and whether it's LZ compressed. Blocks that are all zeros aren't stored at all. A rewritten block goes
+// into the first gap left behind by other blocks that's big enough, or on the end of the file if there isn't one, and only then gets
+// pointed to by the index. Its old slot is freed after that. A crash in the middle of a write leaves the old copy of the block intact
+// for the write queue's journal to replay against. Running the image through compressImage() again squeezes out whatever gaps are left.
+class CompressedDisk
+{
+public:
+	CompressedDisk();
+	~CompressedDisk();
+
+	uint8_t openImage(std::string);
+	void closeImage();
+	void readData(uint64_t, uint8_t*, uint32_t);
+	bool writeData(uint64_t, const uint8_t*, uint32_t);
+
+	static bool isCompressedImage(std::string);
+	static uint8_t compressImage(std::string, std::string);
+	static uint8_t decompressImage(std::string, std::string);
+
+	bool isOpen;
+	uint64_t imageFilesize;			// Size of the raw image the container holds
+	uint64_t containerFilesize;		// Size of the container file itself on the host
+	uint32_t totalBlocks, blocksAllocated;
+	uint64_t blocksDecompressed;
+	uint64_t freeBytes;				// Space inside the container left behind by blocks that moved, shrank or went back to all zeros
+
+private:
+	FILE* imageFile;
+	std::vector<compressedBlockStruct> blockIndex;
+	std::vector<uint8_t> blockBuffer;			// The most recently used block, decompressed
+	std::vector<uint8_t> storedBuffer;			// A block as it sits in the file
+	uint32_t bufferedBlockNum;
+	std::map<uint64_t, uint64_t> freeExtents;	// File offset to length of each gap in the data area, kept merged with its neighbours
+
+	void loadBlock(uint32_t);
+	bool storeBlock(uint32_t);
+	bool writeIndexEntry(uint32_t);
+	void buildFreeExtents();
+	uint64_t allocateExtent(uint32_t);
+	void releaseExtent(uint64_t, uint64_t);
+	static bool readHeader(FILE*, uint64_t&, uint32_t&, uint64_t&);
+	static bool writeHeader(FILE*, uint64_t, uint32_t);
+	static uint64_t getDataStart(uint32_t);
+	static uint32_t packBlock(const uint8_t*, uint8_t*, uint32_t&);
+};
@@ -0,0 +1,248 @@
+#include "DiskBlockCache.h"
+#include <cstring>
+#include <iterator>
+
+DiskBlockCache::DiskBlockCache()
+{
+	capacityChunks = DISK_CACHE_DEFAULT_CHUNKS;
+	writeBackEnabled = false;
+	cacheHits = 0;
+	cacheMisses = 0;
+	chunksReadAhead = 0;
+	chunksWrittenBack = 0;
+	writesThrough = 0;
+	writeQueue = nullptr;
+	writeTarget = DISK_WRITE_NO_TARGET;
+	imageMapping = nullptr;
+	imageFilesize = 0;
+	nextSequentialOffset = 0;
+	sequentialReadCount = 0;
+}
+
+void DiskBlockCache::attachImage(DiskWriteQueue* queuePtr, int targetNum, MappedFile* mappingPtr, uint64_t filesize)
+{
+	invalidateCache();
+	writeQueue = queuePtr;
+	writeTarget = targetNum;
+	imageMapping = mappingPtr;
+	imageFilesize = filesize;
+	cacheHits = 0;
+	cacheMisses = 0;
+	chunksReadAhead = 0;
+	chunksWrittenBack = 0;
+	writesThrough = 0;
+}
+
+void DiskBlockCache::detachImage()
+{
+	if (writeQueue == nullptr)
+		return;
+	flushCache();
+	invalidateCache();
+	writeQueue = nullptr;
+	writeTarget = DISK_WRITE_NO_TARGET;
+	imageMapping = nullptr;
+	imageFilesize = 0;
+}
+
+void DiskBlockCache::setCapacity(uint32_t totalChunks)
+{
+	// Shrinking the cache writes back and drops the least recently used chunks until it fits
+	capacityChunks = totalChunks;
+	while (lruChunks.size() > capacityChunks)
+	{
+		writeBackChunk(lruChunks.back());
+		chunkLookup.erase(lruChunks.back().chunkNum);
+		lruChunks.pop_back();
+	}
+}
+
+void DiskBlockCache::setWriteBack(bool enableWriteBack)
+{
+	// Anything held back in write-back mode goes to the write queue before switching over
+	if (!enableWriteBack)
+		flushCache();
+	writeBackEnabled = enableWriteBack;
+}
+
+void DiskBlockCache::readData(uint64_t byteOffset, uint8_t* destData, uint32_t dataLength)
+{
+	// Keep track of whether reads are picking up where the last one left off, which is what a big module or file load looks like
+	if (byteOffset == nextSequentialOffset)
+		sequentialReadCount++;
+	else
+		sequentialReadCount = 0;
+	nextSequentialOffset = byteOffset + dataLength;
+
+	while (dataLength > 0)
+	{
+		uint32_t chunkPosition = byteOffset % DISK_CACHE_CHUNK_SIZE;
+		uint32_t copyLength = ((DISK_CACHE_CHUNK_SIZE - chunkPosition) < dataLength) ? (DISK_CACHE_CHUNK_SIZE - chunkPosition) : dataLength;
+		diskCacheChunkStruct& curChunk = getChunk(byteOffset / DISK_CACHE_CHUNK_SIZE, true);
+		memcpy(destData, curChunk.chunkData.data() + chunkPosition, copyLength);
+		byteOffset += copyLength;
+		destData += copyLength;
+		dataLength -= copyLength;
+	}
+}
+
+void DiskBlockCache::writeData(uint64_t byteOffset, const uint8_t* sourceData, uint32_t dataLength)
+{
+	if (!writeBackEnabled)
+	{
+		// Write-through. Chunks that are already cached get updated so reads stay right, but nothing gets loaded just to be written.
+		writeQueue->queueWrite(writeTarget, byteOffset, sourceData, dataLength);
+		writesThrough++;
+		while (dataLength > 0)
+		{
+			uint32_t chunkPosition = byteOffset % DISK_CACHE_CHUNK_SIZE;
+			uint32_t copyLength = ((DISK_CACHE_CHUNK_SIZE - chunkPosition) < dataLength) ? (DISK_CACHE_CHUNK_SIZE - chunkPosition) : dataLength;
+			auto foundChunk = chunkLookup.find(byteOffset / DISK_CACHE_CHUNK_SIZE);
+			if (foundChunk != chunkLookup.end())
+				memcpy(foundChunk->second->chunkData.data() + chunkPosition, sourceData, copyLength);
+			byteOffset += copyLength;
+			sourceData += copyLength;
+			dataLength -= copyLength;
+		}
+		return;
+	}
+
+	while (dataLength > 0)
+	{
+		uint32_t chunkPosition = byteOffset % DISK_CACHE_CHUNK_SIZE;
+		uint32_t copyLength = ((DISK_CACHE_CHUNK_SIZE - chunkPosition) < dataLength) ? (DISK_CACHE_CHUNK_SIZE - chunkPosition) : dataLength;
+		diskCacheChunkStruct& curChunk = getChunk(byteOffset / DISK_CACHE_CHUNK_SIZE, false);
+		memcpy(curChunk.chunkData.data() + chunkPosition, sourceData, copyLength);
+		for (uint32_t sectorNum = chunkPosition / 256; sectorNum <= ((chunkPosition + copyLength - 1) / 256); sectorNum++)
+			curChunk.dirtySectors.set(sectorNum);
+		byteOffset += copyLength;
+		sourceData += copyLength;
+		dataLength -= copyLength;
+	}
+}
+
+void DiskBlockCache::flushCache()
+{
+	// Hands every written sector still sitting in the cache to the write queue. The chunks stay cached.
+	for (diskCacheChunkStruct& curChunk : lruChunks)
+		writeBackChunk(curChunk);
+}
+
+void DiskBlockCache::invalidateCache()
+{
+	// Drops everything in the cache, including sectors that haven't been written back yet
+	lruChunks.clear();
+	chunkLookup.clear();
+	nextSequentialOffset = 0;
+	sequentialReadCount = 0;
+}
+
+diskCacheChunkStruct& DiskBlockCache::getChunk(uint64_t chunkNum, bool isRead)
+{
+	auto foundChunk = chunkLookup.find(chunkNum);
+	if (foundChunk != chunkLookup.end())
+	{
+		lruChunks.splice(lruChunks.begin(), lruChunks, foundChunk->second);
+		if (isRead)
+			cacheHits++;
+		return lruChunks.front();
+	}
+
+	// Once reads look sequential, pull the next few chunks in along with this one so a long load makes fewer, bigger trips to the image
+	uint32_t readAheadChunks = 0;
+	if (isRead)
+	{
+		cacheMisses++;
+		if (sequentialReadCount >= DISK_CACHE_SEQUENTIAL_THRESHOLD)
+			readAheadChunks = DISK_CACHE_READ_AHEAD_CHUNKS;
+	}
+	loadChunks(chunkNum, 1 + readAheadChunks);
+	return lruChunks.front();
+}
+
+void DiskBlockCache::loadChunks(uint64_t firstChunkNum, uint32_t chunkCount)
+{
+	// Don't read ahead past the end of the image, into chunks we already have, or into more chunks than the cache can hold
+	uint64_t lastChunkNum = (imageFilesize > 0) ? ((imageFilesize - 1) / DISK_CACHE_CHUNK_SIZE) : 0;
+	uint32_t loadCount = 1;
+	while ((loadCount < chunkCount) && (loadCount < capacityChunks) && ((firstChunkNum + loadCount) <= lastChunkNum) && (chunkLookup.count(firstChunkNum + loadCount) == 0))
+		loadCount++;
+
+	uint64_t loadOffset = firstChunkNum * DISK_CACHE_CHUNK_SIZE;
+	uint64_t loadLength = (uint64_t)loadCount * DISK_CACHE_CHUNK_SIZE;
+	if (loadOffset >= imageFilesize)
+		loadLength = 0;
+	else if ((loadOffset + loadLength) > imageFilesize)
+		loadLength = imageFilesize - loadOffset;
+
+	// The whole span comes in with one read, straight out of the mapping if nothing queued for the image could make it out of date
+	std::vector<uint8_t> loadBuffer;
+	const uint8_t* loadDataPtr;
+	if ((imageMapping != nullptr) && imageMapping->isMapped() && ((loadOffset + loadLength) <= imageMapping->mappedSize) && !writeQueue->hasPendingWrites(writeTarget))
+		loadDataPtr = imageMapping->mappedData + loadOffset;
+	else
+	{
+		loadBuffer.resize(loadLength);
+		if (loadLength > 0)
+			writeQueue->readThrough(writeTarget, loadOffset, loadBuffer.data(), loadLength);
+		loadDataPtr = loadBuffer.data();
+	}
+
+	// Insert the last chunk first so the one that was actually asked for ends up at the front of the list
+	for (int i = loadCount - 1; i >= 0; i--)
+	{
+		if (lruChunks.size() >= capacityChunks)
+		{
+			// Recycle the least recently used chunk's buffer rather than allocating a new one
+			writeBackChunk(lruChunks.back());
+			chunkLookup.erase(lruChunks.back().chunkNum);
+			lruChunks.splice(lruChunks.begin(), lruChunks, std::prev(lruChunks.end()));
+		}
+		else
+			lruChunks.emplace_front();
+
+		diskCacheChunkStruct& newChunk = lruChunks.front();
+		newChunk.chunkNum = firstChunkNum + i;
+		newChunk.chunkData.resize(DISK_CACHE_CHUNK_SIZE);
+		newChunk.dirtySectors.reset();
+		uint64_t chunkStart = (uint64_t)i * DISK_CACHE_CHUNK_SIZE;
+		uint32_t validLength = (chunkStart >= loadLength) ? 0 : (((loadLength - chunkStart) < DISK_CACHE_CHUNK_SIZE) ? (uint32_t)(loadLength - chunkStart) : DISK_CACHE_CHUNK_SIZE);
+		if (validLength > 0)
+			memcpy(newChunk.chunkData.data(), loadDataPtr + chunkStart, validLength);
+		if (validLength < DISK_CACHE_CHUNK_SIZE)
+			memset(newChunk.chunkData.data() + validLength, 0, DISK_CACHE_CHUNK_SIZE - validLength);
+		chunkLookup[newChunk.chunkNum] = lruChunks.begin();
+		if (i > 0)
+			chunksReadAhead++;
+	}
+}
+
+void DiskBlockCache::writeBackChunk(diskCacheChunkStruct& curChunk)
+{
+	if (curChunk.dirtySectors.none())
+		return;
+
+	// Each run of consecutive written sectors goes to the write queue as a single write
+	uint64_t chunkOffset = curChunk.chunkNum * DISK_CACHE_CHUNK_SIZE;
+	uint32_t sectorNum = 0;
+	while (sectorNum < DISK_CACHE_SECTORS_PER_CHUNK)
+	{
+		if (!curChunk.dirtySectors.test(sectorNum))
+		{
+			sectorNum++;
+			continue;
+		}
+		uint32_t runStart = sectorNum;
+		while ((sectorNum < DISK_CACHE_SECTORS_PER_CHUNK) && curChunk.dirtySectors.test(sectorNum))
+			sectorNum++;
+		uint64_t runOffset = chunkOffset + (runStart * 256);
+		uint64_t runLength = (sectorNum - runStart) * 256;
+		if (runOffset >= imageFilesize)
+			continue;
+		if ((runOffset + runLength) > imageFilesize)
+			runLength = imageFilesize - runOffset;
+		writeQueue->queueWrite(writeTarget, runOffset, curChunk.chunkData.data() + (runStart * 256), runLength);
+	}
+	curChunk.dirtySectors.reset();
+	chunksWrittenBack++;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <list>
+#include <bitset>
+#include <unordered_map>
+#include "DiskWriteQueue.h"
+#include "MappedFile.h"
+
+constexpr uint32_t DISK_CACHE_CHUNK_SIZE			= 65536;	// Images are cached in chunks of this many bytes
+constexpr uint32_t DISK_CACHE_SECTORS_PER_CHUNK		= DISK_CACHE_CHUNK_SIZE / 256;
+constexpr uint32_t DISK_CACHE_DEFAULT_CHUNKS		= 64;		// 4 MB per mounted image
+constexpr uint32_t DISK_CACHE_READ_AHEAD_CHUNKS		= 2;		// Extra chunks pulled in by the same read once accesses look sequential
+constexpr uint32_t DISK_CACHE_SEQUENTIAL_THRESHOLD	= 4;		// Reads that each start where the last one ended before we call it sequential
+
+struct diskCacheChunkStruct
+{
+	uint64_t chunkNum;
+	std::vector<uint8_t> chunkData;
+	std::bitset<DISK_CACHE_SECTORS_PER_CHUNK> dirtySectors;		// Sectors written since the chunk was last written back
+};
+
+// LRU cache of 64K chunks sitting in front of a DiskWriteQueue target. By default it's write-through: writes update the chunk if it's
+// cached and go straight to the write queue too, so they get journaled as soon as they would have without the cache. In write-back mode
+// writes only update the cached chunk and get written back when the chunk is evicted or the cache is flushed, which saves queuing the same
+// sectors over and over but leaves them only in memory until then. Chunks are filled from the image's memory mapping when there is one
+// and nothing is still queued for it, otherwise through the write queue's readThrough().
+class DiskBlockCache
+{
+public:
+	DiskBlockCache();
+
+	void attachImage(DiskWriteQueue*, int, MappedFile*, uint64_t);
+	void detachImage();
+	void setCapacity(uint32_t);
+	void setWriteBack(bool);
+	bool isEnabled() { return (capacityChunks > 0) && (writeQueue != nullptr); }
+	size_t cachedChunks() { return lruChunks.size(); }
+	void readData(uint64_t, uint8_t*, uint32_t);
+	void writeData(uint64_t, const uint8_t*, uint32_t);
+	void flushCache();
+	void invalidateCache();
+
+	uint32_t capacityChunks;
+	bool writeBackEnabled;
+	uint64_t cacheHits, cacheMisses, chunksReadAhead, chunksWrittenBack, writesThrough;
+
+private:
+	DiskWriteQueue* writeQueue;
+	int writeTarget;
+	MappedFile* imageMapping;
+	uint64_t imageFilesize;
+	std::list<diskCacheChunkStruct> lruChunks;		// Most recently used at the front
+	std::unordered_map<uint64_t, std::list<diskCacheChunkStruct>::iterator> chunkLookup;
+	uint64_t nextSequentialOffset;
+	uint32_t sequentialReadCount;
+
+	diskCacheChunkStruct& getChunk(uint64_t, bool);
+	void loadChunks(uint64_t, uint32_t);
+	void writeBackChunk(diskCacheChunkStruct&);
+};
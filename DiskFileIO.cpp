@@ -0,0 +1,163 @@
+#include "DiskFileIO.h"
+#include <cstring>
+#include <filesystem>
+#ifdef _WIN32
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+	#include <winioctl.h>
+	#include <io.h>
+#else
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
+
+uint64_t getFileSize64(FILE* filePtr)
+{
+#ifdef _WIN32
+	int64_t fileLength = _filelengthi64(_fileno(filePtr));
+	return (fileLength > 0) ? (uint64_t)fileLength : 0;
+#else
+	struct stat fileStats;
+	if ((fstat(fileno(filePtr), &fileStats) != 0) || (fileStats.st_size <= 0))
+		return 0;
+	return fileStats.st_size;
+#endif
+}
+
+size_t readFileAt(FILE* filePtr, uint64_t byteOffset, void* destData, size_t dataLength)
+{
+#ifdef _WIN32
+	// The MSVC runtime has no pread(), but _fseeki64() gets us the full 64-bit offset
+	if (_fseeki64(filePtr, byteOffset, SEEK_SET) != 0)
+		return 0;
+	return fread(destData, 1, dataLength, filePtr);
+#else
+	static_assert(sizeof(off_t) >= 8, "Disk images over 2 GB need a 64-bit off_t (build with _FILE_OFFSET_BITS=64)");
+	size_t totalRead = 0;
+	while (totalRead < dataLength)
+	{
+		ssize_t bytesRead = pread(fileno(filePtr), (uint8_t*)destData + totalRead, dataLength - totalRead, byteOffset + totalRead);
+		if ((bytesRead < 0) && (errno == EINTR))
+			continue;
+		if (bytesRead <= 0)
+			break;			// End of file or an error, either way the caller zero-fills whatever we didn't get
+		totalRead += bytesRead;
+	}
+	return totalRead;
+#endif
+}
+
+size_t writeFileAt(FILE* filePtr, uint64_t byteOffset, const void* sourceData, size_t dataLength)
+{
+#ifdef _WIN32
+	if (_fseeki64(filePtr, byteOffset, SEEK_SET) != 0)
+		return 0;
+	size_t bytesWritten = fwrite(sourceData, 1, dataLength, filePtr);
+	fflush(filePtr);
+	return bytesWritten;
+#else
+	// pwrite() goes straight to the descriptor, so there's nothing sitting in a stdio buffer to flush afterwards
+	size_t totalWritten = 0;
+	while (totalWritten < dataLength)
+	{
+		ssize_t bytesWritten = pwrite(fileno(filePtr), (const uint8_t*)sourceData + totalWritten, dataLength - totalWritten, byteOffset + totalWritten);
+		if ((bytesWritten < 0) && (errno == EINTR))
+			continue;
+		if (bytesWritten <= 0)
+			break;
+		totalWritten += bytesWritten;
+	}
+	return totalWritten;
+#endif
+}
+
+bool setFileSparse(FILE* filePtr)
+{
+	// Lets the host skip allocating space for parts of the file that have never been written. NTFS only does that for files that have
+	// been marked sparse, and it has to be done before the far end of the file gets written. Filesystems on other hosts leave holes
+	// unallocated on their own, so there's nothing to do there.
+#ifdef _WIN32
+	HANDLE fileHandle = (HANDLE)_get_osfhandle(_fileno(filePtr));
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD bytesReturned = 0;
+	return (DeviceIoControl(fileHandle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr) != 0);
+#else
+	return (filePtr != nullptr);
+#endif
+}
+
+bool selfTestFileIO64(std::string scratchPathname, std::string& failureReason)
+{
+	// Makes a sparse scratch file a bit over 4 GB and writes, then reads back, sectors on both sides of the 4 GB line and the last sector
+	// of the file. The offsets only fit in 64 bits, so whichever of the calls above this build uses (_fseeki64() or pread()/pwrite()) gets
+	// checked. Only the written sectors take up space on the host. Returns false with the reason filled in if anything doesn't match.
+	constexpr uint64_t TEST_FILE_SIZE = 0x140000000ULL;		// 5 GB
+	const uint64_t testOffsets[] = { 0xFFFFFF00ULL, 0x100000000ULL, 0x100000100ULL, TEST_FILE_SIZE - 256 };
+	FILE* scratchFile = fopen(scratchPathname.c_str(), "wb+");
+	if (scratchFile == nullptr)
+	{
+		failureReason = "could not create " + scratchPathname;
+		return false;
+	}
+	setFileSparse(scratchFile);
+
+	bool testPassed = true;
+	uint8_t sectorData[256], readBack[256];
+	for (uint64_t testOffset : testOffsets)
+	{
+		// Every sector gets a different pattern, so one that lands on top of another because its offset got truncated shows up
+		for (int i = 0; i < 256; i++)
+			sectorData[i] = (uint8_t)((testOffset >> 7) + (i * 13));
+		if (writeFileAt(scratchFile, testOffset, sectorData, 256) != 256)
+		{
+			failureReason = "write at offset " + std::to_string(testOffset) + " failed";
+			testPassed = false;
+			break;
+		}
+	}
+	if (testPassed && (getFileSize64(scratchFile) != TEST_FILE_SIZE))
+	{
+		failureReason = "file size came back as " + std::to_string(getFileSize64(scratchFile)) + " instead of " + std::to_string(TEST_FILE_SIZE);
+		testPassed = false;
+	}
+	for (size_t testNum = 0; testPassed && (testNum < (sizeof(testOffsets) / sizeof(testOffsets[0]))); testNum++)
+	{
+		uint64_t testOffset = testOffsets[testNum];
+		for (int i = 0; i < 256; i++)
+			sectorData[i] = (uint8_t)((testOffset >> 7) + (i * 13));
+		if ((readFileAt(scratchFile, testOffset, readBack, 256) != 256) || (memcmp(sectorData, readBack, 256) != 0))
+		{
+			failureReason = "read back at offset " + std::to_string(testOffset) + " didn't match what was written";
+			testPassed = false;
+		}
+	}
+	if (testPassed && (readFileAt(scratchFile, TEST_FILE_SIZE, readBack, 256) != 0))
+	{
+		failureReason = "read past the end of the file returned data";
+		testPassed = false;
+	}
+
+	fclose(scratchFile);
+	remove(scratchPathname.c_str());
+	return testPassed;
+}
+
+bool isSameHostFile(std::string firstPathname, std::string secondPathname)
+{
+	// Catches two spellings of the same file (relative paths, links, different case on Windows) as long as both exist. If either one
+	// doesn't, all we can go on is the names themselves.
+	if (firstPathname.empty() || secondPathname.empty())
+		return false;
+	std::error_code fsError;
+	if (std::filesystem::equivalent(firstPathname, secondPathname, fsError))
+		return true;
+	return (firstPathname == secondPathname);
+}
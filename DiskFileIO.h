@@ -0,0 +1,15 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <string>
+
+// Positioned file I/O with 64-bit offsets for disk images. Plain fseek()/ftell() take a long, which is only 32 bits on Windows and 32-bit
+// hosts, so anything past 2 GB into a .VHD file has to go through these instead. The read and write calls don't move the file's stream
+// position on POSIX hosts (they're pread()/pwrite() on the underlying descriptor), so don't mix them with buffered stdio calls on the same
+// FILE* unless it's been flushed first.
+uint64_t getFileSize64(FILE*);
+size_t readFileAt(FILE*, uint64_t, void*, size_t);
+size_t writeFileAt(FILE*, uint64_t, const void*, size_t);
+bool setFileSparse(FILE*);
+bool selfTestFileIO64(std::string, std::string&);
+bool isSameHostFile(std::string, std::string);
@@ -0,0 +1,273 @@
+#include "DiskOverlay.h"
+#include "DiskFileIO.h"
+#include <cstring>
+#include <algorithm>
+
+DiskOverlay::DiskOverlay()
+{
+	isOpen = false;
+	baseFilesize = 0;
+	totalSectors = 0;
+	sectorsInDelta = 0;
+	deltaDataStart = 0;
+	baseFile = nullptr;
+	deltaFile = nullptr;
+}
+
+DiskOverlay::~DiskOverlay()
+{
+	closeOverlay();
+}
+
+uint8_t DiskOverlay::openOverlay(std::string baseFilePathname, std::string deltaFilePathname)
+{
+	closeOverlay();
+
+	// The base image is never written while the overlay is open, so it's fine for other instances to have it open at the same time
+	baseFile = fopen(baseFilePathname.c_str(), "rb");
+	if (baseFile == nullptr)
+		return DISK_OVERLAY_ERROR_OPENING_BASE;
+	baseFilesize = getFileSize64(baseFile);
+	if (baseFilesize == 0)
+	{
+		fclose(baseFile);
+		baseFile = nullptr;
+		return DISK_OVERLAY_ERROR_OPENING_BASE;
+	}
+	baseMapping.mapFile(baseFilePathname);
+	basePathname = baseFilePathname;
+	deltaPathname = deltaFilePathname;
+
+	totalSectors = (baseFilesize + DISK_OVERLAY_SECTOR_SIZE - 1) / DISK_OVERLAY_SECTOR_SIZE;
+	sectorBitmap.assign((totalSectors + 7) / 8, 0);
+	deltaDataStart = ((DISK_OVERLAY_HEADER_SIZE + sectorBitmap.size() + DISK_OVERLAY_DATA_ALIGN - 1) / DISK_OVERLAY_DATA_ALIGN) * DISK_OVERLAY_DATA_ALIGN;
+
+	// Pick up where this instance left off if it already has a delta file for this image, otherwise start a fresh one
+	deltaFile = fopen(deltaPathname.c_str(), "rb+");
+	if (deltaFile == nullptr)
+	{
+		uint8_t createStatus = createDeltaFile();
+		if (createStatus != DISK_OVERLAY_OPERATION_COMPLETE)
+		{
+			fclose(baseFile);
+			baseFile = nullptr;
+			baseMapping.unmapFile();
+			return createStatus;
+		}
+	}
+	else
+	{
+		setFileSparse(deltaFile);		// Delta files from before they were made sparse get picked up too, for whatever gets written from now on
+		uint8_t deltaHeader[DISK_OVERLAY_HEADER_SIZE];
+		uint64_t deltaBaseFilesize = 0;
+		bool headerValid = (fread(deltaHeader, 1, DISK_OVERLAY_HEADER_SIZE, deltaFile) == DISK_OVERLAY_HEADER_SIZE);
+		if (headerValid)
+		{
+			for (int i = 0; i < 8; i++)
+				deltaBaseFilesize |= (uint64_t)deltaHeader[16 + i] << (i * 8);
+			headerValid = ((deltaHeader[0] | (deltaHeader[1] << 8) | (deltaHeader[2] << 16) | ((uint32_t)deltaHeader[3] << 24)) == DISK_OVERLAY_MAGIC) &&
+				(deltaHeader[4] == DISK_OVERLAY_VERSION) && ((deltaHeader[8] | (deltaHeader[9] << 8)) == DISK_OVERLAY_SECTOR_SIZE) && (deltaBaseFilesize == baseFilesize);
+		}
+		if (!headerValid || (fread(sectorBitmap.data(), 1, sectorBitmap.size(), deltaFile) != sectorBitmap.size()))
+		{
+			fclose(deltaFile);
+			fclose(baseFile);
+			deltaFile = nullptr;
+			baseFile = nullptr;
+			baseMapping.unmapFile();
+			return DISK_OVERLAY_ERROR_DELTA_MISMATCH;
+		}
+		sectorsInDelta = 0;
+		for (uint64_t i = 0; i < totalSectors; i++)
+			if (isSectorInDelta(i))
+				sectorsInDelta++;
+	}
+
+	isOpen = true;
+	return DISK_OVERLAY_OPERATION_COMPLETE;
+}
+
+void DiskOverlay::closeOverlay()
+{
+	if (baseFile != nullptr)
+		fclose(baseFile);
+	if (deltaFile != nullptr)
+		fclose(deltaFile);
+	baseFile = nullptr;
+	deltaFile = nullptr;
+	baseMapping.unmapFile();
+	sectorBitmap.clear();
+	isOpen = false;
+}
+
+void DiskOverlay::readData(uint64_t byteOffset, uint8_t* destData, uint32_t dataLength)
+{
+	if (!isOpen)
+	{
+		memset(destData, 0, dataLength);
+		return;
+	}
+
+	while (dataLength > 0)
+	{
+		// Read as many sectors as we can in one go, as long as they all come from the same file
+		uint64_t sectorNum = byteOffset / DISK_OVERLAY_SECTOR_SIZE;
+		bool fromDelta = (sectorNum < totalSectors) && isSectorInDelta(sectorNum);
+		uint64_t runEnd = (sectorNum + 1) * DISK_OVERLAY_SECTOR_SIZE;
+		while ((runEnd < (byteOffset + dataLength)) && ((runEnd / DISK_OVERLAY_SECTOR_SIZE) < totalSectors) && (isSectorInDelta(runEnd / DISK_OVERLAY_SECTOR_SIZE) == fromDelta))
+			runEnd += DISK_OVERLAY_SECTOR_SIZE;
+		uint32_t runLength = ((byteOffset + dataLength) < runEnd) ? dataLength : (uint32_t)(runEnd - byteOffset);
+
+		size_t bytesRead;
+		if (fromDelta)
+		{
+			bytesRead = readFileAt(deltaFile, deltaDataStart + byteOffset, destData, runLength);
+		}
+		else if (baseMapping.isMapped())
+		{
+			bytesRead = (byteOffset >= baseMapping.mappedSize) ? 0 : (((byteOffset + runLength) > baseMapping.mappedSize) ? (size_t)(baseMapping.mappedSize - byteOffset) : runLength);
+			memcpy(destData, baseMapping.mappedData + byteOffset, bytesRead);
+		}
+		else
+		{
+			bytesRead = readFileAt(baseFile, byteOffset, destData, runLength);
+		}
+		if (bytesRead < runLength)
+			memset(destData + bytesRead, 0, runLength - bytesRead);
+
+		byteOffset += runLength;
+		destData += runLength;
+		dataLength -= runLength;
+	}
+}
+
+bool DiskOverlay::writeData(uint64_t byteOffset, const uint8_t* sourceData, uint32_t dataLength)
+{
+	// Returns false if the host wouldn't take some of the data
+	if (!isOpen)
+		return false;
+	if (byteOffset >= baseFilesize)
+		return true;
+	// The overlay is always the same size as its base image
+	if ((byteOffset + dataLength) > baseFilesize)
+		dataLength = baseFilesize - byteOffset;
+
+	uint8_t sectorData[DISK_OVERLAY_SECTOR_SIZE];
+	bool writeSucceeded = true;
+	while (dataLength > 0)
+	{
+		uint64_t sectorNum = byteOffset / DISK_OVERLAY_SECTOR_SIZE;
+		uint32_t sectorPosition = byteOffset % DISK_OVERLAY_SECTOR_SIZE;
+		uint32_t chunkLength = ((DISK_OVERLAY_SECTOR_SIZE - sectorPosition) < dataLength) ? (DISK_OVERLAY_SECTOR_SIZE - sectorPosition) : dataLength;
+		bool sectorWasInDelta = isSectorInDelta(sectorNum);
+		bool sectorWritten;
+
+		if (!sectorWasInDelta && (chunkLength < DISK_OVERLAY_SECTOR_SIZE))
+		{
+			// Only part of a sector that's still in the base is being written, so carry the rest of it over from the base first
+			readData(sectorNum * DISK_OVERLAY_SECTOR_SIZE, sectorData, DISK_OVERLAY_SECTOR_SIZE);
+			memcpy(sectorData + sectorPosition, sourceData, chunkLength);
+			sectorWritten = (writeFileAt(deltaFile, deltaDataStart + (sectorNum * DISK_OVERLAY_SECTOR_SIZE), sectorData, DISK_OVERLAY_SECTOR_SIZE) == DISK_OVERLAY_SECTOR_SIZE);
+		}
+		else
+		{
+			sectorWritten = (writeFileAt(deltaFile, deltaDataStart + byteOffset, sourceData, chunkLength) == chunkLength);
+		}
+
+		// The data goes in before the bitmap says it's there, so a crash in between just loses this write instead of exposing garbage
+		if (!sectorWritten)
+			writeSucceeded = false;
+		else if (!sectorWasInDelta)
+		{
+			sectorBitmap[sectorNum >> 3] |= 1 << (sectorNum & 7);
+			if (writeFileAt(deltaFile, DISK_OVERLAY_HEADER_SIZE + (sectorNum >> 3), &sectorBitmap[sectorNum >> 3], 1) != 1)
+				writeSucceeded = false;
+			sectorsInDelta++;
+		}
+
+		byteOffset += chunkLength;
+		sourceData += chunkLength;
+		dataLength -= chunkLength;
+	}
+	return writeSucceeded;
+}
+
+uint8_t DiskOverlay::commitOverlay()
+{
+	// Writes every sector in the delta back into the base image, then starts the delta over. The delta is the only copy of those writes,
+	// so it's only thrown away once every sector has gone into the base and the base has closed cleanly. If the host won't take them
+	// (a full disk or read-only media, say), the delta and its bitmap are left just as they were and reads keep coming from it.
+	if (!isOpen)
+		return DISK_OVERLAY_ERROR_NOT_OPEN;
+
+	FILE* baseWriteFile = fopen(basePathname.c_str(), "rb+");
+	if (baseWriteFile == nullptr)
+		return DISK_OVERLAY_ERROR_OPENING_BASE;
+
+	uint8_t sectorData[DISK_OVERLAY_SECTOR_SIZE];
+	for (uint64_t sectorNum = 0; sectorNum < totalSectors; sectorNum++)
+	{
+		if (!isSectorInDelta(sectorNum))
+			continue;
+		uint64_t sectorOffset = sectorNum * DISK_OVERLAY_SECTOR_SIZE;
+		uint32_t sectorLength = ((sectorOffset + DISK_OVERLAY_SECTOR_SIZE) > baseFilesize) ? (uint32_t)(baseFilesize - sectorOffset) : DISK_OVERLAY_SECTOR_SIZE;
+		readData(sectorOffset, sectorData, sectorLength);
+		if (writeFileAt(baseWriteFile, sectorOffset, sectorData, sectorLength) != sectorLength)
+		{
+			fclose(baseWriteFile);
+			return DISK_OVERLAY_ERROR_WRITING_BASE;
+		}
+	}
+	if (fclose(baseWriteFile) != 0)
+		return DISK_OVERLAY_ERROR_WRITING_BASE;
+
+	// Reopen our read-only handle so nothing it had buffered from before the commit gets used. The mapping sees the new data on its own.
+	fclose(baseFile);
+	baseFile = fopen(basePathname.c_str(), "rb");
+	if (baseFile == nullptr)
+	{
+		closeOverlay();
+		return DISK_OVERLAY_ERROR_OPENING_BASE;
+	}
+	return discardOverlay();
+}
+
+uint8_t DiskOverlay::discardOverlay()
+{
+	if (!isOpen)
+		return DISK_OVERLAY_ERROR_NOT_OPEN;
+
+	fclose(deltaFile);
+	deltaFile = nullptr;
+	uint8_t createStatus = createDeltaFile();
+	if (createStatus != DISK_OVERLAY_OPERATION_COMPLETE)
+		closeOverlay();
+	return createStatus;
+}
+
+uint8_t DiskOverlay::createDeltaFile()
+{
+	deltaFile = fopen(deltaPathname.c_str(), "wb+");
+	if (deltaFile == nullptr)
+		return DISK_OVERLAY_ERROR_OPENING_DELTA;
+	// Sector N always lands at the same spot in the data area, so without this, writing the last sector of a big image would have the
+	// host allocate space for every sector in front of it
+	if (!setFileSparse(deltaFile))
+		printf("Disk Overlay: %s can't be made sparse on this filesystem, so it may take up as much space as the image.\n", deltaPathname.c_str());
+
+	uint8_t deltaHeader[DISK_OVERLAY_HEADER_SIZE] = { 0 };
+	for (int i = 0; i < 4; i++)
+		deltaHeader[i] = (DISK_OVERLAY_MAGIC >> (i * 8)) & 0xFF;
+	deltaHeader[4] = DISK_OVERLAY_VERSION;
+	deltaHeader[8] = DISK_OVERLAY_SECTOR_SIZE & 0xFF;
+	deltaHeader[9] = (DISK_OVERLAY_SECTOR_SIZE >> 8) & 0xFF;
+	for (int i = 0; i < 8; i++)
+		deltaHeader[16 + i] = (baseFilesize >> (i * 8)) & 0xFF;
+
+	std::fill(sectorBitmap.begin(), sectorBitmap.end(), 0);
+	sectorsInDelta = 0;
+	fwrite(deltaHeader, 1, DISK_OVERLAY_HEADER_SIZE, deltaFile);
+	fwrite(sectorBitmap.data(), 1, sectorBitmap.size(), deltaFile);
+	fflush(deltaFile);
+	return DISK_OVERLAY_OPERATION_COMPLETE;
+}
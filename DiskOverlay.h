@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include "MappedFile.h"
+
+constexpr uint8_t DISK_OVERLAY_OPERATION_COMPLETE	= 0x00;
+constexpr uint8_t DISK_OVERLAY_ERROR_OPENING_BASE	= 0x01;
+constexpr uint8_t DISK_OVERLAY_ERROR_OPENING_DELTA	= 0x02;
+constexpr uint8_t DISK_OVERLAY_ERROR_DELTA_MISMATCH	= 0x03;		// The delta file on disk was made against a different size base image
+constexpr uint8_t DISK_OVERLAY_ERROR_NOT_OPEN		= 0x04;
+constexpr uint8_t DISK_OVERLAY_ERROR_WRITING_BASE	= 0x05;		// Commit couldn't finish writing the base image, so the delta was kept
+
+constexpr uint32_t DISK_OVERLAY_MAGIC				= 0x544C4443;	// "CDLT" in little-endian
+constexpr uint32_t DISK_OVERLAY_VERSION				= 1;
+constexpr uint32_t DISK_OVERLAY_SECTOR_SIZE			= 256;			// Granularity of the sector bitmap. Matches EmuDisk sectors and the FD502's dirty blocks.
+constexpr uint32_t DISK_OVERLAY_HEADER_SIZE			= 32;			// Magic, version, sector size, reserved, base image size, reserved
+constexpr uint32_t DISK_OVERLAY_DATA_ALIGN			= 4096;			// Sector data starts on a boundary of this many bytes after the bitmap
+
+// Presents a disk image whose base file is only ever opened read-only, so any number of emulator instances can boot from the same master
+// image at once. Sectors that get written go into a delta file owned by this instance instead. Sector N of the image lives at the same
+// spot in the delta file's data area no matter what order sectors get written in. The delta file is marked sparse, so the host only
+// allocates space for sectors that were actually written, and a bitmap at the front of the delta file says which sectors to take from
+// it rather than from the base.
+class DiskOverlay
+{
+public:
+	DiskOverlay();
+	~DiskOverlay();
+
+	uint8_t openOverlay(std::string, std::string);
+	void closeOverlay();
+	void readData(uint64_t, uint8_t*, uint32_t);
+	bool writeData(uint64_t, const uint8_t*, uint32_t);
+	uint8_t commitOverlay();
+	uint8_t discardOverlay();
+
+	bool isOpen;
+	uint64_t baseFilesize;
+	uint32_t sectorsInDelta;
+	std::string basePathname, deltaPathname;
+
+private:
+	FILE* baseFile;
+	MappedFile baseMapping;				// Reads from the base image come straight from here when the host lets us map it
+	FILE* deltaFile;
+	std::vector<uint8_t> sectorBitmap;		// One bit per sector, set once the sector has been written to the delta
+	uint64_t totalSectors;
+	uint64_t deltaDataStart;
+
+	uint8_t createDeltaFile();
+	bool isSectorInDelta(uint64_t sectorNum) { return (sectorBitmap[sectorNum >> 3] >> (sectorNum & 7)) & 0x01; }
+};
@@ -0,0 +1,504 @@
+#include "DiskWriteQueue.h"
+#include "DiskOverlay.h"
+#include "CompressedDisk.h"
+#include "DiskFileIO.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+// Journal records are stored little-endian no matter what the host is
+static void packLittleEndian(uint8_t* destPtr, uint64_t value, int byteCount)
+{
+	for (int i = 0; i < byteCount; i++)
+		destPtr[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static uint64_t unpackLittleEndian(const uint8_t* sourcePtr, int byteCount)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < byteCount; i++)
+		value |= (uint64_t)sourcePtr[i] << (i * 8);
+	return value;
+}
+
+DiskWriteQueue::DiskWriteQueue()
+{
+	ioThreadRunning = false;
+	nextSequenceNum = 0;
+	journaledWrites = 0;
+	writesQueued = 0;
+	writesCompleted = 0;
+	writesFailed = 0;
+	recordsReplayed = 0;
+	highestQueueDepth = 0;
+	longestWriteMicroseconds = 0;
+	longestCallerWaitMicroseconds = 0;
+}
+
+DiskWriteQueue::~DiskWriteQueue()
+{
+	shutdownQueue();
+}
+
+int DiskWriteQueue::openTarget(FILE* imageFile, std::string imageFilePathname)
+{
+	return openTargetSlot(imageFile, nullptr, nullptr, imageFilePathname);
+}
+
+int DiskWriteQueue::openTarget(DiskOverlay* imageOverlay, std::string deltaFilePathname)
+{
+	// Writes to an overlay land in its delta file, so that's what the journal goes next to. The base image is never touched.
+	return openTargetSlot(nullptr, imageOverlay, nullptr, deltaFilePathname);
+}
+
+int DiskWriteQueue::openTarget(CompressedDisk* imageContainer, std::string imageFilePathname)
+{
+	return openTargetSlot(nullptr, nullptr, imageContainer, imageFilePathname);
+}
+
+int DiskWriteQueue::openTargetSlot(FILE* imageFile, DiskOverlay* imageOverlay, CompressedDisk* imageContainer, std::string imageFilePathname)
+{
+	int targetNum = DISK_WRITE_NO_TARGET;
+	for (int i = 0; i < DISK_WRITE_MAX_TARGETS; i++)
+		if (!writeTarget[i].isOpen)
+		{
+			targetNum = i;
+			break;
+		}
+	if (targetNum == DISK_WRITE_NO_TARGET)
+		return DISK_WRITE_NO_TARGET;
+
+	{
+		std::lock_guard<std::mutex> ioLock(writeTarget[targetNum].ioMutex);
+		writeTarget[targetNum].imageFile = imageFile;
+		writeTarget[targetNum].imageOverlay = imageOverlay;
+		writeTarget[targetNum].imageContainer = imageContainer;
+		writeTarget[targetNum].journalPathname = imageFilePathname + ".journal";
+		writeTarget[targetNum].failedWrites = 0;
+		// If the last session didn't get to write everything into the image before it went down, finish the job now before anyone reads from it
+		replayJournal(targetNum);
+		emptyJournal(targetNum);
+		writeTarget[targetNum].isOpen = true;
+	}
+
+	std::lock_guard<std::mutex> queueLock(queueMutex);
+	if (!ioThreadRunning)
+	{
+		ioThreadRunning = true;
+		ioThread = std::thread(&DiskWriteQueue::ioThreadLoop, this);
+	}
+	return targetNum;
+}
+
+void DiskWriteQueue::closeTarget(int targetNum)
+{
+	if ((targetNum < 0) || (targetNum >= DISK_WRITE_MAX_TARGETS) || !writeTarget[targetNum].isOpen)
+		return;
+
+	// Everything queued for this image has to be in it before the device closes the file
+	flushBarrier();
+	std::lock_guard<std::mutex> ioLock(writeTarget[targetNum].ioMutex);
+	if (writeTarget[targetNum].journalFile != nullptr)
+		fclose(writeTarget[targetNum].journalFile);
+	remove(writeTarget[targetNum].journalPathname.c_str());
+	writeTarget[targetNum].journalFile = nullptr;
+	writeTarget[targetNum].imageFile = nullptr;
+	writeTarget[targetNum].imageOverlay = nullptr;
+	writeTarget[targetNum].imageContainer = nullptr;
+	writeTarget[targetNum].journalRecords = 0;
+	writeTarget[targetNum].isOpen = false;
+}
+
+void DiskWriteQueue::queueWrite(int targetNum, uint64_t byteOffset, const uint8_t* sourceData, uint32_t dataLength)
+{
+	// Called from the emulation thread. Copies the data and returns right away, the I/O thread takes it from here.
+	if ((targetNum < 0) || (targetNum >= DISK_WRITE_MAX_TARGETS) || (dataLength == 0))
+		return;
+
+	auto callStartTime = std::chrono::steady_clock::now();
+	diskWriteStruct newWrite;
+	newWrite.targetNum = targetNum;
+	newWrite.byteOffset = byteOffset;
+	newWrite.writeData.assign(sourceData, sourceData + dataLength);
+	{
+		std::lock_guard<std::mutex> queueLock(queueMutex);
+		newWrite.sequenceNum = nextSequenceNum++;
+		writeQueue.push_back(std::move(newWrite));
+		writeTarget[targetNum].pendingWrites++;
+		writesQueued++;
+		if (writeQueue.size() > highestQueueDepth)
+			highestQueueDepth = writeQueue.size();
+	}
+	queueChanged.notify_all();
+	noteCallerWait(callStartTime);
+}
+
+void DiskWriteQueue::readThrough(int targetNum, uint64_t byteOffset, uint8_t* destData, uint32_t dataLength)
+{
+	// Reads from an image as if every queued write had already been made to it
+	if ((targetNum < 0) || (targetNum >= DISK_WRITE_MAX_TARGETS) || !writeTarget[targetNum].isOpen)
+	{
+		memset(destData, 0, dataLength);
+		return;
+	}
+
+	auto callStartTime = std::chrono::steady_clock::now();
+	{
+		// When the queue already holds everything being asked for (reading back sectors that were just written), that's the answer and the
+		// image file never has to be touched
+		std::lock_guard<std::mutex> queueLock(queueMutex);
+		if (overlayPendingWrites(targetNum, byteOffset, destData, dataLength))
+		{
+			noteCallerWait(callStartTime);
+			return;
+		}
+	}
+
+	{
+		// Otherwise read the image under this target's own lock, so only a write in progress on this same image can hold us up. The lock
+		// stays held while the queue is laid over the top, so nothing can move from the queue into the image in between.
+		std::lock_guard<std::mutex> ioLock(writeTarget[targetNum].ioMutex);
+		readImage(targetNum, byteOffset, destData, dataLength);
+		std::lock_guard<std::mutex> queueLock(queueMutex);
+		overlayPendingWrites(targetNum, byteOffset, destData, dataLength);
+	}
+	noteCallerWait(callStartTime);
+}
+
+bool DiskWriteQueue::overlayPendingWrites(int targetNum, uint64_t byteOffset, uint8_t* destData, uint32_t dataLength)
+{
+	// Must be called with queueMutex held. Anything still in the queue is newer than what's in the image, so lay it over the top in the
+	// order it was written. The write the I/O thread is working on stays at the front of the queue until it's done, so it's covered here
+	// either way. Returns true if the queued writes covered every byte of the range.
+	std::vector<std::pair<uint64_t, uint64_t>> coveredRanges;
+	for (diskWriteStruct& pendingWrite : writeQueue)
+	{
+		if (pendingWrite.targetNum != targetNum)
+			continue;
+		uint64_t overlapStart = (pendingWrite.byteOffset > byteOffset) ? pendingWrite.byteOffset : byteOffset;
+		uint64_t overlapEnd = ((pendingWrite.byteOffset + pendingWrite.writeData.size()) < (byteOffset + dataLength)) ? (pendingWrite.byteOffset + pendingWrite.writeData.size()) : (byteOffset + dataLength);
+		if (overlapStart < overlapEnd)
+		{
+			memcpy(destData + (overlapStart - byteOffset), pendingWrite.writeData.data() + (overlapStart - pendingWrite.byteOffset), overlapEnd - overlapStart);
+			coveredRanges.push_back({ overlapStart, overlapEnd });
+		}
+	}
+
+	std::sort(coveredRanges.begin(), coveredRanges.end());
+	uint64_t coveredUpTo = byteOffset;
+	for (std::pair<uint64_t, uint64_t>& curRange : coveredRanges)
+	{
+		if (curRange.first > coveredUpTo)
+			break;
+		if (curRange.second > coveredUpTo)
+			coveredUpTo = curRange.second;
+	}
+	return (coveredUpTo >= (byteOffset + dataLength));
+}
+
+void DiskWriteQueue::noteCallerWait(std::chrono::steady_clock::time_point callStartTime)
+{
+	uint32_t waitMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - callStartTime).count();
+	uint32_t prevLongest = longestCallerWaitMicroseconds;
+	while ((waitMicroseconds > prevLongest) && !longestCallerWaitMicroseconds.compare_exchange_weak(prevLongest, waitMicroseconds))
+		;
+}
+
+uint32_t DiskWriteQueue::takeFailedWrites(int targetNum)
+{
+	// How many writes to the target's image have failed since the last time this was called. The device reports them, since the I/O
+	// thread has no way to tell anyone on its own.
+	if ((targetNum < 0) || (targetNum >= DISK_WRITE_MAX_TARGETS))
+		return 0;
+	return writeTarget[targetNum].failedWrites.exchange(0);
+}
+
+bool DiskWriteQueue::hasPendingWrites(int targetNum)
+{
+	// When this is false, everything written to the target is already in the image file, so it can be read directly without readThrough()
+	if ((targetNum < 0) || (targetNum >= DISK_WRITE_MAX_TARGETS))
+		return false;
+	std::lock_guard<std::mutex> queueLock(queueMutex);
+	return (writeTarget[targetNum].pendingWrites > 0);
+}
+
+void DiskWriteQueue::flushBarrier()
+{
+	// Waits until every write queued so far has been made to its image
+	std::unique_lock<std::mutex> queueLock(queueMutex);
+	queueChanged.wait(queueLock, [this] { return writeQueue.empty() || !ioThreadRunning; });
+}
+
+void DiskWriteQueue::shutdownQueue()
+{
+	flushBarrier();
+	{
+		std::lock_guard<std::mutex> queueLock(queueMutex);
+		ioThreadRunning = false;
+	}
+	queueChanged.notify_all();
+	if (ioThread.joinable())
+		ioThread.join();
+
+	// Every write is in its image now, so the journals aren't needed anymore
+	for (int i = 0; i < DISK_WRITE_MAX_TARGETS; i++)
+	{
+		std::lock_guard<std::mutex> ioLock(writeTarget[i].ioMutex);
+		if (writeTarget[i].isOpen && (writeTarget[i].journalFile != nullptr))
+		{
+			fclose(writeTarget[i].journalFile);
+			remove(writeTarget[i].journalPathname.c_str());
+			writeTarget[i].journalFile = nullptr;
+		}
+	}
+}
+
+void DiskWriteQueue::ioThreadLoop()
+{
+	std::unique_lock<std::mutex> queueLock(queueMutex);
+	while (true)
+	{
+		queueChanged.wait(queueLock, [this] { return !writeQueue.empty() || !ioThreadRunning; });
+		if (writeQueue.empty())
+			break;		// Only gets here when we've been told to stop and there's nothing left to write
+
+		// Journal everything that's come in since last time before putting anything in an image, so a burst of writes is covered by the
+		// journal as soon as possible instead of one at a time. Elements of a deque don't move when more are pushed on the back, and
+		// only this thread ever pops them, so the pointers stay good after the lock is let go.
+		std::vector<diskWriteStruct*> unjournaledWrites;
+		for (size_t i = journaledWrites; i < writeQueue.size(); i++)
+			unjournaledWrites.push_back(&writeQueue[i]);
+		journaledWrites = writeQueue.size();
+
+		// Leave the write at the front of the queue while we work on it so readThrough() still sees it
+		diskWriteStruct& curWrite = writeQueue.front();
+		queueLock.unlock();
+
+		auto writeStartTime = std::chrono::steady_clock::now();
+		if (!unjournaledWrites.empty())
+		{
+			bool targetJournaled[DISK_WRITE_MAX_TARGETS] = { false };
+			for (diskWriteStruct* pendingWrite : unjournaledWrites)
+			{
+				journalWrite(*pendingWrite);
+				targetJournaled[pendingWrite->targetNum] = true;
+			}
+			for (int i = 0; i < DISK_WRITE_MAX_TARGETS; i++)
+				if (targetJournaled[i])
+				{
+					std::lock_guard<std::mutex> ioLock(writeTarget[i].ioMutex);
+					if (writeTarget[i].journalFile != nullptr)
+						fflush(writeTarget[i].journalFile);
+				}
+		}
+		bool writeSucceeded = true;
+		{
+			std::lock_guard<std::mutex> ioLock(writeTarget[curWrite.targetNum].ioMutex);
+			if (writeTarget[curWrite.targetNum].isOpen && !writeImage(curWrite.targetNum, curWrite.byteOffset, curWrite.writeData.data(), curWrite.writeData.size()))
+			{
+				writeTarget[curWrite.targetNum].failedWrites++;
+				writeSucceeded = false;
+			}
+		}
+		uint32_t writeMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - writeStartTime).count();
+		if (writeMicroseconds > longestWriteMicroseconds)
+			longestWriteMicroseconds = writeMicroseconds;
+
+		queueLock.lock();
+		writeTarget[writeQueue.front().targetNum].pendingWrites--;
+		writeQueue.pop_front();
+		journaledWrites--;
+		writesCompleted++;
+		if (!writeSucceeded)
+			writesFailed++;
+		bool queueDrained = writeQueue.empty();
+		queueChanged.notify_all();
+
+		if (queueDrained)
+		{
+			// Everything that's been journaled is in the images now, so start the journals over to keep them from growing forever
+			queueLock.unlock();
+			for (int i = 0; i < DISK_WRITE_MAX_TARGETS; i++)
+			{
+				std::lock_guard<std::mutex> ioLock(writeTarget[i].ioMutex);
+				if (writeTarget[i].isOpen && (writeTarget[i].journalRecords > 0))
+					emptyJournal(i);
+			}
+			queueLock.lock();
+		}
+	}
+}
+
+void DiskWriteQueue::journalWrite(diskWriteStruct& pendingWrite)
+{
+	// Appends one record to the target's journal. The caller flushes the journal once the whole batch is in.
+	std::lock_guard<std::mutex> ioLock(writeTarget[pendingWrite.targetNum].ioMutex);
+	diskWriteTargetStruct& target = writeTarget[pendingWrite.targetNum];
+	if (!target.isOpen || (target.journalFile == nullptr))
+		return;
+
+	uint8_t recordHeader[DISK_JOURNAL_HEADER_SIZE];
+	packLittleEndian(recordHeader, DISK_JOURNAL_RECORD_MAGIC, 4);
+	packLittleEndian(recordHeader + 4, pendingWrite.writeData.size(), 4);
+	packLittleEndian(recordHeader + 8, pendingWrite.byteOffset, 8);
+	packLittleEndian(recordHeader + 16, pendingWrite.sequenceNum, 8);
+	packLittleEndian(recordHeader + 24, calcRecordChecksum(pendingWrite.byteOffset, pendingWrite.writeData.data(), pendingWrite.writeData.size()), 4);
+	fwrite(recordHeader, 1, DISK_JOURNAL_HEADER_SIZE, target.journalFile);
+	fwrite(pendingWrite.writeData.data(), 1, pendingWrite.writeData.size(), target.journalFile);
+	target.journalRecords++;
+}
+
+void DiskWriteQueue::replayJournal(int targetNum)
+{
+	// Must be called with the target's ioMutex held
+	FILE* journalFile = fopen(writeTarget[targetNum].journalPathname.c_str(), "rb");
+	if (journalFile == nullptr)
+		return;
+
+	uint8_t recordHeader[DISK_JOURNAL_HEADER_SIZE];
+	std::vector<uint8_t> recordData;
+	while (fread(recordHeader, 1, DISK_JOURNAL_HEADER_SIZE, journalFile) == DISK_JOURNAL_HEADER_SIZE)
+	{
+		uint32_t recordMagic = unpackLittleEndian(recordHeader, 4);
+		uint32_t dataLength = unpackLittleEndian(recordHeader + 4, 4);
+		uint64_t byteOffset = unpackLittleEndian(recordHeader + 8, 8);
+		uint32_t recordChecksum = unpackLittleEndian(recordHeader + 24, 4);
+		if ((recordMagic != DISK_JOURNAL_RECORD_MAGIC) || (dataLength == 0) || (dataLength > 0x100000))
+			break;
+
+		// A record that's cut short or doesn't check out was being written when things went down, and it's the last one in the journal anyway
+		recordData.resize(dataLength);
+		if (fread(recordData.data(), 1, dataLength, journalFile) != dataLength)
+			break;
+		if (calcRecordChecksum(byteOffset, recordData.data(), dataLength) != recordChecksum)
+			break;
+
+		if (!writeImage(targetNum, byteOffset, recordData.data(), dataLength))
+			writeTarget[targetNum].failedWrites++;
+		recordsReplayed++;
+	}
+	fclose(journalFile);
+}
+
+void DiskWriteQueue::readImage(int targetNum, uint64_t byteOffset, uint8_t* destData, uint32_t dataLength)
+{
+	// Must be called with the target's ioMutex held
+	if (writeTarget[targetNum].imageOverlay != nullptr)
+	{
+		writeTarget[targetNum].imageOverlay->readData(byteOffset, destData, dataLength);
+		return;
+	}
+	if (writeTarget[targetNum].imageContainer != nullptr)
+	{
+		writeTarget[targetNum].imageContainer->readData(byteOffset, destData, dataLength);
+		return;
+	}
+	size_t bytesRead = readFileAt(writeTarget[targetNum].imageFile, byteOffset, destData, dataLength);
+	if (bytesRead < dataLength)
+		memset(destData + bytesRead, 0, dataLength - bytesRead);
+}
+
+bool DiskWriteQueue::writeImage(int targetNum, uint64_t byteOffset, const uint8_t* sourceData, uint32_t dataLength)
+{
+	// Must be called with the target's ioMutex held. Returns false if the host wouldn't take the write.
+	if (writeTarget[targetNum].imageOverlay != nullptr)
+		return writeTarget[targetNum].imageOverlay->writeData(byteOffset, sourceData, dataLength);
+	if (writeTarget[targetNum].imageContainer != nullptr)
+		return writeTarget[targetNum].imageContainer->writeData(byteOffset, sourceData, dataLength);
+	return (writeFileAt(writeTarget[targetNum].imageFile, byteOffset, sourceData, dataLength) == dataLength);
+}
+
+void DiskWriteQueue::emptyJournal(int targetNum)
+{
+	// Must be called with the target's ioMutex held
+	if (writeTarget[targetNum].journalFile != nullptr)
+		fclose(writeTarget[targetNum].journalFile);
+	writeTarget[targetNum].journalFile = fopen(writeTarget[targetNum].journalPathname.c_str(), "wb");
+	writeTarget[targetNum].journalRecords = 0;
+}
+
+uint32_t DiskWriteQueue::calcRecordChecksum(uint64_t byteOffset, const uint8_t* recordData, uint32_t dataLength)
+{
+	// 32-bit FNV-1a over the offset and the data, so a record that got torn or landed somewhere else doesn't get replayed
+	uint32_t checksum = 2166136261u;
+	for (int i = 0; i < 8; i++)
+	{
+		checksum ^= (byteOffset >> (i * 8)) & 0xFF;
+		checksum *= 16777619u;
+	}
+	for (uint32_t i = 0; i < dataLength; i++)
+	{
+		checksum ^= recordData[i];
+		checksum *= 16777619u;
+	}
+	return checksum;
+}
+
+bool DiskWriteQueue::runStressTest(std::string scratchPathname, uint32_t writeCount, diskStressResultStruct& results)
+{
+	// Hammers a scratch image with writes of random sizes and offsets through a queue of its own, the same way the emulation thread
+	// does, and times every call made from this thread. How long queueWrite() and readThrough() keep their caller waiting is the jitter
+	// the emulation thread would see. Every so often a range gets read back through the queue and checked, and the whole image is checked
+	// against what was written once the queue has drained.
+	constexpr uint32_t STRESS_IMAGE_SIZE = 8 * 1024 * 1024;
+	results = diskStressResultStruct();
+	FILE* scratchFile = fopen(scratchPathname.c_str(), "wb+");
+	if (scratchFile == nullptr)
+		return false;
+
+	std::vector<uint8_t> expectedImage(STRESS_IMAGE_SIZE, 0);
+	std::vector<uint8_t> writeBuffer, readBuffer;
+	std::mt19937 randomGen(0x6809);
+	uint64_t totalQueueWriteMicroseconds = 0;
+	auto testStartTime = std::chrono::steady_clock::now();
+	{
+		DiskWriteQueue testQueue;
+		int targetNum = testQueue.openTarget(scratchFile, scratchPathname);
+		for (uint32_t i = 0; i < writeCount; i++)
+		{
+			uint32_t sectorCount = 1 + (randomGen() % 64);
+			uint32_t byteOffset = (randomGen() % ((STRESS_IMAGE_SIZE / 256) - sectorCount)) * 256;
+			writeBuffer.resize(sectorCount * 256);
+			for (uint8_t& curByte : writeBuffer)
+				curByte = randomGen() & 0xFF;
+			memcpy(expectedImage.data() + byteOffset, writeBuffer.data(), writeBuffer.size());
+
+			auto callStartTime = std::chrono::steady_clock::now();
+			testQueue.queueWrite(targetNum, byteOffset, writeBuffer.data(), writeBuffer.size());
+			uint32_t callMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - callStartTime).count();
+			totalQueueWriteMicroseconds += callMicroseconds;
+			if (callMicroseconds > results.longestQueueWriteMicroseconds)
+				results.longestQueueWriteMicroseconds = callMicroseconds;
+			results.writesQueued++;
+
+			if ((i % 8) == 7)
+			{
+				uint32_t readOffset = (randomGen() % ((STRESS_IMAGE_SIZE / 256) - 16)) * 256;
+				readBuffer.resize(16 * 256);
+				callStartTime = std::chrono::steady_clock::now();
+				testQueue.readThrough(targetNum, readOffset, readBuffer.data(), readBuffer.size());
+				callMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - callStartTime).count();
+				if (callMicroseconds > results.longestReadThroughMicroseconds)
+					results.longestReadThroughMicroseconds = callMicroseconds;
+				results.readsChecked++;
+				if (memcmp(readBuffer.data(), expectedImage.data() + readOffset, readBuffer.size()) != 0)
+					results.mismatchedReads++;
+			}
+		}
+		testQueue.flushBarrier();
+		results.longestImageWriteMicroseconds = testQueue.longestWriteMicroseconds;
+		testQueue.closeTarget(targetNum);
+	}
+	results.totalMilliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - testStartTime).count();
+	if (results.writesQueued > 0)
+		results.averageQueueWriteMicroseconds = totalQueueWriteMicroseconds / results.writesQueued;
+
+	readBuffer.resize(STRESS_IMAGE_SIZE);
+	size_t bytesRead = readFileAt(scratchFile, 0, readBuffer.data(), STRESS_IMAGE_SIZE);
+	if (bytesRead < STRESS_IMAGE_SIZE)
+		memset(readBuffer.data() + bytesRead, 0, STRESS_IMAGE_SIZE - bytesRead);
+	results.imageVerified = (memcmp(readBuffer.data(), expectedImage.data(), STRESS_IMAGE_SIZE) == 0);
+	fclose(scratchFile);
+	remove(scratchPathname.c_str());
+	return true;
+}
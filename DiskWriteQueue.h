@@ -0,0 +1,103 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+class DiskOverlay;
+class CompressedDisk;
+
+constexpr int DISK_WRITE_MAX_TARGETS			= 16;		// Every mounted floppy and hard drive image gets one
+constexpr int DISK_WRITE_NO_TARGET				= -1;
+constexpr uint32_t DISK_JOURNAL_RECORD_MAGIC	= 0x4C4E4A43;	// "CJNL" in little-endian
+constexpr unsigned int DISK_JOURNAL_HEADER_SIZE	= 28;			// Magic, data length, byte offset, sequence number, checksum
+
+// One write waiting to be put on the host's disk
+struct diskWriteStruct
+{
+	int targetNum;
+	uint64_t byteOffset;
+	uint64_t sequenceNum;
+	std::vector<uint8_t> writeData;
+};
+
+// What runStressTest() found
+struct diskStressResultStruct
+{
+	uint32_t writesQueued = 0, readsChecked = 0, mismatchedReads = 0;
+	uint32_t longestQueueWriteMicroseconds = 0, averageQueueWriteMicroseconds = 0;
+	uint32_t longestReadThroughMicroseconds = 0;
+	uint32_t longestImageWriteMicroseconds = 0;
+	uint32_t totalMilliseconds = 0;
+	bool imageVerified = false;
+};
+
+struct diskWriteTargetStruct
+{
+	bool isOpen = false;
+	FILE* imageFile = nullptr;		// Owned by the device that mounted the image, we just write to it
+	DiskOverlay* imageOverlay = nullptr;	// Set instead of imageFile when the image is mounted as a copy-on-write overlay
+	CompressedDisk* imageContainer = nullptr;	// Set instead of imageFile when the image is a compressed container
+	FILE* journalFile = nullptr;
+	std::string journalPathname;
+	uint32_t journalRecords = 0;	// Records appended since the journal was last emptied
+	uint32_t pendingWrites = 0;		// Writes queued for this target that haven't been made to the image yet
+	std::atomic<uint32_t> failedWrites = 0;	// Writes the host wouldn't take since the device last asked with takeFailedWrites()
+	std::mutex ioMutex;				// Held around every read or write of this target's image and journal, since both threads use the same files
+};
+
+// Takes disk image writes off the emulation thread. A background I/O thread appends each write to a journal file next to the image and
+// flushes it, then applies it to the image itself. If the emulator dies before a journaled write makes it into the image, it gets replayed
+// from the journal the next time the image is mounted. The I/O thread journals everything waiting in the queue before it touches any
+// image, but a write that was queued in the last few milliseconds before a crash may not have been journaled yet and can still be lost.
+// The journal is only fflush'ed, so getting it onto the platter across a host power loss is up to the OS.
+class DiskWriteQueue
+{
+public:
+	DiskWriteQueue();
+	~DiskWriteQueue();
+
+	int openTarget(FILE*, std::string);
+	int openTarget(DiskOverlay*, std::string);
+	int openTarget(CompressedDisk*, std::string);
+	void closeTarget(int);
+	void queueWrite(int, uint64_t, const uint8_t*, uint32_t);
+	void readThrough(int, uint64_t, uint8_t*, uint32_t);
+	bool hasPendingWrites(int);
+	uint32_t takeFailedWrites(int);
+	void flushBarrier();
+	void shutdownQueue();
+	static bool runStressTest(std::string, uint32_t, diskStressResultStruct&);
+
+	uint64_t writesQueued, writesCompleted, writesFailed, recordsReplayed;
+	uint32_t highestQueueDepth;
+	std::atomic<uint32_t> longestWriteMicroseconds;		// Longest the I/O thread took to journal and apply a single write
+	std::atomic<uint32_t> longestCallerWaitMicroseconds;	// Longest a queueWrite() or readThrough() call held up whoever made it, usually the emulation thread
+
+private:
+	diskWriteTargetStruct writeTarget[DISK_WRITE_MAX_TARGETS];
+	std::deque<diskWriteStruct> writeQueue;
+	std::mutex queueMutex;			// Protects writeQueue and the counters. When both are needed, a target's ioMutex is always taken first.
+	std::condition_variable queueChanged;
+	std::thread ioThread;
+	bool ioThreadRunning;
+	uint64_t nextSequenceNum;
+	size_t journaledWrites;			// How many writes at the front of the queue the I/O thread has already journaled
+
+	int openTargetSlot(FILE*, DiskOverlay*, CompressedDisk*, std::string);
+	void ioThreadLoop();
+	void journalWrite(diskWriteStruct&);
+	bool overlayPendingWrites(int, uint64_t, uint8_t*, uint32_t);
+	void noteCallerWait(std::chrono::steady_clock::time_point);
+	void readImage(int, uint64_t, uint8_t*, uint32_t);
+	bool writeImage(int, uint64_t, const uint8_t*, uint32_t);
+	void replayJournal(int);
+	void emptyJournal(int);
+	uint32_t calcRecordChecksum(uint64_t, const uint8_t*, uint32_t);
+};
@@ -1,24 +1,73 @@
+#include <cstring>
+#include <algorithm>
 #include "GimeBus.h"
+#include "DiskFileIO.h"
 #include "EmuDisk.h"
 
 EmuDisk::EmuDisk()
 {
 	nextLogicalSector.zeroByte = 0;		// By the least significant byte always being zero, this effectively multiplies our LSN sector number by 256 which is our sector size in bytes
 	isEnabled = false;
+	sectorCountReg = 1;
+	transferBuffer.resize(EMUDISK_MAX_SECTOR_COUNT * 256);
 }
 
 uint8_t EmuDisk::vhdMountDisk(uint8_t driveNum, std::string diskImageFilePath)
 {
+	if (driveNum >= EMUDISK_MAX_DRIVES)
+		return EMUDISK_ERROR_INVALID_DRIVE_NUM;
 	// If HDD image already mounted, close it and try to mount new one
 	if (emuDiskDrive[driveNum].imageMounted)
 		vhdEjectDisk(driveNum);
 
-	emuDiskDrive[driveNum].vhdImageFile = fopen(diskImageFilePath.c_str(), "rb+");
-	if (emuDiskDrive[driveNum].vhdImageFile == NULL)
+	if (CompressedDisk::isCompressedImage(diskImageFilePath))
+	{
+		// Compressed containers are read and written a block at a time through the container, never mapped. The delta file of an overlay
+		// holds raw sectors against a raw base image, so the two can't be combined.
+		if (!gimeBus->diskOverlayTag.empty())
+			return EMUDISK_ERROR_UNSUPPORTED_DISK_IMAGE;
+		emuDiskDrive[driveNum].vhdImageFile = nullptr;
+		emuDiskDrive[driveNum].vhdContainer = new CompressedDisk();
+		if (emuDiskDrive[driveNum].vhdContainer->openImage(diskImageFilePath) != COMPRESSED_DISK_OPERATION_COMPLETE)
+		{
+			delete emuDiskDrive[driveNum].vhdContainer;
+			emuDiskDrive[driveNum].vhdContainer = nullptr;
+			return EMUDISK_ERROR_UNSUPPORTED_DISK_IMAGE;
+		}
+		emuDiskDrive[driveNum].writeTarget = gimeBus->diskWriteQueue.openTarget(emuDiskDrive[driveNum].vhdContainer, diskImageFilePath);
+		emuDiskDrive[driveNum].diskImageFilesize = emuDiskDrive[driveNum].vhdContainer->imageFilesize;
+	}
+	else if (gimeBus->diskOverlayTag.empty())
+	{
+		emuDiskDrive[driveNum].vhdImageFile = fopen(diskImageFilePath.c_str(), "rb+");
+		if (emuDiskDrive[driveNum].vhdImageFile == NULL)
+			return EMUDISK_ERROR_OPENING_DISK_IMAGE;
+		// Sector writes go through the bus's write queue, which also replays anything a crash kept from making it into the image last time
+		emuDiskDrive[driveNum].writeTarget = gimeBus->diskWriteQueue.openTarget(emuDiskDrive[driveNum].vhdImageFile, diskImageFilePath);
+		emuDiskDrive[driveNum].diskImageFilesize = getFileSize64(emuDiskDrive[driveNum].vhdImageFile);		// .VHD files can run right up to 4 GB
+		emuDiskDrive[driveNum].vhdMapping.mapFile(diskImageFilePath);		// If this fails, reads just go through the file handle instead
+	}
+	else
+	{
+		// Overlay mode never writes to the image file itself, our writes go to a delta file named after this instance's overlay tag
+		emuDiskDrive[driveNum].vhdImageFile = nullptr;
+		emuDiskDrive[driveNum].vhdOverlay = new DiskOverlay();
+		if (emuDiskDrive[driveNum].vhdOverlay->openOverlay(diskImageFilePath, diskImageFilePath + "." + gimeBus->diskOverlayTag + ".delta") != DISK_OVERLAY_OPERATION_COMPLETE)
+		{
+			delete emuDiskDrive[driveNum].vhdOverlay;
+			emuDiskDrive[driveNum].vhdOverlay = nullptr;
+			return EMUDISK_ERROR_OPENING_DISK_IMAGE;
+		}
+		emuDiskDrive[driveNum].writeTarget = gimeBus->diskWriteQueue.openTarget(emuDiskDrive[driveNum].vhdOverlay, emuDiskDrive[driveNum].vhdOverlay->deltaPathname);
+		emuDiskDrive[driveNum].diskImageFilesize = emuDiskDrive[driveNum].vhdOverlay->baseFilesize;
+	}
+	if (emuDiskDrive[driveNum].writeTarget == DISK_WRITE_NO_TARGET)
+	{
+		closeImageFile(driveNum);
 		return EMUDISK_ERROR_OPENING_DISK_IMAGE;
+	}
 
-	fseek(emuDiskDrive[driveNum].vhdImageFile, 0, SEEK_END);
-	emuDiskDrive[driveNum].diskImageFilesize = ftell(emuDiskDrive[driveNum].vhdImageFile);
+	emuDiskDrive[driveNum].vhdCache.attachImage(&gimeBus->diskWriteQueue, emuDiskDrive[driveNum].writeTarget, &emuDiskDrive[driveNum].vhdMapping, emuDiskDrive[driveNum].diskImageFilesize);
 	emuDiskDrive[driveNum].imageMounted = true;
 	emuDiskDrive[driveNum].imgFilePathname = diskImageFilePath;
 	return EMUDISK_OPERATION_COMPLETE;
@@ -28,16 +77,111 @@ uint8_t EmuDisk::vhdEjectDisk(uint8_t driveNum)
 {
 	if (!isEnabled)
 		return EMUDISK_ERROR_NOT_ENABLED;
+	if (driveNum >= EMUDISK_MAX_DRIVES)
+		return EMUDISK_ERROR_INVALID_DRIVE_NUM;
 	if (!emuDiskDrive[driveNum].imageMounted)
 		return EMUDISK_ERROR_NO_DISK_MOUNTED;
 
-	fclose(emuDiskDrive[driveNum].vhdImageFile);
+	closeImageFile(driveNum);
 	emuDiskDrive[driveNum].imgFilePathname.clear();
 	emuDiskDrive[driveNum].diskImageFilesize = 0;
 	emuDiskDrive[driveNum].imageMounted = false;
 	return EMUDISK_OPERATION_COMPLETE;
 }
 
+uint8_t EmuDisk::vhdCommitOverlay(uint8_t driveNum)
+{
+	if (!isEnabled)
+		return EMUDISK_ERROR_NOT_ENABLED;
+	if (driveNum >= EMUDISK_MAX_DRIVES)
+		return EMUDISK_ERROR_INVALID_DRIVE_NUM;
+	if (!emuDiskDrive[driveNum].imageMounted)
+		return EMUDISK_ERROR_NO_DISK_MOUNTED;
+	if (emuDiskDrive[driveNum].vhdOverlay == nullptr)
+		return EMUDISK_ERROR_NOT_OVERLAY;
+
+	// Let the cached and queued writes land in the delta, then copy the delta into the base image
+	emuDiskDrive[driveNum].vhdCache.flushCache();
+	gimeBus->diskWriteQueue.flushBarrier();
+	uint8_t commitStatus = emuDiskDrive[driveNum].vhdOverlay->commitOverlay();
+	if (commitStatus == DISK_OVERLAY_ERROR_WRITING_BASE)
+		return EMUDISK_ERROR_WRITING_DISK_IMAGE;		// The delta is still there, so nothing the CoCo wrote has been lost
+	if (commitStatus != DISK_OVERLAY_OPERATION_COMPLETE)
+		return EMUDISK_ERROR_OPENING_DISK_IMAGE;
+	return EMUDISK_OPERATION_COMPLETE;
+}
+
+uint8_t EmuDisk::vhdDiscardOverlay(uint8_t driveNum)
+{
+	if (!isEnabled)
+		return EMUDISK_ERROR_NOT_ENABLED;
+	if (driveNum >= EMUDISK_MAX_DRIVES)
+		return EMUDISK_ERROR_INVALID_DRIVE_NUM;
+	if (!emuDiskDrive[driveNum].imageMounted)
+		return EMUDISK_ERROR_NO_DISK_MOUNTED;
+	if (emuDiskDrive[driveNum].vhdOverlay == nullptr)
+		return EMUDISK_ERROR_NOT_OVERLAY;
+
+	emuDiskDrive[driveNum].vhdCache.invalidateCache();		// Cached writes get thrown away along with the delta
+	gimeBus->diskWriteQueue.flushBarrier();
+	if (emuDiskDrive[driveNum].vhdOverlay->discardOverlay() != DISK_OVERLAY_OPERATION_COMPLETE)
+	{
+		vhdEjectDisk(driveNum);
+		return EMUDISK_ERROR_OPENING_DISK_IMAGE;
+	}
+	return EMUDISK_OPERATION_COMPLETE;
+}
+
+void EmuDisk::vhdFlushAllCaches()
+{
+	// Hands sectors written into the caches over to the write queue, called every so often from the UI thread and on exit
+	for (int i = 0; i < EMUDISK_MAX_DRIVES; i++)
+		if (emuDiskDrive[i].imageMounted)
+			emuDiskDrive[i].vhdCache.flushCache();
+}
+
+void EmuDisk::vhdFlushDisk(uint8_t driveNum)
+{
+	// Gets everything written to this drive out of its cache and write queue and into the file, for when something is about to read the
+	// image straight off the host
+	emuDiskDrive[driveNum].vhdCache.flushCache();
+	gimeBus->diskWriteQueue.flushBarrier();
+}
+
+int EmuDisk::findDriveUsingFile(std::string filePathname)
+{
+	// Returns the drive that has this file mounted as its image or as the base or delta of its overlay, or -1 if none of them do
+	for (int i = 0; i < EMUDISK_MAX_DRIVES; i++)
+	{
+		if (!emuDiskDrive[i].imageMounted)
+			continue;
+		if (isSameHostFile(filePathname, emuDiskDrive[i].imgFilePathname))
+			return i;
+		if ((emuDiskDrive[i].vhdOverlay != nullptr) && (isSameHostFile(filePathname, emuDiskDrive[i].vhdOverlay->basePathname) ||
+			isSameHostFile(filePathname, emuDiskDrive[i].vhdOverlay->deltaPathname)))
+			return i;
+	}
+	return -1;
+}
+
+void EmuDisk::closeImageFile(uint8_t driveNum)
+{
+	// Writes back anything still in the cache, then waits for any writes still queued for this image before we close it
+	emuDiskDrive[driveNum].vhdCache.detachImage();
+	gimeBus->diskWriteQueue.closeTarget(emuDiskDrive[driveNum].writeTarget);
+	emuDiskDrive[driveNum].writeTarget = DISK_WRITE_NO_TARGET;
+	if (emuDiskDrive[driveNum].vhdImageFile != nullptr)
+		fclose(emuDiskDrive[driveNum].vhdImageFile);
+	emuDiskDrive[driveNum].vhdImageFile = nullptr;
+	emuDiskDrive[driveNum].vhdMapping.unmapFile();
+	if (emuDiskDrive[driveNum].vhdOverlay != nullptr)
+		delete emuDiskDrive[driveNum].vhdOverlay;		// The delta file is left behind so this instance can pick it back up later
+	emuDiskDrive[driveNum].vhdOverlay = nullptr;
+	if (emuDiskDrive[driveNum].vhdContainer != nullptr)
+		delete emuDiskDrive[driveNum].vhdContainer;
+	emuDiskDrive[driveNum].vhdContainer = nullptr;
+}
+
 void EmuDisk::registerWrite(uint16_t regAddress, uint8_t paramByte)
 {
 	switch (regAddress)
@@ -60,15 +204,23 @@ void EmuDisk::registerWrite(uint16_t regAddress, uint8_t paramByte)
 		{
 		case 0x00:
 			// Read Sector Command
-			statusCode = readSector();
+			statusCode = readSectors(1);
 			break;
 		case 0x01:
 			// Write Sector Command
-			statusCode = writeSector();
+			statusCode = writeSectors(1);
 			break;
 		case 0x02:
 			// Close 
 			break;
+		case 0x03:
+			// Read Multiple Sectors Command. Reads the number of contiguous sectors in the Sector Count register into consecutive 256-byte blocks at the buffer pointer.
+			statusCode = readSectors(sectorCountReg);
+			break;
+		case 0x04:
+			// Write Multiple Sectors Command
+			statusCode = writeSectors(sectorCountReg);
+			break;
 		default:
 			statusCode = EMUDISK_STATUS_ERROR_INVALID_CMD;
 			break;
@@ -84,58 +236,222 @@ void EmuDisk::registerWrite(uint16_t regAddress, uint8_t paramByte)
 	case 0xFF86:
 		vhdDriveNum = paramByte;
 		break;
+	case 0xFF87:
+		// Sector Count for the multiple sector commands
+		sectorCountReg = paramByte;
+		break;
 	}
 }
 
-uint8_t EmuDisk::readSector()
+uint8_t EmuDisk::readSectors(uint8_t sectorCount)
 {
-	if (vhdDriveNum > 0x01)
+	if (vhdDriveNum >= EMUDISK_MAX_DRIVES)
 		return EMUDISK_STATUS_ERROR_INVALID_DRV_NUM;					// Invalid Virtual HDD drive number
 	else if (!emuDiskDrive[vhdDriveNum].imageMounted)
 		return EMUDISK_STATUS_ERROR_NOT_ENABLED;
 	else
 	{
-		if (nextLogicalSector.byteOffset <= (emuDiskDrive[vhdDriveNum].diskImageFilesize - 256))
+		uint64_t startOffset = nextLogicalSector.byteOffset;
+		uint32_t validSectors = getValidSectorCount(startOffset, sectorCount);
+		uint32_t validLength = validSectors * 256;
+		if (validSectors > 0)
 		{
-			// Requested LSN is not greater than our filesize and therefore valid. Seek to it and grab the 256-byte sector from .VHD file
-			fseek(emuDiskDrive[vhdDriveNum].vhdImageFile, nextLogicalSector.byteOffset, SEEK_SET);
-			fread(&sectorBuffer, 1, 256, emuDiskDrive[vhdDriveNum].vhdImageFile);
-			snprintf(textBuffer, sizeof(textBuffer), "EmuDisk: Read from Logical Sector Number %02X%02X%02X", nextLogicalSector.highByte, nextLogicalSector.middleByte, nextLogicalSector.lowByte);
+			// Requested LSNs are not greater than our filesize and therefore valid. They come from the block cache when it's turned on. Otherwise if the
+			// .VHD file is mapped and has nothing still waiting to be written to it, the sectors get copied right out of the mapping, and if not, grab
+			// them with any queued writes to them laid on top.
+			const uint8_t* sectorDataPtr = transferBuffer.data();
+			if (emuDiskDrive[vhdDriveNum].vhdCache.isEnabled())
+				emuDiskDrive[vhdDriveNum].vhdCache.readData(startOffset, transferBuffer.data(), validLength);
+			else if (emuDiskDrive[vhdDriveNum].vhdMapping.isMapped() && ((startOffset + validLength) <= emuDiskDrive[vhdDriveNum].vhdMapping.mappedSize) &&
+				!gimeBus->diskWriteQueue.hasPendingWrites(emuDiskDrive[vhdDriveNum].writeTarget))
+				sectorDataPtr = emuDiskDrive[vhdDriveNum].vhdMapping.mappedData + startOffset;
+			else
+				gimeBus->diskWriteQueue.readThrough(emuDiskDrive[vhdDriveNum].writeTarget, startOffset, transferBuffer.data(), validLength);
+			if (sectorCount == 1)
+				snprintf(textBuffer, sizeof(textBuffer), "EmuDisk: Read from Logical Sector Number %02X%02X%02X", nextLogicalSector.highByte, nextLogicalSector.middleByte, nextLogicalSector.lowByte);
+			else
+				snprintf(textBuffer, sizeof(textBuffer), "EmuDisk: Read %u sectors from Logical Sector Number %02X%02X%02X", sectorCount, nextLogicalSector.highByte, nextLogicalSector.middleByte, nextLogicalSector.lowByte);
 			gimeBus->statusBarText = textBuffer;
-			// Now copy our populated internal sectorBuffer data to it's destination within CoCo memory space
-			for (uint16_t i = 0; i < 256; i++)
-				gimeBus->writePhysicalByte(dataBufferPtr.bufferPtr + i, sectorBuffer[i]);
+			// Now copy the sectors to their destination within CoCo memory space
+			gimeBus->writePhysicalBlock(dataBufferPtr.bufferPtr, sectorDataPtr, validLength);
 		}
-		else
+		if (validSectors < sectorCount)
 		{
 			// If the requested LSN does not exist within our .VHD file, return a zero-ed out sector (This is the behavoir i've observed MAME doing in this situation)
-			for (uint16_t i = 0; i < 256; i++)
-				gimeBus->writePhysicalByte(dataBufferPtr.bufferPtr + i, 0x00);
+			memset(transferBuffer.data(), 0, (sectorCount - validSectors) * 256);
+			gimeBus->writePhysicalBlock(dataBufferPtr.bufferPtr + validLength, transferBuffer.data(), (sectorCount - validSectors) * 256);
 		}
 		return EMUDISK_STATUS_SUCCESSFUL;
 	}
 }
 
-uint8_t EmuDisk::writeSector()
+uint8_t EmuDisk::writeSectors(uint8_t sectorCount)
 {
-	if (vhdDriveNum > 0x01)
+	if (vhdDriveNum >= EMUDISK_MAX_DRIVES)
 		return EMUDISK_STATUS_ERROR_INVALID_DRV_NUM;					// Invalid Virtual HDD drive number
 	else if (!emuDiskDrive[vhdDriveNum].imageMounted)
 		return EMUDISK_STATUS_ERROR_NOT_ENABLED;
 	else
 	{
-		if (nextLogicalSector.byteOffset <= (emuDiskDrive[vhdDriveNum].diskImageFilesize - 256))
+		// Writes to LSNs past the end of the .VHD file are dropped, the same as they always have been
+		uint64_t startOffset = nextLogicalSector.byteOffset;
+		uint32_t validSectors = getValidSectorCount(startOffset, sectorCount);
+		if (validSectors > 0)
 		{
-			// First copy our source sector data from CoCo memory space to our temp sectorBuffer
-			for (uint16_t i = 0; i < 256; i++)
-				sectorBuffer[i] = gimeBus->readPhysicalByte(dataBufferPtr.bufferPtr + i);
-			// Requested LSN is not greater than our filesize and therefore valid. Seek to it's position and write the 256-byte sector to the .VHD file
-			fseek(emuDiskDrive[vhdDriveNum].vhdImageFile, nextLogicalSector.byteOffset, SEEK_SET);
-			fwrite(&sectorBuffer, 1, 256, emuDiskDrive[vhdDriveNum].vhdImageFile);
-			snprintf(textBuffer, sizeof(textBuffer), "EmuDisk: Wrote to Logical Sector Number %02X%02X%02X", nextLogicalSector.highByte, nextLogicalSector.middleByte, nextLogicalSector.lowByte);
+			// First copy our source sector data from CoCo memory space to our temp transferBuffer
+			gimeBus->readPhysicalBlock(dataBufferPtr.bufferPtr, transferBuffer.data(), validSectors * 256);
+			// Then put it in the cache, which queues it right away unless it's in write-back mode, or hand all of it to the write queue as one
+			// write if there's no cache
+			if (emuDiskDrive[vhdDriveNum].vhdCache.isEnabled())
+				emuDiskDrive[vhdDriveNum].vhdCache.writeData(startOffset, transferBuffer.data(), validSectors * 256);
+			else
+				gimeBus->diskWriteQueue.queueWrite(emuDiskDrive[vhdDriveNum].writeTarget, startOffset, transferBuffer.data(), validSectors * 256);
+			if (sectorCount == 1)
+				snprintf(textBuffer, sizeof(textBuffer), "EmuDisk: Wrote to Logical Sector Number %02X%02X%02X", nextLogicalSector.highByte, nextLogicalSector.middleByte, nextLogicalSector.lowByte);
+			else
+				snprintf(textBuffer, sizeof(textBuffer), "EmuDisk: Wrote %u sectors to Logical Sector Number %02X%02X%02X", sectorCount, nextLogicalSector.highByte, nextLogicalSector.middleByte, nextLogicalSector.lowByte);
 			gimeBus->statusBarText = textBuffer;
 		}
 		return EMUDISK_STATUS_SUCCESSFUL;
 	}
 }
 
+uint32_t EmuDisk::getValidSectorCount(uint64_t startOffset, uint8_t sectorCount)
+{
+	// How many of the requested sectors, starting at startOffset, actually exist within the mounted .VHD file. The highest 24-bit LSN ends
+	// right at 4 GB, so all of this has to be done in 64 bits, and a multiple sector command isn't allowed to run on past that LSN into the
+	// part of a bigger image that no LSN can reach.
+	uint64_t imageFilesize = std::min(emuDiskDrive[vhdDriveNum].diskImageFilesize, EMUDISK_MAX_ADDRESSABLE_BYTES);
+	if ((startOffset + 256) > imageFilesize)
+		return 0;
+	uint64_t sectorsToEnd = (imageFilesize - startOffset) / 256;
+	return (sectorsToEnd < sectorCount) ? (uint32_t)sectorsToEnd : sectorCount;
+}
+
+bool EmuDisk::selfTestLargeImage(std::string scratchPathname, std::string& failureReason)
+{
+	// Mounts a sparse scratch image a bit over 4 GB on a free drive and runs real sector commands against it, the same way the CoCo would,
+	// so the LSN to byte offset math and getValidSectorCount() get checked along with the file I/O underneath. LSN $FFFFFF is written,
+	// flushed, checked in the file itself and read back. Then a two sector command starting there has to be cut off after the first
+	// sector, leaving the file untouched past 4 GB and reading the second sector back as zeros. Everything the commands touch (registers,
+	// the CoCo memory they use, the status bar) is put back the way it was, and the scratch image is deleted.
+	constexpr uint64_t TEST_IMAGE_SIZE = EMUDISK_MAX_ADDRESSABLE_BYTES + 0x10000;
+	constexpr uint32_t LAST_LSN = 0xFFFFFF;
+	int testDrive = -1;
+	for (int i = EMUDISK_MAX_DRIVES - 1; (i >= 0) && (testDrive < 0); i--)
+		if (!emuDiskDrive[i].imageMounted)
+			testDrive = i;
+	if (testDrive < 0)
+	{
+		failureReason = "every HDD has an image mounted, so there's no drive free to test with";
+		return false;
+	}
+
+	FILE* scratchFile = fopen(scratchPathname.c_str(), "wb");
+	if (scratchFile == nullptr)
+	{
+		failureReason = "could not create " + scratchPathname;
+		return false;
+	}
+	setFileSparse(scratchFile);
+	uint8_t zeroByte = 0;
+	bool fileCreated = (writeFileAt(scratchFile, TEST_IMAGE_SIZE - 1, &zeroByte, 1) == 1);
+	if ((fclose(scratchFile) != 0) || !fileCreated)
+	{
+		remove(scratchPathname.c_str());
+		failureReason = "could not make " + scratchPathname + " big enough";
+		return false;
+	}
+	if (vhdMountDisk(testDrive, scratchPathname) != EMUDISK_OPERATION_COMPLETE)
+	{
+		remove(scratchPathname.c_str());
+		failureReason = "could not mount " + scratchPathname;
+		return false;
+	}
+
+	uint8_t savedDriveNum = vhdDriveNum, savedStatusCode = statusCode, savedSectorCount = sectorCountReg;
+	uint32_t savedLogicalSector = nextLogicalSector.byteOffset;
+	uint16_t savedBufferPtr = dataBufferPtr.bufferPtr;
+	std::string savedStatusBarText = gimeBus->statusBarText;
+	uint8_t savedMemory[512], testSectors[512], readBack[512], fileData[256];
+	gimeBus->readPhysicalBlock(EMUDISK_SELF_TEST_BUFFER, savedMemory, sizeof(savedMemory));
+
+	vhdDriveNum = testDrive;
+	dataBufferPtr.bufferPtr = EMUDISK_SELF_TEST_BUFFER;
+	nextLogicalSector.byteOffset = LAST_LSN << 8;
+	bool testPassed = true;
+
+	// Write the last LSN on its own, then read it back both from the file and through a Read Sector command
+	for (int i = 0; i < 256; i++)
+		testSectors[i] = (uint8_t)(i * 7 + 1);
+	gimeBus->writePhysicalBlock(EMUDISK_SELF_TEST_BUFFER, testSectors, 256);
+	if (writeSectors(1) != EMUDISK_STATUS_SUCCESSFUL)
+	{
+		failureReason = "writing LSN $FFFFFF returned an error";
+		testPassed = false;
+	}
+	vhdFlushDisk(testDrive);
+	gimeBus->diskWriteQueue.readThrough(emuDiskDrive[testDrive].writeTarget, (uint64_t)LAST_LSN * 256, fileData, 256);
+	if (testPassed && (memcmp(fileData, testSectors, 256) != 0))
+	{
+		failureReason = "LSN $FFFFFF didn't land at offset $FFFFFF00 of the image";
+		testPassed = false;
+	}
+	memset(readBack, 0xFF, 256);
+	gimeBus->writePhysicalBlock(EMUDISK_SELF_TEST_BUFFER, readBack, 256);
+	uint8_t readStatus = readSectors(1);
+	gimeBus->readPhysicalBlock(EMUDISK_SELF_TEST_BUFFER, readBack, 256);
+	if (testPassed && ((readStatus != EMUDISK_STATUS_SUCCESSFUL) || (memcmp(readBack, testSectors, 256) != 0)))
+	{
+		failureReason = "reading LSN $FFFFFF back didn't return what was written";
+		testPassed = false;
+	}
+
+	// A two sector command starting at the last LSN runs off the end of what an LSN can reach, even though the image goes further.
+	// Only its first sector may be written, and the second has to read back as zeros.
+	for (int i = 0; i < 512; i++)
+		testSectors[i] = (uint8_t)(i * 11 + 3);
+	gimeBus->writePhysicalBlock(EMUDISK_SELF_TEST_BUFFER, testSectors, 512);
+	sectorCountReg = 2;
+	if (testPassed && (writeSectors(sectorCountReg) != EMUDISK_STATUS_SUCCESSFUL))
+	{
+		failureReason = "writing two sectors at LSN $FFFFFF returned an error";
+		testPassed = false;
+	}
+	vhdFlushDisk(testDrive);
+	uint8_t zeroSector[256] = { 0 };
+	gimeBus->diskWriteQueue.readThrough(emuDiskDrive[testDrive].writeTarget, EMUDISK_MAX_ADDRESSABLE_BYTES, fileData, 256);
+	if (testPassed && (memcmp(fileData, zeroSector, 256) != 0))
+	{
+		failureReason = "a write running past LSN $FFFFFF wasn't stopped at 4 GB";
+		testPassed = false;
+	}
+	memset(readBack, 0xFF, 512);
+	gimeBus->writePhysicalBlock(EMUDISK_SELF_TEST_BUFFER, readBack, 512);
+	readStatus = readSectors(sectorCountReg);
+	gimeBus->readPhysicalBlock(EMUDISK_SELF_TEST_BUFFER, readBack, 512);
+	if (testPassed && ((readStatus != EMUDISK_STATUS_SUCCESSFUL) || (memcmp(readBack, testSectors, 256) != 0) || (memcmp(readBack + 256, zeroSector, 256) != 0)))
+	{
+		failureReason = "a read running past LSN $FFFFFF didn't stop at 4 GB";
+		testPassed = false;
+	}
+
+	gimeBus->writePhysicalBlock(EMUDISK_SELF_TEST_BUFFER, savedMemory, sizeof(savedMemory));
+	vhdDriveNum = savedDriveNum;
+	statusCode = savedStatusCode;
+	sectorCountReg = savedSectorCount;
+	nextLogicalSector.byteOffset = savedLogicalSector;
+	dataBufferPtr.bufferPtr = savedBufferPtr;
+	gimeBus->statusBarText = savedStatusBarText;
+
+	// In overlay mode the writes went into a delta file next to the scratch image, which has to go too
+	std::string deltaPathname = (emuDiskDrive[testDrive].vhdOverlay != nullptr) ? emuDiskDrive[testDrive].vhdOverlay->deltaPathname : "";
+	closeImageFile(testDrive);
+	emuDiskDrive[testDrive].imgFilePathname.clear();
+	emuDiskDrive[testDrive].diskImageFilesize = 0;
+	emuDiskDrive[testDrive].imageMounted = false;
+	remove(scratchPathname.c_str());
+	if (!deltaPathname.empty())
+		remove(deltaPathname.c_str());
+	return testPassed;
+}
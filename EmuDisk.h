@@ -5,6 +5,15 @@ constexpr uint8_t EMUDISK_ERROR_NOT_ENABLED				= 0x02;
 constexpr uint8_t EMUDISK_ERROR_NO_DISK_MOUNTED			= 0x03;
 constexpr uint8_t EMUDISK_ERROR_OPENING_DISK_IMAGE		= 0x04;
 constexpr uint8_t EMUDISK_ERROR_UNSUPPORTED_DISK_IMAGE	= 0x05;
+constexpr uint8_t EMUDISK_ERROR_NOT_OVERLAY				= 0x06;
+constexpr uint8_t EMUDISK_ERROR_INVALID_DRIVE_NUM		= 0x07;
+constexpr uint8_t EMUDISK_ERROR_WRITING_DISK_IMAGE		= 0x08;
+
+constexpr uint8_t EMUDISK_MAX_DRIVES					= 8;	// Each drive unit has its own image file, write queue target and block cache
+
+constexpr uint64_t EMUDISK_MAX_ADDRESSABLE_BYTES		= 0x100000000;	// 24-bit LSNs of 256 bytes each. An image bigger than this is only used up to here.
+constexpr uint16_t EMUDISK_SELF_TEST_BUFFER				= 0x0600;		// Where in CoCo memory the self test puts its sectors. What was there gets put back.
+constexpr uint8_t EMUDISK_MAX_SECTOR_COUNT				= 255;	// Most sectors one multiple sector command can move. 255 * 256 bytes still fits in the CPU's address space.
 
 constexpr uint8_t EMUDISK_STATUS_SUCCESSFUL				= 0;
 constexpr uint8_t EMUDISK_STATUS_ERROR_NOT_ENABLED		= 2;
@@ -14,9 +23,14 @@ constexpr uint8_t EMUDISK_STATUS_ERROR_INVALID_CMD		= 254;
 struct emuDiskDriveStruct
 {
 	bool imageMounted;
-	long diskImageFilesize;
+	uint64_t diskImageFilesize;
 	std::string imgFilePathname;
 	FILE* vhdImageFile;
+	MappedFile vhdMapping;					// Sector reads come straight from here when there are no writes still queued for the image
+	DiskBlockCache vhdCache;				// Sits in front of the write queue for this image. Its size is kept across mounts.
+	DiskOverlay* vhdOverlay = nullptr;		// Only set when the image was mounted in overlay mode, in which case vhdImageFile isn't used
+	CompressedDisk* vhdContainer = nullptr;	// Only set when the image is a compressed container, in which case vhdImageFile isn't used either
+	int writeTarget = DISK_WRITE_NO_TARGET;	// Our slot in the bus's DiskWriteQueue
 };
 
 class EmuDisk
@@ -27,9 +41,15 @@ public:
 	void ConnectToBus(GimeBus* busPtr) { gimeBus = busPtr; }
 	uint8_t vhdMountDisk(uint8_t, std::string);
 	uint8_t vhdEjectDisk(uint8_t);
+	uint8_t vhdCommitOverlay(uint8_t);
+	uint8_t vhdDiscardOverlay(uint8_t);
+	void vhdFlushAllCaches();
+	void vhdFlushDisk(uint8_t);
+	int findDriveUsingFile(std::string);
+	bool selfTestLargeImage(std::string, std::string&);
 	void registerWrite(uint16_t regAddress, uint8_t paramByte);
-	uint8_t readSector();
-	uint8_t writeSector();
+	uint8_t readSectors(uint8_t);
+	uint8_t writeSectors(uint8_t);
 
 	union
 	{
@@ -54,11 +74,14 @@ public:
 	} dataBufferPtr;
 
 	bool isEnabled;
-	uint8_t vhdDriveNum, statusCode;
-	emuDiskDriveStruct emuDiskDrive[2];
+	uint8_t vhdDriveNum, statusCode, sectorCountReg;
+	emuDiskDriveStruct emuDiskDrive[EMUDISK_MAX_DRIVES];
 	char textBuffer[128];
 
 private:
+	void closeImageFile(uint8_t);
+	uint32_t getValidSectorCount(uint64_t, uint8_t);
+
 	GimeBus* gimeBus = nullptr;
-	uint8_t sectorBuffer[256];
+	std::vector<uint8_t> transferBuffer;	// Big enough for the most sectors a single command can move
 };
@@ -1,15 +1,25 @@
+#include <cstring>
+#include <algorithm>
 #include "GimeBus.h"
 #include "FD502.h"
+#include "DiskFileIO.h"
 
 FD502::FD502()
 {
 	isConnected = true;
+	fastDiskMode = false;
+	dskconHLEEnabled = false;
+	trapAddrDSKCON = 0;
+	dskconParamAddr = 0;
+	dskconCallsHandled = 0;
 	stepWaitCounter = 0;
 	fdcPendingCommand = 0;
 	fdcHeadLoaded = false;
 	verifyAfterCommand = false;
-	fdcIndexPulse = false;
-	for (int i = 0; i < 3; i++)
+	fdcMotorOn = false;
+	motorStartTimestamp = 0;
+	diskSectorLength = 256;
+	for (int i = 0; i < FD502_MAX_DRIVES; i++)
 	{
 		fdcDrive[i].isDiskInserted = false;
 		fdcDrive[i].isDriveAttached = false;
@@ -44,25 +54,209 @@ uint8_t FD502::fdcInsertDisk(uint8_t driveNum, std::string diskImageFilePath)
 	if (fdcDrive[driveNum].isDiskInserted)
 		fdcEjectDisk(driveNum);
 
-	fdcDrive[driveNum].diskImageFile = fopen(diskImageFilePath.c_str(), "rb+");
-	if (fdcDrive[driveNum].diskImageFile == NULL)
-	//if (fopen_s(&fdcDrive[driveNum].diskImageFile, diskImageFilePath.c_str(), "rb+") != 0)
+	if (HostDirectoryDisk::isHostDirectory(diskImageFilePath))
+		return insertHostDirectory(driveNum, diskImageFilePath);
+
+	long diskImageFilesize;
+	if (gimeBus->diskOverlayTag.empty())
+	{
+		fdcDrive[driveNum].diskImageFile = fopen(diskImageFilePath.c_str(), "rb+");
+		if (fdcDrive[driveNum].diskImageFile == NULL)
+		//if (fopen_s(&fdcDrive[driveNum].diskImageFile, diskImageFilePath.c_str(), "rb+") != 0)
+			return FD502_ERROR_OPENING_DISK_IMAGE;
+		// Flushed sectors go out through the bus's write queue. Opening our target also replays anything a crash kept from making it into the image last time.
+		fdcDrive[driveNum].writeTarget = gimeBus->diskWriteQueue.openTarget(fdcDrive[driveNum].diskImageFile, diskImageFilePath);
+		fseek(fdcDrive[driveNum].diskImageFile, 0, SEEK_END);
+		diskImageFilesize = ftell(fdcDrive[driveNum].diskImageFile);
+	}
+	else
+	{
+		// Overlay mode leaves the image file itself alone. Our writes go to a delta file that belongs to this instance's overlay tag.
+		fdcDrive[driveNum].diskImageFile = nullptr;
+		fdcDrive[driveNum].diskOverlay = new DiskOverlay();
+		if (fdcDrive[driveNum].diskOverlay->openOverlay(diskImageFilePath, diskImageFilePath + "." + gimeBus->diskOverlayTag + ".delta") != DISK_OVERLAY_OPERATION_COMPLETE)
+		{
+			delete fdcDrive[driveNum].diskOverlay;
+			fdcDrive[driveNum].diskOverlay = nullptr;
+			return FD502_ERROR_OPENING_DISK_IMAGE;
+		}
+		fdcDrive[driveNum].writeTarget = gimeBus->diskWriteQueue.openTarget(fdcDrive[driveNum].diskOverlay, fdcDrive[driveNum].diskOverlay->deltaPathname);
+		diskImageFilesize = fdcDrive[driveNum].diskOverlay->baseFilesize;
+	}
+	if (fdcDrive[driveNum].writeTarget == DISK_WRITE_NO_TARGET)
+	{
+		closeImageFile(driveNum);
 		return FD502_ERROR_OPENING_DISK_IMAGE;
+	}
+	if (diskImageFilesize <= 0)
+	{
+		closeImageFile(driveNum);
+		return FD502_ERROR_UNSUPPORTED_DISK_IMAGE;
+	}
 
-	// At least for now, guess at the disk's geometry based on filesize
-	fseek(fdcDrive[driveNum].diskImageFile, 0, SEEK_END);
-	long diskImageFilesize = ftell(fdcDrive[driveNum].diskImageFile);
-	//fseek(fdcDrive[driveNum].diskImageFile, 0, SEEK_SET);				// Return file pointer to beginning of file again
-	fdcDrive[driveNum].diskImageGeometry = nullptr;
-	for (int i = 0; i < (sizeof(diskImageGeometry) / sizeof(diskImageGeometry[0])); i++)
-		if (diskImageFilesize == diskImageGeometry[i].totalFilesize)
+	// Pull the whole image into memory up front so sector reads and writes never have to wait on the host's filesystem
+	fdcDrive[driveNum].diskImageData.resize(diskImageFilesize);
+	gimeBus->diskWriteQueue.readThrough(fdcDrive[driveNum].writeTarget, 0, fdcDrive[driveNum].diskImageData.data(), diskImageFilesize);
+
+	// Work out the disk's layout and build the sector index from it, so finding any sector later is just a table lookup
+	uint8_t parseResult;
+	if (isDmkImage(driveNum))
+		parseResult = parseDmkImage(driveNum);
+	else
+		parseResult = parseJvcImage(driveNum);
+	if (parseResult != FD502_OPERATION_COMPLETE)
+	{
+		closeImageFile(driveNum);
+		fdcDrive[driveNum].diskImageData.clear();
+		fdcDrive[driveNum].sectorIndex.clear();
+		return parseResult;
+	}
+
+	fdcDrive[driveNum].dirtyBlocks.assign((diskImageFilesize + FD502_DIRTY_BLOCK_SIZE - 1) / FD502_DIRTY_BLOCK_SIZE, false);
+	fdcDrive[driveNum].isImageDirty = false;
+	fdcDrive[driveNum].mountedGeometry.totalFilesize = diskImageFilesize;
+	fdcDrive[driveNum].diskImageGeometry = &fdcDrive[driveNum].mountedGeometry;
+	fdcDrive[driveNum].isDiskInserted = true;
+	fdcDrive[driveNum].imgFilePathname = diskImageFilePath;
+	return FD502_OPERATION_COMPLETE;
+}
+
+bool FD502::isDmkImage(uint8_t driveNum)
+{
+	// DMK has no signature, so check that the header describes a set of tracks that adds up to exactly the size of the file
+	std::vector<uint8_t>& imageData = fdcDrive[driveNum].diskImageData;
+	if (imageData.size() <= DMK_HEADER_SIZE)
+		return false;
+	if ((imageData[0] != 0x00) && (imageData[0] != 0xFF))
+		return false;
+	uint8_t totalTracks = imageData[1];
+	uint16_t trackLength = imageData[2] | (imageData[3] << 8);
+	uint8_t totalSides = (imageData[4] & DMK_FLAG_SINGLE_SIDED) ? 1 : 2;
+	if ((totalTracks == 0) || (trackLength <= DMK_IDAM_TABLE_SIZE))
+		return false;
+	return ((imageData.size() - DMK_HEADER_SIZE) == ((size_t)totalTracks * totalSides * trackLength));
+}
+
+uint8_t FD502::parseJvcImage(uint8_t driveNum)
+{
+	std::vector<uint8_t>& imageData = fdcDrive[driveNum].diskImageData;
+	diskImageStruct& geometry = fdcDrive[driveNum].mountedGeometry;
+
+	// A JVC header is however many bytes are left over after the sectors, and every field in it is optional. Missing ones get the RS-DOS defaults.
+	uint32_t headerSize = imageData.size() % 256;
+	uint8_t sectorsPerTrack = 18, totalSides = 1, sectorSizeCode = 1, firstSectorID = 1, attributeBytes = 0;
+	if (headerSize >= 1)
+		sectorsPerTrack = imageData[0];
+	if (headerSize >= 2)
+		totalSides = imageData[1];
+	if (headerSize >= 3)
+		sectorSizeCode = imageData[2] & 0x03;
+	if (headerSize >= 4)
+		firstSectorID = imageData[3];
+	if (headerSize >= 5)
+		attributeBytes = (imageData[4] != 0) ? 1 : 0;		// If set, each sector is preceded by one attribute byte
+	if ((sectorsPerTrack == 0) || (totalSides == 0) || (totalSides > 2))
+		return FD502_ERROR_UNSUPPORTED_DISK_IMAGE;
+
+	uint16_t sectorLength = sectorLengthTable[sectorSizeCode];
+	uint32_t sectorRecordLength = sectorLength + attributeBytes;
+	uint32_t totalTracks = (imageData.size() - headerSize) / (sectorRecordLength * sectorsPerTrack);
+	if (headerSize == 0)
+	{
+		// No header, so fall back on guessing the number of sides from the filesize like we always have
+		totalSides = (totalTracks > 80) ? 2 : 1;
+		for (size_t i = 0; i < (sizeof(diskImageGeometry) / sizeof(diskImageGeometry[0])); i++)
+			if (imageData.size() == (size_t)diskImageGeometry[i].totalFilesize)
+				totalSides = diskImageGeometry[i].totalSides;
+	}
+	uint32_t tracksPerSide = totalTracks / totalSides;
+	if ((tracksPerSide == 0) || (tracksPerSide > 255))
+		return FD502_ERROR_UNSUPPORTED_DISK_IMAGE;
+
+	geometry.bytesPerSector = sectorLength;
+	geometry.sectorsPerTrack = sectorsPerTrack;
+	geometry.bytesPerTrack = sectorRecordLength * sectorsPerTrack;
+	geometry.tracksPerSide = tracksPerSide;
+	geometry.totalSides = totalSides;
+	fdcDrive[driveNum].diskImageFormat = DISK_IMAGE_FORMAT_JVC;
+
+	// Sectors are simply stored in order, side 0 then side 1 for each track
+	fdcDrive[driveNum].sectorIndex.assign(tracksPerSide * totalSides * 256, { 0, 0 });
+	for (uint32_t trackNum = 0; trackNum < tracksPerSide; trackNum++)
+		for (uint8_t sideNum = 0; sideNum < totalSides; sideNum++)
+			for (uint8_t sectorNum = 0; sectorNum < sectorsPerTrack; sectorNum++)
+			{
+				uint32_t trackSideIndex = (trackNum * totalSides) + sideNum;
+				sectorIndexStruct& indexEntry = fdcDrive[driveNum].sectorIndex[(trackSideIndex * 256) + (uint8_t)(firstSectorID + sectorNum)];
+				indexEntry.imageOffset = headerSize + (((trackSideIndex * sectorsPerTrack) + sectorNum) * sectorRecordLength) + attributeBytes;
+				indexEntry.sectorLength = sectorLength;
+			}
+	return FD502_OPERATION_COMPLETE;
+}
+
+uint8_t FD502::parseDmkImage(uint8_t driveNum)
+{
+	std::vector<uint8_t>& imageData = fdcDrive[driveNum].diskImageData;
+	diskImageStruct& geometry = fdcDrive[driveNum].mountedGeometry;
+
+	uint8_t totalTracks = imageData[1];
+	uint16_t trackLength = imageData[2] | (imageData[3] << 8);
+	uint8_t dmkFlags = imageData[4];
+	uint8_t totalSides = (dmkFlags & DMK_FLAG_SINGLE_SIDED) ? 1 : 2;
+	uint8_t mostSectorsOnTrack = 0;
+
+	fdcDrive[driveNum].sectorIndex.assign(totalTracks * totalSides * 256, { 0, 0 });
+	for (uint8_t trackNum = 0; trackNum < totalTracks; trackNum++)
+		for (uint8_t sideNum = 0; sideNum < totalSides; sideNum++)
 		{
-			fdcDrive[driveNum].diskImageGeometry = &diskImageGeometry[i];
-			fdcDrive[driveNum].isDiskInserted = true;
-			fdcDrive[driveNum].imgFilePathname = diskImageFilePath;
-			return FD502_OPERATION_COMPLETE;
+			uint32_t trackSideIndex = (trackNum * totalSides) + sideNum;
+			uint32_t trackStart = DMK_HEADER_SIZE + (trackSideIndex * trackLength);
+			uint8_t* trackData = imageData.data() + trackStart;
+			uint8_t sectorsOnTrack = 0;
+
+			// Go through each ID address mark on the track. The sector ID comes from the ID field itself, so non-sequential or duplicate
+			// looking IDs on copy protected disks end up indexed exactly as they were recorded.
+			for (uint8_t idamNum = 0; idamNum < (DMK_IDAM_TABLE_SIZE / 2); idamNum++)
+			{
+				uint16_t idamPointer = trackData[idamNum * 2] | (trackData[(idamNum * 2) + 1] << 8);
+				if (idamPointer == 0)
+					break;
+				// Single density bytes are normally stored twice in a DMK, which we can't serve straight out of the image, so those get skipped
+				if (!(idamPointer & DMK_IDAM_DOUBLE_DENSITY) && !(dmkFlags & DMK_FLAG_IGNORE_DENSITY))
+					continue;
+				uint16_t idamOffset = idamPointer & DMK_IDAM_OFFSET_MASK;
+				if ((idamOffset < DMK_IDAM_TABLE_SIZE) || ((idamOffset + 7) > trackLength))
+					continue;
+
+				// ID field = $FE, Track, Side, Sector, Length code, CRC (2 bytes). The Data Address Mark ($F8-$FB) follows after gap 2.
+				uint8_t sectorID = trackData[idamOffset + 3];
+				uint16_t sectorLength = sectorLengthTable[trackData[idamOffset + 4] & 0x03];
+				uint32_t dataOffset = 0;
+				for (uint32_t i = idamOffset + 7; (i < (uint32_t)(idamOffset + 7 + DMK_DATA_MARK_SEARCH_WINDOW)) && (i < trackLength); i++)
+					if ((trackData[i] >= 0xF8) && (trackData[i] <= 0xFB))
+					{
+						dataOffset = i + 1;
+						break;
+					}
+				if ((dataOffset == 0) || ((dataOffset + sectorLength) > trackLength))
+					continue;
+
+				sectorIndexStruct& indexEntry = fdcDrive[driveNum].sectorIndex[(trackSideIndex * 256) + sectorID];
+				indexEntry.imageOffset = trackStart + dataOffset;
+				indexEntry.sectorLength = sectorLength;
+				sectorsOnTrack++;
+			}
+			if (sectorsOnTrack > mostSectorsOnTrack)
+				mostSectorsOnTrack = sectorsOnTrack;
 		}
-	return FD502_ERROR_UNSUPPORTED_DISK_IMAGE;
+
+	geometry.bytesPerSector = 256;
+	geometry.sectorsPerTrack = mostSectorsOnTrack;
+	geometry.bytesPerTrack = trackLength;
+	geometry.tracksPerSide = totalTracks;
+	geometry.totalSides = totalSides;
+	fdcDrive[driveNum].diskImageFormat = DISK_IMAGE_FORMAT_DMK;
+	return FD502_OPERATION_COMPLETE;
 }
 
 uint8_t FD502::fdcEjectDisk(uint8_t driveNum)
@@ -72,29 +266,404 @@ uint8_t FD502::fdcEjectDisk(uint8_t driveNum)
 	if (!fdcDrive[driveNum].isDiskInserted)
 		return FD502_ERROR_NO_DISK_INSERTED;
 
-	fclose(fdcDrive[driveNum].diskImageFile);
+	// Make sure anything written to the disk makes it back to the host file before we let go of it
+	fdcFlushDisk(driveNum);
+	closeImageFile(driveNum);
+	fdcDrive[driveNum].diskImageData.clear();
+	fdcDrive[driveNum].diskImageData.shrink_to_fit();
+	fdcDrive[driveNum].dirtyBlocks.clear();
+	fdcDrive[driveNum].sectorIndex.clear();
+	fdcDrive[driveNum].sectorIndex.shrink_to_fit();
 	fdcDrive[driveNum].imgFilePathname.clear();
 	fdcDrive[driveNum].diskImageGeometry = nullptr;
 	fdcDrive[driveNum].isDiskInserted = false;
 	return FD502_OPERATION_COMPLETE;
 }
 
-bool FD502::getDiskImageOffset(uint8_t driveNum, uint8_t trackNum, uint8_t sectorNum, uint8_t sideNum)
+uint8_t FD502::fdcFlushDisk(uint8_t driveNum)
 {
-	diskImageStruct* diskGeometry = fdcDrive[driveNum].diskImageGeometry;	// This pointer is just so we can use a shortened code reference to make things easier to read
+	if (!fdcDrive[driveNum].isDriveAttached)
+		return FD502_ERROR_DRIVE_NOT_ATTACHED;
+	if (!fdcDrive[driveNum].isDiskInserted)
+		return FD502_ERROR_NO_DISK_INSERTED;
+	if (fdcDrive[driveNum].hostDirectory != nullptr)
+		return syncHostDirectory(driveNum);
 
-	// Attempt some basic validation of the parameters
-	if ((driveNum > 2) || (trackNum > 80) || (sideNum > 1))
-		return false;
-	if ((diskGeometry->bytesPerSector == 256) && (sectorNum > 0x1A))
+	// Writes are made to the image on the write queue's I/O thread, so any that failed since last time get reported here
+	uint8_t flushResult = (gimeBus->diskWriteQueue.takeFailedWrites(fdcDrive[driveNum].writeTarget) > 0) ? FD502_ERROR_WRITING_DISK_IMAGE : FD502_OPERATION_COMPLETE;
+	if (!fdcDrive[driveNum].isImageDirty)
+		return flushResult;
+
+	// Queue each run of consecutive dirty blocks as a single write. The I/O thread journals it and puts it in the image file.
+	std::vector<bool>& dirtyBlocks = fdcDrive[driveNum].dirtyBlocks;
+	size_t imageSize = fdcDrive[driveNum].diskImageData.size();
+	size_t blockNum = 0;
+	while (blockNum < dirtyBlocks.size())
+	{
+		if (!dirtyBlocks[blockNum])
+		{
+			blockNum++;
+			continue;
+		}
+		size_t runStart = blockNum;
+		while ((blockNum < dirtyBlocks.size()) && dirtyBlocks[blockNum])
+			dirtyBlocks[blockNum++] = false;
+		size_t runEnd = blockNum * FD502_DIRTY_BLOCK_SIZE;
+		if (runEnd > imageSize)
+			runEnd = imageSize;			// Last block can be a partial one when the image has a header
+		gimeBus->diskWriteQueue.queueWrite(fdcDrive[driveNum].writeTarget, runStart * FD502_DIRTY_BLOCK_SIZE, fdcDrive[driveNum].diskImageData.data() + (runStart * FD502_DIRTY_BLOCK_SIZE), runEnd - (runStart * FD502_DIRTY_BLOCK_SIZE));
+	}
+	fdcDrive[driveNum].isImageDirty = false;
+	return flushResult;
+}
+
+int FD502::fdcFindDriveUsingFile(std::string filePathname)
+{
+	// Returns the drive with this file inserted as its disk image or as the base or delta of its overlay, or -1 if none of them do
+	for (int i = 0; i < FD502_MAX_DRIVES; i++)
+	{
+		if (!fdcDrive[i].isDiskInserted || (fdcDrive[i].hostDirectory != nullptr))
+			continue;
+		if (isSameHostFile(filePathname, fdcDrive[i].imgFilePathname))
+			return i;
+		if ((fdcDrive[i].diskOverlay != nullptr) && (isSameHostFile(filePathname, fdcDrive[i].diskOverlay->basePathname) ||
+			isSameHostFile(filePathname, fdcDrive[i].diskOverlay->deltaPathname)))
+			return i;
+	}
+	return -1;
+}
+
+uint8_t FD502::fdcCommitOverlay(uint8_t driveNum)
+{
+	if (!fdcDrive[driveNum].isDriveAttached)
+		return FD502_ERROR_DRIVE_NOT_ATTACHED;
+	if (!fdcDrive[driveNum].isDiskInserted)
+		return FD502_ERROR_NO_DISK_INSERTED;
+	if (fdcDrive[driveNum].diskOverlay == nullptr)
+		return FD502_ERROR_NOT_OVERLAY;
+
+	// Get every write into the delta first, then copy the delta into the base image
+	fdcFlushDisk(driveNum);
+	gimeBus->diskWriteQueue.flushBarrier();
+	uint8_t commitStatus = fdcDrive[driveNum].diskOverlay->commitOverlay();
+	if (commitStatus == DISK_OVERLAY_ERROR_WRITING_BASE)
+		return FD502_ERROR_WRITING_DISK_IMAGE;			// The delta is still there, so nothing the CoCo wrote has been lost
+	if (commitStatus != DISK_OVERLAY_OPERATION_COMPLETE)
+		return FD502_ERROR_OPENING_DISK_IMAGE;
+	return FD502_OPERATION_COMPLETE;
+}
+
+uint8_t FD502::fdcDiscardOverlay(uint8_t driveNum)
+{
+	if (!fdcDrive[driveNum].isDriveAttached)
+		return FD502_ERROR_DRIVE_NOT_ATTACHED;
+	if (!fdcDrive[driveNum].isDiskInserted)
+		return FD502_ERROR_NO_DISK_INSERTED;
+	if (fdcDrive[driveNum].diskOverlay == nullptr)
+		return FD502_ERROR_NOT_OVERLAY;
+
+	// Drop the writes that haven't been flushed yet along with the ones already in the delta
+	std::fill(fdcDrive[driveNum].dirtyBlocks.begin(), fdcDrive[driveNum].dirtyBlocks.end(), false);
+	fdcDrive[driveNum].isImageDirty = false;
+	gimeBus->diskWriteQueue.flushBarrier();
+	if (fdcDrive[driveNum].diskOverlay->discardOverlay() != DISK_OVERLAY_OPERATION_COMPLETE)
+	{
+		fdcEjectDisk(driveNum);
+		return FD502_ERROR_OPENING_DISK_IMAGE;
+	}
+
+	// Then reload the in-memory copy from the base image, which is what the disk looks like again now
+	gimeBus->diskWriteQueue.readThrough(fdcDrive[driveNum].writeTarget, 0, fdcDrive[driveNum].diskImageData.data(), fdcDrive[driveNum].diskImageData.size());
+	uint8_t parseResult;
+	if (isDmkImage(driveNum))
+		parseResult = parseDmkImage(driveNum);
+	else
+		parseResult = parseJvcImage(driveNum);
+	if (parseResult != FD502_OPERATION_COMPLETE)
+		fdcEjectDisk(driveNum);
+	return parseResult;
+}
+
+void FD502::closeImageFile(uint8_t driveNum)
+{
+	gimeBus->diskWriteQueue.closeTarget(fdcDrive[driveNum].writeTarget);		// Waits for the I/O thread to finish with the file
+	fdcDrive[driveNum].writeTarget = DISK_WRITE_NO_TARGET;
+	if (fdcDrive[driveNum].diskImageFile != nullptr)
+		fclose(fdcDrive[driveNum].diskImageFile);
+	fdcDrive[driveNum].diskImageFile = nullptr;
+	if (fdcDrive[driveNum].diskOverlay != nullptr)
+		delete fdcDrive[driveNum].diskOverlay;		// Closes the base image and delta files. The delta file itself stays so this instance can pick it back up later.
+	fdcDrive[driveNum].diskOverlay = nullptr;
+	if (fdcDrive[driveNum].hostDirectory != nullptr)
+		delete fdcDrive[driveNum].hostDirectory;
+	fdcDrive[driveNum].hostDirectory = nullptr;
+}
+
+uint8_t FD502::insertHostDirectory(uint8_t driveNum, std::string directoryPath)
+{
+	// The disk is built in memory from the directory's files and is never backed by an image file. Sector reads and writes work on the
+	// in-memory copy exactly like they do for an image, and flushing writes changed files back out to the directory instead.
+	fdcDrive[driveNum].diskImageFile = nullptr;
+	fdcDrive[driveNum].hostDirectory = new HostDirectoryDisk();
+	if (fdcDrive[driveNum].hostDirectory->openDirectory(directoryPath) != HOST_DIRECTORY_OPERATION_COMPLETE)
+	{
+		closeImageFile(driveNum);
+		return FD502_ERROR_OPENING_DISK_IMAGE;
+	}
+	fdcDrive[driveNum].hostDirectory->buildImage(fdcDrive[driveNum].diskImageData);
+	uint8_t parseResult = parseJvcImage(driveNum);
+	if (parseResult != FD502_OPERATION_COMPLETE)
+	{
+		closeImageFile(driveNum);
+		fdcDrive[driveNum].diskImageData.clear();
+		fdcDrive[driveNum].sectorIndex.clear();
+		return parseResult;
+	}
+
+	fdcDrive[driveNum].dirtyBlocks.assign((fdcDrive[driveNum].diskImageData.size() + FD502_DIRTY_BLOCK_SIZE - 1) / FD502_DIRTY_BLOCK_SIZE, false);
+	fdcDrive[driveNum].isImageDirty = false;
+	fdcDrive[driveNum].guestWroteSinceRebuild = false;
+	fdcDrive[driveNum].rescanNoticeShown = false;
+	fdcDrive[driveNum].mountedGeometry.totalFilesize = fdcDrive[driveNum].diskImageData.size();
+	fdcDrive[driveNum].diskImageGeometry = &fdcDrive[driveNum].mountedGeometry;
+	fdcDrive[driveNum].isDiskInserted = true;
+	fdcDrive[driveNum].imgFilePathname = directoryPath;
+	return FD502_OPERATION_COMPLETE;
+}
+
+uint8_t FD502::syncHostDirectory(uint8_t driveNum)
+{
+	// Called along with the other disk flushes. Anything the CoCo wrote goes out to the host files. In overlay mode the host directory is
+	// treated like any other shared image and never written to, so the CoCo's writes just stay on the in-memory disk until it's ejected.
+	HostDirectoryDisk* hostDirectory = fdcDrive[driveNum].hostDirectory;
+	if (fdcDrive[driveNum].isImageDirty)
+	{
+		uint8_t syncResult = FD502_OPERATION_COMPLETE;
+		if (gimeBus->diskOverlayTag.empty() && !hostDirectory->writeBackImage(fdcDrive[driveNum].diskImageData))
+			syncResult = FD502_ERROR_WRITING_DISK_IMAGE;
+		std::fill(fdcDrive[driveNum].dirtyBlocks.begin(), fdcDrive[driveNum].dirtyBlocks.end(), false);
+		fdcDrive[driveNum].isImageDirty = false;
+		return syncResult;
+	}
+
+	// Otherwise, if files were changed on the host side (a fresh build, say), rebuild the disk so the CoCo sees them. Only while the
+	// motor is off, so the disk never changes out from under a command that's in the middle of running, and only if the CoCo hasn't
+	// written to the disk since it was last built. Once it has, a program may still have a file open with its directory entry and
+	// granule table sitting in memory, and closing it onto a rebuilt disk would scribble over whatever moved. From then on the host's
+	// changes wait for a RESCAN.
+	if (!fdcMotorOn && gimeBus->diskOverlayTag.empty() && hostDirectory->hostDirectoryChanged())
+	{
+		if (!fdcDrive[driveNum].guestWroteSinceRebuild)
+			fdcRescanHostDirectory(driveNum);
+		else if (!fdcDrive[driveNum].rescanNoticeShown)
+		{
+			snprintf(textBuffer, sizeof(textBuffer), "FDC: Drive %u host directory changed, RESCAN to reload it", driveNum);
+			gimeBus->statusBarText = textBuffer;
+			fdcDrive[driveNum].rescanNoticeShown = true;
+		}
+	}
+	return FD502_OPERATION_COMPLETE;
+}
+
+uint8_t FD502::fdcRescanHostDirectory(uint8_t driveNum)
+{
+	if (!fdcDrive[driveNum].isDriveAttached)
+		return FD502_ERROR_DRIVE_NOT_ATTACHED;
+	if (!fdcDrive[driveNum].isDiskInserted)
+		return FD502_ERROR_NO_DISK_INSERTED;
+	if (fdcDrive[driveNum].hostDirectory == nullptr)
+		return FD502_ERROR_NOT_HOST_DIRECTORY;
+
+	// The disk always comes out the same size and layout, so the sector index built when it was inserted still holds
+	if (fdcDrive[driveNum].isImageDirty && gimeBus->diskOverlayTag.empty())
+		fdcDrive[driveNum].hostDirectory->writeBackImage(fdcDrive[driveNum].diskImageData);
+	fdcDrive[driveNum].hostDirectory->buildImage(fdcDrive[driveNum].diskImageData);
+	std::fill(fdcDrive[driveNum].dirtyBlocks.begin(), fdcDrive[driveNum].dirtyBlocks.end(), false);
+	fdcDrive[driveNum].isImageDirty = false;
+	fdcDrive[driveNum].guestWroteSinceRebuild = false;
+	fdcDrive[driveNum].rescanNoticeShown = false;
+	return FD502_OPERATION_COMPLETE;
+}
+
+uint32_t FD502::getRotationPosition()
+{
+	// How far the disk has turned past the leading edge of the index hole, in GIME cycles. The first index pulse comes one rotation minus the
+	// width of the hole after the motor comes on, same as always.
+	uint32_t elapsedCycles = gimeBus->masterBusCycleCounter - motorStartTimestamp;
+	if (elapsedCycles >= gimePerFloppyRotation)
+	{
+		// Keep the start time within a rotation of now, so the 32-bit cycle counter wrapping around doesn't throw off the position
+		motorStartTimestamp += (elapsedCycles / gimePerFloppyRotation) * gimePerFloppyRotation;
+		elapsedCycles %= gimePerFloppyRotation;
+	}
+	return (elapsedCycles + gimeFloppyIndexWidth) % gimePerFloppyRotation;
+}
+
+bool FD502::isIndexPulseActive()
+{
+	return fdcMotorOn && (getRotationPosition() < gimeFloppyIndexWidth);
+}
+
+uint32_t FD502::getSectorRotationalDelay()
+{
+	// Cycles until the sector in the Sector Register comes around under the head. Disk images don't record where on the track each sector
+	// physically sits, so they're taken to be spread evenly around it in ID order starting at the index hole.
+	if ((fdcDriveSelect == 0xFF) || !fdcDrive[fdcDriveSelect].isDiskInserted || (fdcDrive[fdcDriveSelect].diskImageGeometry->sectorsPerTrack == 0) || (fdcSectorReg == 0))
+		return 0;
+	uint8_t sectorsPerTrack = fdcDrive[fdcDriveSelect].diskImageGeometry->sectorsPerTrack;
+	uint32_t sectorPosition = (uint32_t)(((fdcSectorReg - 1) % sectorsPerTrack) * ((uint64_t)gimePerFloppyRotation / sectorsPerTrack));
+	return (sectorPosition + gimePerFloppyRotation - getRotationPosition()) % gimePerFloppyRotation;
+}
+
+void FD502::fdcFlushAllDisks()
+{
+	// Runs under the emulation lock, so the emulation thread does wait for this. For image files it only hands the changed blocks to the
+	// disk write queue though, and the host's filesystem is dealt with on the queue's I/O thread. A host directory disk's files are
+	// written right here.
+	for (uint8_t i = 0; i < FD502_MAX_DRIVES; i++)
+		if (fdcDrive[i].isDriveAttached && fdcDrive[i].isDiskInserted && (fdcFlushDisk(i) == FD502_ERROR_WRITING_DISK_IMAGE))
+		{
+			snprintf(textBuffer, sizeof(textBuffer), "FDC: Could not write Drive %u to the host", i);
+			gimeBus->statusBarText = textBuffer;
+		}
+}
+
+void FD502::fdcSetDskconHLE(bool enableHLE)
+{
+	// Look up DSKCON's entry point and parameter block from the loaded disk ROM rather than hardcoding the addresses for one particular version
+	dskconHLEEnabled = enableHLE && (gimeBus->romExternal != nullptr);
+	if (dskconHLEEnabled)
+	{
+		trapAddrDSKCON = (gimeBus->romExternal->readByte(DSKCON_VECTOR) * 256) + gimeBus->romExternal->readByte(DSKCON_VECTOR + 1);
+		dskconParamAddr = (gimeBus->romExternal->readByte(DSKCON_PARAM_VECTOR) * 256) + gimeBus->romExternal->readByte(DSKCON_PARAM_VECTOR + 1);
+	}
+	gimeBus->updateExecTraps();
+}
+
+bool FD502::checkDskconTrap(uint16_t address)
+{
+	// Called by the CPU before every instruction while the trap is armed, so get out quickly if it isn't DSKCON
+	if (address != trapAddrDSKCON)
 		return false;
-	else if ((diskGeometry->bytesPerSector == 512) && (sectorNum > 0x0F))
+
+	// Make sure it really is Disk BASIC at this address and not something else mapped over it (OS-9, etc)
+	for (uint16_t i = 0; i < 4; i++)
+		if (gimeBus->readMemoryByte(address + i) != gimeBus->romExternal->readByte(address + i))
+			return false;
+
+	uint8_t opCode = gimeBus->readMemoryByte(dskconParamAddr + DSKCON_PARAM_DCOPC);
+	uint8_t driveNum = gimeBus->readMemoryByte(dskconParamAddr + DSKCON_PARAM_DCDRV);
+	uint8_t trackNum = gimeBus->readMemoryByte(dskconParamAddr + DSKCON_PARAM_DCTRK);
+	uint8_t sectorNum = gimeBus->readMemoryByte(dskconParamAddr + DSKCON_PARAM_DSEC);
+	uint16_t bufferAddr = gimeBus->readMemoryWord(dskconParamAddr + DSKCON_PARAM_DCBPT);
+	uint8_t resultStatus = 0;
+
+	if (opCode > DSKCON_OP_WRITE_SECTOR)
+		return false;		// Not something we know about, so let the real routine deal with it
+	if ((driveNum >= FD502_MAX_DRIVES) || !fdcDrive[driveNum].isDriveAttached || !fdcDrive[driveNum].isDiskInserted)
+		resultStatus = FDC_STATUS_II_III_NOT_READY;
+	else if ((opCode == DSKCON_OP_READ_SECTOR) || (opCode == DSKCON_OP_WRITE_SECTOR))
+	{
+		if (!getDiskImageOffset(driveNum, trackNum, sectorNum - 1, 0))
+			resultStatus = FDC_STATUS_II_III_RECORD_NOT_FOUND;
+		else if (diskSectorLength != 256)
+			return false;		// DSKCON only ever moves 256 byte sectors, so leave anything else to the real routine
+		else if (opCode == DSKCON_OP_READ_SECTOR)
+		{
+			readImageSector(driveNum);
+			for (uint16_t i = 0; i < 256; i++)
+				gimeBus->writePhysicalByte(bufferAddr + i, sectorBuffer[i]);
+			snprintf(textBuffer, sizeof(textBuffer), "FDC: DSKCON Read Drive %u Track %02u Sector %02u", driveNum, trackNum, sectorNum);
+			gimeBus->statusBarText = textBuffer;
+		}
+		else
+		{
+			for (uint16_t i = 0; i < 256; i++)
+				sectorBuffer[i] = gimeBus->readPhysicalByte(bufferAddr + i);
+			writeImageSector(driveNum);
+			snprintf(textBuffer, sizeof(textBuffer), "FDC: DSKCON Write Drive %u Track %02u Sector %02u", driveNum, trackNum, sectorNum);
+			gimeBus->statusBarText = textBuffer;
+		}
+	}
+	// Restore and No-op have nothing to do since there's no head to move
+
+	gimeBus->writeMemoryByte(dskconParamAddr + DSKCON_PARAM_DCSTA, resultStatus);
+	dskconCallsHandled++;
+
+	// DSKCON saves and restores all of the registers it uses, so the only thing left to do is the equivalent of its RTS
+	gimeBus->cpu.cpuReg.PC = gimeBus->readMemoryWord(gimeBus->cpu.cpuReg.S);
+	gimeBus->cpu.cpuReg.S += 2;
+	return true;
+}
+
+static uint16_t calcCrc16Ccitt(uint16_t crcValue, const uint8_t* dataPtr, uint32_t dataLength)
+{
+	// The same CRC the WD2797 puts after every ID and data field: polynomial $1021, MSB first
+	for (uint32_t i = 0; i < dataLength; i++)
+	{
+		crcValue ^= dataPtr[i] << 8;
+		for (int bitNum = 0; bitNum < 8; bitNum++)
+			crcValue = (crcValue & 0x8000) ? ((crcValue << 1) ^ 0x1021) : (crcValue << 1);
+	}
+	return crcValue;
+}
+
+void FD502::readImageSector(uint8_t driveNum)
+{
+	// Copies the sector at diskImageOffset (as set by getDiskImageOffset) from our in-memory disk image into the sector buffer
+	memcpy(sectorBuffer, fdcDrive[driveNum].diskImageData.data() + diskImageOffset, diskSectorLength);
+}
+
+void FD502::writeImageSector(uint8_t driveNum)
+{
+	// Copies the sector buffer into our in-memory disk image at diskImageOffset and marks it to be written back on the next flush
+	memcpy(fdcDrive[driveNum].diskImageData.data() + diskImageOffset, sectorBuffer, diskSectorLength);
+	for (uint32_t blockNum = diskImageOffset / FD502_DIRTY_BLOCK_SIZE; blockNum <= ((diskImageOffset + diskSectorLength - 1) / FD502_DIRTY_BLOCK_SIZE); blockNum++)
+		fdcDrive[driveNum].dirtyBlocks[blockNum] = true;
+	fdcDrive[driveNum].isImageDirty = true;
+	if (fdcDrive[driveNum].diskImageFormat == DISK_IMAGE_FORMAT_DMK)
+		updateDmkDataCrc(driveNum);
+	if (fdcDrive[driveNum].hostDirectory != nullptr)
+		fdcDrive[driveNum].guestWroteSinceRebuild = true;
+}
+
+void FD502::updateDmkDataCrc(uint8_t driveNum)
+{
+	// A DMK keeps the data field's CRC right after the data, so it has to be worked out again whenever the sector changes or other DMK
+	// tools will see a CRC error. For a double density sector the CRC also covers the three $A1 sync bytes in front of the Data Address
+	// Mark, which the image stores along with everything else. A single density sector's CRC starts at the mark itself.
+	std::vector<uint8_t>& imageData = fdcDrive[driveNum].diskImageData;
+	uint16_t trackLength = imageData[2] | (imageData[3] << 8);
+	uint32_t trackEnd = DMK_HEADER_SIZE + (((diskImageOffset - DMK_HEADER_SIZE) / trackLength) + 1) * trackLength;
+	uint32_t crcEnd = diskImageOffset + diskSectorLength + 2;
+	if (crcEnd > trackEnd)
+		return;			// No room for a CRC before the next track starts
+	uint32_t crcStart = diskImageOffset - 1;
+	if ((crcStart >= 3) && (imageData[crcStart - 3] == DMK_MFM_SYNC_BYTE) && (imageData[crcStart - 2] == DMK_MFM_SYNC_BYTE) && (imageData[crcStart - 1] == DMK_MFM_SYNC_BYTE))
+		crcStart -= 3;
+	uint16_t crcValue = calcCrc16Ccitt(0xFFFF, imageData.data() + crcStart, (diskImageOffset + diskSectorLength) - crcStart);
+	imageData[crcEnd - 2] = crcValue >> 8;
+	imageData[crcEnd - 1] = crcValue & 0xFF;
+	for (uint32_t blockNum = (crcEnd - 2) / FD502_DIRTY_BLOCK_SIZE; blockNum <= ((crcEnd - 1) / FD502_DIRTY_BLOCK_SIZE); blockNum++)
+		fdcDrive[driveNum].dirtyBlocks[blockNum] = true;
+}
+
+bool FD502::getDiskImageOffset(uint8_t driveNum, uint8_t trackNum, uint8_t sectorNum, uint8_t sideNum)
+{
+	// IMPORTANT: Entry parameters (track number, sector number, side number) are zero-based. The sector number becomes the sector ID by adding 1.
+	if ((driveNum >= FD502_MAX_DRIVES) || !fdcDrive[driveNum].isDiskInserted)
 		return false;
-	else if ((diskGeometry->bytesPerSector == 1024) && (sectorNum > 0x08))
+	diskImageStruct* diskGeometry = fdcDrive[driveNum].diskImageGeometry;	// This pointer is just so we can use a shortened code reference to make things easier to read
+	if ((trackNum >= diskGeometry->tracksPerSide) || (sideNum >= diskGeometry->totalSides))
 		return false;
 
-	// IMPORTANT: The math below assumes all entry parameters (track number, sector number, side number) are zero-base numbers
-	diskImageOffset = (diskGeometry->bytesPerTrack * (trackNum * diskGeometry->totalSides)) + (diskGeometry->bytesPerTrack * sideNum) + (diskGeometry->bytesPerSector * sectorNum);
+	// Every sector ID on every track was indexed when the disk was inserted, so this works the same for any image format or sector layout
+	uint8_t sectorID = sectorNum + 1;
+	sectorIndexStruct& indexEntry = fdcDrive[driveNum].sectorIndex[((((uint32_t)trackNum * diskGeometry->totalSides) + sideNum) * 256) + sectorID];
+	if (indexEntry.sectorLength == 0)
+		return false;
+	diskImageOffset = indexEntry.imageOffset;
+	diskSectorLength = indexEntry.sectorLength;
 	return true;
 }
 
@@ -123,7 +692,7 @@ void FD502::fdcRegisterWrite(uint16_t regAddress, uint8_t paramByte)
 		fdcWritePrecompensation = paramByte & 0x10;
 		if (!fdcMotorOn && (paramByte & 0x08))
 		{
-			gimeBus->floppyIndexHoleCounter = 0;
+			motorStartTimestamp = gimeBus->masterBusCycleCounter;
 			printf("Floppy motor on.\n");
 			gimeBus->statusBarText = "FDC: Motor on";
 		}
@@ -195,6 +764,14 @@ uint8_t FD502::fdcRegisterRead(uint16_t regAddress)
 	switch (regAddress)
 	{
 	case 0xFF48:
+		// While a Type I command is running, bit 1 follows the index hole. It's only worked out when the status register is actually read.
+		if ((fdcPendingCommand >= FDC_OP_RESTORE) && (fdcPendingCommand <= FDC_OP_STEP_OUT))
+		{
+			if (isIndexPulseActive())
+				fdcStatusReg |= FDC_STATUS_I_INDEX;
+			else
+				fdcStatusReg &= ~FDC_STATUS_I_INDEX;
+		}
 		return fdcStatusReg;
 	case 0xFF49:
 		return fdcTrackReg;
@@ -356,7 +933,7 @@ uint8_t FD502::fdcHandleNextEvent()
 				}
 				return FD502_OPERATION_COMPLETE;
 			}
-			else if (bufferPosition < fdcDrive[fdcDriveSelect].diskImageGeometry->bytesPerSector)
+			else if (bufferPosition < diskSectorLength)
 			{
 				if (fdcStatusReg & FDC_STATUS_II_III_DATA_REQUEST)
 					fdcStatusReg |= FDC_STATUS_II_III_LOST_DATA;
@@ -375,8 +952,7 @@ uint8_t FD502::fdcHandleNextEvent()
 						fdcStatusReg |= FDC_STATUS_II_III_RECORD_NOT_FOUND;
 						return FDC_OP_READ_SECTOR;
 					}
-					fseek(fdcDrive[fdcDriveSelect].diskImageFile, diskImageOffset, SEEK_SET);
-					fread(&sectorBuffer, 1, fdcDrive[fdcDriveSelect].diskImageGeometry->bytesPerSector, fdcDrive[fdcDriveSelect].diskImageFile);
+					readImageSector(fdcDriveSelect);
 				}
 				fdcDataReg = sectorBuffer[bufferPosition];
 
@@ -428,7 +1004,7 @@ uint8_t FD502::fdcHandleNextEvent()
 				}
 				return FD502_OPERATION_COMPLETE;
 			}
-			else if (bufferPosition < fdcDrive[fdcDriveSelect].diskImageGeometry->bytesPerSector)
+			else if (bufferPosition < diskSectorLength)
 			{
 				// In double-density mode, the FDC waits for 22 "byte" times before it checks if DRQ was serviced and is ready to write data
 				if (fdcByteDelayCounter < 22)
@@ -483,15 +1059,13 @@ uint8_t FD502::fdcHandleNextEvent()
 			}
 			else
 			{
-				// If here, we have finished building our complete sector buffer. Write it to our Host device's disk image file and our Write Sector command is now complete.
+				// If here, we have finished building our complete sector buffer. Write it to our in-memory disk image and our Write Sector command is now complete.
 				if (!getDiskImageOffset(fdcDriveSelect, fdcTrackReg, fdcSectorReg - 1, fdcSideSelect))
 				{
 					fdcStatusReg |= FDC_STATUS_II_III_RECORD_NOT_FOUND;
 					return FDC_OP_WRITE_SECTOR;
 				}
-				fseek(fdcDrive[fdcDriveSelect].diskImageFile, diskImageOffset, SEEK_SET);
-				fwrite(&sectorBuffer, 1, fdcDrive[fdcDriveSelect].diskImageGeometry->bytesPerSector, fdcDrive[fdcDriveSelect].diskImageFile);
-				fflush(fdcDrive[fdcDriveSelect].diskImageFile);
+				writeImageSector(fdcDriveSelect);
 				fdcPendingCommand = FDC_OP_NONE;
 				fdcStatusReg &= ~(FDC_STATUS_II_III_BUSY | FDC_STATUS_II_III_DATA_REQUEST);		// clear both BUSY and DRQ flags
 				fdcHaltFlag = false;
@@ -514,7 +1088,7 @@ uint8_t FD502::fdcHandleNextEvent()
 			// Write Track waits until it encounters leading edge of Index Pulse before starting to write bytes, so until then, just return
 			if (!formatWritingStarted)
 			{
-				if (fdcIndexPulse)
+				if (isIndexPulseActive())
 					formatWritingStarted = true;
 				else
 					return FDC_OP_WRITE_TRACK;
@@ -618,9 +1192,7 @@ uint8_t FD502::fdcHandleNextEvent()
 						// At this point, we would have a complete sector written to the track. Output it to our disk image.
 						if (getDiskImageOffset(fdcDriveSelect, fdcTrackReg, formatSectorInfo[FDC_SECTOR_INFO_SECTOR] - 1, fdcSideSelect))
 						{
-							fseek(fdcDrive[fdcDriveSelect].diskImageFile, diskImageOffset, SEEK_SET);
-							fwrite(&sectorBuffer, 1, fdcDrive[fdcDriveSelect].diskImageGeometry->bytesPerSector, fdcDrive[fdcDriveSelect].diskImageFile);
-							fflush(fdcDrive[fdcDriveSelect].diskImageFile);
+							writeImageSector(fdcDriveSelect);
 							//printf("Physically wrote a sector to Host PC filesystem\n");
 						}
 						else
@@ -646,7 +1218,7 @@ uint8_t FD502::fdcHandleNextEvent()
 
 			formatTotalBytesCounter++;
 			//if (formatTotalBytesCounter == 6250)
-			if (fdcIndexPulse && (curFormatSegment == FDC_FORMAT_SEGMENT_GAP3))
+			if (isIndexPulseActive() && (curFormatSegment == FDC_FORMAT_SEGMENT_GAP3))
 			{
 				fdcPendingCommand = FDC_OP_NONE;
 				fdcStatusReg &= ~(FDC_STATUS_II_III_BUSY | FDC_STATUS_II_III_DATA_REQUEST);		// clear both BUSY and DRQ flags
@@ -737,8 +1309,8 @@ void FD502::fdcForceInterrupt(uint8_t interruptType)
 
 uint8_t FD502::fdcReadSector()
 {
-	// First, make sure the requested sector and track are not out of range for our mounted disk image
-	if ((fdcSectorReg <= fdcDrive[fdcDriveSelect].diskImageGeometry->sectorsPerTrack) && (fdcTrackReg < fdcDrive[fdcDriveSelect].diskImageGeometry->tracksPerSide))
+	// First, make sure the requested sector actually exists on this track of our mounted disk image. This also tells us the sector's length.
+	if (getDiskImageOffset(fdcDriveSelect, fdcTrackReg, fdcSectorReg - 1, fdcSideSelect))
 	{
 		// Note: When starting a command, we aren't merging bits into status register but starting fresh with default value
 		fdcStatusReg = FDC_STATUS_II_III_BUSY;		
@@ -762,8 +1334,8 @@ uint8_t FD502::fdcReadSector()
 
 uint8_t FD502::fdcWriteSector()
 {
-	// First, make sure the requested sector and track are not out of range for our mounted disk image
-	if ((fdcSectorReg <= fdcDrive[fdcDriveSelect].diskImageGeometry->sectorsPerTrack) && (fdcTrackReg < fdcDrive[fdcDriveSelect].diskImageGeometry->tracksPerSide))
+	// First, make sure the requested sector actually exists on this track of our mounted disk image. This also tells us the sector's length.
+	if (getDiskImageOffset(fdcDriveSelect, fdcTrackReg, fdcSectorReg - 1, fdcSideSelect))
 	{
 		// Note: When starting a command, we aren't merging bits into status register but starting fresh with default value
 		fdcStatusReg = FDC_STATUS_II_III_BUSY;
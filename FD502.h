@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include <vector>
 
 constexpr uint8_t FDC_CMD_PREFIX_RESTORE_SEEK				= 0b00000000;
 constexpr uint8_t FDC_CMD_PREFIX_STEP						= 0b00100000;
@@ -62,12 +63,52 @@ constexpr uint8_t FDC_STATUS_II_III_LOST_DATA				= 0x04;
 constexpr uint8_t FDC_STATUS_II_III_DATA_REQUEST			= 0x02;
 constexpr uint8_t FDC_STATUS_II_III_BUSY					= 0x01;
 
+constexpr uint8_t FD502_MAX_DRIVES							= 3;
+
 constexpr uint8_t FD502_OPERATION_COMPLETE					= 0x00;
 constexpr uint8_t FD502_HALT_ENABLED						= 0x01;
 constexpr uint8_t FD502_ERROR_DRIVE_NOT_ATTACHED			= 0x02;
 constexpr uint8_t FD502_ERROR_NO_DISK_INSERTED				= 0x03;
 constexpr uint8_t FD502_ERROR_OPENING_DISK_IMAGE			= 0x04;
 constexpr uint8_t FD502_ERROR_UNSUPPORTED_DISK_IMAGE		= 0x05;
+constexpr uint8_t FD502_ERROR_NOT_OVERLAY					= 0x06;
+constexpr uint8_t FD502_ERROR_NOT_HOST_DIRECTORY			= 0x07;
+constexpr uint8_t FD502_ERROR_WRITING_DISK_IMAGE			= 0x08;
+
+// Disk BASIC's DSKCON routine, which all of its disk I/O goes through. The ROM has a pointer to DSKCON at $C004 and a pointer to its parameter block at $C006.
+constexpr uint16_t DSKCON_VECTOR			= 0xC004;
+constexpr uint16_t DSKCON_PARAM_VECTOR		= 0xC006;
+constexpr uint8_t DSKCON_PARAM_DCOPC		= 0;		// Operation code
+constexpr uint8_t DSKCON_PARAM_DCDRV		= 1;		// Drive number
+constexpr uint8_t DSKCON_PARAM_DCTRK		= 2;		// Track number
+constexpr uint8_t DSKCON_PARAM_DSEC			= 3;		// Sector number (1-18)
+constexpr uint8_t DSKCON_PARAM_DCBPT		= 4;		// 16-bit pointer to the 256 byte sector buffer
+constexpr uint8_t DSKCON_PARAM_DCSTA		= 6;		// Status, which is the FDC status register's error bits (0 = success)
+constexpr uint8_t DSKCON_OP_RESTORE			= 0;
+constexpr uint8_t DSKCON_OP_NOP				= 1;
+constexpr uint8_t DSKCON_OP_READ_SECTOR		= 2;
+constexpr uint8_t DSKCON_OP_WRITE_SECTOR	= 3;
+
+constexpr uint8_t DISK_IMAGE_FORMAT_JVC					= 0;	// Plain sector dump (.DSK), with or without a JVC header
+constexpr uint8_t DISK_IMAGE_FORMAT_DMK					= 1;	// Track-level image that keeps every ID address mark, so odd layouts survive
+
+constexpr uint16_t DMK_HEADER_SIZE						= 16;
+constexpr uint16_t DMK_IDAM_TABLE_SIZE					= 128;	// Each track starts with 64 little-endian pointers to its ID address marks
+constexpr uint8_t DMK_FLAG_SINGLE_SIDED					= 0x10;
+constexpr uint8_t DMK_FLAG_IGNORE_DENSITY				= 0x80;
+constexpr uint16_t DMK_IDAM_DOUBLE_DENSITY				= 0x8000;
+constexpr uint16_t DMK_IDAM_OFFSET_MASK					= 0x3FFF;
+constexpr uint16_t DMK_DATA_MARK_SEARCH_WINDOW			= 64;	// How far past an ID field we look for its Data Address Mark
+constexpr uint8_t DMK_MFM_SYNC_BYTE						= 0xA1;	// Three of these come before every double density address mark, and count towards its CRC
+
+constexpr uint16_t FD502_DIRTY_BLOCK_SIZE				= 256;	// Written areas of the in-memory image are tracked in blocks of this size
+
+// Where a sector lives in the disk image. The sector index holds one of these for every possible sector ID on every track/side.
+struct sectorIndexStruct
+{
+	uint32_t imageOffset;
+	uint16_t sectorLength;		// 0 = No sector with this ID on this track
+};
 
 struct diskImageStruct
 {
@@ -88,7 +129,18 @@ struct driveStruct
 	bool isDiskInserted = false;
 	std::string imgFilePathname;
 	FILE* diskImageFile;
+	DiskOverlay* diskOverlay = nullptr;			// Only set when the disk was inserted in overlay mode, in which case diskImageFile isn't used
+	HostDirectoryDisk* hostDirectory = nullptr;	// Only set when a host directory was inserted instead of a disk image. It has no file or write target.
+	int writeTarget = DISK_WRITE_NO_TARGET;		// Our slot in the bus's DiskWriteQueue
 	diskImageStruct* diskImageGeometry;
+	std::vector<uint8_t> diskImageData;		// The entire disk image is kept in memory. Written sectors only go back to the host file when flushed.
+	std::vector<bool> dirtyBlocks;			// One flag per FD502_DIRTY_BLOCK_SIZE bytes of the image, set when it has been written since the last flush
+	bool isImageDirty = false;
+	bool guestWroteSinceRebuild = false;	// Host directory disks only. Once set, host-side changes wait for a RESCAN instead of being picked up on their own.
+	bool rescanNoticeShown = false;
+	uint8_t diskImageFormat = DISK_IMAGE_FORMAT_JVC;
+	diskImageStruct mountedGeometry;		// Worked out when the disk is inserted, diskImageGeometry points here
+	std::vector<sectorIndexStruct> sectorIndex;	// Indexed by ((track * sides) + side) * 256 + sector ID
 };
 
 class FD502
@@ -101,22 +153,36 @@ public:
 	void fdcDetachDrive(uint8_t);
 	uint8_t fdcInsertDisk(uint8_t, std::string);
 	uint8_t fdcEjectDisk(uint8_t);
+	uint8_t fdcFlushDisk(uint8_t);
+	uint8_t fdcCommitOverlay(uint8_t);
+	uint8_t fdcDiscardOverlay(uint8_t);
+	uint8_t fdcRescanHostDirectory(uint8_t);
+	void fdcFlushAllDisks();
+	int fdcFindDriveUsingFile(std::string);
+	void fdcSetDskconHLE(bool);
+	bool checkDskconTrap(uint16_t);
 	void fdcRegisterWrite(uint16_t, uint8_t);
 	uint8_t fdcRegisterRead(uint16_t);
 	uint8_t fdcHandleNextEvent();
+	bool isIndexPulseActive();
+	uint32_t getSectorRotationalDelay();
 
 public:
 	bool isConnected;
+	bool fastDiskMode;						// Skips the mechanical delays (stepping, head load, byte timing) but keeps the register protocol the same
+	bool dskconHLEEnabled;					// Services Disk BASIC's DSKCON calls directly against the disk image instead of going through the FDC registers
+	uint16_t trapAddrDSKCON, dskconParamAddr;
+	uint32_t dskconCallsHandled;
 	uint8_t fdcDriveSelect;
 	bool fdcMotorOn;
 	bool fdcWritePrecompensation;
 	bool fdcDoubleDensity;					// false = Single Density, true = Double Density
 	bool fdcHaltFlag;
 	bool fdcHeadLoaded;
-	bool fdcIndexPulse;
+	uint32_t motorStartTimestamp;			// masterBusCycleCounter when the motor came on, moved forward a whole number of rotations at a time
 	uint8_t fdcCommandReg, fdcTrackReg, fdcSectorReg, fdcSideSelect, fdcDataReg, fdcStatusReg;
 	uint8_t stepWaitCounter, curStepRate, fdcPendingCommand;
-	driveStruct fdcDrive[3];
+	driveStruct fdcDrive[FD502_MAX_DRIVES];
 	char textBuffer[128];
 
 	// FOR DEBUG
@@ -134,6 +200,16 @@ private:
 	uint8_t fdcWriteSector();
 	uint8_t fdcWriteTrack();
 	bool getDiskImageOffset(uint8_t, uint8_t, uint8_t, uint8_t);
+	uint8_t parseJvcImage(uint8_t);
+	uint8_t parseDmkImage(uint8_t);
+	bool isDmkImage(uint8_t);
+	uint8_t insertHostDirectory(uint8_t, std::string);
+	uint8_t syncHostDirectory(uint8_t);
+	void closeImageFile(uint8_t);
+	uint32_t getRotationPosition();
+	void readImageSector(uint8_t);
+	void writeImageSector(uint8_t);
+	void updateDmkDataCrc(uint8_t);
 
 	GimeBus* gimeBus = nullptr;
 	uint8_t physicalTrackPosition, destinationTrack, destinationSector, lastStepDirection;
@@ -144,6 +220,7 @@ private:
 	uint8_t sectorBuffer[1024];			// Allocate 1024 bytes for sector buffer as its the maximum sector length supported by the FD502
 	bool updateTrackRegFlag, verifyAfterCommand, formatWritingStarted;
 	uint32_t diskImageOffset;
+	uint16_t diskSectorLength;			// Length of the sector found by the last successful getDiskImageOffset() call
 
 	// Common CoCo disk image configs
 	// Elements = Total Filesize in bytes, Bytes/Sector, Sectors/Track, Tracks/Side, Total Sides
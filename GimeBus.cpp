@@ -1,3 +1,4 @@
+#include <cstring>
 #include "GimeBus.h"
 #include "CoCo3EmuPGE.h"
 #include <conio.h>
@@ -14,6 +15,7 @@ GimeBus::GimeBus()
 	cpu.ConnectToBus(this);
 	diskController.ConnectToBus(this);
 	emuDiskDriver.ConnectToBus(this);
+	cassetteDeck.ConnectToBus(this);
 	//serial.ConnectToBus(this);
 
 	// Joysticks state setup
@@ -44,8 +46,9 @@ GimeBus::GimeBus()
 	gimeRegFIRQtypes = 0x00;
 
 	samPageSelectReg = 0x00;
-	vdgVideoConfig.gfxModeEnabled = false;
-	vdgVideoConfig.fontIsExternal = false;
+	memset(videoRegs, 0, sizeof(videoRegs));
+	videoRegWriteLog.reserve(4096);
+	videoFrameComplete = false;
 
 	// One CPU clock occurs for every 4 NTSC video color burst clock cycles, and one video color burst cycle occurs for every 8 (GIME) Master Clock cycles.
 	// CoCo 3's power-up clock speed is ~0.89 MHz (slow-mode), so with the cycle scaling described above, 1 (slow-mode) CPU clock tick happens every 32 GIME Master clock cycles
@@ -64,6 +67,7 @@ void GimeBus::SetRAMSize(int sizeInKB)
 	ramTotalSizeKB = sizeInKB;
 	ramSizeMask = (sizeInKB * 1024) - 1;
 	physicalRAM.resize(sizeInKB * 1024);
+	videoPageWriteStamp.assign((sizeInKB * 1024) >> VIDEO_DIRTY_PAGE_SHIFT, videoLineStamp);
 	printf("CoCo 3 RAM Size set to %u bytes.\n", (unsigned int)physicalRAM.size());
 	// Init all the physical RAM to random values which is what happens on real hardware
 	//for (int i = 0; i < (sizeInKB * 1024); i++)
@@ -91,33 +95,15 @@ void GimeBus::gimeBusClockTick()
 
 	if (diskController.isConnected)
 	{
-		// Check if the emulated disk is spinning, and if so, emulate the state of the Index Pulse
-		if (diskController.fdcMotorOn)
-		{
-			floppyIndexHoleCounter++;
-			// Set the internal Floppy Index Pulse state if we are at the right points in the counter/rotation
-			if (floppyIndexHoleCounter >= gimePerFloppyRotation)
-			{
-				diskController.fdcIndexPulse = false;
-				floppyIndexHoleCounter = 0;		// If the emulated floppy has completed one complete rotation (assuming 300 rpm), then reset our counter until next Index Pulse will occur
-			}
-			else if (floppyIndexHoleCounter >= (gimePerFloppyRotation - gimeFloppyIndexWidth))
-				diskController.fdcIndexPulse = true;
-		}
-
+		// The index pulse and the disk's rotational position are worked out from masterBusCycleCounter by the FD502 when they're needed, so
+		// nothing has to happen here unless a command is running
 		if (diskController.fdcPendingCommand != FDC_OP_NONE)
 		{
 			// Check if we are processing a "Type I" floppy head-stepping related command and handle it if so
 			if ((diskController.fdcPendingCommand >= FDC_OP_RESTORE) && (diskController.fdcPendingCommand <= FDC_OP_STEP_OUT))
 			{
-				// Copy internal Floppy Index Pulse state from internal variable to FDC Status Register (Bit 1)
-				if (diskController.fdcIndexPulse)
-					diskController.fdcStatusReg |= FDC_STATUS_I_INDEX;
-				else
-					diskController.fdcStatusReg &= ~FDC_STATUS_I_INDEX;
-
 				floppySeekIntervalCounter++;
-				if (floppySeekIntervalCounter > 28636)
+				if (floppySeekIntervalCounter > (diskController.fastDiskMode ? gimeFastFloppyStepInterval : 28636))
 				{
 					// 28636 GIME cycles approximately works out to be 1 millisecond in real-time, which we can use to time our floppy head-stepping rate
 					floppySeekIntervalCounter = 0;
@@ -133,11 +119,16 @@ void GimeBus::gimeBusClockTick()
 			else if (diskController.fdcMotorOn && (diskController.fdcPendingCommand >= FDC_OP_READ_SECTOR) && (diskController.fdcPendingCommand <= FDC_OP_WRITE_TRACK))
 			{
 				floppyAccessIntervalCounter++;
-				if (!diskController.fdcHeadLoaded && (floppyAccessIntervalCounter > (28636 * 100)))
+				if (!diskController.fdcHeadLoaded && (floppyAccessIntervalCounter > (diskController.fastDiskMode ? gimeFastFloppyHeadLoad : gimeFloppyHeadLoad)))
 				{
 					floppyAccessIntervalCounter = 0;
 					floppyFormatIndexCounter = 0;
 					diskController.fdcHeadLoaded = true;
+					// With the head down, the first byte of a sector can't come until its ID field has rotated around to it. Read and Write
+					// Track sync up on the index hole themselves, so they don't get this.
+					floppyRotationalWait = 0;
+					if (!diskController.fastDiskMode && ((diskController.fdcPendingCommand == FDC_OP_READ_SECTOR) || (diskController.fdcPendingCommand == FDC_OP_WRITE_SECTOR)))
+						floppyRotationalWait = diskController.getSectorRotationalDelay();
 					if (diskController.fdcPendingCommand == FDC_OP_WRITE_SECTOR)
 					{
 						diskController.fdcStatusReg |= FDC_STATUS_II_III_DATA_REQUEST;
@@ -148,10 +139,14 @@ void GimeBus::gimeBusClockTick()
 						}
 					}
 				}
-				else if (diskController.fdcHeadLoaded && (floppyAccessIntervalCounter > 916))
+				else if (diskController.fdcHeadLoaded && ((floppyAccessIntervalCounter > (916 + floppyRotationalWait)) || (diskController.fastDiskMode && (floppyAccessIntervalCounter > gimeFastFloppyByteGap)
+					&& !(diskController.fdcStatusReg & FDC_STATUS_II_III_DATA_REQUEST))))
 				{
+					// In fast disk mode, move on to the next byte as soon as the CPU has read or written the last one. If it doesn't get around to it, we still
+					// fall back to the normal byte timing so Lost Data behaves the same as always.
 					// 916 GIME Master Bus cycles works out to be approximately 32 microseconds (it's technically 916.3635200000006) which is the data rate defined in the docs for MFM (double density)
 					floppyAccessIntervalCounter = 0;
+					floppyRotationalWait = 0;
 					uint8_t fdcEventResult = diskController.fdcHandleNextEvent();
 					if (fdcEventResult == FD502_OPERATION_COMPLETE)
 					{
@@ -167,6 +162,10 @@ void GimeBus::gimeBusClockTick()
 	{
 		dotCounter = 0;
 		scanlineCounter++;
+		videoLineStamp++;
+		audioBlockComplete = true;				// Audio gets mixed once per scanline
+		if (scanlineCounter == VIDEO_FRAME_END_SCANLINE)
+			videoFrameComplete = true;			// Last visible scanline has gone by so the main loop can now draw the whole frame from the register log
 		if (scanlineCounter == 262)
 		{
 			scanlineCounter = 0;
@@ -216,6 +215,8 @@ void GimeBus::decrementGimeTimer()
 	{
 		gimeTimerCounter = gimeRegTimer.word;		// Reset the counter to it's set start value
 		gimeBlinkStateOn = !gimeBlinkStateOn;		// Invert the on/off state for blinking text in the GIME Hardware Font text modes since it's governed by the Timer
+		if (!gimeRegInit0.cocoCompatMode && !gimeRegVMode.gfxOrTextMode && (gimeRegVRES.CRES & 0x01))
+			logVideoRegWrite(VIDEO_REG_BLINK, gimeBlinkStateOn);	// Only text modes with color attributes enabled can show blinking characters
 		// TODO: Check if GIME registers have interrupts enabled for when timer hits zero
 		if ((gimeRegIRQtypes & GIME_INT_MASK_TIMER) && gimeRegInit0.chipIRQEnabled)
 		{
@@ -230,123 +231,162 @@ void GimeBus::decrementGimeTimer()
 	}
 }
 
+void GimeBus::setAudioSourceLevel(uint8_t sourceNum, float newLevel)
+{
+	// Record the source's new output level at the exact GIME clock it changed so it can be turned into a band-limited step
+	audioSynth[sourceNum].setLevel(masterBusCycleCounter - audioBlockStartClock, newLevel);
+}
+
+bool GimeBus::isCassetteAudioSelected()
+{
+	// The tape is only heard when sound is enabled (PIA1 CB2) and the analog multiplexer is switched to the cassette input, which is
+	// select line 1 (PIA0 CA2) high and select line 2 (PIA0 CB2) low. That's what AUDIO ON in BASIC sets up.
+	return (devPIA1.SideB.controlReg & 0x08) && (devPIA0.SideA.controlReg & 0x08) && !(devPIA0.SideB.controlReg & 0x08);
+}
+
 void GimeBus::updateVideoParams()
 {
-	if (gimeRegInit0.cocoCompatMode)
-	{
-		videoStartAddr = ((gimeVertOffsetMSB >> 5) * 0x10000) + (samPageSelectReg * 512) + ((gimeVertOffsetLSB & 0x3F) * 8) + gimeHorizontalOffsetReg.offsetAddress;
-		vdgVideoConfig.gfxModeEnabled = devPIA1.SideB.dataReg & 0x80;
-		vdgVideoConfig.colorSetSelect = (devPIA1.SideB.dataReg & 0b00001000) >> 3;
-		curResolutionWidth = 512;
-		curResolutionHeight = 192;
+	// The renderer works from its own copy of the video registers (replayed from the write log at the end of each frame), so all that's needed 
+	// live is the current resolution for mapping the host mouse onto the CoCo's joystick port
+	videoParamsStruct liveVideoParams;
+	calcVideoParams(videoRegs, liveVideoParams);
+	curResolutionWidth = liveVideoParams.resolutionWidth;
+	curResolutionHeight = liveVideoParams.resolutionHeight;
+
+	// Make sure the blink state in the register file is current whenever we switch into a mode that can show it
+	if (!gimeRegInit0.cocoCompatMode && !gimeRegVMode.gfxOrTextMode && (gimeRegVRES.CRES & 0x01))
+		logVideoRegWrite(VIDEO_REG_BLINK, gimeBlinkStateOn);
+}
 
-		if (vdgVideoConfig.gfxModeEnabled)
+void GimeBus::calcVideoParams(const uint8_t* regs, videoParamsStruct& params)
+{
+	uint8_t pia1DataB = regs[VIDEO_REG_PIA1B];
+	uint8_t vertOffsetMSB = regs[VIDEO_REG_VOFFSET_MSB];
+	uint8_t vertOffsetLSB = regs[VIDEO_REG_VOFFSET_LSB];
+	uint8_t horizOffset = regs[VIDEO_REG_HOFFSET] & 0x7F;
+
+	params.cocoCompatMode = regs[VIDEO_REG_INIT0] & 0x80;
+	params.vmode.gfxOrTextMode = (regs[VIDEO_REG_VMODE] & 0x80);
+	params.vmode.cmpColorPhaseInvert = (regs[VIDEO_REG_VMODE] & 0x20);
+	params.vmode.monoCompositeOut = (regs[VIDEO_REG_VMODE] & 0x10);
+	params.vmode.video50hz = (regs[VIDEO_REG_VMODE] & 0x08);
+	params.vmode.LPR = (regs[VIDEO_REG_VMODE] & 0x07);
+	params.vres.LPF = (regs[VIDEO_REG_VRES] >> 5) & 0x03;
+	params.vres.HRES = (regs[VIDEO_REG_VRES] >> 2) & 0x07;
+	params.vres.CRES = (regs[VIDEO_REG_VRES] & 0x03);
+	params.linesPerRow = gimeLinesPerRow[params.vmode.LPR];
+
+	if (params.cocoCompatMode)
+	{
+		params.videoStartAddr = ((vertOffsetMSB >> 5) * 0x10000) + (regs[VIDEO_REG_SAM_PAGE] * 512) + ((vertOffsetLSB & 0x3F) * 8) + horizOffset;
+		params.vdg.gfxModeEnabled = pia1DataB & 0x80;
+		params.vdg.colorSetSelect = (pia1DataB & 0b00001000) >> 3;
+		params.vdg.fontIsExternal = pia1DataB & 0x10;
+		params.resolutionWidth = 512;
+		params.resolutionHeight = 192;
+
+		if (params.vdg.gfxModeEnabled)
 		{
-			uint8_t videoMode = ((devPIA1.SideB.dataReg & 0b01110000) >> 1) | samVideoDisplayReg;
+			uint8_t videoMode = ((pia1DataB & 0b01110000) >> 1) | regs[VIDEO_REG_SAM_DISPLAY];
 			switch (videoMode)
 			{
 			case 0b00000001:
-				vdgVideoConfig.colorDepth = 4;
-				mainPtr->bytesPerPixelRow = 16;
-				mainPtr->pixelsPerDraw = 8;
+				params.vdg.colorDepth = 4;
+				params.bytesPerPixelRow = 16;
+				params.pixelsPerDraw = 8;
 				break;
 			case 0b00001001:
-				vdgVideoConfig.colorDepth = 2;
-				mainPtr->bytesPerPixelRow = 16;
-				mainPtr->pixelsPerDraw = 4;
+				params.vdg.colorDepth = 2;
+				params.bytesPerPixelRow = 16;
+				params.pixelsPerDraw = 4;
 				break;
 			case 0b00010010:
-				vdgVideoConfig.colorDepth = 4;
-				mainPtr->bytesPerPixelRow = 32;
-				mainPtr->pixelsPerDraw = 4;
+				params.vdg.colorDepth = 4;
+				params.bytesPerPixelRow = 32;
+				params.pixelsPerDraw = 4;
 				break;
 			case 0b00011011:
-				vdgVideoConfig.colorDepth = 2;
-				mainPtr->bytesPerPixelRow = 16;
-				mainPtr->pixelsPerDraw = 4;
+				params.vdg.colorDepth = 2;
+				params.bytesPerPixelRow = 16;
+				params.pixelsPerDraw = 4;
 				break;
 			case 0b00100100:
-				vdgVideoConfig.colorDepth = 4;
-				mainPtr->bytesPerPixelRow = 32;
-				mainPtr->pixelsPerDraw = 4;
+				params.vdg.colorDepth = 4;
+				params.bytesPerPixelRow = 32;
+				params.pixelsPerDraw = 4;
 				break;
 			case 0b00101101:
-				vdgVideoConfig.colorDepth = 2;
-				mainPtr->bytesPerPixelRow = 16;
-				mainPtr->pixelsPerDraw = 4;
+				params.vdg.colorDepth = 2;
+				params.bytesPerPixelRow = 16;
+				params.pixelsPerDraw = 4;
 				break;
 			case 0b00110110:
-				vdgVideoConfig.colorDepth = 4;
-				mainPtr->bytesPerPixelRow = 32;
-				mainPtr->pixelsPerDraw = 4;
+				params.vdg.colorDepth = 4;
+				params.bytesPerPixelRow = 32;
+				params.pixelsPerDraw = 4;
 				break;
 			case 0b00111110:
-				vdgVideoConfig.colorDepth = 2;
-				mainPtr->bytesPerPixelRow = 32;
-				mainPtr->pixelsPerDraw = 2;
+				params.vdg.colorDepth = 2;
+				params.bytesPerPixelRow = 32;
+				params.pixelsPerDraw = 2;
 				break;
 			}
-			mainPtr->colorSetOffset = vdgVideoConfig.colorDepth * vdgVideoConfig.colorSetSelect;
-			mainPtr->borderPixel = vdgBorderPaletteDefs[vdgVideoConfig.colorSetSelect];
+			params.colorSetOffset = params.vdg.colorDepth * params.vdg.colorSetSelect;
 		}
-		else 
-			vdgVideoConfig.fontIsExternal = devPIA1.SideB.dataReg & 0x10;
 	}
 	else
 	{
-		videoStartAddr = (gimeVertOffsetMSB * 2048) + (gimeVertOffsetLSB * 8) + gimeHorizontalOffsetReg.offsetAddress;
-		curResolutionHeight = gimeVerticalResolutions[gimeRegVRES.LPF];
-		if (!gimeRegVMode.gfxOrTextMode)
+		params.videoStartAddr = (vertOffsetMSB * 2048) + (vertOffsetLSB * 8) + horizOffset;
+		params.resolutionHeight = gimeVerticalResolutions[params.vres.LPF];
+		if (!params.vmode.gfxOrTextMode)
 		{
 			// Text display mode
-			mainPtr->curLinesPerRow = gimeLinesPerRow[gimeRegVMode.LPR];
-			mainPtr->underlineRowOffset = gimeUnderlineOffset[mainPtr->curLinesPerRow - 8];
-			mainPtr->curBytesPerChar = (gimeRegVRES.CRES & 0x01) + 1;	// If color attributes are enabled, will be 2 bytes/char, otherwise 1
-			mainPtr->curCharsPerRow = textCharsPerRow[gimeRegVRES.HRES];
-			mainPtr->curBytesPerCharRow = mainPtr->curCharsPerRow * mainPtr->curBytesPerChar;
-			curResolutionWidth = gimeHorizontalResolutions[((gimeRegVRES.HRES & 0x05) >> 1) | (gimeRegVRES.HRES & 0x01)];
+			params.underlineRowOffset = (params.linesPerRow >= 8) ? gimeUnderlineOffset[params.linesPerRow - 8] : 0;
+			params.bytesPerChar = (params.vres.CRES & 0x01) + 1;	// If color attributes are enabled, will be 2 bytes/char, otherwise 1
+			params.charsPerRow = textCharsPerRow[params.vres.HRES];
+			params.bytesPerCharRow = params.charsPerRow * params.bytesPerChar;
+			params.resolutionWidth = gimeHorizontalResolutions[((params.vres.HRES & 0x05) >> 1) | (params.vres.HRES & 0x01)];
 		}
 		else
 		{
 			// GIME Graphics Modes
-			mainPtr->curLinesPerRow = gimeLinesPerRow[gimeRegVMode.LPR];
-			mainPtr->bytesPerPixelRow = gfxBytesPerRow[gimeRegVRES.HRES];
+			params.bytesPerPixelRow = gfxBytesPerRow[params.vres.HRES];
 
-			switch ((gimeRegVRES.HRES << 2) | gimeRegVRES.CRES)
+			switch ((params.vres.HRES << 2) | params.vres.CRES)
 			{
 			case 0b00011101:
 			case 0b00010100:
-				mainPtr->pixelsPerDraw = 1;
-				curResolutionWidth = 640;
+				params.pixelsPerDraw = 1;
+				params.resolutionWidth = 640;
 				break;
 			case 0b00011001:
 			case 0b00010000:
-				mainPtr->pixelsPerDraw = 1;
-				curResolutionWidth = 512;
+				params.pixelsPerDraw = 1;
+				params.resolutionWidth = 512;
 				break;
 			case 0b00011110:
 			case 0b00010101:
 			case 0b00001100:
-				mainPtr->pixelsPerDraw = 2;
-				curResolutionWidth = 640;
+				params.pixelsPerDraw = 2;
+				params.resolutionWidth = 640;
 				break;
 			case 0b00011010:
 			case 0b00010001:
 			case 0b00001000:
-				mainPtr->pixelsPerDraw = 2;
-				curResolutionWidth = 512;
+				params.pixelsPerDraw = 2;
+				params.resolutionWidth = 512;
 				break;
 			case 0b00010110:
 			case 0b00001101:
 			case 0b00000100:
-				mainPtr->pixelsPerDraw = 4;
-				curResolutionWidth = 640;
+				params.pixelsPerDraw = 4;
+				params.resolutionWidth = 640;
 				break;
 			case 0b00010010:
 			case 0b00001001:
 			case 0b00000000:
-				mainPtr->pixelsPerDraw = 4;
-				curResolutionWidth = 512;
+				params.pixelsPerDraw = 4;
+				params.resolutionWidth = 512;
 				break;
 			}
 		}
@@ -354,7 +394,17 @@ void GimeBus::updateVideoParams()
 
 	// If total system RAM is stock CoCo 3 128K, mask off the upper bits to keep within the limited physical address space
 	if (ramTotalSizeKB == 128)
-		videoStartAddr &= 0x1FFFF;
+		params.videoStartAddr &= 0x1FFFF;
+}
+
+void GimeBus::logVideoRegWrite(uint8_t regIndex, uint8_t value)
+{
+	// Writes that don't actually change anything are dropped so the renderer only ever sees real changes
+	if (videoRegs[regIndex] == value)
+		return;
+	videoRegs[regIndex] = value;
+	// Timestamp is measured in GIME master clocks from the end of the last rendered frame, which is the same scale renderVideoFrame() uses for each scanline
+	videoRegWriteLog.push_back({ (((scanlineCounter + 262 - VIDEO_FRAME_END_SCANLINE) % 262) * 1820) + dotCounter, regIndex, value });
 }
 
 uint8_t GimeBus::readPhysicalByte(uint16_t address)
@@ -407,10 +457,80 @@ uint8_t GimeBus::writePhysicalByte(uint16_t address, uint8_t byte)
 	}
 
 	physicalRAM[destPhysicalAddr & ramSizeMask] = byte;
+	videoPageWriteStamp[(destPhysicalAddr & ramSizeMask) >> VIDEO_DIRTY_PAGE_SHIFT] = videoLineStamp;
 	
 	return byte;
 }
 
+void GimeBus::readPhysicalBlock(uint16_t address, uint8_t* destData, uint16_t length)
+{
+	// Same result as calling readPhysicalByte() for every address in the range, but the address is only translated once per MMU block
+	while (length > 0)
+	{
+		int32_t physicalAddr;
+		uint16_t spanLength = translateLogicalSpan(address, length, physicalAddr);
+		if (physicalAddr < 0)
+		{
+			for (uint16_t i = 0; i < spanLength; i++)
+				destData[i] = readByteFromROM(address + i);
+		}
+		else
+			memcpy(destData, physicalRAM.data() + physicalAddr, spanLength);
+		address += spanLength;
+		destData += spanLength;
+		length -= spanLength;
+	}
+}
+
+void GimeBus::writePhysicalBlock(uint16_t address, const uint8_t* sourceData, uint16_t length)
+{
+	// Same result as calling writePhysicalByte() for every address in the range, but the address is only translated once per MMU block
+	while (length > 0)
+	{
+		int32_t physicalAddr;
+		uint16_t spanLength = translateLogicalSpan(address, length, physicalAddr);
+		if (physicalAddr >= 0)
+		{
+			uint32_t spanStart = physicalAddr;
+			memcpy(physicalRAM.data() + spanStart, sourceData, spanLength);
+			uint32_t lastPageNum = (spanStart + spanLength - 1) >> VIDEO_DIRTY_PAGE_SHIFT;
+			for (uint32_t pageNum = spanStart >> VIDEO_DIRTY_PAGE_SHIFT; pageNum <= lastPageNum; pageNum++)
+				videoPageWriteStamp[pageNum] = videoLineStamp;
+		}
+		address += spanLength;
+		sourceData += spanLength;
+		length -= spanLength;
+	}
+}
+
+uint16_t GimeBus::translateLogicalSpan(uint16_t address, uint32_t length, int32_t& physicalAddr)
+{
+	// Works out how many bytes starting at a logical address map to one contiguous run of physical RAM, which is never more than the rest
+	// of the current 8K MMU block. physicalAddr is set to where the run starts, or -1 if ROM has that part of the address space.
+	uint32_t spanEnd = (address & 0xE000) + 0x2000;
+	if (gimeRegInit0.mmuEnabled && ((address < 0xFE00) || !gimeRegInit0.constSecondaryVectors))
+	{
+		if (gimeRegInit0.constSecondaryVectors && (spanEnd > 0xFE00))
+			spanEnd = 0xFE00;		// The constant secondary vectors don't follow the MMU, so they get their own span
+		uint8_t mmuRegisterIndex = (address >> 13) + (gimeRegInit1.mmuTaskSelect * 8);
+		if (!gimeAllRamModeEnabled && ((gimeMMUBankRegs[mmuRegisterIndex].bankNum >= 0x3C) && (gimeMMUBankRegs[mmuRegisterIndex].bankNum <= 0x3F)))
+			physicalAddr = -1;
+		else
+			physicalAddr = (gimeMMUBankRegs[mmuRegisterIndex].mmuBlockAddr + (address & 0x1FFF)) & ramSizeMask;
+	}
+	else
+	{
+		if (!gimeAllRamModeEnabled && !gimeRegInit0.mmuEnabled && (address >= 0x8000))
+			physicalAddr = -1;
+		else
+			physicalAddr = (address + 0x70000) & ramSizeMask;
+	}
+
+	if ((address + length) < spanEnd)
+		spanEnd = address + length;
+	return spanEnd - address;
+}
+
 uint8_t GimeBus::readByteFromROM(uint16_t address)
 {
 	switch (gimeRegInit0.romMapControl)
@@ -495,7 +615,7 @@ uint8_t GimeBus::readMemoryByte(uint16_t address)
 			if (!(devPIA1.SideA.controlReg & PIA_CTRL_DIR_MASK))
 				return devPIA1.SideA.dataDirReg;
 			else
-				return (devPIA1.SideA.dataReg);
+				return ((devPIA1.SideA.dataReg & 0xFE) | cassetteDeck.readInputBit());	// Bit 0 is the cassette input
 			break;
 		case 0xFF21:
 			return devPIA1.SideA.controlReg;
@@ -532,6 +652,10 @@ uint8_t GimeBus::readMemoryByte(uint16_t address)
 			if (emuDiskDriver.isEnabled)
 				return EMUDISK_STATUS_ERROR_INVALID_DRV_NUM;
 			break;
+		case 0xFF87:
+			if (emuDiskDriver.isEnabled)
+				return emuDiskDriver.sectorCountReg;
+			break;
 		// GIME Registers
 		case 0xFF92:
 			// GIME IRQ Request Enable Register
@@ -553,7 +677,14 @@ uint8_t GimeBus::readMemoryByte(uint16_t address)
 			return returnByte;
 		// This is my custom idea for Emulator Info register. $FF96 supposedly isnt used by anything else real
 		case 0xFF96:
-			if (emuInfoTextIndex == -3)
+			if (emuInfoTextIndex == -4)
+			{
+				// Capability flags come after both strings so anything that only reads the header and name never sees them
+				returnByte = emuDiskDriver.isEnabled ? (EMU_INFO_CAP_EMUDISK_MULTI_SECTOR | ((EMUDISK_MAX_DRIVES - 1) << EMU_INFO_CAP_EMUDISK_UNITS_SHIFT)) : 0x00;
+				emuInfoTextIndex = -3;
+				emuInfoStringPtr = &strEmuInfoName;
+			}
+			else if (emuInfoTextIndex == -3)
 			{
 				returnByte = 'E';
 				emuInfoTextIndex++;
@@ -583,8 +714,7 @@ uint8_t GimeBus::readMemoryByte(uint16_t address)
 			}
 			else if (emuInfoStringPtr == &strEmuInfoExtra)
 			{
-				emuInfoTextIndex = -3;		// This should loop back to the beginning of info from this special register
-				emuInfoStringPtr = &strEmuInfoName;
+				emuInfoTextIndex = -4;		// Capability flags are next, then it loops back to the beginning of info from this special register
 				returnByte = 0;
 			}
 			return returnByte;
@@ -610,6 +740,7 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 		{
 			// GIME Palette Registers
 			gimePaletteRegs[address & 0x000F] = (byte & 0x3F);		// Use mask to enforce color is within GIME's 64 color range
+			logVideoRegWrite(VIDEO_REG_PALETTE + (address & 0x000F), gimePaletteRegs[address & 0x000F]);
 		}
 		else if ((address >= 0xFFC6) && (address <= 0xFFD3))
 		{
@@ -617,10 +748,11 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 				samPageSelectReg |= samPageSelectMasks[(address - 0xFFC6)];
 			else
 				samPageSelectReg &= samPageSelectMasks[(address - 0xFFC6)];
+			logVideoRegWrite(VIDEO_REG_SAM_PAGE, samPageSelectReg);
 			updateVideoParams();
 		}
 		// Check for EmuDisk Virtual HD Control Registers
-		else if ((address >= 0xFF80) && (address <= 0xFF86))
+		else if ((address >= 0xFF80) && (address <= 0xFF87))
 		{
 			if (emuDiskDriver.isEnabled)
 				emuDiskDriver.registerWrite(address, byte);
@@ -665,10 +797,12 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 					// direction register receive actual data from the written byte
 					devPIA1.SideA.dataReg &= ~devPIA1.SideA.dataDirReg;
 					devPIA1.SideA.dataReg |= (byte & devPIA1.SideA.dataDirReg);
+					setAudioSourceLevel(AUDIO_SOURCE_DAC, (devPIA1.SideA.dataReg >> 2) * AUDIO_DAC_LEVEL_STEP);
 				}
 				break;
 			case 0xFF21:
 				devPIA1.SideA.controlReg = (byte & 0b00111111) | 0b00110000;
+				cassetteDeck.setMotor(devPIA1.SideA.controlReg & 0x08);		// CA2 drives the cassette motor relay
 				break;
 			case 0xFF22:		// PIA1 Side B Data Register
 				if (!(devPIA1.SideB.controlReg & PIA_CTRL_DIR_MASK))
@@ -680,8 +814,13 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 					uint8_t tempByte = devPIA1.SideB.dataReg;
 					devPIA1.SideB.dataReg &= ~devPIA1.SideB.dataDirReg;
 					devPIA1.SideB.dataReg |= (byte & devPIA1.SideB.dataDirReg);
+					if ((tempByte & 0x02) != (devPIA1.SideB.dataReg & 0x02))
+						setAudioSourceLevel(AUDIO_SOURCE_SINGLE_BIT, (devPIA1.SideB.dataReg & 0x02) ? AUDIO_SINGLE_BIT_LEVEL : 0.0f);
 					if ((tempByte & 0xF8) != (devPIA1.SideB.dataReg & 0xF8))
+					{
+						logVideoRegWrite(VIDEO_REG_PIA1B, devPIA1.SideB.dataReg & 0xF8);
 						updateVideoParams();			// Only update video mode parameters when video-related bits have changed 
+					}
 				}
 				break;
 			case 0xFF23:		// PIA1 Side B Control Register
@@ -699,9 +838,11 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 			// Orchestra-90 Pak Registers
 			case 0xFF7A:
 				orch90dac.leftChannel = byte;
+				setAudioSourceLevel(AUDIO_SOURCE_ORCH90_LEFT, byte * AUDIO_ORCH90_LEVEL_STEP);
 				break;
 			case 0xFF7B:
 				orch90dac.rightChannel = byte;
+				setAudioSourceLevel(AUDIO_SOURCE_ORCH90_RIGHT, byte * AUDIO_ORCH90_LEVEL_STEP);
 				break;
 			// GIME Hardware Registers
 			case 0xFF90:		// GIME Initialization Register 0 (INIT0)
@@ -712,6 +853,7 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 				gimeRegInit0.constSecondaryVectors = (byte & 0x08);
 				gimeRegInit0.scsEnabled = (byte & 0x04);
 				gimeRegInit0.romMapControl = (byte & 0b00000011);
+				logVideoRegWrite(VIDEO_REG_INIT0, byte & 0x80);		// Only the CoCo compatibility bit matters to the video display
 				updateVideoParams();
 				break;
 			case 0xFF91:
@@ -748,6 +890,7 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 				gimeRegVMode.monoCompositeOut = (byte & 0x10);
 				gimeRegVMode.video50hz = (byte & 0x08);
 				gimeRegVMode.LPR = (byte & 0x07);
+				logVideoRegWrite(VIDEO_REG_VMODE, byte);
 				updateVideoParams();
 				break;
 			case 0xFF99:
@@ -755,23 +898,28 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 				gimeRegVRES.LPF = (byte >> 5) & 0x03;
 				gimeRegVRES.HRES = (byte >> 2) & 0x07;
 				gimeRegVRES.CRES = (byte & 0x03);
+				logVideoRegWrite(VIDEO_REG_VRES, byte);
  				updateVideoParams();
 				break;
 			case 0xFF9A:
 				// Border Color Register
 				gimeRegBorder = (byte & 0x3F);
+				logVideoRegWrite(VIDEO_REG_BORDER, gimeRegBorder);
 				break;
 			case 0xFF9D:
 				gimeVertOffsetMSB = byte;
+				logVideoRegWrite(VIDEO_REG_VOFFSET_MSB, byte);
 				updateVideoParams();
 				break;
 			case 0xFF9E:
 				gimeVertOffsetLSB = byte;
+				logVideoRegWrite(VIDEO_REG_VOFFSET_LSB, byte);
 				updateVideoParams();
 				break;
 			case 0xFF9F:
 				gimeHorizontalOffsetReg.hven = (byte & 0x80);
 				gimeHorizontalOffsetReg.offsetAddress = (byte & 0x7F);
+				logVideoRegWrite(VIDEO_REG_HOFFSET, byte);
 				break;
 			// SAM Video Display Registers
 			// If changing the specified bits below will result in a different value than it's current value, perform the operation and call our updateVideoParams() function.
@@ -781,7 +929,10 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 				tempByte = samVideoDisplayReg;
 				samVideoDisplayReg &= samVideoDisplayMasks[address & 0x0007];
 				if (tempByte != samVideoDisplayReg)
+				{
+					logVideoRegWrite(VIDEO_REG_SAM_DISPLAY, samVideoDisplayReg);
 					updateVideoParams();
+				}
 				break;
 			case 0xFFC1:
 			case 0xFFC3:
@@ -789,7 +940,10 @@ uint8_t GimeBus::writeMemoryByte(uint16_t address, uint8_t byte)
 				tempByte = samVideoDisplayReg;
 				samVideoDisplayReg |= samVideoDisplayMasks[address & 0x0007];
 				if (tempByte != samVideoDisplayReg)
+				{
+					logVideoRegWrite(VIDEO_REG_SAM_DISPLAY, samVideoDisplayReg);
 					updateVideoParams();
+				}
 				break;
 			case 0xFFD8:
 				cpuClockDivisor = 32;
@@ -822,6 +976,24 @@ uint16_t GimeBus::writeMemoryWord(uint16_t address, uint16_t word)
 	return word;		// This is just a placeholder in case later, for hardware register-related reasons, I want to indicate result of writing to I/O
 }
 
+bool GimeBus::checkExecTrap(uint16_t address)
+{
+	// Gives devices that fast-forward ROM routines a chance to take over before the CPU executes the instruction at this address.
+	// Returns true if one of them did, in which case it has already set the CPU state up as if the routine had run.
+	if (cassetteDeck.fastLoadEnabled && cassetteDeck.isTapeInserted && cassetteDeck.checkFastLoadTrap(address))
+		return true;
+	if (diskController.isConnected && diskController.dskconHLEEnabled && diskController.checkDskconTrap(address))
+		return true;
+	return false;
+}
+
+void GimeBus::updateExecTraps()
+{
+	// Only have the CPU call checkExecTrap() when something actually wants it, since it would otherwise be checked before every instruction
+	cpu.execTrapsArmed = (cassetteDeck.fastLoadEnabled && cassetteDeck.isTapeInserted && (romCoCo3 != nullptr))
+		|| (diskController.isConnected && diskController.dskconHLEEnabled);
+}
+
 uint8_t GimeBus::getCocoKey(uint8_t columnsByte)
 {
 	uint8_t rowByte = 0xFF;
@@ -4,8 +4,16 @@
 #include <string>
 #include "CPU6809.h"
 #include "DeviceROM.h"
+#include "MappedFile.h"
+#include "DiskOverlay.h"
+#include "CompressedDisk.h"
+#include "DiskWriteQueue.h"
+#include "DiskBlockCache.h"
+#include "HostDirectoryDisk.h"
 #include "FD502.h"
 #include "EmuDisk.h"
+#include "Cassette.h"
+#include "AudioMixer.h"
 #include "olcPixelGameEngine.h"
 
 constexpr uint8_t INT_CLEAR = 0;
@@ -28,6 +36,52 @@ constexpr double cpuFrameTime_NTSC = cpuClockFreq_NTSC / 60;
 
 constexpr unsigned int gimePerFloppyRotation = (gimeMasterClock_NTSC / 5);
 constexpr unsigned int gimeFloppyIndexWidth = (2056 * 32);	// I estimated using MAME debuger that 2056 6809 CPU cycles pass between leading edge of index hole and trailing edge (about 2.3 milliseconds)
+constexpr unsigned int gimeFloppyHeadLoad = (28636 * 100);	// About 100 milliseconds for the head to load before a Type II or III command starts moving data
+// Fast disk mode timings. Seeks and head loads finish almost immediately, and bytes are handed over as soon as the CPU has serviced the previous DRQ.
+constexpr unsigned int gimeFastFloppyStepInterval = 16;
+constexpr unsigned int gimeFastFloppyHeadLoad = 16;
+constexpr unsigned int gimeFastFloppyByteGap = 16;
+
+// Physical RAM is divided into pages of this size (as a power of 2) for tracking which areas of video memory have been written since a scanline was last drawn
+constexpr unsigned int VIDEO_DIRTY_PAGE_SHIFT = 8;
+
+// Video register file indexes. Every register that affects the picture gets a slot here so that writes to it can be timestamped and logged, 
+// then replayed by the renderer at the end of the frame
+constexpr uint8_t VIDEO_REG_PALETTE		= 0;	// 16 entries, $FFB0-$FFBF
+constexpr uint8_t VIDEO_REG_VMODE		= 16;	// $FF98
+constexpr uint8_t VIDEO_REG_VRES		= 17;	// $FF99
+constexpr uint8_t VIDEO_REG_BORDER		= 18;	// $FF9A
+constexpr uint8_t VIDEO_REG_VOFFSET_MSB	= 19;	// $FF9D
+constexpr uint8_t VIDEO_REG_VOFFSET_LSB	= 20;	// $FF9E
+constexpr uint8_t VIDEO_REG_HOFFSET		= 21;	// $FF9F
+constexpr uint8_t VIDEO_REG_INIT0		= 22;	// $FF90 (CoCo compatibility bit only)
+constexpr uint8_t VIDEO_REG_SAM_DISPLAY	= 23;	// SAM V0-V2 ($FFC0-$FFC5)
+constexpr uint8_t VIDEO_REG_SAM_PAGE	= 24;	// SAM F0-F6 ($FFC6-$FFD3)
+constexpr uint8_t VIDEO_REG_PIA1B		= 25;	// $FF22 (VDG mode bits only)
+constexpr uint8_t VIDEO_REG_BLINK		= 26;	// GIME text blink state, toggled by the timer
+constexpr uint8_t VIDEO_REG_COUNT		= 27;
+
+constexpr unsigned int VIDEO_FIRST_SCANLINE = 13;		// First scanline that gets drawn to the screen
+constexpr unsigned int VIDEO_FRAME_END_SCANLINE = 255;	// Once the beam reaches this scanline every visible line has gone by and the frame can be drawn
+constexpr unsigned int VIDEO_RENDER_DOT = 168;			// Dot position within a scanline where that line's register state gets sampled
+
+struct videoRegWriteStruct
+{
+	uint32_t framePosition;		// GIME master clocks since the end of the previous frame
+	uint8_t regIndex;
+	uint8_t value;
+};
+
+// Audio output levels, where 1.0 is the full scale of the 6-bit DAC
+constexpr float AUDIO_DAC_LEVEL_STEP	= 1.0f / 63.0f;
+constexpr float AUDIO_SINGLE_BIT_LEVEL	= 0.5f;
+constexpr float AUDIO_ORCH90_LEVEL_STEP	= 1.0f / 255.0f;
+constexpr float AUDIO_CASSETTE_LEVEL	= 0.5f;				// High half of a CAS bit's square wave
+constexpr float AUDIO_CASSETTE_WAV_STEP	= 0.5f / 32768.0f;	// WAV tape samples, full scale comes out the same as a CAS tape
+
+// Capability flags returned by the $FF96 emulator info register, in the byte that follows the extra text string's terminating zero
+constexpr uint8_t EMU_INFO_CAP_EMUDISK_MULTI_SECTOR	= 0x01;		// EmuDisk has the Sector Count register at $FF87 and commands $03/$04
+constexpr uint8_t EMU_INFO_CAP_EMUDISK_UNITS_SHIFT	= 4;		// The high nibble holds the number of EmuDisk drive units minus 1
 
 constexpr int gimeTimerOffset = 2;						// 1986 GIMEs process an additional 2 counts of the timer from what the user sets, 1987 revision is only 1 instead of 2.
 
@@ -45,6 +99,11 @@ constexpr uint8_t GIME_GFX_COLORS_4		= 0b00000001;
 constexpr uint8_t GIME_GFX_COLORS_16	= 0b00000010;
 constexpr uint8_t GIME_GFX_COLORS_UNDEF = 0b00000011;
 
+// GIME color numbers for the few fixed colors the VDG modes use that don't come from the palette registers
+constexpr uint8_t GIME_COLOR_BLACK		= 0;
+constexpr uint8_t GIME_COLOR_GREEN		= 18;
+constexpr uint8_t GIME_COLOR_WHITE		= 63;
+
 constexpr uint8_t GIME_INT_MASK_TIMER	 = 0b00100000;
 constexpr uint8_t GIME_INT_MASK_HBORDER  = 0b00010000;
 constexpr uint8_t GIME_INT_MASK_VBORDER  = 0b00001000;
@@ -114,8 +173,10 @@ class GimeBus
 		GimeBus();
 
 	public:
+		DiskWriteQueue diskWriteQueue;
 		FD502 diskController;
 		EmuDisk emuDiskDriver;
+		Cassette cassetteDeck;
 		Cpu6809 cpu;
 		DeviceROM* romCoCo3;
 		DeviceROM* romExternal;
@@ -125,14 +186,23 @@ class GimeBus
 		//std::vector<olc::Pixel> offscreenBuffer;
 		uint16_t ramTotalSizeKB, curResolutionWidth;
 		uint8_t curResolutionHeight;
-		unsigned int masterBusCycleCounter, floppyIndexHoleCounter = 0;
+		unsigned int masterBusCycleCounter;
 		unsigned int scanlineCounter, dotCounter;	// 1024 GIME cycles for Active Display Area, 1484 GIME cycles for start of left border to end of right border, 1820 GIME cycles for EVERYTHING together, 336 GIME cycles of horizontal blanking period
 		int cpuClockDivisor;
-		uint32_t videoStartAddr, ramSizeMask;
+		uint32_t ramSizeMask;
 		uint8_t gimePaletteRegs[16];
+		uint8_t videoRegs[VIDEO_REG_COUNT];	// Live copy of the video register file, always reflects the most recent writes
+		std::vector<videoRegWriteStruct> videoRegWriteLog;
+		bool videoFrameComplete;
+		BlipSynth audioSynth[AUDIO_SOURCE_COUNT];
+		uint32_t audioBlockStartClock = 0;	// Value of masterBusCycleCounter when the current audio block started
+		bool audioBlockComplete = false;
+		uint32_t videoLineStamp = 1;		// Incremented once per scanline and recorded against each RAM page when it's written to
+		std::vector<uint32_t> videoPageWriteStamp;
 		bool gimeBlinkStateOn;
 		piaDevice devPIA0, devPIA1;
 		std::string statusBarText;
+		std::string diskOverlayTag;		// When set, disk images are mounted as copy-on-write overlays with deltas named after this tag
 
 		struct joystickStruct
 		{
@@ -156,7 +226,7 @@ class GimeBus
 			uint8_t colorDepth;
 			uint8_t bytesPerRow;
 
-		} vdgVideoConfig;
+		};
 
 		// GIME-specific internal registers
 		struct GimeInit0
@@ -216,6 +286,21 @@ class GimeBus
 
 		} gimeRegVRES;
 
+		// Everything the renderer needs to know about the current video mode, as worked out from the video register file by calcVideoParams()
+		struct videoParamsStruct
+		{
+			bool cocoCompatMode;
+			vdgConfig vdg;
+			GimeVMODE vmode;
+			GimeVRES vres;
+			uint32_t videoStartAddr;
+			uint16_t resolutionWidth;
+			uint8_t resolutionHeight;
+			uint8_t linesPerRow, underlineRowOffset;
+			uint8_t bytesPerChar, charsPerRow, bytesPerCharRow;
+			uint8_t bytesPerPixelRow, pixelsPerDraw, colorSetOffset;
+		};
+
 		uint8_t textCharsPerRow[8] = { 32, 40, 32, 40, 64, 80, 64, 80 };
 		uint8_t gfxBytesPerRow[8] = { 16, 20, 32, 40, 64, 80, 128, 160 };
 		uint8_t gimeTopBorderEnd[4] = { 25, 21, 0, 9 };				// Values are zero-based VISIBLE scanline numbers. Array index should be LPF value from GIME $FF99 VRES register
@@ -252,6 +337,7 @@ class GimeBus
 
 		// CoCo 1/2 compatible VDG color palette defintions
 		olc::Pixel vdgBorderPaletteDefs[2] = { {0, 255, 0}, {255, 255, 255} };
+		uint8_t vdgBorderColors[2] = { GIME_COLOR_GREEN, GIME_COLOR_WHITE };	// Same colors as above as GIME color numbers
 
 		olcKeyMatrix hostKeyMatrix[56] = {
 			{olc::G, false},		{olc::O, false}, {olc::W, false}, {olc::SPACE, false},	{olc::K7, false}, {olc::OEM_2, false},	{olc::SHIFT, false},
@@ -274,18 +360,27 @@ class GimeBus
 		void ConnectBusGime(CoCoEmuPGE* inputPtr) { mainPtr = inputPtr; }
 		uint8_t readPhysicalByte(uint16_t);
 		uint8_t writePhysicalByte(uint16_t, uint8_t);
+		void readPhysicalBlock(uint16_t, uint8_t*, uint16_t);
+		void writePhysicalBlock(uint16_t, const uint8_t*, uint16_t);
 		uint8_t readMemoryByte(uint16_t);
 		uint16_t readMemoryWord(uint16_t);
 		uint8_t writeMemoryByte(uint16_t,uint8_t);
 		uint16_t writeMemoryWord(uint16_t,uint16_t);
+		bool checkExecTrap(uint16_t);
+		void updateExecTraps();
 		void SetRAMSize(int);
 		void gimeBusClockTick();
 		void updateVideoParams();
+		void setAudioSourceLevel(uint8_t, float);
+		bool isCassetteAudioSelected();
+		void calcVideoParams(const uint8_t*, videoParamsStruct&);
+		void logVideoRegWrite(uint8_t, uint8_t);
 
 	private:
 		CoCoEmuPGE* mainPtr = nullptr;
 		const unsigned int vdgColumnsPerRow = 32;
 		unsigned int floppySeekIntervalCounter, floppyAccessIntervalCounter, floppyFormatIndexCounter;
+		unsigned int floppyRotationalWait = 0;		// Extra cycles before the first byte of a sector, while it comes around under the head
 		uint8_t vdgCharLineOffset, curVDGchar, fontDataByte, joystickPortIndex, joystickAxisValue, joystickCompareResult, returnByte, tempByte;
 		uint16_t scanlineIndex, rowPixelCounter, vdgFontDataIndex;
 		uint32_t vdgScreenRamPtr;
@@ -293,7 +388,7 @@ class GimeBus
 		uint16_t diskByteReadCount;
 
 		std::string strEmuInfoName = "COCO3EMU";
-		uint8_t emuInfoVersionMajor = 0, emuInfoVersionMinor = 1;
+		uint8_t emuInfoVersionMajor = 0, emuInfoVersionMinor = 2;
 		std::string strEmuInfoExtra = "WRITTEN BY TODD WALLACE";
 		int emuInfoTextIndex;
 		std::string* emuInfoStringPtr = &strEmuInfoName;
@@ -325,6 +420,7 @@ class GimeBus
 		uint8_t samVideoDisplayMasks[6] = { 0b11111110, 0b00000001, 0b11111101, 0b00000010, 0b11111011, 0b00000100 };
 
 		uint8_t readByteFromROM(uint16_t);
+		uint16_t translateLogicalSpan(uint16_t, uint32_t, int32_t&);
 		uint8_t getCocoKey(uint8_t);
 		uint8_t cocoKeyStrobeResult[7] = { 0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF };
 
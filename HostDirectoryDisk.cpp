@@ -0,0 +1,293 @@
+#include "HostDirectoryDisk.h"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+
+HostDirectoryDisk::HostDirectoryDisk()
+{
+	filesOnDisk = 0;
+	filesSkipped = 0;
+	filesWrittenBack = 0;
+}
+
+bool HostDirectoryDisk::isHostDirectory(std::string pathname)
+{
+	std::error_code fsError;
+	return std::filesystem::is_directory(pathname, fsError);
+}
+
+uint8_t HostDirectoryDisk::openDirectory(std::string pathname)
+{
+	if (!isHostDirectory(pathname))
+		return HOST_DIRECTORY_ERROR_NOT_A_DIRECTORY;
+	directoryPathname = pathname;
+	filesWrittenBack = 0;
+	return HOST_DIRECTORY_OPERATION_COMPLETE;
+}
+
+void HostDirectoryDisk::buildImage(std::vector<uint8_t>& imageData)
+{
+	// Start with what a freshly DSKINI'd disk looks like. Every sector is $FF, and the granule table is all free with zeros after it.
+	imageData.assign(RSDOS_DISK_SIZE, 0xFF);
+	uint8_t* fatPtr = imageData.data() + getSectorOffset(RSDOS_DIRECTORY_TRACK, RSDOS_FAT_SECTOR);
+	memset(fatPtr + RSDOS_TOTAL_GRANULES, 0x00, RSDOS_SECTOR_SIZE - RSDOS_TOTAL_GRANULES);
+	uint8_t* directoryPtr = imageData.data() + getSectorOffset(RSDOS_DIRECTORY_TRACK, RSDOS_FIRST_DIRECTORY_SECTOR);
+
+	hostFilenames.clear();
+	diskFileContents.clear();
+	hostDirectoryState = scanHostDirectory();
+	filesOnDisk = 0;
+	filesSkipped = 0;
+	uint8_t nextFreeGranule = 0;
+
+	// std::map keeps the host files in name order, so the directory comes out sorted
+	for (auto& hostFile : hostDirectoryState)
+	{
+		std::string rsdosFilename = makeRsdosFilename(hostFile.first);
+		if (rsdosFilename.empty() || (hostFilenames.count(rsdosFilename) != 0))
+		{
+			printf("Host Directory Disk: Skipping %s, its name doesn't fit RS-DOS's 8.3 format or is a duplicate once shortened.\n", hostFile.first.c_str());
+			filesSkipped++;
+			continue;
+		}
+		std::ifstream hostFileStream(std::filesystem::path(directoryPathname) / hostFile.first, std::ios::binary);
+		std::vector<uint8_t> fileData((std::istreambuf_iterator<char>(hostFileStream)), std::istreambuf_iterator<char>());
+		uint32_t granulesNeeded = (fileData.size() + RSDOS_GRANULE_SIZE - 1) / RSDOS_GRANULE_SIZE;
+		if (granulesNeeded == 0)
+			granulesNeeded = 1;			// Even an empty file gets a granule, the same as RS-DOS does
+		if ((filesOnDisk >= RSDOS_MAX_DIRECTORY_ENTRIES) || ((nextFreeGranule + granulesNeeded) > RSDOS_TOTAL_GRANULES))
+		{
+			printf("Host Directory Disk: Skipping %s, there's no room left for it on the disk.\n", hostFile.first.c_str());
+			filesSkipped++;
+			continue;
+		}
+
+		// Files get consecutive granules, chained together through the granule table
+		uint8_t firstGranule = nextFreeGranule;
+		uint32_t dataPosition = 0;
+		for (uint32_t i = 0; i < granulesNeeded; i++)
+		{
+			uint8_t granuleNum = nextFreeGranule++;
+			uint32_t copyLength = ((fileData.size() - dataPosition) < RSDOS_GRANULE_SIZE) ? (fileData.size() - dataPosition) : RSDOS_GRANULE_SIZE;
+			if (copyLength > 0)
+				memcpy(imageData.data() + getGranuleOffset(granuleNum), fileData.data() + dataPosition, copyLength);
+			dataPosition += copyLength;
+			if (i < (granulesNeeded - 1))
+				fatPtr[granuleNum] = granuleNum + 1;
+			else
+			{
+				uint32_t sectorsUsed = (copyLength == 0) ? 1 : ((copyLength + RSDOS_SECTOR_SIZE - 1) / RSDOS_SECTOR_SIZE);
+				fatPtr[granuleNum] = RSDOS_FAT_LAST_GRANULE | sectorsUsed;
+			}
+		}
+		uint16_t lastSectorBytes = (fileData.size() == 0) ? 0 : (((fileData.size() - 1) % RSDOS_SECTOR_SIZE) + 1);
+
+		uint8_t* entryPtr = directoryPtr + (filesOnDisk * RSDOS_DIRECTORY_ENTRY_SIZE);
+		memset(entryPtr, 0x00, RSDOS_DIRECTORY_ENTRY_SIZE);
+		memset(entryPtr, ' ', 11);
+		size_t dotPosition = rsdosFilename.find('.');
+		std::string namePart = rsdosFilename.substr(0, dotPosition);
+		std::string extensionPart = (dotPosition == std::string::npos) ? "" : rsdosFilename.substr(dotPosition + 1);
+		memcpy(entryPtr, namePart.data(), namePart.length());
+		memcpy(entryPtr + 8, extensionPart.data(), extensionPart.length());
+		getRsdosFileType(extensionPart, fileData, entryPtr[11], entryPtr[12]);
+		entryPtr[13] = firstGranule;
+		entryPtr[14] = lastSectorBytes >> 8;
+		entryPtr[15] = lastSectorBytes & 0xFF;
+
+		hostFilenames[rsdosFilename] = hostFile.first;
+		diskFileContents[rsdosFilename] = std::move(fileData);
+		filesOnDisk++;
+	}
+}
+
+bool HostDirectoryDisk::writeBackImage(const std::vector<uint8_t>& imageData)
+{
+	// Every file in the image's directory whose contents differ from when we last synced gets written to the host. Files that disappeared
+	// from the directory (KILL, or a DSKINI) are deliberately left alone on the host, since losing a source file to a stray DSKINI would be a
+	// lot worse than having to delete one by hand. Returns false if any of them couldn't be written, and those get tried again next time.
+	std::map<std::string, std::vector<uint8_t>> curDiskFiles = readDiskFiles(imageData);
+	std::vector<std::string> failedFiles;
+	for (auto& diskFile : curDiskFiles)
+	{
+		auto previousContents = diskFileContents.find(diskFile.first);
+		if ((previousContents != diskFileContents.end()) && (previousContents->second == diskFile.second))
+			continue;
+
+		if (hostFilenames.count(diskFile.first) == 0)
+		{
+			// New file from the CoCo side. Keep its RS-DOS name, minus anything the host wouldn't allow in a filename.
+			std::string hostFilename = diskFile.first;
+			for (char& curChar : hostFilename)
+				if (strchr("/\\:*?\"<>|", curChar) != nullptr)
+					curChar = '_';
+			hostFilenames[diskFile.first] = hostFilename;
+		}
+		std::ofstream hostFileStream(std::filesystem::path(directoryPathname) / hostFilenames[diskFile.first], std::ios::binary | std::ios::trunc);
+		if (!hostFileStream)
+		{
+			printf("Host Directory Disk: Could not write %s back to the host directory.\n", hostFilenames[diskFile.first].c_str());
+			failedFiles.push_back(diskFile.first);
+			continue;
+		}
+		hostFileStream.write((const char*)diskFile.second.data(), diskFile.second.size());
+		if (!hostFileStream)
+		{
+			printf("Host Directory Disk: Could not write %s back to the host directory.\n", hostFilenames[diskFile.first].c_str());
+			failedFiles.push_back(diskFile.first);
+			continue;
+		}
+		filesWrittenBack++;
+	}
+
+	// Remember the files that didn't make it as they were before, so they still look changed the next time around
+	for (std::string& failedFile : failedFiles)
+	{
+		auto previousContents = diskFileContents.find(failedFile);
+		if (previousContents != diskFileContents.end())
+			curDiskFiles[failedFile] = previousContents->second;
+		else
+			curDiskFiles.erase(failedFile);
+	}
+	diskFileContents = std::move(curDiskFiles);
+
+	// What we just wrote shouldn't look like the host changing the directory behind our back
+	hostDirectoryState = scanHostDirectory();
+	return failedFiles.empty();
+}
+
+bool HostDirectoryDisk::hostDirectoryChanged()
+{
+	return (scanHostDirectory() != hostDirectoryState);
+}
+
+std::map<std::string, hostFileStateStruct> HostDirectoryDisk::scanHostDirectory()
+{
+	std::map<std::string, hostFileStateStruct> directoryState;
+	std::error_code fsError;
+	for (auto& dirEntry : std::filesystem::directory_iterator(directoryPathname, fsError))
+	{
+		if (!dirEntry.is_regular_file(fsError))
+			continue;
+		std::string hostFilename = dirEntry.path().filename().string();
+		if (hostFilename.empty() || (hostFilename.at(0) == '.'))
+			continue;			// Hidden files and the like never go on the disk
+		hostFileStateStruct fileState;
+		fileState.fileSize = dirEntry.file_size(fsError);
+		fileState.modifiedTime = dirEntry.last_write_time(fsError);
+		directoryState[hostFilename] = fileState;
+	}
+	return directoryState;
+}
+
+std::map<std::string, std::vector<uint8_t>> HostDirectoryDisk::readDiskFiles(const std::vector<uint8_t>& imageData)
+{
+	// Follows each directory entry's granule chain to pull the file back out of the image
+	std::map<std::string, std::vector<uint8_t>> diskFiles;
+	const uint8_t* fatPtr = imageData.data() + getSectorOffset(RSDOS_DIRECTORY_TRACK, RSDOS_FAT_SECTOR);
+	const uint8_t* directoryPtr = imageData.data() + getSectorOffset(RSDOS_DIRECTORY_TRACK, RSDOS_FIRST_DIRECTORY_SECTOR);
+	for (uint8_t entryNum = 0; entryNum < RSDOS_MAX_DIRECTORY_ENTRIES; entryNum++)
+	{
+		const uint8_t* entryPtr = directoryPtr + (entryNum * RSDOS_DIRECTORY_ENTRY_SIZE);
+		if (entryPtr[0] == 0xFF)
+			break;			// Never been used, and neither has anything after it
+		if (entryPtr[0] == 0x00)
+			continue;		// Killed file
+
+		std::string namePart((const char*)entryPtr, 8), extensionPart((const char*)entryPtr + 8, 3);
+		namePart.erase(namePart.find_last_not_of(' ') + 1);
+		extensionPart.erase(extensionPart.find_last_not_of(' ') + 1);
+		std::string rsdosFilename = extensionPart.empty() ? namePart : (namePart + "." + extensionPart);
+
+		std::vector<uint8_t> fileData;
+		uint8_t granuleNum = entryPtr[13];
+		uint16_t lastSectorBytes = (entryPtr[14] << 8) | entryPtr[15];
+		bool chainValid = false;
+		for (uint8_t granulesFollowed = 0; (granulesFollowed < RSDOS_TOTAL_GRANULES) && (granuleNum < RSDOS_TOTAL_GRANULES); granulesFollowed++)
+		{
+			const uint8_t* granulePtr = imageData.data() + getGranuleOffset(granuleNum);
+			uint8_t fatEntry = fatPtr[granuleNum];
+			if (fatEntry < RSDOS_TOTAL_GRANULES)
+			{
+				fileData.insert(fileData.end(), granulePtr, granulePtr + RSDOS_GRANULE_SIZE);
+				granuleNum = fatEntry;
+			}
+			else if ((fatEntry & RSDOS_FAT_LAST_GRANULE) == RSDOS_FAT_LAST_GRANULE)
+			{
+				uint32_t sectorsUsed = fatEntry & 0x3F;
+				if ((sectorsUsed > RSDOS_SECTORS_PER_GRANULE) || (lastSectorBytes > RSDOS_SECTOR_SIZE))
+					break;
+				uint32_t lastGranuleBytes = (sectorsUsed == 0) ? 0 : (((sectorsUsed - 1) * RSDOS_SECTOR_SIZE) + lastSectorBytes);
+				fileData.insert(fileData.end(), granulePtr, granulePtr + lastGranuleBytes);
+				chainValid = true;
+				break;
+			}
+			else
+				break;
+		}
+		// A file that's still being written has a half finished chain, so leave it out until it's closed rather than saving a mangled copy
+		if (chainValid && !namePart.empty())
+			diskFiles[rsdosFilename] = std::move(fileData);
+	}
+	return diskFiles;
+}
+
+std::string HostDirectoryDisk::makeRsdosFilename(std::string hostFilename)
+{
+	// Host names have to already fit 8.3 to go on the disk. They're uppercased, and come back out under their original host name.
+	size_t dotPosition = hostFilename.rfind('.');
+	std::string namePart = hostFilename.substr(0, dotPosition);
+	std::string extensionPart = (dotPosition == std::string::npos) ? "" : hostFilename.substr(dotPosition + 1);
+	if (namePart.empty() || (namePart.length() > 8) || (extensionPart.length() > 3))
+		return "";
+	std::string rsdosFilename = extensionPart.empty() ? namePart : (namePart + "." + extensionPart);
+	for (char& curChar : rsdosFilename)
+	{
+		if ((curChar <= ' ') || (curChar > '~'))
+			return "";
+		curChar = toupper(curChar);
+	}
+	return rsdosFilename;
+}
+
+void HostDirectoryDisk::getRsdosFileType(std::string extensionPart, const std::vector<uint8_t>& fileData, uint8_t& fileType, uint8_t& asciiFlag)
+{
+	// RS-DOS file types are 0 = BASIC program, 1 = BASIC data, 2 = Machine language, 3 = Text editor source. The host file only has its
+	// extension to go by. Tokenized BASIC programs start with $FF, anything else with a .BAS extension gets treated as ASCII listing.
+	if (extensionPart == "BAS")
+	{
+		fileType = 0;
+		asciiFlag = (!fileData.empty() && (fileData[0] == 0xFF)) ? 0x00 : 0xFF;
+	}
+	else if (extensionPart == "DAT")
+	{
+		fileType = 1;
+		asciiFlag = 0xFF;
+	}
+	else if ((extensionPart == "ASM") || (extensionPart == "TXT"))
+	{
+		fileType = 3;
+		asciiFlag = 0xFF;
+	}
+	else
+	{
+		fileType = 2;
+		asciiFlag = 0x00;
+	}
+}
+
+uint32_t HostDirectoryDisk::getSectorOffset(uint8_t trackNum, uint8_t sectorNum)
+{
+	return ((trackNum * RSDOS_SECTORS_PER_TRACK) + (sectorNum - 1)) * RSDOS_SECTOR_SIZE;
+}
+
+uint32_t HostDirectoryDisk::getGranuleOffset(uint8_t granuleNum)
+{
+	// Two granules per track, skipping over the directory track
+	uint8_t trackNum = granuleNum / 2;
+	if (trackNum >= RSDOS_DIRECTORY_TRACK)
+		trackNum++;
+	return getSectorOffset(trackNum, ((granuleNum % 2) * RSDOS_SECTORS_PER_GRANULE) + 1);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <filesystem>
+
+constexpr uint8_t HOST_DIRECTORY_OPERATION_COMPLETE		= 0x00;
+constexpr uint8_t HOST_DIRECTORY_ERROR_NOT_A_DIRECTORY	= 0x01;
+
+// Standard 35 track, single sided, 18 sectors per track RS-DOS disk layout
+constexpr uint8_t RSDOS_TOTAL_TRACKS				= 35;
+constexpr uint8_t RSDOS_SECTORS_PER_TRACK			= 18;
+constexpr uint16_t RSDOS_SECTOR_SIZE				= 256;
+constexpr uint32_t RSDOS_DISK_SIZE					= RSDOS_TOTAL_TRACKS * RSDOS_SECTORS_PER_TRACK * RSDOS_SECTOR_SIZE;
+constexpr uint8_t RSDOS_DIRECTORY_TRACK				= 17;
+constexpr uint8_t RSDOS_FAT_SECTOR					= 2;
+constexpr uint8_t RSDOS_FIRST_DIRECTORY_SECTOR		= 3;
+constexpr uint8_t RSDOS_DIRECTORY_SECTORS			= 9;
+constexpr uint8_t RSDOS_DIRECTORY_ENTRY_SIZE		= 32;
+constexpr uint8_t RSDOS_MAX_DIRECTORY_ENTRIES		= (RSDOS_DIRECTORY_SECTORS * RSDOS_SECTOR_SIZE) / RSDOS_DIRECTORY_ENTRY_SIZE;
+constexpr uint8_t RSDOS_TOTAL_GRANULES				= 68;
+constexpr uint8_t RSDOS_SECTORS_PER_GRANULE			= 9;
+constexpr uint16_t RSDOS_GRANULE_SIZE				= RSDOS_SECTORS_PER_GRANULE * RSDOS_SECTOR_SIZE;
+constexpr uint8_t RSDOS_FAT_FREE_GRANULE			= 0xFF;
+constexpr uint8_t RSDOS_FAT_LAST_GRANULE			= 0xC0;		// Or'ed with the number of sectors used in the file's last granule
+
+// What we last saw of a file in the host directory, used to spot files that were changed on the host side
+struct hostFileStateStruct
+{
+	uintmax_t fileSize;
+	std::filesystem::file_time_type modifiedTime;
+	bool operator==(const hostFileStateStruct& otherState) const { return (fileSize == otherState.fileSize) && (modifiedTime == otherState.modifiedTime); }
+};
+
+// Builds an RS-DOS disk image in memory out of the files in a host directory, laying out the granule table and directory track the same
+// way DSKINI and SAVE would have. When the emulated disk has been written to, the image's directory is read back and every file whose
+// contents changed gets written out to the host directory. If the host directory changes instead, the image can be built over again.
+class HostDirectoryDisk
+{
+public:
+	HostDirectoryDisk();
+
+	static bool isHostDirectory(std::string);
+	uint8_t openDirectory(std::string);
+	void buildImage(std::vector<uint8_t>&);
+	bool writeBackImage(const std::vector<uint8_t>&);
+	bool hostDirectoryChanged();
+
+	std::string directoryPathname;
+	uint32_t filesOnDisk, filesSkipped, filesWrittenBack;
+
+private:
+	std::map<std::string, std::string> hostFilenames;					// RS-DOS "NAME.EXT" to the name of the host file it came from
+	std::map<std::string, std::vector<uint8_t>> diskFileContents;		// Each file's contents as of the last time the disk and host directory matched
+	std::map<std::string, hostFileStateStruct> hostDirectoryState;		// Keyed by host filename
+
+	std::map<std::string, hostFileStateStruct> scanHostDirectory();
+	std::map<std::string, std::vector<uint8_t>> readDiskFiles(const std::vector<uint8_t>&);
+	static std::string makeRsdosFilename(std::string);
+	static void getRsdosFileType(std::string, const std::vector<uint8_t>&, uint8_t&, uint8_t&);
+	static uint32_t getSectorOffset(uint8_t, uint8_t);
+	static uint32_t getGranuleOffset(uint8_t);
+};
@@ -0,0 +1,136 @@
+#include "LZCodec.h"
+#include <cstring>
+
+static inline uint32_t hashFourBytes(const uint8_t* dataPtr)
+{
+	uint32_t fourBytes = dataPtr[0] | (dataPtr[1] << 8) | (dataPtr[2] << 16) | ((uint32_t)dataPtr[3] << 24);
+	return (fourBytes * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the part of a length that didn't fit in its token nibble as a run of 255s and a final byte below 255
+static inline bool putExtraLength(uint8_t*& destPtr, const uint8_t* destEnd, uint32_t extraLength)
+{
+	while (extraLength >= 255)
+	{
+		if (destPtr >= destEnd)
+			return false;
+		*destPtr++ = 255;
+		extraLength -= 255;
+	}
+	if (destPtr >= destEnd)
+		return false;
+	*destPtr++ = extraLength;
+	return true;
+}
+
+static inline bool getExtraLength(const uint8_t*& sourcePtr, const uint8_t* sourceEnd, uint32_t& totalLength)
+{
+	uint8_t lengthByte;
+	do
+	{
+		if (sourcePtr >= sourceEnd)
+			return false;
+		lengthByte = *sourcePtr++;
+		totalLength += lengthByte;
+	} while (lengthByte == 255);
+	return true;
+}
+
+static bool putSequence(uint8_t*& destPtr, const uint8_t* destEnd, const uint8_t* literalPtr, uint32_t literalLength, uint32_t matchOffset, uint32_t matchLength)
+{
+	if (destPtr >= destEnd)
+		return false;
+	uint8_t* tokenPtr = destPtr++;
+	*tokenPtr = ((literalLength < 15) ? literalLength : 15) << 4;
+	if ((literalLength >= 15) && !putExtraLength(destPtr, destEnd, literalLength - 15))
+		return false;
+	if ((uint32_t)(destEnd - destPtr) < literalLength)
+		return false;
+	memcpy(destPtr, literalPtr, literalLength);
+	destPtr += literalLength;
+
+	// A match length of zero marks the final, literals-only sequence
+	if (matchLength == 0)
+		return true;
+	if ((destEnd - destPtr) < 2)
+		return false;
+	*destPtr++ = matchOffset & 0xFF;
+	*destPtr++ = (matchOffset >> 8) & 0xFF;
+	uint32_t lengthCode = matchLength - LZ_MIN_MATCH;
+	*tokenPtr |= (lengthCode < 15) ? lengthCode : 15;
+	if ((lengthCode >= 15) && !putExtraLength(destPtr, destEnd, lengthCode - 15))
+		return false;
+	return true;
+}
+
+uint32_t lzCompress(const uint8_t* sourceData, uint32_t sourceLength, uint8_t* destData, uint32_t destCapacity)
+{
+	// Greedy single-probe matcher. Not the tightest compression around, but it's fast and disk blocks full of zeros or repeated
+	// directory entries shrink to almost nothing, which is where nearly all the savings on a mostly empty image come from.
+	uint32_t hashTable[1 << LZ_HASH_BITS];
+	for (uint32_t& hashEntry : hashTable)
+		hashEntry = UINT32_MAX;
+
+	uint8_t* destPtr = destData;
+	const uint8_t* destEnd = destData + destCapacity;
+	uint32_t literalStart = 0;
+	uint32_t curPos = 0;
+	while ((curPos + LZ_MIN_MATCH) <= sourceLength)
+	{
+		uint32_t hashValue = hashFourBytes(sourceData + curPos);
+		uint32_t candidatePos = hashTable[hashValue];
+		hashTable[hashValue] = curPos;
+		if ((candidatePos == UINT32_MAX) || ((curPos - candidatePos) > LZ_MAX_OFFSET) || (memcmp(sourceData + candidatePos, sourceData + curPos, LZ_MIN_MATCH) != 0))
+		{
+			curPos++;
+			continue;
+		}
+
+		uint32_t matchLength = LZ_MIN_MATCH;
+		while (((curPos + matchLength) < sourceLength) && (sourceData[candidatePos + matchLength] == sourceData[curPos + matchLength]))
+			matchLength++;
+		if (!putSequence(destPtr, destEnd, sourceData + literalStart, curPos - literalStart, curPos - candidatePos, matchLength))
+			return 0;
+		curPos += matchLength;
+		literalStart = curPos;
+	}
+
+	if (!putSequence(destPtr, destEnd, sourceData + literalStart, sourceLength - literalStart, 0, 0))
+		return 0;
+	return destPtr - destData;
+}
+
+uint32_t lzDecompress(const uint8_t* sourceData, uint32_t sourceLength, uint8_t* destData, uint32_t destCapacity)
+{
+	const uint8_t* sourcePtr = sourceData;
+	const uint8_t* sourceEnd = sourceData + sourceLength;
+	uint32_t destPos = 0;
+	while (sourcePtr < sourceEnd)
+	{
+		uint8_t tokenByte = *sourcePtr++;
+		uint32_t literalLength = tokenByte >> 4;
+		if ((literalLength == 15) && !getExtraLength(sourcePtr, sourceEnd, literalLength))
+			return 0;
+		if (((uint32_t)(sourceEnd - sourcePtr) < literalLength) || ((destCapacity - destPos) < literalLength))
+			return 0;
+		memcpy(destData + destPos, sourcePtr, literalLength);
+		sourcePtr += literalLength;
+		destPos += literalLength;
+		if (sourcePtr == sourceEnd)
+			break;			// That was the final literals-only sequence
+
+		if ((sourceEnd - sourcePtr) < 2)
+			return 0;
+		uint32_t matchOffset = sourcePtr[0] | (sourcePtr[1] << 8);
+		sourcePtr += 2;
+		uint32_t matchLength = (tokenByte & 0x0F) + LZ_MIN_MATCH;
+		if (((tokenByte & 0x0F) == 15) && !getExtraLength(sourcePtr, sourceEnd, matchLength))
+			return 0;
+		if ((matchOffset == 0) || (matchOffset > destPos) || ((destCapacity - destPos) < matchLength))
+			return 0;
+		// Byte at a time since a match is allowed to overlap the bytes it's producing, which is how runs get encoded
+		for (uint32_t i = 0; i < matchLength; i++, destPos++)
+			destData[destPos] = destData[destPos - matchOffset];
+	}
+	return destPos;
+}
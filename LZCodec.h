@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+
+// Small LZ77 block codec in the style of LZ4, used for compressed disk image blocks. Each sequence is a token byte (high nibble is the
+// literal count, low nibble is the match length minus 4, with 15 in either meaning more length bytes follow), the literals, then a 16-bit
+// little-endian offset back into the output and any extra match length bytes. The last sequence in a block has literals only.
+constexpr uint32_t LZ_MIN_MATCH			= 4;
+constexpr uint32_t LZ_MAX_OFFSET		= 65535;
+constexpr int LZ_HASH_BITS				= 12;
+
+// Returns the compressed length, or 0 if the data wouldn't fit in destCapacity (meaning it isn't worth compressing)
+uint32_t lzCompress(const uint8_t*, uint32_t, uint8_t*, uint32_t);
+// Returns the decompressed length, or 0 if the compressed data is damaged or would overrun destCapacity
+uint32_t lzDecompress(const uint8_t*, uint32_t, uint8_t*, uint32_t);
@@ -1,9 +1,21 @@
 #include "CoCo3EmuPGE.h"
 
-int main()
+int main(int argc, char* argv[])
 {
 	CoCoEmuPGE emuMainWindow;
 
+	// Check for command line options
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		if (((argument == "-wav") || (argument == "--record-wav")) && ((i + 1) < argc))
+			emuMainWindow.startupWavPathname = argv[++i];
+		else if (((argument == "-overlay") || (argument == "--overlay")) && ((i + 1) < argc))
+			emuMainWindow.startupOverlayTag = argv[++i];
+		else
+			printf("Unknown command line option: %s\n", argv[i]);
+	}
+
 	//if (emuMainWindow.Construct(640, 242, 1, 2))
 	if (emuMainWindow.Construct(640, 256, 1, 2))
 		emuMainWindow.Start();
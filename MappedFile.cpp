@@ -0,0 +1,97 @@
+#include "MappedFile.h"
+#ifdef _WIN32
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+	mappedData = nullptr;
+	mappedSize = 0;
+	fileHandle = nullptr;
+	mappingHandle = nullptr;
+}
+
+MappedFile::~MappedFile()
+{
+	unmapFile();
+}
+
+bool MappedFile::mapFile(std::string filePathname)
+{
+	unmapFile();
+
+#ifdef _WIN32
+	HANDLE winFileHandle = CreateFileA(filePathname.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (winFileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER winFileSize;
+	if (!GetFileSizeEx(winFileHandle, &winFileSize) || (winFileSize.QuadPart <= 0) || ((uint64_t)winFileSize.QuadPart > SIZE_MAX))
+	{
+		CloseHandle(winFileHandle);
+		return false;
+	}
+	HANDLE winMappingHandle = CreateFileMappingA(winFileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (winMappingHandle == NULL)
+	{
+		CloseHandle(winFileHandle);
+		return false;
+	}
+	void* viewPtr = MapViewOfFile(winMappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (viewPtr == NULL)
+	{
+		CloseHandle(winMappingHandle);
+		CloseHandle(winFileHandle);
+		return false;
+	}
+	fileHandle = winFileHandle;
+	mappingHandle = winMappingHandle;
+	mappedSize = winFileSize.QuadPart;
+#else
+	int posixFileHandle = open(filePathname.c_str(), O_RDONLY);
+	if (posixFileHandle < 0)
+		return false;
+	struct stat fileStats;
+	if ((fstat(posixFileHandle, &fileStats) != 0) || (fileStats.st_size <= 0) || ((uint64_t)fileStats.st_size > SIZE_MAX))
+	{
+		close(posixFileHandle);
+		return false;
+	}
+	void* viewPtr = mmap(nullptr, fileStats.st_size, PROT_READ, MAP_SHARED, posixFileHandle, 0);
+	close(posixFileHandle);		// The mapping keeps its own reference to the file
+	if (viewPtr == MAP_FAILED)
+		return false;
+	mappedSize = fileStats.st_size;
+#endif
+
+	mappedData = (const uint8_t*)viewPtr;
+	return true;
+}
+
+void MappedFile::unmapFile()
+{
+	if (mappedData == nullptr)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(mappedData);
+	CloseHandle((HANDLE)mappingHandle);
+	CloseHandle((HANDLE)fileHandle);
+#else
+	munmap((void*)mappedData, mappedSize);
+#endif
+	mappedData = nullptr;
+	mappedSize = 0;
+	fileHandle = nullptr;
+	mappingHandle = nullptr;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+// Read-only memory mapping of a whole file. The mapping is shared, so writes made to the file through a normal file handle show up in it,
+// and every process that maps the same file shares the same pages of the host's file cache.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool mapFile(std::string);
+	void unmapFile();
+	bool isMapped() { return (mappedData != nullptr); }
+
+	const uint8_t* mappedData;
+	uint64_t mappedSize;
+
+private:
+	void* fileHandle;		// Windows needs the file and mapping handles kept around until the view is unmapped
+	void* mappingHandle;
+};
@@ -0,0 +1,118 @@
+#include "WavWriter.h"
+#include <chrono>
+
+WavWriter::WavWriter()
+{
+	recordingActive = false;
+	writerThreadRunning = false;
+	wavFile = nullptr;
+	wavSampleRate = 0;
+	framesWritten = 0;
+}
+
+WavWriter::~WavWriter()
+{
+	stopRecording();
+}
+
+bool WavWriter::startRecording(std::string filePathname, uint32_t sampleRate)
+{
+	if (recordingActive)
+		stopRecording();
+
+	wavFile = fopen(filePathname.c_str(), "wb");
+	if (wavFile == nullptr)
+		return false;
+
+	wavFilePathname = filePathname;
+	wavSampleRate = sampleRate;
+	framesWritten = 0;
+	writeWavHeader();		// Written with zero lengths for now and filled in properly when recording stops
+
+	frameQueue.clearBuffer();
+	writerThreadRunning = true;
+	writerThread = std::thread(&WavWriter::writerThreadLoop, this);
+	recordingActive = true;
+	return true;
+}
+
+void WavWriter::stopRecording()
+{
+	if (!recordingActive)
+		return;
+
+	recordingActive = false;
+	writerThreadRunning = false;
+	if (writerThread.joinable())
+		writerThread.join();
+
+	// Write out whatever the writer thread didn't get to, then go back and fix up the header with the final lengths
+	while (writeQueuedFrames() > 0)
+		;
+	writeWavHeader();
+	fclose(wavFile);
+	wavFile = nullptr;
+}
+
+void WavWriter::queueFrames(const audioFrameStruct* sourceFrames, unsigned int frameCount)
+{
+	// Called from the emulation thread. If the writer thread ever falls so far behind that the queue fills, frames get dropped
+	// rather than making the emulation wait on the disk.
+	if (!recordingActive)
+		return;
+	for (unsigned int i = 0; i < frameCount; i++)
+		frameQueue.pushFrame(sourceFrames[i]);
+}
+
+void WavWriter::writerThreadLoop()
+{
+	while (writerThreadRunning)
+	{
+		if (writeQueuedFrames() == 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+unsigned int WavWriter::writeQueuedFrames()
+{
+	unsigned int frameCount = 0;
+	while ((frameCount < WAV_WRITE_CHUNK_FRAMES) && frameQueue.popFrame(writeBuffer[frameCount]))
+		frameCount++;
+
+	if (frameCount > 0)
+	{
+		// WAV files are little-endian, same as the PC, so our frames can be written out exactly as they are in memory
+		fwrite(writeBuffer, sizeof(audioFrameStruct), frameCount, wavFile);
+		framesWritten += frameCount;
+	}
+	return frameCount;
+}
+
+void WavWriter::writeWavHeader()
+{
+	uint32_t dataSize = framesWritten * sizeof(audioFrameStruct);
+	uint32_t riffSize = 36 + dataSize;
+	uint32_t fmtSize = 16;
+	uint16_t audioFormat = 1;		// PCM
+	uint16_t numChannels = 2;
+	uint32_t byteRate = wavSampleRate * sizeof(audioFrameStruct);
+	uint16_t blockAlign = sizeof(audioFrameStruct);
+	uint16_t bitsPerSample = 16;
+
+	long curFilePos = ftell(wavFile);
+	fseek(wavFile, 0, SEEK_SET);
+	fwrite("RIFF", 1, 4, wavFile);
+	fwrite(&riffSize, 4, 1, wavFile);
+	fwrite("WAVEfmt ", 1, 8, wavFile);
+	fwrite(&fmtSize, 4, 1, wavFile);
+	fwrite(&audioFormat, 2, 1, wavFile);
+	fwrite(&numChannels, 2, 1, wavFile);
+	fwrite(&wavSampleRate, 4, 1, wavFile);
+	fwrite(&byteRate, 4, 1, wavFile);
+	fwrite(&blockAlign, 2, 1, wavFile);
+	fwrite(&bitsPerSample, 2, 1, wavFile);
+	fwrite("data", 1, 4, wavFile);
+	fwrite(&dataSize, 4, 1, wavFile);
+	if (curFilePos > 44)
+		fseek(wavFile, curFilePos, SEEK_SET);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include "AudioRingBuffer.h"
+
+constexpr uint32_t WAV_QUEUE_FRAMES			= 65536;	// About 1.3 seconds at 48 kHz, which is plenty of slack for the writer thread
+constexpr unsigned int WAV_WRITE_CHUNK_FRAMES	= 4096;
+
+// Records the emulator's mixed stereo output to a 16-bit PCM WAV file. Samples are handed over through a lock-free ring buffer
+// and written to disk by a background thread so host file I/O never holds up the emulation thread.
+class WavWriter
+{
+public:
+	WavWriter();
+	~WavWriter();
+
+	bool startRecording(std::string, uint32_t);
+	void stopRecording();
+	void queueFrames(const audioFrameStruct*, unsigned int);
+	bool isRecording() const { return recordingActive; }
+
+	std::string wavFilePathname;
+	uint32_t framesWritten;
+
+private:
+	AudioRingBuffer frameQueue{ WAV_QUEUE_FRAMES };
+	std::thread writerThread;
+	std::atomic<bool> recordingActive, writerThreadRunning;
+	FILE* wavFile;
+	uint32_t wavSampleRate;
+	audioFrameStruct writeBuffer[WAV_WRITE_CHUNK_FRAMES];
+
+	void writerThreadLoop();
+	unsigned int writeQueuedFrames();
+	void writeWavHeader();
+};